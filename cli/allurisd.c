@@ -0,0 +1,1069 @@
+/*
+
+Copyright (C) 2015 Alluris GmbH & Co. KG <weber@alluris.de>
+
+allurisd -- keeps all Alluris devices open and serves them over a Unix domain socket
+
+Only one process can claim a device. allurisd claims every gauge which shows up,
+executes commands of many local clients and shares one stream per gauge between
+all subscribed clients. The protocol is line based text, see README.md:
+
+  request: COMMAND [SERIAL|-] [ARG]      ("-" is the first device)
+  reply:   OK [VALUE...] or ERR NAME     (NAME from liballuris_error_name)
+  data:    D SERIAL TIMESTAMP_NS V1 V2 ... (only to subscribed clients, between replies)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  See ../COPYING
+If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <argp.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <liballuris.h>
+
+#define MAX_GAUGES 32           // slots, the subscriptions of a client are a bitmask
+#define MAX_CLIENTS 64
+#define MAX_LIBUSB_FDS 16
+#define MAX_LINE 256            // longer requests are answered with ERR and discarded
+#define MAX_QUEUED (1 << 20)    // data lines are dropped if a client has more bytes queued
+#define RESCAN_MS 1000          // period of liballuris_registry_update
+
+char do_exit = 0;
+
+const char *argp_program_version =
+  "allurisd 0.1.0 using " PACKAGE_NAME " " PACKAGE_VERSION;
+
+const char *argp_program_bug_address =
+  "<software@alluris.de>";
+
+static char doc[] =
+  "Serve all Alluris devices to local clients over a Unix domain socket";
+
+/* A description of the arguments we accept. */
+static char args_doc[] = "";
+
+/* The options we understand. */
+static struct argp_option options[] =
+{
+  {"socket",       1000, "PATH",       0, "Listen on PATH (default $XDG_RUNTIME_DIR/allurisd.sock or /tmp/allurisd-UID.sock)", 0},
+  {"latency",      1001, "MS",         0, "Latency target of the streams, the packet size is chosen from the measurement mode (default 100)", 0},
+  {"simulate",     1002, 0,            0, "Serve a simulated device in addition to USB", 0},
+  {"speed",        1003, "X",          0, "Time scale of the simulated device (default 1)", 0},
+  { 0,0,0,0,0,0 }
+};
+
+/* Used by main to communicate with parse_opt. */
+struct arguments
+{
+  const char* socket_path;
+  unsigned int latency;
+  char simulate;
+  double speed;
+};
+
+struct client;
+
+//! command of a client waiting for the device, see gauge_run
+struct request
+{
+  struct request* next;
+  struct client* client;              // NULL if the client disconnected meanwhile
+  int k;                              // index into commands
+  int arg;
+};
+
+struct gauge
+{
+  char serial[30];
+  struct liballuris_device* dev;      // NULL if the slot is free
+  libusb_device_handle* sim;          // handle of the simulator or NULL
+  struct liballuris_stream* stream;
+  char streaming;
+  char resume;                        // call gauge_stream_update when the queue is empty
+  int subscribers;
+  int last_value;
+  int64_t last_ns;                    // 0 if there is no value from the current stream
+  struct liballuris_stream_stats total; // counters of stopped runs of the stream
+  struct request* head;               // queued requests, head is in flight if busy
+  struct request* tail;
+  char busy;                          // head was submitted with liballuris_device_submit
+};
+
+struct client
+{
+  int fd;                             // -1 if the slot is free
+  char in[MAX_LINE];
+  size_t in_len;
+  char discard;                       // skip the rest of an overlong request
+  char* out;
+  size_t out_len;
+  size_t out_size;
+  unsigned long subscriptions;        // bit k = gauges[k]
+  unsigned long long dropped_lines;
+};
+
+static struct gauge gauges[MAX_GAUGES];
+static struct client clients[MAX_CLIENTS];
+static libusb_context* ctx;
+static unsigned int latency = 100;
+
+void termination_handler (int signum)
+{
+  (void) signum;
+  do_exit = 1;
+}
+
+static int64_t monotonic_ns (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/****************************************************************************************/
+// client output
+
+//! append len bytes to the output buffer, data lines are dropped if the client doesn't keep up
+static void client_queue (struct client* c, const char* buf, size_t len, char is_data)
+{
+  if (is_data && c->out_len + len > MAX_QUEUED)
+    {
+      c->dropped_lines++;
+      return;
+    }
+  if (c->out_len + len > c->out_size)
+    {
+      size_t size = (c->out_size)? c->out_size : 4096;
+      while (size < c->out_len + len)
+        size *= 2;
+      char* p = realloc (c->out, size);
+      if (! p)
+        {
+          c->dropped_lines++;
+          return;
+        }
+      c->out = p;
+      c->out_size = size;
+    }
+  memcpy (c->out + c->out_len, buf, len);
+  c->out_len += len;
+}
+
+static void gauge_stream_request (struct gauge* g);
+
+//! drop the client and stop the streams nobody else is subscribed to
+static void client_close (struct client* c)
+{
+  int k;
+  for (k=0; k < MAX_GAUGES; ++k)
+    {
+      struct request* r;
+      for (r = gauges[k].head; r; r = r->next)
+        if (r->client == c)
+          r->client = NULL;
+      if (c->subscriptions & (1UL << k) && ! --gauges[k].subscribers)
+        gauge_stream_request (&gauges[k]);
+    }
+  close (c->fd);
+  free (c->out);
+  memset (c, 0, sizeof (struct client));
+  c->fd = -1;
+}
+
+//! write as much as the socket takes without blocking, returns -1 if the client is gone
+static int client_flush (struct client* c)
+{
+  while (c->out_len)
+    {
+      ssize_t n = send (c->fd, c->out, c->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (n < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)? 0 : -1;
+      memmove (c->out, c->out + n, c->out_len - n);
+      c->out_len -= n;
+    }
+  return 0;
+}
+
+static void reply (struct client* c, int ret, const char* fmt, ...) __attribute__ ((format (printf, 3, 4)));
+
+//! queue "OK ..." if ret is 0 else "ERR name"
+static void reply (struct client* c, int ret, const char* fmt, ...)
+{
+  char buf[MAX_LINE + 64];
+  int n;
+  if (ret)
+    n = snprintf (buf, sizeof (buf), "ERR %s\n", liballuris_error_name (ret));
+  else if (! fmt)
+    n = snprintf (buf, sizeof (buf), "OK\n");
+  else
+    {
+      va_list ap;
+      va_start (ap, fmt);
+      n = snprintf (buf, sizeof (buf), "OK ");
+      n += vsnprintf (buf + n, sizeof (buf) - n - 1, fmt, ap);
+      va_end (ap);
+      if (n > (int) sizeof (buf) - 2)
+        n = sizeof (buf) - 2;
+      buf[n++] = '\n';
+    }
+  client_queue (c, buf, n, 0);
+}
+
+/****************************************************************************************/
+// gauges and their shared streams
+
+//! stream callback, broadcast the block to all subscribed clients
+static void gauge_block_cb (const struct liballuris_block* block, void* user_data)
+{
+  struct gauge* g = user_data;
+  if (! block->num_values)
+    return;
+  g->last_value = block->values[block->num_values - 1];
+  g->last_ns = block->timestamp_ns;
+
+  char line[64 + 30 + 19 * 12];
+  int n = snprintf (line, sizeof (line), "D %s %lli", g->serial, (long long) block->timestamp_ns);
+  size_t k;
+  for (k=0; k < block->num_values; ++k)
+    n += snprintf (line + n, sizeof (line) - n, " %i", block->values[k]);
+  line[n++] = '\n';
+
+  unsigned long bit = 1UL << (g - gauges);
+  int j;
+  for (j=0; j < MAX_CLIENTS; ++j)
+    if (clients[j].fd >= 0 && (clients[j].subscriptions & bit))
+      client_queue (&clients[j], line, n, 1);
+}
+
+static struct gauge* gauge_find (const char* serial)
+{
+  int k;
+  for (k=0; k < MAX_GAUGES; ++k)
+    if (gauges[k].dev && (! serial || ! strcmp (serial, "-") || ! strcmp (serial, gauges[k].serial)))
+      return &gauges[k];
+  return NULL;
+}
+
+static void gauge_stream_stop (struct gauge* g)
+{
+  if (! g->streaming)
+    return;
+  liballuris_stream_stop (g->stream);
+  struct liballuris_stream_stats s;
+  liballuris_stream_get_stats (g->stream, &s);
+  g->total.packets += s.packets;
+  g->total.samples += s.samples;
+  g->total.malformed += s.malformed;
+  g->total.gaps += s.gaps;
+  g->total.lost_samples += s.lost_samples;
+  g->total.dropped_samples += s.dropped_samples;
+  g->total.resyncs += s.resyncs;
+  g->total.transfer_errors += s.transfer_errors;
+  g->streaming = 0;
+  g->last_ns = 0;
+}
+
+//! start the stream if somebody is subscribed, starts the measurement if needed
+static int gauge_stream_update (struct gauge* g)
+{
+  if (! g->subscribers)
+    {
+      gauge_stream_stop (g);
+      return LIBALLURIS_SUCCESS;
+    }
+  if (g->streaming)
+    return LIBALLURIS_SUCCESS;
+
+  int ret = LIBALLURIS_SUCCESS;
+  if (! g->stream)
+    {
+      ret = liballuris_device_stream_open (ctx, g->dev, 19, 0, gauge_block_cb, g, &g->stream);
+      if (! ret)
+        ret = liballuris_stream_set_latency (g->stream, latency);
+    }
+  struct liballuris_state state;
+  if (! ret)
+    ret = liballuris_device_read_state (g->dev, &state);
+  if (! ret && ! state.measuring)
+    ret = liballuris_device_start_measurement_wait (g->dev, 1000, NULL);
+  if (! ret)
+    ret = liballuris_stream_start (g->stream);
+  g->streaming = (ret == LIBALLURIS_SUCCESS);
+  return ret;
+}
+
+//! update the stream now or, if commands are pending, when the queue is empty
+static void gauge_stream_request (struct gauge* g)
+{
+  if (g->head)
+    g->resume = 1;
+  else
+    gauge_stream_update (g);
+}
+
+static struct gauge* gauge_add (struct liballuris_device* dev, libusb_device_handle* sim)
+{
+  int k;
+  for (k=0; k < MAX_GAUGES && gauges[k].dev; ++k);
+  if (k == MAX_GAUGES)
+    return NULL;
+
+  struct gauge* g = &gauges[k];
+  memset (g, 0, sizeof (struct gauge));
+  g->dev = dev;
+  g->sim = sim;
+  // a stream left running by a previous owner
+  liballuris_device_cyclic_measurement (dev, 0, 19);
+  liballuris_device_clear_RX (dev, 10);
+  int ret = liballuris_device_get_serial_number (dev, g->serial, sizeof (g->serial));
+  if (ret)
+    snprintf (g->serial, sizeof (g->serial), "#%i", k);
+  // fill the cache of the device context, see device_command
+  struct liballuris_metadata md;
+  liballuris_device_get_metadata (dev, &md);
+  fprintf (stderr, "allurisd: serving %s\n", g->serial);
+  return g;
+}
+
+static void request_done (struct gauge* g, int ret, int v);
+
+static void gauge_remove (struct gauge* g)
+{
+  fprintf (stderr, "allurisd: %s removed\n", g->serial);
+  unsigned long bit = 1UL << (g - gauges);
+  int j;
+  for (j=0; j < MAX_CLIENTS; ++j)
+    clients[j].subscriptions &= ~bit;
+
+  // the transfer callbacks of the command in flight refer to the device context
+  liballuris_device_cancel_commands (g->dev);
+  for (j=0; j < 100 && liballuris_device_get_num_pending (g->dev); ++j)
+    liballuris_handle_events (ctx, 10);
+  g->busy = 0;
+  while (g->head)
+    request_done (g, LIBUSB_ERROR_NO_DEVICE, 0);
+
+  gauge_stream_stop (g);
+  liballuris_stream_close (g->stream);
+  liballuris_device_close (g->dev);
+  if (g->sim)
+    liballuris_close_transport (g->sim);
+  memset (g, 0, sizeof (struct gauge));
+}
+
+/****************************************************************************************/
+// device registry
+
+static char arrived[MAX_GAUGES][30];
+static int num_arrived;
+
+//! registry callback, the devices are opened after liballuris_registry_update returned
+static void registry_cb (const struct alluris_device_description* desc, int arrived_flag, void* user_data)
+{
+  (void) user_data;
+  if (arrived_flag)
+    {
+      if (num_arrived < MAX_GAUGES)
+        snprintf (arrived[num_arrived++], sizeof (arrived[0]), "%s", desc->serial_number);
+    }
+  else
+    {
+      struct gauge* g = gauge_find (desc->serial_number);
+      if (g && ! g->sim)
+        gauge_remove (g);
+    }
+}
+
+static void registry_update (struct liballuris_registry* reg)
+{
+  int r = liballuris_registry_update (reg);
+  if (r < 0)
+    fprintf (stderr, "allurisd: registry update failed: %s\n", liballuris_error_name (r));
+
+  int k;
+  for (k=0; k < num_arrived; ++k)
+    {
+      struct liballuris_device* dev;
+      if (gauge_find (arrived[k]))
+        continue;
+      r = liballuris_registry_device_open (reg, arrived[k], &dev);
+      if (r)
+        fprintf (stderr, "allurisd: couldn't open %s: %s\n", arrived[k], liballuris_error_name (r));
+      else if (! gauge_add (dev, NULL))
+        {
+          fprintf (stderr, "allurisd: too many devices, %s ignored\n", arrived[k]);
+          liballuris_device_close (dev);
+        }
+    }
+  num_arrived = 0;
+}
+
+/****************************************************************************************/
+// commands
+
+// synchronous variants for the simulator and commands without asynchronous encoding
+
+static int start_wait (struct liballuris_device* dev)
+{
+  return liballuris_device_start_measurement_wait (dev, 1000, NULL);
+}
+
+static int stop_wait (struct liballuris_device* dev)
+{
+  return liballuris_device_stop_measurement_wait (dev, 2000, NULL);
+}
+
+static int get_mode (struct liballuris_device* dev, int* v)
+{
+  enum liballuris_measurement_mode mode;
+  int ret = liballuris_device_get_mode (dev, &mode);
+  *v = mode;
+  return ret;
+}
+
+static int set_mode (struct liballuris_device* dev, int v)
+{
+  return liballuris_device_set_mode (dev, v);
+}
+
+static int get_mem_mode (struct liballuris_device* dev, int* v)
+{
+  enum liballuris_memory_mode mode;
+  int ret = liballuris_device_get_mem_mode (dev, &mode);
+  *v = mode;
+  return ret;
+}
+
+static int set_mem_mode (struct liballuris_device* dev, int v)
+{
+  return liballuris_device_set_mem_mode (dev, v);
+}
+
+static int get_unit (struct liballuris_device* dev, int* v)
+{
+  enum liballuris_unit unit;
+  int ret = liballuris_device_get_unit (dev, &unit);
+  *v = unit;
+  return ret;
+}
+
+static int read_state (struct liballuris_device* dev, int* v)
+{
+  union __liballuris_state__ state;
+  state._int = 0;
+  int ret = liballuris_device_read_state (dev, &state.bits);
+  *v = state._int;
+  return ret;
+}
+
+/* Commands which are executed on the device. They are queued per gauge and sent with
+ * liballuris_device_submit (cmd), only the simulator and commands without asynchronous
+ * encoding (cmd -1) use the synchronous get, set or action.
+ * The replies of asynchronous commands are taken from the packets of a running stream, the
+ * stream is only paused for commands which change it (pause) or are executed synchronously.
+ * Commands with a cached member of liballuris_metadata are answered from the cache if it's valid. */
+static const struct
+{
+  const char* name;
+  int cmd;                            // enum liballuris_command or -1
+  char pause;
+  unsigned int cached;                // LIBALLURIS_METADATA_* bit or 0
+  char result;                        // 'i' number, 'u' unit, 's' state or 0 for none
+  int (*get) (struct liballuris_device* dev, int* v);
+  int (*set) (struct liballuris_device* dev, int v);
+  int (*action) (struct liballuris_device* dev);
+} commands[] =
+{
+  {"value",           LIBALLURIS_CMD_GET_VALUE,         0, 0, 'i', liballuris_device_get_value, NULL, NULL},
+  {"pos-peak",        LIBALLURIS_CMD_GET_POS_PEAK,      0, 0, 'i', liballuris_device_get_pos_peak, NULL, NULL},
+  {"neg-peak",        LIBALLURIS_CMD_GET_NEG_PEAK,      0, 0, 'i', liballuris_device_get_neg_peak, NULL, NULL},
+  {"start",           LIBALLURIS_CMD_START_MEASUREMENT, 0, 0, 0,   NULL, NULL, start_wait},
+  {"stop",            LIBALLURIS_CMD_STOP_MEASUREMENT,  1, 0, 0,   NULL, NULL, stop_wait},
+  {"tare",            LIBALLURIS_CMD_TARE,              0, 0, 0,   NULL, NULL, liballuris_device_tare},
+  {"clear-pos",       LIBALLURIS_CMD_CLEAR_POS_PEAK,    0, 0, 0,   NULL, NULL, liballuris_device_clear_pos_peak},
+  {"clear-neg",       LIBALLURIS_CMD_CLEAR_NEG_PEAK,    0, 0, 0,   NULL, NULL, liballuris_device_clear_neg_peak},
+  {"set-upper-limit", LIBALLURIS_CMD_SET_UPPER_LIMIT,   0, 0, 0,   NULL, liballuris_device_set_upper_limit, NULL},
+  {"set-lower-limit", LIBALLURIS_CMD_SET_LOWER_LIMIT,   0, 0, 0,   NULL, liballuris_device_set_lower_limit, NULL},
+  {"get-upper-limit", LIBALLURIS_CMD_GET_UPPER_LIMIT,   0, 0, 'i', liballuris_device_get_upper_limit, NULL, NULL},
+  {"get-lower-limit", LIBALLURIS_CMD_GET_LOWER_LIMIT,   0, 0, 'i', liballuris_device_get_lower_limit, NULL, NULL},
+  {"set-mode",        LIBALLURIS_CMD_SET_MODE,          1, 0, 0,   NULL, set_mode, NULL},
+  {"get-mode",        LIBALLURIS_CMD_GET_MODE,          0, LIBALLURIS_METADATA_MODE, 'i', get_mode, NULL, NULL},
+  {"set-mem-mode",    LIBALLURIS_CMD_SET_MEM_MODE,      0, 0, 0,   NULL, set_mem_mode, NULL},
+  {"get-mem-mode",    -1,                               1, 0, 'i', get_mem_mode, NULL, NULL},
+  {"set-auto-stop",   LIBALLURIS_CMD_SET_AUTOSTOP,      0, 0, 0,   NULL, liballuris_device_set_autostop, NULL},
+  {"get-auto-stop",   LIBALLURIS_CMD_GET_AUTOSTOP,      0, 0, 'i', liballuris_device_get_autostop, NULL, NULL},
+  {"set-digout",      LIBALLURIS_CMD_SET_DIGOUT,        0, 0, 0,   NULL, liballuris_device_set_digout, NULL},
+  {"get-digout",      LIBALLURIS_CMD_GET_DIGOUT,        0, 0, 'i', liballuris_device_get_digout, NULL, NULL},
+  {"get-digin",       LIBALLURIS_CMD_GET_DIGIN,         0, 0, 'i', liballuris_device_get_digin, NULL, NULL},
+  {"get-mem-count",   LIBALLURIS_CMD_GET_MEM_COUNT,     0, 0, 'i', liballuris_device_get_mem_count, NULL, NULL},
+  {"state",           LIBALLURIS_CMD_READ_STATE,        0, 0, 's', read_state, NULL, NULL},
+  {"digits",          -1,                               1, LIBALLURIS_METADATA_DIGITS, 'i', liballuris_device_get_digits, NULL, NULL},
+  {"resolution",      -1,                               1, LIBALLURIS_METADATA_RESOLUTION, 'i', liballuris_device_get_resolution, NULL, NULL},
+  {"fmax",            -1,                               1, LIBALLURIS_METADATA_FMAX, 'i', liballuris_device_get_F_max, NULL, NULL},
+  {"get-unit",        -1,                               1, LIBALLURIS_METADATA_UNIT, 'u', get_unit, NULL, NULL},
+};
+
+//! queue "OK RESULT" of command k or "ERR name"
+static void reply_result (struct client* c, int k, int ret, int v)
+{
+  union __liballuris_state__ state;
+  if (ret || ! commands[k].result)
+    reply (c, ret, NULL);
+  else if (commands[k].result == 'u')
+    reply (c, 0, "%s", liballuris_unit_enum2str (v));
+  else if (commands[k].result == 's')
+    {
+      state._int = v;
+      reply (c, 0, "measuring %i peak %i peak_plus %i peak_minus %i upper_limit_exceeded %i lower_limit_underrun %i overload %i mem_active %i mem_running %i",
+             state.bits.measuring, state.bits.some_peak_mode_active, state.bits.peak_plus_active, state.bits.peak_minus_active,
+             state.bits.upper_limit_exceeded, state.bits.lower_limit_underrun, state.bits.overload, state.bits.mem_active, state.bits.mem_running);
+    }
+  else
+    reply (c, 0, "%i", v);
+}
+
+//! answer and remove the head request of the gauge
+static void request_done (struct gauge* g, int ret, int v)
+{
+  struct request* r = g->head;
+  g->head = r->next;
+  if (! g->head)
+    g->tail = NULL;
+  if (r->client)
+    reply_result (r->client, r->k, ret, v);
+
+  // don't restart the measurement which was just stopped by a client
+  if (commands[r->k].action == stop_wait)
+    g->resume = 0;
+  else if (commands[r->k].action == start_wait)
+    g->resume = 1;
+  free (r);
+}
+
+//! completion of the head request, called during libusb event handling
+static void command_cb (struct liballuris_device* dev, enum liballuris_command cmd, int status, int value, void* user_data)
+{
+  (void) dev;
+  (void) cmd;
+  struct gauge* g = user_data;
+  g->busy = 0;
+  request_done (g, status, value);
+}
+
+//! send the queued requests, called from the main loop (never from a libusb callback)
+static void gauge_run (struct gauge* g)
+{
+  while (g->head && ! g->busy)
+    {
+      struct request* r = g->head;
+      int k = r->k;
+      char async = commands[k].cmd >= 0 && ! g->sim;
+      if (g->streaming && (commands[k].pause || ! async))
+        {
+          gauge_stream_stop (g);
+          g->resume = 1;
+        }
+
+      int ret;
+      if (async)
+        {
+          // command_cb may already run in liballuris_device_submit
+          g->busy = 1;
+          ret = liballuris_device_submit (g->dev, commands[k].cmd, r->arg, command_cb, g);
+          if (ret)
+            {
+              g->busy = 0;
+              request_done (g, ret, 0);
+            }
+          continue;
+        }
+
+      int v = r->arg;
+      if (commands[k].get)
+        ret = commands[k].get (g->dev, &v);
+      else if (commands[k].set)
+        ret = commands[k].set (g->dev, v);
+      else
+        ret = commands[k].action (g->dev);
+      request_done (g, ret, v);
+    }
+
+  if (! g->head && g->resume)
+    {
+      g->resume = 0;
+      int ret = gauge_stream_update (g);
+      if (ret)
+        fprintf (stderr, "allurisd: couldn't restart stream of %s: %s\n", g->serial, liballuris_error_name (ret));
+    }
+}
+
+//! answer from the stream or the cache if possible, else queue the command
+static void device_command (struct client* c, struct gauge* g, int k, const char* arg)
+{
+  int v = 0;
+  if (commands[k].set)
+    {
+      char* endptr;
+      if (! arg)
+        {
+          reply (c, LIBALLURIS_OUT_OF_RANGE, NULL);
+          return;
+        }
+      v = strtol (arg, &endptr, 10);
+      if (*endptr)
+        {
+          reply (c, LIBALLURIS_OUT_OF_RANGE, NULL);
+          return;
+        }
+    }
+
+  // the last value of a running stream is fresher than a round trip
+  if (commands[k].cmd == LIBALLURIS_CMD_GET_VALUE && g->streaming && g->last_ns)
+    {
+      reply (c, 0, "%i", g->last_value);
+      return;
+    }
+
+  struct liballuris_metadata md;
+  if (commands[k].cached && (liballuris_device_get_cached_metadata (g->dev, &md) & commands[k].cached))
+    {
+      switch (commands[k].cached)
+        {
+        case LIBALLURIS_METADATA_MODE:
+          v = md.mode;
+          break;
+        case LIBALLURIS_METADATA_UNIT:
+          v = md.unit;
+          break;
+        case LIBALLURIS_METADATA_DIGITS:
+          v = md.digits;
+          break;
+        case LIBALLURIS_METADATA_RESOLUTION:
+          v = md.resolution;
+          break;
+        default:
+          v = md.fmax;
+        }
+      reply_result (c, k, 0, v);
+      return;
+    }
+
+  struct request* r = malloc (sizeof (struct request));
+  if (! r)
+    {
+      reply (c, LIBUSB_ERROR_NO_MEM, NULL);
+      return;
+    }
+  r->next = NULL;
+  r->client = c;
+  r->k = k;
+  r->arg = v;
+  if (g->tail)
+    g->tail->next = r;
+  else
+    g->head = r;
+  g->tail = r;
+}
+
+static void handle_line (struct client* c, char* line)
+{
+  char* save;
+  char* cmd = strtok_r (line, " \t\r", &save);
+  char* serial = strtok_r (NULL, " \t\r", &save);
+  char* arg = strtok_r (NULL, " \t\r", &save);
+  int k;
+
+  if (! cmd)
+    return;
+  if (! strcmp (cmd, "list"))
+    {
+      char buf[MAX_LINE] = "";
+      size_t n = 0;
+      for (k=0; k < MAX_GAUGES; ++k)
+        if (gauges[k].dev && n < sizeof (buf))
+          n += snprintf (buf + n, sizeof (buf) - n, "%s%s", (n)? " " : "", gauges[k].serial);
+      reply (c, 0, "%s", buf);
+      return;
+    }
+
+  struct gauge* g = gauge_find (serial);
+  if (! g)
+    {
+      reply (c, LIBUSB_ERROR_NOT_FOUND, NULL);
+      return;
+    }
+  unsigned long bit = 1UL << (g - gauges);
+
+  if (! strcmp (cmd, "subscribe"))
+    {
+      if (! (c->subscriptions & bit))
+        {
+          c->subscriptions |= bit;
+          g->subscribers++;
+        }
+      // the stream starts after the queued commands
+      int ret = LIBALLURIS_SUCCESS;
+      if (g->head)
+        g->resume = 1;
+      else
+        ret = gauge_stream_update (g);
+      if (ret)
+        {
+          c->subscriptions &= ~bit;
+          g->subscribers--;
+        }
+      reply (c, ret, NULL);
+    }
+  else if (! strcmp (cmd, "unsubscribe"))
+    {
+      if (c->subscriptions & bit)
+        {
+          c->subscriptions &= ~bit;
+          g->subscribers--;
+        }
+      gauge_stream_request (g);
+      reply (c, 0, NULL);
+    }
+  else if (! strcmp (cmd, "stats"))
+    {
+      struct liballuris_stream_stats s = g->total;
+      if (g->streaming)
+        {
+          struct liballuris_stream_stats cur;
+          liballuris_stream_get_stats (g->stream, &cur);
+          s.packets += cur.packets;
+          s.samples += cur.samples;
+          s.gaps += cur.gaps;
+          s.lost_samples += cur.lost_samples;
+          s.transfer_errors += cur.transfer_errors;
+        }
+      reply (c, 0, "streaming %i subscribers %i packets %llu samples %llu gaps %llu lost %llu transfer_errors %llu dropped_lines %llu",
+             g->streaming, g->subscribers, s.packets, s.samples, s.gaps, s.lost_samples, s.transfer_errors, c->dropped_lines);
+    }
+  else
+    {
+      for (k=0; k < (int) (sizeof (commands) / sizeof (commands[0])); ++k)
+        if (! strcmp (cmd, commands[k].name))
+          {
+            device_command (c, g, k, arg);
+            return;
+          }
+      reply (c, LIBUSB_ERROR_NOT_SUPPORTED, NULL);
+    }
+}
+
+//! read from the client and execute all complete lines, returns -1 if the client is gone
+static int client_read (struct client* c)
+{
+  char buf[4096];
+  ssize_t n = recv (c->fd, buf, sizeof (buf), MSG_DONTWAIT);
+  if (n == 0)
+    return -1;
+  if (n < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)? 0 : -1;
+
+  ssize_t k;
+  for (k=0; k < n; ++k)
+    {
+      if (buf[k] != '\n')
+        {
+          if (c->in_len < sizeof (c->in) - 1)
+            c->in[c->in_len++] = buf[k];
+          else
+            c->discard = 1;
+          continue;
+        }
+      c->in[c->in_len] = 0;
+      if (c->discard)
+        reply (c, LIBALLURIS_OUT_OF_RANGE, NULL);
+      else
+        handle_line (c, c->in);
+      c->in_len = 0;
+      c->discard = 0;
+    }
+  return 0;
+}
+
+/****************************************************************************************/
+
+//! create the listening socket, a stale socket file of a dead daemon is replaced
+static int open_socket (const char* path)
+{
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen (path) >= sizeof (addr.sun_path))
+    {
+      fprintf (stderr, "allurisd: socket path too long\n");
+      return -1;
+    }
+  strcpy (addr.sun_path, path);
+
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      perror ("allurisd: socket");
+      return -1;
+    }
+  if (connect (fd, (struct sockaddr*) &addr, sizeof (addr)) == 0)
+    {
+      fprintf (stderr, "allurisd: another daemon is listening on %s\n", path);
+      close (fd);
+      return -1;
+    }
+  if (errno == ECONNREFUSED)
+    unlink (path);
+  close (fd);
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0)
+    {
+      fcntl (fd, F_SETFD, FD_CLOEXEC);
+      fcntl (fd, F_SETFL, O_NONBLOCK);
+    }
+  if (fd < 0 || bind (fd, (struct sockaddr*) &addr, sizeof (addr)) || listen (fd, 16))
+    {
+      fprintf (stderr, "allurisd: couldn't listen on %s: %s\n", path, strerror (errno));
+      if (fd >= 0)
+        close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+static error_t
+parse_opt (int key, char *arg, struct argp_state *state)
+{
+  struct arguments *arguments = state->input;
+  char *endptr;
+
+  switch (key)
+    {
+    case 1000:
+      arguments->socket_path = arg;
+      break;
+    case 1001:
+      arguments->latency = strtol (arg, &endptr, 10);
+      if (*endptr)
+        argp_error (state, "invalid latency '%s'", arg);
+      break;
+    case 1002:
+      arguments->simulate = 1;
+      break;
+    case 1003:
+      arguments->speed = strtod (arg, &endptr);
+      if (*endptr || arguments->speed <= 0)
+        argp_error (state, "invalid speed '%s'", arg);
+      break;
+    default:
+      return ARGP_ERR_UNKNOWN;
+    }
+  return 0;
+}
+
+/* Our argp parser. */
+static struct argp argp = { options, parse_opt, args_doc, doc, 0, 0, 0};
+
+int main(int argc, char** argv)
+{
+  struct arguments arguments;
+  char default_path[108];
+
+  arguments.socket_path = NULL;
+  arguments.latency     = 100;
+  arguments.simulate    = 0;
+  arguments.speed       = 1;
+  argp_parse (&argp, argc, argv, ARGP_NO_ARGS, 0, &arguments);
+  latency = arguments.latency;
+
+  if (! arguments.socket_path)
+    {
+      const char* dir = getenv ("XDG_RUNTIME_DIR");
+      if (dir && *dir)
+        snprintf (default_path, sizeof (default_path), "%s/allurisd.sock", dir);
+      else
+        snprintf (default_path, sizeof (default_path), "/tmp/allurisd-%u.sock", (unsigned) getuid ());
+      arguments.socket_path = default_path;
+    }
+
+  if (signal (SIGINT, termination_handler) == SIG_IGN)
+    signal (SIGINT, SIG_IGN);
+
+  if (signal (SIGTERM, termination_handler) == SIG_IGN)
+    signal (SIGTERM, SIG_IGN);
+
+  signal (SIGPIPE, SIG_IGN);
+
+  int k;
+  for (k=0; k < MAX_CLIENTS; ++k)
+    clients[k].fd = -1;
+
+  int r = libusb_init (&ctx);
+  if (r < 0)
+    {
+      fprintf (stderr, "Couldn't init libusb %s\n", liballuris_error_name (r));
+      return EXIT_FAILURE;
+    }
+
+  int listen_fd = open_socket (arguments.socket_path);
+  if (listen_fd < 0)
+    {
+      libusb_exit (ctx);
+      return EXIT_FAILURE;
+    }
+
+  if (arguments.simulate)
+    {
+      libusb_device_handle* h;
+      struct liballuris_device* dev;
+      r = liballuris_open_simulator (arguments.speed, &h);
+      if (! r)
+        {
+          r = liballuris_device_wrap (h, &dev);
+          if (r)
+            liballuris_close_transport (h);
+          else
+            gauge_add (dev, h);
+        }
+      if (r)
+        fprintf (stderr, "allurisd: couldn't open simulator: %s\n", liballuris_error_name (r));
+    }
+
+  struct liballuris_registry* reg;
+  r = liballuris_registry_open (ctx, registry_cb, NULL, &reg);
+  if (r)
+    {
+      fprintf (stderr, "allurisd: couldn't open registry: %s\n", liballuris_error_name (r));
+      close (listen_fd);
+      unlink (arguments.socket_path);
+      libusb_exit (ctx);
+      return EXIT_FAILURE;
+    }
+  registry_update (reg);
+  int64_t next_rescan = monotonic_ns () + (int64_t) RESCAN_MS * 1000000;
+  fprintf (stderr, "allurisd: listening on %s\n", arguments.socket_path);
+
+  struct pollfd fds[1 + MAX_CLIENTS + MAX_LIBUSB_FDS];
+  int client_index[MAX_CLIENTS];
+  while (! do_exit)
+    {
+      // listen socket, clients, libusb
+      size_t nfds = 0, num_usb = 0;
+      fds[nfds].fd = listen_fd;
+      fds[nfds++].events = POLLIN;
+      int num_clients = 0;
+      for (k=0; k < MAX_CLIENTS; ++k)
+        if (clients[k].fd >= 0)
+          {
+            client_index[num_clients++] = k;
+            fds[nfds].fd = clients[k].fd;
+            fds[nfds++].events = POLLIN | ((clients[k].out_len)? POLLOUT : 0);
+          }
+      if (liballuris_get_pollfds (ctx, fds + nfds, MAX_LIBUSB_FDS, &num_usb) == LIBALLURIS_OUT_OF_RANGE)
+        num_usb = MAX_LIBUSB_FDS;
+      nfds += num_usb;
+
+      int timeout;
+      liballuris_get_next_timeout (ctx, &timeout);
+      int rescan = (int) ((next_rescan - monotonic_ns ()) / 1000000);
+      if (rescan < 0)
+        rescan = 0;
+      if (timeout < 0 || timeout > rescan)
+        timeout = rescan;
+      // the streams of simulated devices are received in liballuris_stream_dispatch
+      for (k=0; k < MAX_GAUGES; ++k)
+        if (gauges[k].streaming && gauges[k].sim)
+          timeout = 0;
+
+      r = poll (fds, nfds, timeout);
+      if (r < 0 && errno != EINTR)
+        {
+          perror ("allurisd: poll");
+          break;
+        }
+      if (r < 0)
+        continue;
+
+      // libusb events first, they carry the data for the clients
+      liballuris_handle_events (ctx, 0);
+      for (k=0; k < MAX_GAUGES; ++k)
+        if (gauges[k].streaming)
+          {
+            int ret = liballuris_stream_dispatch (gauges[k].stream);
+            if (ret == LIBUSB_ERROR_NO_DEVICE)
+              gauge_remove (&gauges[k]);
+            else if (ret)
+              fprintf (stderr, "allurisd: stream of %s: %s\n", gauges[k].serial, liballuris_error_name (ret));
+          }
+      if (monotonic_ns () >= next_rescan)
+        {
+          registry_update (reg);
+          next_rescan = monotonic_ns () + (int64_t) RESCAN_MS * 1000000;
+        }
+
+      for (k=0; k < num_clients; ++k)
+        {
+          struct client* c = &clients[client_index[k]];
+          short revents = fds[1 + k].revents;
+          if (c->fd >= 0 && (revents & (POLLIN | POLLHUP | POLLERR)) && client_read (c))
+            client_close (c);
+        }
+      for (k=0; k < MAX_GAUGES; ++k)
+        if (gauges[k].dev)
+          gauge_run (&gauges[k]);
+
+      if (fds[0].revents & POLLIN)
+        {
+          int fd = accept (listen_fd, NULL, NULL);
+          if (fd >= 0)
+            fcntl (fd, F_SETFD, FD_CLOEXEC);
+          for (k=0; fd >= 0 && k < MAX_CLIENTS && clients[k].fd >= 0; ++k);
+          if (fd >= 0 && k == MAX_CLIENTS)
+            {
+              fprintf (stderr, "allurisd: too many clients\n");
+              close (fd);
+            }
+          else if (fd >= 0)
+            clients[k].fd = fd;
+        }
+
+      // replies and data queued above
+      for (k=0; k < MAX_CLIENTS; ++k)
+        if (clients[k].fd >= 0 && client_flush (&clients[k]))
+          client_close (&clients[k]);
+    }
+
+  for (k=0; k < MAX_CLIENTS; ++k)
+    if (clients[k].fd >= 0)
+      client_close (&clients[k]);
+  for (k=0; k < MAX_GAUGES; ++k)
+    if (gauges[k].dev)
+      gauge_remove (&gauges[k]);
+  liballuris_registry_close (reg);
+  close (listen_fd);
+  unlink (arguments.socket_path);
+  libusb_exit (ctx);
+  return EXIT_SUCCESS;
+}
@@ -22,7 +22,10 @@ If not, see <http://www.gnu.org/licenses/>.
 
 #include <stdio.h>
 #include <argp.h>
+#include <errno.h>
 #include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <liballuris.h>
 
 char do_exit = 0;
@@ -46,6 +49,11 @@ static struct argp_option options[] =
   {"list",         'l', 0,             0, "List accessible (stopped and not claimed) devices", 0},
   {"serial",       1009, "SERIAL",     0, "Connect to specific alluris device using serial number. This only works if the device is stopped.", 0},
   {NULL,           'b',  "Bus,Device", 0, "Connect to specific alluris device using bus and device id", 0},
+  {"simulate",     1038, 0,            0, "Use a simulated device instead of USB", 0},
+  {"replay",       1039, "FILE",       0, "Use a recording (see --record) instead of USB", 0},
+  {"speed",        1040, "X",          0, "Time scale of following --simulate or --replay, for example 10 (default 1, 0=replay without delays)", 0},
+  {"batch",        1042, "FILE",       OPTION_ARG_OPTIONAL, "Keep the device open and execute the options on each line of stdin (or FILE, for example a FIFO). "\
+   "Each line is answered with one line 'OK [OUTPUT]' or 'ERR NAME', newlines of the output are replaced by spaces", 0},
 
   {0, 0, 0, 0, "Measurement:", 2 },
   {"start",        1006, 0,            0, "Start", 0},
@@ -54,6 +62,7 @@ static struct argp_option options[] =
   {"pos-peak",     'p', 0,             0, "Positive peak", 0},
   {"neg-peak",     'n', 0,             0, "Negative peak", 0},
   {"sample",       's', "NUM",         0, "Capture NUM values (Inf if NUM==0)", 0},
+  {"latency",      1037, "MS",         0, "Latency target for following --sample, the packet size is chosen from the measurement mode (0=max. packet size, default)", 0},
 
   {0, 0, 0, 0, "Tare:", 3 },
   {"tare",         't', 0,             0, "Tare measurement", 0},
@@ -90,6 +99,7 @@ static struct argp_option options[] =
   {"power-off",    1023, 0,            0, "Power off the device", 0},
   {"delete-memory",1024, 0,            0, "Delete the measurement memory", 0},
   {"read-memory",  1025, "ADR",        0, "Read adr 0..999 or -1 for whole memory", 0},
+  {"dump-memory",  1035, 0,            0, "Fast read of all stored values (see --get-mem-count) with pipelined requests", 0},
   {
     "get-stats",    1026, 0,            0, "Get statistic (MAX_PLUS, MIN_PLUS, MAX_MINUS, MIN_MINUS, AVERAGE, VARIANCE) from memory values. "\
     "All values are fixed-point numbers (see --digits) except DEVIATION which uses 3 digits in firmware "\
@@ -97,6 +107,8 @@ static struct argp_option options[] =
   {"keypress",     1027, "KEY",        0, "Sim. keypress. Bit 0=S1, 1=S2, 2=S3, 3=long_press. For ex. 12 => long press of S3", 0},
   {"get-mem-count",1028, 0,            0, "Get number of values in memory", 0},
   {"get-next-cal-date",1029, 0,        0, "Get the next calibration date as YYMM", 0},
+  {"get-calibration",1036, 0,          0, "Get calibration date, uncertainty and calibration number (firmware >= V5.04.005)", 0},
+  {"record",       1041, "FILE",       0, "Record all following transfers to FILE for --replay", 0},
   {"set-keylock",  1031, "V",          0, "Lock (V=1) or unlock (V=0) keys. Power-off with S1 is still possible. Disconnecting USB automatically unlocks the keys. (firmware >= V4.04.005/V5.04.005)", 0},
   { 0,0,0,0,0,0 }
 
@@ -109,8 +121,15 @@ struct arguments
   libusb_device_handle* h;
   int error;
   int last_key;
+  unsigned int latency;
+  double speed;
+  char transport;     // h is a simulator or replay, see liballuris_open_transport
+  char batch;         // executing a line of --batch
+  FILE* out;          // output of the commands, collected per line in --batch
 };
 
+#define MAX_BATCH_ARGS 64
+
 void termination_handler (int signum)
 {
   //fprintf(stderr, "Received signal %i, terminating program\n", signum);
@@ -118,15 +137,15 @@ void termination_handler (int signum)
   do_exit = 1;
 }
 
-static void print_value (int ret, int value)
+static void print_value (FILE* out, int ret, int value)
 {
   if (ret != LIBUSB_SUCCESS)
     fprintf(stderr, "Error: '%s'\n", liballuris_error_name (ret));
   else
-    printf ("%i\n", value);
+    fprintf (out, "%i\n", value);
 }
 
-static int print_multiple (libusb_device_handle *dev_handle, int num)
+static int print_multiple (FILE* out, libusb_context* ctx, libusb_device_handle *dev_handle, int num, unsigned int latency)
 {
   // check if measurement is running
   struct liballuris_state state;
@@ -139,33 +158,49 @@ static int print_multiple (libusb_device_handle *dev_handle, int num)
           if (block_size > 19 || !num)
             block_size = 19;
 
-          int tempx[block_size];
-
-          // enable streaming
-          ret = liballuris_cyclic_measurement (dev_handle, 1, block_size);
-
+          // enable streaming, the stream keeps several transfers in flight
+          struct liballuris_stream* stream;
+          ret = liballuris_stream_open (ctx, dev_handle, block_size, 0, NULL, NULL, &stream);
+          if (ret)
+            return ret;
+          if (latency)
+            liballuris_stream_set_latency (stream, latency);
+          ret = liballuris_stream_start (stream);
+
+          // read many packets at once, the timeout limits the output latency and checks do_exit
+          int tempx[4096];
           int cnt = 0;
           // if num==0, read until sigint or sigterm
           while (!do_exit && !ret && (!num || num > cnt))
             {
-              //printf ("polling %i, %i left\n", block_size, num);
-              ret = liballuris_poll_measurement (dev_handle, tempx, block_size);
-              if (ret == LIBUSB_SUCCESS)
-                {
-                  int k = 0;
-                  while (k < block_size && (cnt < num || !num))
-                    {
-                      printf ("%i\n", tempx[k++]);
-                      cnt++;
-                    }
-                  fflush (stdout);
-                }
-              else
-                return ret;
+              size_t len = sizeof (tempx) / sizeof (tempx[0]);
+              if (num && (size_t) (num - cnt) < len)
+                len = num - cnt;
+
+              size_t actual = 0;
+              ret = liballuris_stream_read_bulk (stream, tempx, NULL, len, &actual, 100);
+              if (ret == LIBALLURIS_TIMEOUT)
+                ret = LIBUSB_SUCCESS;
+
+              size_t k;
+              for (k=0; k < actual; ++k)
+                fprintf (out, "%i\n", tempx[k]);
+              cnt += actual;
+              fflush (out);
             }
 
           // disable streaming
-          ret = liballuris_cyclic_measurement (dev_handle, 0, block_size);
+          int r = liballuris_stream_stop (stream);
+          if (!ret)
+            ret = r;
+
+          // to stderr, stdout only contains the values
+          struct liballuris_stream_stats stats;
+          liballuris_stream_get_stats (stream, &stats);
+          fprintf (stderr, "stream: %llu samples in %llu packets, %llu gaps (%llu samples lost), %llu malformed, %llu dropped, %llu resyncs, %llu transfer errors\n",
+                   stats.samples, stats.packets, stats.gaps, stats.lost_samples, stats.malformed,
+                   stats.dropped_samples, stats.resyncs, stats.transfer_errors);
+          liballuris_stream_close (stream);
         }
       else
         {
@@ -176,6 +211,8 @@ static int print_multiple (libusb_device_handle *dev_handle, int num)
   return ret;
 }
 
+static int run_batch (struct arguments* arguments, const char* path);
+
 /* Parse a single option. */
 static error_t
 parse_opt (int key, char *arg, struct argp_state *state)
@@ -194,20 +231,32 @@ parse_opt (int key, char *arg, struct argp_state *state)
   struct liballuris_state device_state;
   char firmware_buf[21];
 
+  // neither exit nor nest from within a batch line
+  if (arguments->batch && (key == 'l' || key == 1042))
+    {
+      arguments->error = LIBUSB_ERROR_NOT_SUPPORTED;
+      state->next = state->argc;
+      return 0;
+    }
+
   if (key == 'l')
     {
       // list accessible devices and exit
       // FIXME: document that a running measurement prohibits reading the serial_number
 
-#define MAX_NUM_DEVICES 4
-      struct alluris_device_description alluris_devs[MAX_NUM_DEVICES];
-      ssize_t cnt = liballuris_get_device_list (arguments->ctx, alluris_devs, MAX_NUM_DEVICES, 1);
+      struct alluris_device_description* alluris_devs;
+      int cnt = liballuris_get_device_list_alloc (arguments->ctx, &alluris_devs, 1);
+      if (cnt < 0)
+        {
+          fprintf (stderr, "Couldn't list devices: %s\n", liballuris_error_name (cnt));
+          exit (EXIT_FAILURE);
+        }
 
       int k;
-      printf ("Device list:\n");
-      printf ("Num Bus Device Product                   Serial\n");
+      fprintf (arguments->out, "Device list:\n");
+      fprintf (arguments->out, "Num Bus Device Product                   Serial\n");
       for (k=0; k < cnt; k++)
-        printf ("%3i %03d    %03d %-25s %s\n", k+1,
+        fprintf (arguments->out, "%3i %03d    %03d %-25s %s\n", k+1,
                 libusb_get_bus_number(alluris_devs[k].dev),
                 libusb_get_device_address(alluris_devs[k].dev),
                 alluris_devs[k].product,
@@ -217,7 +266,7 @@ parse_opt (int key, char *arg, struct argp_state *state)
         fprintf (stderr, "No accessible device found\n");
 
       // free device list
-      liballuris_free_device_list (alluris_devs, MAX_NUM_DEVICES);
+      liballuris_release_device_list (alluris_devs, cnt);
 
       exit (0);
     }
@@ -261,6 +310,31 @@ parse_opt (int key, char *arg, struct argp_state *state)
       return 0;
     }
 
+  if (key == 1040)  // time scale for simulator and replay
+    {
+      arguments->speed = strtod (arg, &endptr);
+      return 0;
+    }
+
+  if (key == 1038 || key == 1039)  // simulated device or recording
+    {
+      if (!arguments->h)
+        {
+          if (key == 1038)
+            r = liballuris_open_simulator (arguments->speed, &arguments->h);
+          else
+            r = liballuris_open_replay (arg, arguments->speed, &arguments->h);
+          if (r)
+            {
+              fprintf (stderr, "Couldn't open %s: %s\n", (key == 1038)? "simulator" : arg, liballuris_error_name (r));
+              exit (EXIT_FAILURE);
+            }
+          arguments->transport = 1;
+          state->next = state->argc;
+        }
+      return 0;
+    }
+
   enum liballuris_measurement_mode r_mode;
   enum liballuris_memory_mode r_mem_mode;
   enum liballuris_unit r_unit;
@@ -269,20 +343,20 @@ parse_opt (int key, char *arg, struct argp_state *state)
       {
       case 'v':
         r = liballuris_get_value (arguments->h, &value);
-        print_value (r, value);
+        print_value (arguments->out, r, value);
         break;
       case 'p':
         r = liballuris_get_pos_peak (arguments->h, &value);
-        print_value (r, value);
+        print_value (arguments->out, r, value);
         break;
       case 'n':
         r = liballuris_get_neg_peak (arguments->h, &value);
-        print_value (r, value);
+        print_value (arguments->out, r, value);
         break;
       case 's':
         num_samples = strtol (arg, &endptr, 10);
         if (!num_samples || num_samples > 1)
-          r = print_multiple (arguments->h, num_samples);
+          r = print_multiple (arguments->out, arguments->ctx, arguments->h, num_samples, arguments->latency);
         else
           {
             fprintf (stderr, "NUM has to be > 1 or 0 (read until sigint or sigterm)\n");
@@ -290,7 +364,7 @@ parse_opt (int key, char *arg, struct argp_state *state)
           }
         break;
       case 't':
-        r = liballuris_tare (arguments->h);
+        r = liballuris_tare_wait (arguments->h, 2, NULL);
         break;
       case 1000:
         r = liballuris_clear_pos_peak (arguments->h);
@@ -308,26 +382,26 @@ parse_opt (int key, char *arg, struct argp_state *state)
         break;
       case 1004:
         r = liballuris_get_upper_limit (arguments->h, &value);
-        print_value (r, value);
+        print_value (arguments->out, r, value);
         break;
       case 1005:
         r = liballuris_get_lower_limit (arguments->h, &value);
-        print_value (r, value);
+        print_value (arguments->out, r, value);
         break;
       case 1006:
-        r = liballuris_start_measurement (arguments->h);
+        r = liballuris_start_measurement_wait (arguments->h, 1000, NULL);
         break;
       case 1007:
-        r = liballuris_stop_measurement (arguments->h);
+        r = liballuris_stop_measurement_wait (arguments->h, 2000, NULL);
         break;
       case 1008:
         r = liballuris_get_digits (arguments->h, &value);
-        print_value (r, value);
+        print_value (arguments->out, r, value);
         break;
       case 1010:
         r = liballuris_read_state (arguments->h, &device_state);
         if (r == LIBUSB_SUCCESS)
-          liballuris_print_state (device_state);
+          liballuris_fprint_state (arguments->out, device_state);
         break;
       case 1011:
         value = strtol (arg, &endptr, 10);
@@ -340,7 +414,7 @@ parse_opt (int key, char *arg, struct argp_state *state)
         break;
       case 1013:
         r = liballuris_get_mode (arguments->h, &r_mode);
-        print_value (r, r_mode);
+        print_value (arguments->out, r, r_mode);
         break;
       case 1014:
         r_mem_mode = strtol (arg, &endptr, 10);
@@ -348,14 +422,14 @@ parse_opt (int key, char *arg, struct argp_state *state)
         break;
       case 1015:
         r = liballuris_get_mem_mode (arguments->h, &r_mem_mode);
-        print_value (r, r_mem_mode);
+        print_value (arguments->out, r, r_mem_mode);
         break;
       case 1016:  //get-unit
         r = liballuris_get_unit (arguments->h, &r_unit);
         if (r != LIBUSB_SUCCESS)
           fprintf(stderr, "Error: '%s'\n", liballuris_error_name (r));
         else
-          printf ("%s\n", liballuris_unit_enum2str (r_unit));
+          fprintf (arguments->out, "%s\n", liballuris_unit_enum2str (r_unit));
         break;
       case 1017:  //set-unit
         r_unit = liballuris_unit_str2enum (arg);
@@ -363,7 +437,7 @@ parse_opt (int key, char *arg, struct argp_state *state)
         break;
       case 1018:  //get fmax
         r = liballuris_get_F_max (arguments->h, &value);
-        print_value (r, value);
+        print_value (arguments->out, r, value);
         break;
       case 1019:  //set digout
         value = strtol (arg, &endptr, 10);
@@ -371,20 +445,20 @@ parse_opt (int key, char *arg, struct argp_state *state)
         break;
       case 1020:  //get digout
         r = liballuris_get_digout (arguments->h, &value);
-        print_value (r, value);
+        print_value (arguments->out, r, value);
         break;
       case 1021:  //get firmware
         r = liballuris_get_firmware (arguments->h, 0, firmware_buf, 21);
         if (r != LIBUSB_SUCCESS)
           fprintf(stderr, "Error: '%s'\n", liballuris_error_name (r));
         else
-          printf ("%s;", firmware_buf);
+          fprintf (arguments->out, "%s;", firmware_buf);
 
         r = liballuris_get_firmware (arguments->h, 1, firmware_buf, 21);
         if (r != LIBUSB_SUCCESS)
           fprintf(stderr, "Error: '%s'\n", liballuris_error_name (r));
         else
-          printf ("%s\n", firmware_buf);
+          fprintf (arguments->out, "%s\n", firmware_buf);
         break;
       case 1022:  //restore factory defaults
         r = liballuris_restore_factory_defaults (arguments->h);
@@ -407,7 +481,7 @@ parse_opt (int key, char *arg, struct argp_state *state)
         while (star_adr <= stop_adr)
           {
             r = liballuris_read_memory (arguments->h, star_adr++, &value);
-            print_value (r, value);
+            print_value (arguments->out, r, value);
           }
         break;
       case 1026:  //get-stats
@@ -416,12 +490,12 @@ parse_opt (int key, char *arg, struct argp_state *state)
           fprintf(stderr, "Error: '%s'\n", liballuris_error_name (r));
         else
           {
-            printf ("MAX_PLUS  (raw) = %5i\n", stats[0]);
-            printf ("MIN_PLUS  (raw) = %5i\n", stats[1]);
-            printf ("MAX_MINUS (raw) = %5i\n", stats[2]);
-            printf ("MIN_MINUS (raw) = %5i\n", stats[3]);
-            printf ("AVERAGE   (raw) = %5i\n", stats[4]);
-            printf ("VARIANCE  (raw) = %5i\n", stats[5]);
+            fprintf (arguments->out, "MAX_PLUS  (raw) = %5i\n", stats[0]);
+            fprintf (arguments->out, "MIN_PLUS  (raw) = %5i\n", stats[1]);
+            fprintf (arguments->out, "MAX_MINUS (raw) = %5i\n", stats[2]);
+            fprintf (arguments->out, "MIN_MINUS (raw) = %5i\n", stats[3]);
+            fprintf (arguments->out, "AVERAGE   (raw) = %5i\n", stats[4]);
+            fprintf (arguments->out, "VARIANCE  (raw) = %5i\n", stats[5]);
           }
         break;
       case 1027:  //simulate keypress
@@ -430,16 +504,16 @@ parse_opt (int key, char *arg, struct argp_state *state)
         break;
       case 1028: //get-mem-count
         r = liballuris_get_mem_count (arguments->h, &value);
-        print_value (r, value);
+        print_value (arguments->out, r, value);
         break;
       case 1029: //next-cal-date
         r = liballuris_get_next_calibration_date (arguments->h, &value);
-        print_value (r, value);
+        print_value (arguments->out, r, value);
         break;
 
       case 1030: //get_resolution
         r = liballuris_get_resolution (arguments->h, &value);
-        print_value (r, value);
+        print_value (arguments->out, r, value);
         break;
 
       case 1031: //set-keylock
@@ -454,12 +528,51 @@ parse_opt (int key, char *arg, struct argp_state *state)
 
       case 1033: //get-auto-stop
         r = liballuris_get_autostop (arguments->h, &value);
-        print_value (r, value);
+        print_value (arguments->out, r, value);
         break;
 
       case 1034: //get-digin
         r = liballuris_get_digin (arguments->h, &value);
-        print_value (r, value);
+        print_value (arguments->out, r, value);
+        break;
+
+      case 1035: //dump-memory
+        {
+          int mem_values[1000];
+          size_t num_values, k;
+          r = liballuris_read_memory_all (arguments->h, mem_values, 1000, &num_values);
+          for (k=0; k < num_values; ++k)
+            fprintf (arguments->out, "%i\n", mem_values[k]);
+        }
+        break;
+
+      case 1036: //get-calibration
+        {
+          struct liballuris_calibration_info cal;
+          r = liballuris_get_calibration_info (arguments->h, &cal);
+          if (r != LIBUSB_SUCCESS)
+            fprintf(stderr, "Error: '%s'\n", liballuris_error_name (r));
+          else
+            {
+              // date is days since 1.1.2000, let mktime normalize it
+              struct tm t;
+              memset (&t, 0, sizeof (t));
+              t.tm_year = 100;
+              t.tm_mday = 1 + cal.date;
+              t.tm_hour = 12;
+              mktime (&t);
+              fprintf (arguments->out, "%04i-%02i-%02i;%g;%s\n", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, cal.uncertainty, cal.number);
+            }
+        }
+        break;
+      case 1037: //latency target for --sample
+        arguments->latency = strtol (arg, &endptr, 10);
+        break;
+      case 1041:
+        r = liballuris_record_start (arguments->h, arg);
+        break;
+      case 1042:
+        r = run_batch (arguments, arg);
         break;
 
       default:
@@ -482,6 +595,96 @@ parse_opt (int key, char *arg, struct argp_state *state)
 /* Our argp parser. */
 static struct argp argp = { options, parse_opt, args_doc, doc, 0, 0, 0};
 
+/* Execute one line of --batch and answer it with one line on stdout */
+static void batch_line (struct arguments* arguments, char* line)
+{
+  char* argv[MAX_BATCH_ARGS + 1];
+  char* save;
+  int argc = 0;
+  argv[argc++] = "gadc";
+  char* tok = strtok_r (line, " \t\r\n", &save);
+  while (tok && argc < MAX_BATCH_ARGS)
+    {
+      argv[argc++] = tok;
+      tok = strtok_r (NULL, " \t\r\n", &save);
+    }
+  argv[argc] = NULL;
+  // empty lines and comments aren't answered
+  if (argc == 1 || argv[1][0] == '#')
+    return;
+
+  // collect the output of the commands to answer with one line
+  char* buf = NULL;
+  size_t len = 0;
+  FILE* mem = open_memstream (&buf, &len);
+  if (!mem)
+    {
+      printf ("ERR %s\n", liballuris_error_name (LIBUSB_ERROR_NO_MEM));
+      fflush (stdout);
+      return;
+    }
+  arguments->error = 0;
+  arguments->batch = 1;
+  arguments->out = mem;
+  int r = argp_parse (&argp, argc, argv, ARGP_NO_ARGS | ARGP_IN_ORDER | ARGP_NO_EXIT | ARGP_NO_HELP, 0, arguments);
+  arguments->batch = 0;
+  arguments->out = stdout;
+  fclose (mem);
+
+  if (r)
+    r = LIBUSB_ERROR_INVALID_PARAM;
+  else
+    r = arguments->error;
+  arguments->error = 0;
+
+  size_t k;
+  for (k=0; k < len; ++k)
+    if (buf[k] == '\n')
+      buf[k] = ' ';
+  while (len && buf[len - 1] == ' ')
+    buf[--len] = 0;
+
+  if (r)
+    {
+      printf ("ERR %s\n", liballuris_error_name (r));
+      // discard a late reply, see cleanup in main
+      liballuris_clear_RX (arguments->h, 10);
+    }
+  else
+    printf ("OK%s%s\n", (len)? " " : "", buf);
+  fflush (stdout);
+  free (buf);
+}
+
+/* --batch: read command lines until EOF. A FIFO is reopened when the last writer closed it. */
+static int run_batch (struct arguments* arguments, const char* path)
+{
+  FILE* in = stdin;
+  struct stat st;
+  char is_fifo = path && !stat (path, &st) && S_ISFIFO (st.st_mode);
+  char line[1024];
+
+  do
+    {
+      if (path)
+        {
+          in = fopen (path, "r");
+          if (!in)
+            {
+              fprintf (stderr, "Couldn't open '%s': %s\n", path, strerror (errno));
+              return LIBUSB_ERROR_NOT_FOUND;
+            }
+        }
+      while (!do_exit && fgets (line, sizeof (line), in))
+        batch_line (arguments, line);
+      if (path)
+        fclose (in);
+    }
+  while (is_fifo && !do_exit);
+  return 0;
+}
+
+
 int main(int argc, char** argv)
 {
   if (argc == 1)
@@ -506,6 +709,11 @@ int main(int argc, char** argv)
   arguments.h            = NULL;
   arguments.error        = 0;
   arguments.last_key     = 0;
+  arguments.latency      = 0;
+  arguments.speed        = 1;
+  arguments.transport    = 0;
+  arguments.batch        = 0;
+  arguments.out          = stdout;
 
   int r = libusb_init (&arguments.ctx);
   if (r < 0)
@@ -527,7 +735,8 @@ int main(int argc, char** argv)
 
   if (arguments.h)
     {
-      r = libusb_claim_interface (arguments.h, 0);
+      // simulator and replay have no USB interface
+      r = (arguments.transport)? 0 : libusb_claim_interface (arguments.h, 0);
       if (r)
         fprintf (stderr, "Couldn't claim interface: %s\n", liballuris_error_name (r));
       else
@@ -553,10 +762,17 @@ int main(int argc, char** argv)
               fprintf(stderr, "closing application...\n");
             }
           //printf ("libusb_release_interface\n");
-          libusb_release_interface (arguments.h, 0);
+          if (!arguments.transport)
+            libusb_release_interface (arguments.h, 0);
+        }
+      if (arguments.transport)
+        liballuris_close_transport (arguments.h);
+      else
+        {
+          liballuris_record_stop (arguments.h);
+          //printf ("libusb_close\n");
+          libusb_close (arguments.h);
         }
-      //printf ("libusb_close\n");
-      libusb_close (arguments.h);
     }
   return r;
 }
@@ -0,0 +1,675 @@
+/*
+
+Copyright (C) 2015 Alluris GmbH & Co. KG <weber@alluris.de>
+
+raw_gauge -- virtual Alluris gauge on the Linux raw-gadget interface
+
+Emulates the USB side of an FMI-S (VID 0x04d8, PID 0xfc30) on a UDC, for example
+dummy_hcd, so that liballuris talks to it through the unmodified libusb and kernel
+USB stack. Commands are answered immediately, thus benchmarks measure the transport
+and not the firmware. See raw_gauge_setup.sh and transport_bench.c
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  See ../COPYING
+If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * raw-gadget is used instead of FunctionFS because liballuris expects the
+ * endpoints 0x01 and 0x81. With FunctionFS the UDC assigns the endpoint numbers
+ * (dummy_hcd for example only has ep5in-int for interrupt IN), raw-gadget keeps
+ * the addresses of our descriptors.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#define VENDOR_ID  0x04d8
+#define PRODUCT_ID 0xfc30
+
+#define EP0_MAX_DATA 256
+#define PACKET_LEN 64
+#define MAX_BLOCK_SIZE 19
+#define REPLY_QUEUE_LEN 16
+
+struct ep0_io
+{
+  struct usb_raw_ep_io inner;
+  unsigned char data[EP0_MAX_DATA];
+};
+
+struct ep_io
+{
+  struct usb_raw_ep_io inner;
+  unsigned char data[PACKET_LEN];
+};
+
+struct control_event
+{
+  struct usb_raw_event inner;
+  struct usb_ctrlrequest ctrl;
+};
+
+static struct usb_device_descriptor device_desc =
+{
+  .bLength = USB_DT_DEVICE_SIZE,
+  .bDescriptorType = USB_DT_DEVICE,
+  .bcdUSB = 0x0200,
+  .bDeviceClass = 0,
+  .bDeviceSubClass = 0,
+  .bDeviceProtocol = 0,
+  .bMaxPacketSize0 = 64,
+  .idVendor = VENDOR_ID,
+  .idProduct = PRODUCT_ID,
+  .bcdDevice = 0x0100,
+  .iManufacturer = 1,
+  .iProduct = 2,
+  .iSerialNumber = 0,
+  .bNumConfigurations = 1,
+};
+
+static struct usb_qualifier_descriptor qualifier_desc =
+{
+  .bLength = sizeof (struct usb_qualifier_descriptor),
+  .bDescriptorType = USB_DT_DEVICE_QUALIFIER,
+  .bcdUSB = 0x0200,
+  .bDeviceClass = 0,
+  .bDeviceSubClass = 0,
+  .bDeviceProtocol = 0,
+  .bMaxPacketSize0 = 64,
+  .bNumConfigurations = 1,
+  .bRESERVED = 0,
+};
+
+static struct usb_config_descriptor config_desc =
+{
+  .bLength = USB_DT_CONFIG_SIZE,
+  .bDescriptorType = USB_DT_CONFIG,
+  .wTotalLength = 0,  // set in build_config
+  .bNumInterfaces = 1,
+  .bConfigurationValue = 1,
+  .iConfiguration = 0,
+  .bmAttributes = USB_CONFIG_ATT_ONE | USB_CONFIG_ATT_SELFPOWER,
+  .bMaxPower = 50,
+};
+
+// vendor specific, thus no kernel driver binds to it
+static struct usb_interface_descriptor interface_desc =
+{
+  .bLength = USB_DT_INTERFACE_SIZE,
+  .bDescriptorType = USB_DT_INTERFACE,
+  .bInterfaceNumber = 0,
+  .bAlternateSetting = 0,
+  .bNumEndpoints = 2,
+  .bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+  .bInterfaceSubClass = 0,
+  .bInterfaceProtocol = 0,
+  .iInterface = 0,
+};
+
+static struct usb_endpoint_descriptor ep_in_desc =
+{
+  .bLength = USB_DT_ENDPOINT_SIZE,
+  .bDescriptorType = USB_DT_ENDPOINT,
+  .bEndpointAddress = USB_DIR_IN | 1,
+  .bmAttributes = USB_ENDPOINT_XFER_INT,
+  .wMaxPacketSize = PACKET_LEN,
+  .bInterval = 1,
+};
+
+static struct usb_endpoint_descriptor ep_out_desc =
+{
+  .bLength = USB_DT_ENDPOINT_SIZE,
+  .bDescriptorType = USB_DT_ENDPOINT,
+  .bEndpointAddress = USB_DIR_OUT | 1,
+  .bmAttributes = USB_ENDPOINT_XFER_INT,
+  .wMaxPacketSize = PACKET_LEN,
+  .bInterval = 1,
+};
+
+static const char* strings[] = {NULL, "Alluris GmbH & Co. KG", "FMI-S Force-Gauge (virtual)"};
+
+static volatile sig_atomic_t do_exit = 0;
+static int fd = -1;
+static int ep_in = -1, ep_out = -1;
+
+/****************************************************************************************/
+// gauge model
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+
+static struct
+{
+  unsigned short serial;
+  int mode, measuring, tare;
+  int stream_on, stream_len;
+  int64_t stream_t0, stream_samples;
+
+  unsigned char replies[REPLY_QUEUE_LEN][PACKET_LEN];
+  int reply_len[REPLY_QUEUE_LEN];
+  unsigned int reply_head, reply_count;
+} gauge;
+
+static int64_t monotonic_ns (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void put24 (unsigned char* out, int v)
+{
+  out[0] = v & 0xFF;
+  out[1] = (v >> 8) & 0xFF;
+  out[2] = (v >> 16) & 0xFF;
+}
+
+static int64_t sample_period_ns (void)
+{
+  return (gauge.mode)? 1111111 : 100000000;
+}
+
+//! triangle of +-1000 digits with 2s period like the simulator of liballuris
+static int value_at (int64_t t)
+{
+  int phase = (t / 1000000) % 2000;
+  return ((phase < 1000)? phase * 2 - 1000 : 3000 - phase * 2) - gauge.tare;
+}
+
+//! reply length of each command, see liballuris.c
+static int reply_len (unsigned char cmd)
+{
+  switch (cmd)
+    {
+    case 0x01:
+      return 4;
+    case 0x06:
+      return 5;
+    case 0x08:
+    case 0x18:
+    case 0x19:
+    case 0x46:
+    case 0x72:
+      return 6;
+    case 0x09:
+      return 20;
+    case 0x13:
+      return 0;
+    default:
+      return 3;
+    }
+}
+
+//! execute a command from the OUT endpoint and queue the reply, caller holds lock
+static void process_cmd (const unsigned char* in, int len)
+{
+  unsigned char r[PACKET_LEN];
+  memset (r, 0, sizeof (r));
+  r[0] = in[0];
+  r[1] = reply_len (in[0]);
+  int arg = (len > 2)? in[2] : 0;
+  int64_t t = monotonic_ns ();
+
+  switch (in[0])
+    {
+    case 0x01: // cyclic measurements
+      gauge.stream_on = (arg == 2);
+      gauge.stream_len = (len > 3 && in[3] >= 1 && in[3] <= MAX_BLOCK_SIZE)? in[3] : 1;
+      gauge.stream_t0 = t;
+      gauge.stream_samples = 0;
+      r[2] = arg;
+      r[3] = gauge.stream_len;
+      break;
+    case 0x04: // set mode, rejected while measuring
+      if (! gauge.measuring && arg <= 3)
+        gauge.mode = arg;
+      r[2] = gauge.mode;
+      break;
+    case 0x05:
+      r[2] = gauge.mode;
+      break;
+    case 0x08: // fixed attributes, not available while measuring
+      switch (arg)
+        {
+        case 0:
+        case 1:
+          r[3] = 9;
+          r[4] = 4;
+          r[5] = 5;
+          break;
+        case 2:
+          put24 (r + 3, 500);
+          break;
+        case 3:
+        case 16:
+          put24 (r + 3, 1);
+          break;
+        case 6:
+          r[3] = gauge.serial & 0xFF;
+          r[4] = gauge.serial >> 8;
+          r[5] = 'P' - 'A';
+          break;
+        }
+      if (gauge.measuring)
+        r[3] = r[4] = r[5] = 0xFF;
+      break;
+    case 0x13: // power off
+      do_exit = 1;
+      return;
+    case 0x15:
+      if (arg == 0)
+        {
+          gauge.tare = 0;
+          gauge.tare = value_at (t);
+        }
+      break;
+    case 0x1C: // start or stop
+      gauge.measuring = (arg != 0);
+      gauge.stream_t0 = t;
+      gauge.stream_samples = 0;
+      break;
+    case 0x46:
+      if (arg == 2)
+        put24 (r + 3, ((gauge.measuring)? 1 << 23 : 0) | ((gauge.mode)? 1 << 3 : 0));
+      else
+        put24 (r + 3, value_at (t));
+      break;
+    default:
+      // other getters reply zero and setters echo their argument
+      memcpy (r + 2, in + 2, (len < r[1])? len - 2 : r[1] - 2);
+      break;
+    }
+
+  if (gauge.reply_count < REPLY_QUEUE_LEN)
+    {
+      unsigned int k = (gauge.reply_head + gauge.reply_count++) % REPLY_QUEUE_LEN;
+      memcpy (gauge.replies[k], r, r[1]);
+      gauge.reply_len[k] = r[1];
+    }
+  pthread_cond_signal (&cond);
+}
+
+/*!
+ * \brief next packet for the IN endpoint, caller holds lock
+ * \return 0 if a packet was copied to out, else the time when the next cyclic packet is due
+ */
+static int64_t next_packet (unsigned char* out, int* len)
+{
+  if (gauge.reply_count)
+    {
+      unsigned int k = gauge.reply_head;
+      memcpy (out, gauge.replies[k], gauge.reply_len[k]);
+      *len = gauge.reply_len[k];
+      gauge.reply_head = (k + 1) % REPLY_QUEUE_LEN;
+      gauge.reply_count--;
+      return 0;
+    }
+
+  if (! gauge.stream_on || ! gauge.measuring)
+    return INT64_MAX;
+
+  int64_t period = sample_period_ns ();
+  int64_t t = monotonic_ns ();
+  int64_t due = gauge.stream_t0 + (gauge.stream_samples + gauge.stream_len) * period;
+  // the device drops packets which aren't read within 1s
+  while (t - due > 1000000000)
+    {
+      gauge.stream_samples += gauge.stream_len;
+      due += gauge.stream_len * period;
+    }
+  if (due > t)
+    return due;
+
+  int k;
+  out[0] = 0x02;
+  out[1] = 5 + gauge.stream_len * 3;
+  out[2] = out[3] = out[4] = 0;
+  for (k=0; k < gauge.stream_len; ++k)
+    put24 (out + 5 + k * 3, value_at (gauge.stream_t0 + (gauge.stream_samples + k + 1) * period));
+  *len = out[1];
+  gauge.stream_samples += gauge.stream_len;
+  return 0;
+}
+
+static void* out_thread (void* arg)
+{
+  (void) arg;
+  struct ep_io io;
+  while (! do_exit)
+    {
+      io.inner.ep = ep_out;
+      io.inner.flags = 0;
+      io.inner.length = PACKET_LEN;
+      int r = ioctl (fd, USB_RAW_IOCTL_EP_READ, &io);
+      if (r < 0)
+        {
+          if (errno != EINTR)
+            perror ("USB_RAW_IOCTL_EP_READ");
+          break;
+        }
+      if (r >= 2)
+        {
+          pthread_mutex_lock (&lock);
+          process_cmd (io.data, r);
+          pthread_mutex_unlock (&lock);
+        }
+    }
+  do_exit = 1;
+  return NULL;
+}
+
+static void* in_thread (void* arg)
+{
+  (void) arg;
+  struct ep_io io;
+  while (! do_exit)
+    {
+      int len = 0;
+      pthread_mutex_lock (&lock);
+      int64_t due;
+      while (! do_exit && (due = next_packet (io.data, &len)))
+        {
+          // wake up regularly to check do_exit
+          int64_t wake = monotonic_ns () + 100000000;
+          if (due < wake)
+            wake = due;
+          struct timespec ts = {wake / 1000000000, wake % 1000000000};
+          pthread_cond_timedwait (&cond, &lock, &ts);
+        }
+      pthread_mutex_unlock (&lock);
+      if (do_exit)
+        break;
+
+      // blocks until the host polls the endpoint
+      io.inner.ep = ep_in;
+      io.inner.flags = 0;
+      io.inner.length = len;
+      if (ioctl (fd, USB_RAW_IOCTL_EP_WRITE, &io) < 0)
+        {
+          if (errno != EINTR)
+            perror ("USB_RAW_IOCTL_EP_WRITE");
+          break;
+        }
+    }
+  do_exit = 1;
+  return NULL;
+}
+
+/****************************************************************************************/
+// ep0
+
+static int build_config (unsigned char* buf, int length)
+{
+  int total = config_desc.bLength + interface_desc.bLength + ep_in_desc.bLength + ep_out_desc.bLength;
+  if (total > length)
+    return -1;
+  config_desc.wTotalLength = total;
+  unsigned char* p = buf;
+  memcpy (p, &config_desc, config_desc.bLength);
+  p += config_desc.bLength;
+  memcpy (p, &interface_desc, interface_desc.bLength);
+  p += interface_desc.bLength;
+  memcpy (p, &ep_in_desc, ep_in_desc.bLength);
+  p += ep_in_desc.bLength;
+  memcpy (p, &ep_out_desc, ep_out_desc.bLength);
+  return total;
+}
+
+static int build_string (int index, unsigned char* buf, int length)
+{
+  if (index == 0)
+    {
+      buf[0] = 4;
+      buf[1] = USB_DT_STRING;
+      buf[2] = 0x09;  // en-US
+      buf[3] = 0x04;
+      return 4;
+    }
+  if (index >= (int) (sizeof (strings) / sizeof (strings[0])))
+    return -1;
+  int n = strlen (strings[index]);
+  if (2 + 2 * n > length || 2 + 2 * n > 255)
+    return -1;
+  buf[0] = 2 + 2 * n;
+  buf[1] = USB_DT_STRING;
+  int k;
+  for (k=0; k < n; ++k)
+    {
+      buf[2 + 2 * k] = strings[index][k];
+      buf[3 + 2 * k] = 0;
+    }
+  return buf[0];
+}
+
+//! enable the endpoints and start the threads on SET_CONFIGURATION
+static int configure (pthread_t* threads)
+{
+  ep_in = ioctl (fd, USB_RAW_IOCTL_EP_ENABLE, &ep_in_desc);
+  ep_out = ioctl (fd, USB_RAW_IOCTL_EP_ENABLE, &ep_out_desc);
+  if (ep_in < 0 || ep_out < 0)
+    {
+      perror ("USB_RAW_IOCTL_EP_ENABLE");
+      return -1;
+    }
+  ioctl (fd, USB_RAW_IOCTL_VBUS_DRAW, config_desc.bMaxPower);
+  if (ioctl (fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0)
+    {
+      perror ("USB_RAW_IOCTL_CONFIGURE");
+      return -1;
+    }
+  pthread_create (&threads[0], NULL, in_thread, NULL);
+  pthread_create (&threads[1], NULL, out_thread, NULL);
+  return 0;
+}
+
+/*!
+ * \brief answer a control request
+ * \return length of the IN data in io, 0 to acknowledge a request without data, -1 to stall
+ */
+static int handle_control (const struct usb_ctrlrequest* ctrl, struct ep0_io* io, int* do_configure)
+{
+  int type = ctrl->bRequestType & USB_TYPE_MASK;
+  if (type != USB_TYPE_STANDARD)
+    return -1;
+
+  int len = -1;
+  switch (ctrl->bRequest)
+    {
+    case USB_REQ_GET_DESCRIPTOR:
+      switch (ctrl->wValue >> 8)
+        {
+        case USB_DT_DEVICE:
+          memcpy (io->data, &device_desc, sizeof (device_desc));
+          len = sizeof (device_desc);
+          break;
+        case USB_DT_DEVICE_QUALIFIER:
+          memcpy (io->data, &qualifier_desc, sizeof (qualifier_desc));
+          len = sizeof (qualifier_desc);
+          break;
+        case USB_DT_CONFIG:
+          len = build_config (io->data, EP0_MAX_DATA);
+          break;
+        case USB_DT_STRING:
+          len = build_string (ctrl->wValue & 0xFF, io->data, EP0_MAX_DATA);
+          break;
+        }
+      break;
+    case USB_REQ_SET_CONFIGURATION:
+      *do_configure = (ep_in < 0);
+      len = 0;
+      break;
+    case USB_REQ_GET_CONFIGURATION:
+      io->data[0] = (ep_in < 0)? 0 : 1;
+      len = 1;
+      break;
+    case USB_REQ_SET_INTERFACE:
+      len = 0;
+      break;
+    case USB_REQ_GET_INTERFACE:
+      io->data[0] = 0;
+      len = 1;
+      break;
+    case USB_REQ_GET_STATUS:
+      io->data[0] = io->data[1] = 0;
+      len = 2;
+      break;
+    }
+
+  if (len > ctrl->wLength)
+    len = ctrl->wLength;
+  return len;
+}
+
+static void termination_handler (int signum)
+{
+  (void) signum;
+  do_exit = 1;
+}
+
+static void usage (const char* name)
+{
+  fprintf (stderr, "Usage: %s [-d DRIVER] [-u DEVICE] [-s SERIAL] [-H]\n", name);
+  fprintf (stderr, "  -d  UDC driver (default dummy_udc)\n");
+  fprintf (stderr, "  -u  UDC device (default dummy_udc.0)\n");
+  fprintf (stderr, "  -s  serial number 0..65535, reported as P.SERIAL (default 4242)\n");
+  fprintf (stderr, "  -H  high speed (125us interrupt interval) instead of full speed like the real gauge\n");
+}
+
+int main (int argc, char** argv)
+{
+  const char* driver = "dummy_udc";
+  const char* device = "dummy_udc.0";
+  int speed = USB_SPEED_FULL;
+  int c;
+
+  gauge.serial = 4242;
+  while ((c = getopt (argc, argv, "d:u:s:H")) != -1)
+    switch (c)
+      {
+      case 'd':
+        driver = optarg;
+        break;
+      case 'u':
+        device = optarg;
+        break;
+      case 's':
+        gauge.serial = atoi (optarg);
+        break;
+      case 'H':
+        speed = USB_SPEED_HIGH;
+        break;
+      default:
+        usage (argv[0]);
+        return EXIT_FAILURE;
+      }
+
+  pthread_condattr_t attr;
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&cond, &attr);
+
+  // no SA_RESTART, the blocking ioctls have to return on a signal
+  struct sigaction sa;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = termination_handler;
+  sigaction (SIGINT, &sa, NULL);
+  sigaction (SIGTERM, &sa, NULL);
+
+  fd = open ("/dev/raw-gadget", O_RDWR);
+  if (fd < 0)
+    {
+      perror ("Couldn't open /dev/raw-gadget (see raw_gauge_setup.sh)");
+      return EXIT_FAILURE;
+    }
+
+  struct usb_raw_init init;
+  memset (&init, 0, sizeof (init));
+  snprintf ((char*) init.driver_name, sizeof (init.driver_name), "%s", driver);
+  snprintf ((char*) init.device_name, sizeof (init.device_name), "%s", device);
+  init.speed = speed;
+  if (ioctl (fd, USB_RAW_IOCTL_INIT, &init) < 0 || ioctl (fd, USB_RAW_IOCTL_RUN, 0) < 0)
+    {
+      perror ("Couldn't bind to UDC");
+      return EXIT_FAILURE;
+    }
+  fprintf (stderr, "raw_gauge: P.%u on %s\n", gauge.serial, device);
+
+  pthread_t threads[2];
+  int configured = 0;
+  while (! do_exit)
+    {
+      struct control_event event;
+      event.inner.type = 0;
+      event.inner.length = sizeof (event.ctrl);
+      if (ioctl (fd, USB_RAW_IOCTL_EVENT_FETCH, &event) < 0)
+        {
+          if (errno != EINTR)
+            perror ("USB_RAW_IOCTL_EVENT_FETCH");
+          break;
+        }
+      if (event.inner.type != USB_RAW_EVENT_CONTROL)
+        continue;
+
+      struct ep0_io io;
+      int do_configure = 0;
+      int len = handle_control (&event.ctrl, &io, &do_configure);
+      if (len < 0)
+        {
+          ioctl (fd, USB_RAW_IOCTL_EP0_STALL, 0);
+          continue;
+        }
+
+      io.inner.ep = 0;
+      io.inner.flags = 0;
+      io.inner.length = len;
+      if (event.ctrl.bRequestType & USB_DIR_IN)
+        ioctl (fd, USB_RAW_IOCTL_EP0_WRITE, &io);
+      else
+        {
+          if (do_configure)
+            {
+              if (configure (threads))
+                break;
+              configured = 1;
+            }
+          // status stage of a request without data
+          ioctl (fd, USB_RAW_IOCTL_EP0_READ, &io);
+        }
+    }
+
+  do_exit = 1;
+  if (configured)
+    {
+      pthread_cond_signal (&cond);
+      // the endpoint threads may block in an ioctl until the host disconnects
+      pthread_kill (threads[0], SIGINT);
+      pthread_kill (threads[1], SIGINT);
+      pthread_join (threads[0], NULL);
+      pthread_join (threads[1], NULL);
+    }
+  close (fd);
+  return EXIT_SUCCESS;
+}
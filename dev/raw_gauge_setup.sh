@@ -0,0 +1,29 @@
+#!/bin/bash
+
+## Run transport_bench against the virtual gauge of raw_gauge.c on dummy_hcd
+## Needs root and a kernel with CONFIG_USB_DUMMY_HCD and CONFIG_USB_RAW_GADGET.
+## Usage: sudo ./raw_gauge_setup.sh [transport_bench options]
+
+set -e
+cd "$(dirname "$0")"
+
+make raw_gauge transport_bench
+
+modprobe dummy_hcd
+modprobe raw_gadget
+
+./raw_gauge -s 4242 &
+gauge=$!
+trap 'kill $gauge 2>/dev/null; wait $gauge 2>/dev/null' EXIT
+
+# wait until the host side has enumerated the device
+for i in $(seq 50); do
+  if grep -qs "^04d8$" /sys/bus/usb/devices/*/idVendor \
+     && grep -qs "^fc30$" /sys/bus/usb/devices/*/idProduct; then
+    break
+  fi
+  sleep 0.1
+done
+
+# the device cache may contain a real gauge with the same serial
+LIBALLURIS_CACHE= ./transport_bench -S P.4242 "$@"
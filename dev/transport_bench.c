@@ -0,0 +1,268 @@
+/*
+
+Copyright (C) 2015 Alluris GmbH & Co. KG <weber@alluris.de>
+
+transport_bench -- round trip latency and streaming throughput of the USB transport
+
+Runs against the first Alluris device (or the one with -S SERIAL), typically the
+virtual gauge of raw_gauge.c. With -x the in-process simulator of liballuris is
+used instead, which gives the numbers without kernel and libusb as baseline.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  See ../COPYING
+If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "liballuris.h"
+
+static int64_t monotonic_ns (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int cmp_int64 (const void* a, const void* b)
+{
+  int64_t x = *(const int64_t*) a, y = *(const int64_t*) b;
+  return (x > y) - (x < y);
+}
+
+//! print min, median, 99th percentile and max of n durations in us
+static void print_stats (const char* name, int64_t* t, int n)
+{
+  qsort (t, n, sizeof (int64_t), cmp_int64);
+  printf ("%-22s %6i %9.1f %9.1f %9.1f %9.1f\n", name, n,
+          t[0] / 1e3, t[n / 2] / 1e3, t[(n * 99) / 100] / 1e3, t[n - 1] / 1e3);
+}
+
+static int bench_get_mode (libusb_device_handle* h)
+{
+  enum liballuris_measurement_mode mode;
+  return liballuris_get_mode (h, &mode);
+}
+
+static int bench_read_state (libusb_device_handle* h)
+{
+  struct liballuris_state state;
+  return liballuris_read_state (h, &state);
+}
+
+static int bench_get_fmax (libusb_device_handle* h)
+{
+  int v;
+  return liballuris_get_F_max (h, &v);
+}
+
+static int bench_get_serial (libusb_device_handle* h)
+{
+  char buf[30];
+  return liballuris_get_serial_number (h, buf, sizeof (buf));
+}
+
+static const struct
+{
+  const char* name;
+  int (*fn) (libusb_device_handle* h);
+} commands[] =
+{
+  {"get_mode", bench_get_mode},
+  {"read_state", bench_read_state},
+  {"get_F_max", bench_get_fmax},
+  {"get_serial_number", bench_get_serial},
+};
+
+//! round trip of each command, the measurement has to be stopped
+static int bench_commands (libusb_device_handle* h, int n)
+{
+  int64_t* t = malloc (n * sizeof (int64_t));
+  if (! t)
+    return LIBUSB_ERROR_NO_MEM;
+
+  printf ("%-22s %6s %9s %9s %9s %9s\n", "round trip [us]", "n", "min", "median", "p99", "max");
+  size_t c;
+  int k, r = 0;
+  for (c=0; c < sizeof (commands) / sizeof (commands[0]) && !r; ++c)
+    {
+      for (k=0; k < n && !r; ++k)
+        {
+          int64_t start = monotonic_ns ();
+          r = commands[c].fn (h);
+          t[k] = monotonic_ns () - start;
+        }
+      if (r)
+        fprintf (stderr, "%s failed: %s\n", commands[c].name, liballuris_error_name (r));
+      else
+        print_stats (commands[c].name, t, n);
+    }
+  free (t);
+  return r;
+}
+
+//! sustained rate of liballuris_poll_measurement with 19 values per packet in 900Hz mode
+static int bench_poll (libusb_device_handle* h, int seconds)
+{
+  int buf[19];
+  long packets = 0;
+  int r = liballuris_cyclic_measurement (h, 1, 19);
+  if (r)
+    return r;
+
+  int64_t start = monotonic_ns ();
+  int64_t end = start + (int64_t) seconds * 1000000000;
+  int64_t now = start;
+  while (!r && now < end)
+    {
+      r = liballuris_poll_measurement (h, buf, 19);
+      now = monotonic_ns ();
+      if (!r)
+        packets++;
+    }
+  double dt = (now - start) / 1e9;
+  printf ("poll_measurement: %ld packets, %.1f packets/s, %.1f samples/s\n", packets, packets / dt, packets * 19 / dt);
+
+  int r2 = liballuris_cyclic_measurement (h, 0, 19);
+  liballuris_clear_RX (h, 10);
+  return (r)? r : r2;
+}
+
+//! sustained rate of the asynchronous stream
+static int bench_stream (libusb_context* ctx, libusb_device_handle* h, int seconds)
+{
+  struct liballuris_stream* stream;
+  int r = liballuris_stream_open (ctx, h, 19, 0, NULL, NULL, &stream);
+  if (!r)
+    r = liballuris_stream_start (stream);
+  if (r)
+    return r;
+
+  int buf[1024];
+  size_t n;
+  long samples = 0;
+  int64_t start = monotonic_ns ();
+  int64_t end = start + (int64_t) seconds * 1000000000;
+  int64_t now = start;
+  while (!r && now < end)
+    {
+      r = liballuris_stream_read_bulk (stream, buf, NULL, 1024, &n, 100);
+      if (r == LIBALLURIS_TIMEOUT)
+        r = 0;
+      samples += n;
+      now = monotonic_ns ();
+    }
+
+  struct liballuris_stream_stats stats;
+  liballuris_stream_get_stats (stream, &stats);
+  double dt = (now - start) / 1e9;
+  printf ("stream: %.1f packets/s, %.1f samples/s, %llu gaps, %llu transfer errors\n",
+          stats.packets / dt, samples / dt, stats.gaps, stats.transfer_errors);
+  liballuris_stream_close (stream);
+  return r;
+}
+
+int main (int argc, char** argv)
+{
+  const char* serial = NULL;
+  int n = 1000;
+  int seconds = 5;
+  char simulate = 0;
+  int c;
+
+  while ((c = getopt (argc, argv, "S:n:t:x")) != -1)
+    switch (c)
+      {
+      case 'S':
+        serial = optarg;
+        break;
+      case 'n':
+        n = atoi (optarg);
+        break;
+      case 't':
+        seconds = atoi (optarg);
+        break;
+      case 'x':
+        simulate = 1;
+        break;
+      default:
+        fprintf (stderr, "Usage: %s [-S SERIAL] [-n COMMANDS] [-t SECONDS] [-x]\n", argv[0]);
+        return EXIT_FAILURE;
+      }
+  if (n < 1)
+    n = 1;
+
+  libusb_context* ctx;
+  int r = libusb_init (&ctx);
+  if (r < 0)
+    {
+      fprintf (stderr, "Couldn't init libusb %s\n", libusb_error_name (r));
+      return EXIT_FAILURE;
+    }
+
+  libusb_device_handle* h;
+  int64_t start = monotonic_ns ();
+  if (simulate)
+    r = liballuris_open_simulator (1, &h);
+  else
+    {
+      struct alluris_device_description devs[8];
+      int cnt = liballuris_get_device_list (ctx, devs, 8, 1);
+      printf ("get_device_list: %i devices in %.1f ms\n", cnt, (monotonic_ns () - start) / 1e6);
+      liballuris_free_device_list (devs, 8);
+
+      start = monotonic_ns ();
+      r = liballuris_open_device (ctx, serial, &h);
+      if (!r)
+        {
+          r = libusb_claim_interface (h, 0);
+          if (r)
+            libusb_close (h);
+        }
+    }
+  if (r)
+    {
+      fprintf (stderr, "Couldn't open device: %s\n", liballuris_error_name (r));
+      return EXIT_FAILURE;
+    }
+  printf ("open: %.1f ms\n", (monotonic_ns () - start) / 1e6);
+
+  r = liballuris_stop_measurement_wait (h, 2000, NULL);
+  if (!r)
+    r = bench_commands (h, n);
+  if (!r)
+    r = liballuris_set_mode (h, LIBALLURIS_MODE_PEAK);
+  if (!r)
+    r = liballuris_start_measurement_wait (h, 1000, NULL);
+  if (!r)
+    r = bench_poll (h, seconds);
+  if (!r)
+    r = bench_stream (ctx, h, seconds);
+  if (r)
+    fprintf (stderr, "Error: %s\n", liballuris_error_name (r));
+
+  liballuris_stop_measurement (h);
+  if (simulate)
+    liballuris_close_transport (h);
+  else
+    {
+      libusb_release_interface (h, 0);
+      libusb_close (h);
+    }
+  libusb_exit (ctx);
+  return (r)? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -5,6 +5,7 @@ Copyright (C) 2015 Alluris GmbH & Co. KG <weber@alluris.de>
 fstream -- f(ast)stream(ing)
 
 Capture values in peak mode with 900Hz and output it as ASCII or binary int32
+or publish it in shared memory for any number of local readers (see shmread.c)
 
 This program is free software: you can redistribute it and/or modify
 it under the terms of the GNU General Public License as published by
@@ -23,24 +24,345 @@ If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <stdio.h>
-#include <sys/poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 #include "liballuris.h"
 
 /*
  * Save the output to a file or pipe it to some program to evaluate it.
- * Use nc -q0 localhost 9000 -c "./fstream -b" to send it via TCP
+ *
+ * With "-l [ADDR:]PORT" fstream serves the values as binary int32 to any number of
+ * TCP clients instead (ADDR defaults to 127.0.0.1). Each client has its own queue of
+ * "-q VALUES" values and a policy what happens if it doesn't keep up:
+ *
+ *   drop-oldest  the oldest queued values are dropped (default)
+ *   decimate     only every 2nd, 4th, ... value is queued until the client caught up
+ *   block        acquisition stops while the queue has less than 152 values (8 packets)
+ *                free. This stalls all clients and may lose values in the device, use it
+ *                only for a single lossless consumer. VALUES has to be larger than 152.
+ *
+ * "-p POLICY" sets the policy of new clients, a client can switch its own policy by
+ * sending the name followed by a newline. Dropped and decimated values are reported on
+ * stderr when a client disconnects.
  *
  * For an example using GNU Octave see fstream_serv.m
  *
  * For an example using GNU Radio Companion see fstream_recv.grc
+ *
+ * Both connect to "./fstream -l 9000" and can run at the same time.
+ *
+ * With "-s NAME" nothing is written to stdout, the values and their timestamps are
+ * published in the POSIX shared memory ring NAME instead, for example "/alluris".
+ * Run ./shmread NAME (several times if you like) to read them.
  */
 
+#define SHM_CAPACITY 65536 // about 70s at 900Hz
+#define MAX_CLIENTS 16
+#define MAX_BLOCK 19       // values per packet
+#define NUM_TRANSFERS 8    // one liballuris_stream_dispatch may complete all of them
+#define BLOCK_HEADROOM (NUM_TRANSFERS * MAX_BLOCK)
+#define MAX_DECIMATION 1024
+#define SOCKET_BUFFER 16384 // keep the kernel from hiding a slow client behind a huge send buffer
+
+enum policy
+{
+  POLICY_DROP_OLDEST,
+  POLICY_DECIMATE,
+  POLICY_BLOCK
+};
+
+static const char* policy_names[] = {"drop-oldest", "decimate", "block"};
+
+//! TCP client with its own bounded queue of values
+struct client
+{
+  int fd;                   // -1 if the slot is free
+  enum policy policy;
+  int* queue;
+  size_t head;
+  size_t count;
+  size_t sent;              // bytes of queue[head] already sent
+  unsigned int decimation;  // queue every decimation-th value
+  unsigned int phase;
+  unsigned long long dropped;
+  unsigned long long decimated;
+  char line[32];            // policy change requested by the client
+  size_t line_len;
+};
+
+struct server
+{
+  int fd;
+  size_t capacity;
+  enum policy policy;
+  struct client clients[MAX_CLIENTS];
+};
+
+//! Where the decoded blocks go
+struct output
+{
+  char bin;
+  struct liballuris_shm* shm;
+  struct server* server;
+};
+
+static int parse_policy (const char* name, enum policy* policy)
+{
+  size_t k;
+  for (k=0; k < sizeof (policy_names) / sizeof (policy_names[0]); ++k)
+    if (!strcmp (name, policy_names[k]))
+      {
+        *policy = k;
+        return 0;
+      }
+  return -1;
+}
+
+//! Remove n values after the one which is partially sent (or from the head)
+static void client_drop (struct client* c, size_t n, size_t capacity)
+{
+  if (n > c->count - (c->sent > 0))
+    n = c->count - (c->sent > 0);
+  if (c->sent)
+    {
+      // move the partial value forward, it has to be completed first
+      int partial = c->queue[c->head];
+      c->head = (c->head + n) % capacity;
+      c->queue[c->head] = partial;
+    }
+  else
+    c->head = (c->head + n) % capacity;
+  c->count -= n;
+  c->dropped += n;
+}
+
+static void client_push (struct client* c, int v, size_t capacity)
+{
+  if (c->policy == POLICY_DECIMATE)
+    {
+      if (c->phase++ % c->decimation)
+        {
+          c->decimated++;
+          return;
+        }
+      if (c->count == capacity && c->decimation < MAX_DECIMATION)
+        c->decimation *= 2;
+      else if (c->count < capacity / 4 && c->decimation > 1)
+        c->decimation /= 2;
+    }
+  // with POLICY_BLOCK the acquisition stops before the queue is full, see server_stalled
+  if (c->count == capacity)
+    {
+      assert (c->policy != POLICY_BLOCK);
+      client_drop (c, 1, capacity);
+    }
+  c->queue[(c->head + c->count) % capacity] = v;
+  c->count++;
+}
+
+//! true if a blocking client has no space for the packets of another dispatch
+static char server_stalled (struct server* s)
+{
+  int k;
+  for (k=0; k < MAX_CLIENTS; ++k)
+    {
+      struct client* c = &s->clients[k];
+      if (c->fd >= 0 && c->policy == POLICY_BLOCK && c->count + BLOCK_HEADROOM > s->capacity)
+        return 1;
+    }
+  return 0;
+}
+
+static void client_close (struct client* c)
+{
+  fprintf (stderr, "Client %i disconnected, %llu values dropped, %llu decimated\n", c->fd, c->dropped, c->decimated);
+  close (c->fd);
+  free (c->queue);
+  memset (c, 0, sizeof (struct client));
+  c->fd = -1;
+}
+
+//! Send as much of the queue as the socket takes without blocking
+static int client_send (struct client* c, size_t capacity)
+{
+  while (c->count)
+    {
+      size_t n = (c->count < capacity - c->head)? c->count : capacity - c->head;
+      ssize_t w = send (c->fd, (char*) (c->queue + c->head) + c->sent, n * 4 - c->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (w < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)? 0 : -1;
+      size_t bytes = c->sent + w;
+      c->head = (c->head + bytes / 4) % capacity;
+      c->count -= bytes / 4;
+      c->sent = bytes % 4;
+    }
+  return 0;
+}
+
+//! Read policy changes, returns -1 if the client closed the connection
+static int client_read (struct client* c)
+{
+  char buf[64];
+  ssize_t n = recv (c->fd, buf, sizeof (buf), MSG_DONTWAIT);
+  if (n == 0)
+    return -1;
+  if (n < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)? 0 : -1;
+
+  ssize_t k;
+  for (k=0; k < n; ++k)
+    if (buf[k] == '\n' || buf[k] == '\r')
+      {
+        c->line[c->line_len] = 0;
+        if (c->line_len && !parse_policy (c->line, &c->policy))
+          c->decimation = 1;
+        c->line_len = 0;
+      }
+    else if (c->line_len < sizeof (c->line) - 1)
+      c->line[c->line_len++] = buf[k];
+  return 0;
+}
+
+static void server_accept (struct server* s)
+{
+  int fd = accept (s->fd, NULL, NULL);
+  if (fd < 0)
+    return;
+
+  int k;
+  for (k=0; k < MAX_CLIENTS && s->clients[k].fd >= 0; ++k);
+  int* queue = (k < MAX_CLIENTS)? malloc (s->capacity * sizeof (int)) : NULL;
+  if (!queue)
+    {
+      fprintf (stderr, "Too many clients\n");
+      close (fd);
+      return;
+    }
+  int size = SOCKET_BUFFER;
+  setsockopt (fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof (size));
+
+  struct client* c = &s->clients[k];
+  memset (c, 0, sizeof (struct client));
+  c->fd = fd;
+  c->policy = s->policy;
+  c->queue = queue;
+  c->decimation = 1;
+  fprintf (stderr, "Client %i connected\n", fd);
+}
+
+//! Listen on [ADDR:]PORT, ADDR defaults to the loopback interface
+static int server_open (const char* spec, struct server* s)
+{
+  struct sockaddr_in addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  char host[64];
+  const char* port = strrchr (spec, ':');
+  if (port)
+    {
+      snprintf (host, sizeof (host), "%.*s", (int) (port - spec), spec);
+      if (inet_pton (AF_INET, host, &addr.sin_addr) != 1)
+        return -1;
+      port++;
+    }
+  else
+    port = spec;
+  addr.sin_port = htons (atoi (port));
+
+  int one = 1;
+  s->fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (s->fd < 0)
+    return -1;
+  setsockopt (s->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+  fcntl (s->fd, F_SETFL, O_NONBLOCK);
+  if (bind (s->fd, (struct sockaddr*) &addr, sizeof (addr)) || listen (s->fd, MAX_CLIENTS))
+    {
+      close (s->fd);
+      return -1;
+    }
+
+  int k;
+  for (k=0; k < MAX_CLIENTS; ++k)
+    s->clients[k].fd = -1;
+  return 0;
+}
+
+//! Write a decoded block to stdout or the shared memory and the clients, called from liballuris_stream_dispatch
+static void print_block (const struct liballuris_block* block, void* user_data)
+{
+  struct output* out = user_data;
+  size_t k;
+  if (out->shm)
+    liballuris_shm_publish_cb (block, out->shm);
+  if (out->server)
+    {
+      int j;
+      for (j=0; j < MAX_CLIENTS; ++j)
+        if (out->server->clients[j].fd >= 0)
+          for (k=0; k < block->num_values; ++k)
+            client_push (&out->server->clients[j], block->values[k], out->server->capacity);
+    }
+  if (out->shm || out->server)
+    return;
+
+  if (out->bin)
+    fwrite (block->values, 4, block->num_values, stdout);
+  else
+    {
+      for (k=0; k < block->num_values; ++k)
+        printf ("%i\n", block->values[k]);
+    }
+  fflush (stdout);
+}
+
 int main(int argc, char** argv)
 {
-  char bin = (argc == 2 && !strcmp (argv [1], "-b"));
+  struct output out = {0, NULL, NULL};
+  struct server server;
+  const char* shm_name = NULL;
+  const char* listen_spec = NULL;
+  int k;
+  server.capacity = 9000; // 10s at 900Hz
+  server.policy = POLICY_DROP_OLDEST;
+  for (k=1; k < argc; ++k)
+    if (!strcmp (argv[k], "-b"))
+      out.bin = 1;
+    else if (!strcmp (argv[k], "-s") && k + 1 < argc)
+      shm_name = argv[++k];
+    else if (!strcmp (argv[k], "-l") && k + 1 < argc)
+      listen_spec = argv[++k];
+    else if (!strcmp (argv[k], "-q") && k + 1 < argc && atoi (argv[k + 1]) > BLOCK_HEADROOM)
+      server.capacity = atoi (argv[++k]);
+    else if (!strcmp (argv[k], "-p") && k + 1 < argc && !parse_policy (argv[k + 1], &server.policy))
+      k++;
+    else
+      {
+        fprintf (stderr, "Usage: %s [-b] [-s NAME] [-l [ADDR:]PORT [-q VALUES] [-p drop-oldest|decimate|block]]\n", argv[0]);
+        return EXIT_FAILURE;
+      }
+
+  if (listen_spec)
+    {
+      if (server_open (listen_spec, &server))
+        {
+          fprintf (stderr, "Couldn't listen on %s: %s\n", listen_spec, strerror (errno));
+          return EXIT_FAILURE;
+        }
+      out.server = &server;
+      signal (SIGPIPE, SIG_IGN);
+    }
 
   libusb_context* ctx;
-  libusb_device_handle* h;
 
   int r;
   r = libusb_init (&ctx);
@@ -50,63 +372,132 @@ int main(int argc, char** argv)
       return EXIT_FAILURE;
     }
 
-  r = liballuris_open_device (ctx, NULL, &h);
+  // open the first available device
+  struct liballuris_device* dev;
+  r = liballuris_device_open (ctx, NULL, &dev);
   if (r)
     {
-      fprintf (stderr, "Couldn't open device: %s\n", libusb_error_name (r));
+      fprintf (stderr, "Couldn't open device: %s\n", liballuris_error_name (r));
       return EXIT_FAILURE;
     }
 
-  r = libusb_claim_interface (h, 0);
-  if (r)
-    {
-      fprintf (stderr, "Couldn't claim interface: %s\n", libusb_error_name (r));
-      return EXIT_FAILURE;
-    }
-
-  struct pollfd fds;
-  int tret;
-  fds.fd = 0; /* this is STDIN */
-  fds.events = POLLIN;
-
-  char reply; //send "c" to abort capturing
   int block_size = 19;
-  int tempx[block_size];
 
   // FIXME: check if measurement is running before
   // enabling data stream. Abort if device is idle
 
-  // enable streaming
-  liballuris_cyclic_measurement (h, 1, block_size);
+  // the readers get serial number and metadata with the values
+  if (shm_name)
+    {
+      struct liballuris_shm_info info;
+      memset (&info, 0, sizeof (info));
+      liballuris_device_get_serial_number (dev, info.serial_number, sizeof (info.serial_number));
+      liballuris_device_get_metadata (dev, &info.metadata);
+      r = liballuris_shm_create (shm_name, SHM_CAPACITY, &info, &out.shm);
+      if (r)
+        {
+          fprintf (stderr, "Couldn't create shared memory %s: %s\n", shm_name, liballuris_error_name (r));
+          return EXIT_FAILURE;
+        }
+    }
+
+  struct liballuris_stream* stream;
+  r = liballuris_device_stream_open (ctx, dev, block_size, NUM_TRANSFERS, print_block, &out, &stream);
+  if (!r)
+    r = liballuris_stream_start (stream);
+  if (r)
+    {
+      fprintf (stderr, "Couldn't start stream: %s\n", liballuris_error_name (r));
+      return EXIT_FAILURE;
+    }
 
-  int k;
+  // Wait for stdin, the clients and the libusb descriptors in one poll call,
+  // thus "c" stops immediately and nothing is polled while idle.
+  struct pollfd fds[2 + MAX_CLIENTS + 16];
+  size_t num_fds;
+  int stdin_fd = 0; /* this is STDIN */
+  r = liballuris_get_pollfds (ctx, fds, 16, &num_fds);
+  if (r)
+    {
+      fprintf (stderr, "Couldn't get libusb file descriptors: %s\n", liballuris_error_name (r));
+      return EXIT_FAILURE;
+    }
+
+  char reply = 0; //send "c" to abort capturing
   do
     {
-      int r = liballuris_poll_measurement (h, tempx, block_size);
-      if (r == LIBUSB_SUCCESS)
+      size_t nfds = 0;
+      fds[nfds].fd = stdin_fd;
+      fds[nfds++].events = POLLIN;
+      if (out.server)
+        {
+          fds[nfds].fd = server.fd;
+          fds[nfds++].events = POLLIN;
+          for (k=0; k < MAX_CLIENTS; ++k)
+            {
+              fds[nfds].fd = server.clients[k].fd;
+              fds[nfds++].events = POLLIN | ((server.clients[k].count)? POLLOUT : 0);
+            }
+        }
+      // a blocking client which is behind stops the acquisition
+      char stalled = out.server && server_stalled (&server);
+      size_t usb_fds = 0;
+      if (!stalled)
+        liballuris_get_pollfds (ctx, fds + nfds, 16, &usb_fds);
+
+      int timeout;
+      r = liballuris_get_next_timeout (ctx, &timeout);
+      if (!r && poll (fds, nfds + usb_fds, (stalled)? -1 : timeout) < 0)
+        break;
+      if (!r && !stalled)
+        r = liballuris_stream_dispatch (stream);
+      if (r)
+        break;
+
+      if (fds[0].revents & (POLLIN | POLLHUP))
         {
-          if (bin)
-            fwrite (tempx, 4, block_size, stdout);
+          int c = getc (stdin);
+          if (c == EOF)
+            stdin_fd = -1; // stdin closed, keep streaming
           else
-            for (k=0; k < block_size; ++k)
-              printf ("%i\n", tempx[k]);
-          fflush (stdout);
+            reply = c;
         }
 
-      tret = poll (&fds, 1, 0);
-      reply = 0;
-      if (tret == 1)
-        reply = getc(stdin);
+      if (out.server)
+        {
+          if (fds[1].revents & POLLIN)
+            server_accept (&server);
+          for (k=0; k < MAX_CLIENTS; ++k)
+            {
+              struct client* c = &server.clients[k];
+              if (c->fd < 0)
+                continue;
+              if (((fds[2 + k].revents & (POLLIN | POLLHUP | POLLERR)) && client_read (c))
+                  || client_send (c, server.capacity))
+                client_close (c);
+            }
+        }
     }
   while (reply != 'c');
 
-  // disable streaming
-  liballuris_cyclic_measurement (h, 0, block_size);
+  if (r)
+    fprintf (stderr, "Error while streaming: %s\n", liballuris_error_name (r));
 
-  // empty read remaining data
-  liballuris_clear_RX (h, 500);
+  // disable streaming and empty read remaining data
+  r = liballuris_stream_stop (stream);
+  if (r)
+    fprintf (stderr, "Error while streaming: %s\n", liballuris_error_name (r));
 
-  libusb_release_interface (h, 0);
-  libusb_close (h);
+  liballuris_stream_close (stream);
+  liballuris_shm_close (out.shm);
+  if (out.server)
+    {
+      for (k=0; k < MAX_CLIENTS; ++k)
+        if (server.clients[k].fd >= 0)
+          client_close (&server.clients[k]);
+      close (server.fd);
+    }
+  liballuris_device_close (dev);
+  libusb_exit (ctx);
   return EXIT_SUCCESS;
 }
@@ -1,17 +1,14 @@
 ## GNU Octave script to receive the fstream output
-## This creates a TCP listener on port 9000
+## This connects to "./fstream -l 9000" on port 9000
 
 pkg load sockets-enh
 graphics_toolkit fltk
 
-server = socket (AF_INET, SOCK_STREAM, 0);
-setsockopt (server, SOL_SOCKET, SO_REUSEADDR, 1);
-assert (getsockopt (server, SOL_SOCKET, SO_REUSEADDR), 1);
+server_data = socket (AF_INET, SOCK_STREAM, 0);
+connect (server_data, struct ("addr", "127.0.0.1", "port", 9000));
 
-bind (server, 9000);
-listen (server, 1);
-
-server_data = accept (server);
+## Drop the oldest values if plotting can't keep up, fstream keeps serving other clients
+send (server_data, "drop-oldest\n");
 
 # Es kommen Messwerte mit 900Hz
 close all
@@ -111,8 +108,5 @@ unwind_protect_cleanup
   fprintf (fid, "## End at %s\n", datestr (tend));
   fprintf (fid, "## Length = %is\n", (tend - tstart) * 24 * 3600);
   fclose (fid);
-  ## exit fstream
-  send (server_data, "c");
   disconnect (server_data);
-  disconnect (server);
 end
@@ -20,24 +20,56 @@
 ## @deftypefn  {Function File} {@var{r} =} gadc (@var{cmd})
 ## Thin gadc wrapper for GNU Octave
 ## See "gadc -?" for possible commands
+##
+## The first call starts "gadc --batch" as coprocess which keeps the device
+## open, following calls only write a command line and read the reply line.
+## @code{gadc ("quit")} ends the coprocess.
 ## @end deftypefn
 
 function ret = gadc (cmd)
 
+  persistent in out pid
+
   if (nargin != 1)
     print_usage ();
   endif
 
-  [s, ret] = system ( sprintf ("gadc %s", cmd));
-  
-  if (s != 0)
-    error ("gadc call failed: returned %i", s)
+  if (strcmp (cmd, "quit"))
+    if (! isempty (pid))
+      fclose (in);
+      fclose (out);
+      waitpid (pid);
+      pid = [];
+    endif
+    ret = [];
+    return;
+  endif
+
+  if (isempty (pid))
+    [in, out, pid] = popen2 ("gadc", {"--batch"});
   endif
-  
-  if (! isempty (ret))
-    ## remove last \n
-    ret(end)=[];
 
+  fputs (in, [cmd "\n"]);
+  fflush (in);
+
+  ## the output of the coprocess is non-blocking
+  reply = fgetl (out);
+  while (! ischar (reply))
+    if (waitpid (pid, WNOHANG) != 0)
+      pid = [];
+      error ("gadc terminated");
+    endif
+    fclear (out);
+    pause (0.001);
+    reply = fgetl (out);
+  endwhile
+
+  if (strncmp (reply, "ERR", 3))
+    error ("gadc call failed: %s", reply(5:end))
+  endif
+
+  ret = strtrim (reply(3:end));
+  if (! isempty (ret))
     ## try to convert to double
     tmp = sscanf (ret, "%f");
     if (!isempty (tmp))
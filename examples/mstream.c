@@ -0,0 +1,128 @@
+/*
+
+Copyright (C) 2015 Alluris GmbH & Co. KG <weber@alluris.de>
+
+mstream -- m(ulti device)stream(ing)
+
+Capture values from several devices with one event loop and output them as
+ASCII lines "DEVICE_INDEX TIMESTAMP VALUE"
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  See ../COPYING
+If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <signal.h>
+#include <sys/poll.h>
+#include "liballuris.h"
+
+/*
+ * Usage: mstream SERIAL|BUS,DEVICE [SERIAL|BUS,DEVICE ...]
+ * for example: ./mstream P.25412 P.25413 1,14
+ *
+ * TIMESTAMP is the sample time in seconds (CLOCK_MONOTONIC), interpolated from the
+ * host receive time of the packet.
+ * The device index is the position on the command line starting with 0.
+ */
+
+char do_exit = 0;
+
+void termination_handler (int signum)
+{
+  (void) signum;
+  do_exit = 1;
+}
+
+// called from the event thread of liballuris_multi
+static void print_block (const struct liballuris_block* block, void* user_data)
+{
+  (void) user_data;
+  size_t k;
+  for (k=0; k < block->num_values; ++k)
+    printf ("%u %.6f %i\n", block->device_index, block->timestamps_ns[k] / 1.0e9, block->values[k]);
+  fflush (stdout);
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2)
+    {
+      fprintf (stderr, "Usage: %s SERIAL|BUS,DEVICE [SERIAL|BUS,DEVICE ...]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  signal (SIGINT, termination_handler);
+  signal (SIGTERM, termination_handler);
+
+  libusb_context* ctx;
+  int r;
+  r = libusb_init (&ctx);
+  if (r < 0)
+    {
+      fprintf (stderr, "Couldn't init libusb %s\n", libusb_error_name (r));
+      return EXIT_FAILURE;
+    }
+
+  struct liballuris_multi* multi;
+  r = liballuris_multi_open (ctx, (const char* const*) argv + 1, argc - 1, &multi);
+  if (r)
+    return EXIT_FAILURE;
+
+  size_t k;
+  for (k=0; k < liballuris_multi_get_num_devices (multi); ++k)
+    {
+      r = liballuris_device_start_measurement (liballuris_multi_get_device (multi, k));
+      if (r)
+        {
+          fprintf (stderr, "Couldn't start measurement on device %li: %s\n", k, liballuris_error_name (r));
+          liballuris_multi_close (multi);
+          return EXIT_FAILURE;
+        }
+    }
+
+  r = liballuris_multi_start (multi, 19, 0, print_block, NULL);
+  if (r)
+    {
+      fprintf (stderr, "Couldn't start streams: %s\n", liballuris_error_name (r));
+      liballuris_multi_close (multi);
+      return EXIT_FAILURE;
+    }
+
+  struct pollfd fds;
+  fds.fd = 0; /* this is STDIN */
+  fds.events = POLLIN;
+
+  char reply = 0; //send "c" to abort capturing
+  while (reply != 'c' && !do_exit)
+    if (poll (&fds, 1, 100) == 1)
+      {
+        int c = getc (stdin);
+        if (c == EOF)
+          fds.fd = -1; // stdin closed, capture until SIGINT or SIGTERM
+        else
+          reply = c;
+      }
+
+  r = liballuris_multi_stop (multi);
+  if (r)
+    fprintf (stderr, "Error while streaming: %s\n", liballuris_error_name (r));
+
+  for (k=0; k < liballuris_multi_get_num_devices (multi); ++k)
+    liballuris_device_stop_measurement (liballuris_multi_get_device (multi, k));
+
+  liballuris_multi_close (multi);
+  libusb_exit (ctx);
+  return (r)? EXIT_FAILURE : EXIT_SUCCESS;
+}
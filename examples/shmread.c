@@ -0,0 +1,94 @@
+/*
+
+Copyright (C) 2015 Alluris GmbH & Co. KG <weber@alluris.de>
+
+shmread -- read the values published by "fstream -s NAME"
+
+Any number of readers can map the same ring, the writer doesn't wait for them.
+Values overwritten before a slow reader got them are counted and reported at the end.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  See ../COPYING
+If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include "liballuris.h"
+
+char do_exit = 0;
+
+void termination_handler (int signum)
+{
+  (void) signum;
+  do_exit = 1;
+}
+
+int main(int argc, char** argv)
+{
+  char with_timestamps = (argc == 3 && !strcmp (argv[1], "-t"));
+  if (argc != 2 && !with_timestamps)
+    {
+      fprintf (stderr, "Usage: %s [-t] NAME\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  signal (SIGINT, termination_handler);
+  signal (SIGTERM, termination_handler);
+
+  struct liballuris_shm* shm;
+  int r = liballuris_shm_open (argv[argc - 1], &shm);
+  if (r)
+    {
+      fprintf (stderr, "Couldn't open shared memory %s: %s\n", argv[argc - 1], liballuris_error_name (r));
+      return EXIT_FAILURE;
+    }
+
+  struct liballuris_shm_info info;
+  liballuris_shm_get_info (shm, &info);
+  fprintf (stderr, "%s: Fmax %i, digits %i, unit %s, capacity %zu values\n", info.serial_number,
+           info.metadata.fmax, info.metadata.digits, liballuris_unit_enum2str (info.metadata.unit), info.capacity);
+
+  int buf[1024];
+  int64_t timestamps[1024];
+  size_t n;
+  while (!do_exit && !r)
+    {
+      r = liballuris_shm_wait (shm, 1, 100);
+      if (r == LIBALLURIS_TIMEOUT)
+        {
+          r = 0;
+          continue;
+        }
+      if (!r)
+        r = liballuris_shm_read (shm, buf, timestamps, 1024, &n);
+
+      size_t k;
+      for (k=0; !r && k < n; ++k)
+        if (with_timestamps)
+          printf ("%lli %i\n", (long long) timestamps[k], buf[k]);
+        else
+          printf ("%i\n", buf[k]);
+      fflush (stdout);
+    }
+
+  if (r == LIBUSB_ERROR_NO_DEVICE)
+    fprintf (stderr, "Writer closed the stream\n");
+  else if (r)
+    fprintf (stderr, "Error: %s\n", liballuris_error_name (r));
+  fprintf (stderr, "%llu values lost\n", liballuris_shm_get_lost (shm));
+  liballuris_shm_close (shm);
+  return EXIT_SUCCESS;
+}
@@ -25,10 +25,83 @@ If not, see <http://www.gnu.org/licenses/>.
  * \brief Implementation of generic Alluris device driver
 */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include "liballuris.h"
 
-static unsigned char out_buf[DEFAULT_SEND_BUF_LEN];
-static unsigned char in_buf[DEFAULT_RECV_BUF_LEN];
+/*!
+ * \brief Per-device context, see \ref liballuris_device_open
+ *
+ * Every device context owns its send and receive buffers. Thus several devices
+ * can be driven from different threads at the same time.
+ */
+struct liballuris_device
+{
+  libusb_device_handle* dev_handle;
+  char owns_handle;                           // release and close dev_handle in liballuris_device_close
+  char thread_safe;                           // lock is initialized and used
+  pthread_mutex_t lock;                       // recursive, serializes all transfers of this device
+  unsigned int send_timeout;                  // replaces DEFAULT_SEND_TIMEOUT
+  unsigned int receive_timeout;               // replaces DEFAULT_RECEIVE_TIMEOUT
+  char serial_number[30];                     // cached serial number, empty if unknown
+  unsigned int cache_valid;                   // DEVICE_CACHE_* bits of valid members in cache
+  struct liballuris_metadata cache;           // see liballuris_device_get_metadata
+  unsigned char out_buf[DEFAULT_SEND_BUF_LEN];
+  unsigned char in_buf[DEFAULT_RECV_BUF_LEN];
+  struct device_async* async;                 // asynchronous commands, allocated on first use
+  struct liballuris_stream* stream;           // running stream with USB transfers, receives the async replies
+};
+
+// valid bits of liballuris_device.cache
+#define DEVICE_CACHE_FMAX       LIBALLURIS_METADATA_FMAX
+#define DEVICE_CACHE_DIGITS     LIBALLURIS_METADATA_DIGITS
+#define DEVICE_CACHE_RESOLUTION LIBALLURIS_METADATA_RESOLUTION
+#define DEVICE_CACHE_UNIT       LIBALLURIS_METADATA_UNIT
+#define DEVICE_CACHE_MODE       LIBALLURIS_METADATA_MODE
+#define DEVICE_CACHE_MEASURING  LIBALLURIS_METADATA_MEASURING
+#define DEVICE_CACHE_ALL        0x3F
+
+//! Internal: setup a temporary context on the stack for the libusb_device_handle based API
+static void device_init_transient (struct liballuris_device* dev, libusb_device_handle* dev_handle)
+{
+  dev->dev_handle = dev_handle;
+  dev->owns_handle = 0;
+  dev->thread_safe = 0;
+  dev->send_timeout = DEFAULT_SEND_TIMEOUT;
+  dev->receive_timeout = DEFAULT_RECEIVE_TIMEOUT;
+  dev->serial_number[0] = 0;
+  dev->cache_valid = 0;
+  dev->async = NULL;
+  dev->stream = NULL;
+  memset (dev->out_buf, 0, sizeof (dev->out_buf));
+  memset (dev->in_buf, 0, sizeof (dev->in_buf));
+}
+
+//! Internal: get exclusive access to the buffers and the device. May be nested.
+static void device_lock (struct liballuris_device* dev)
+{
+  if (dev->thread_safe)
+    pthread_mutex_lock (&dev->lock);
+}
+
+//! Internal: counterpart to device_lock. Returns ret for convenience.
+static int device_unlock (struct liballuris_device* dev, int ret)
+{
+  // most commands are rejected while measuring, so the cached state may be outdated
+  if (ret == LIBALLURIS_DEVICE_BUSY)
+    dev->cache_valid &= ~DEVICE_CACHE_MEASURING;
+  if (dev->thread_safe)
+    pthread_mutex_unlock (&dev->lock);
+  return ret;
+}
 
 // minimum length of "in" is 2 bytes
 static unsigned short char_to_uint16 (unsigned char* in)
@@ -55,6 +128,348 @@ static int char_to_int24 (unsigned char* in)
   return ret;
 }
 
+/****************************************************************************************/
+// bulk int24 decoding
+
+/*
+ * Samples are transferred as packed 24-bit little-endian two's complement values.
+ * The SIMD kernels move the 3 bytes of each value into the upper 3 bytes of a 32-bit lane
+ * and sign extend with an arithmetic right shift by 8. They only read the bytes of the
+ * values to decode, the tail is handled by the scalar loop.
+ */
+
+// Internal: scalar decode of one value, independent of host byte order
+static inline int decode_int24_scalar_one (const unsigned char* in)
+{
+  uint32_t u = (uint32_t) in[0] << 8 | (uint32_t) in[1] << 16 | (uint32_t) in[2] << 24;
+  return (int32_t) u >> 8;
+}
+
+static void decode_int24_scalar (const unsigned char* in, int* out, size_t num_values)
+{
+  size_t k;
+  for (k=0; k < num_values; ++k)
+    out[k] = decode_int24_scalar_one (in + 3*k);
+}
+
+static void decode_int24_float_scalar (const unsigned char* in, float* out, size_t num_values)
+{
+  size_t k;
+  for (k=0; k < num_values; ++k)
+    out[k] = (float) decode_int24_scalar_one (in + 3*k);
+}
+
+static void scale_float_scalar (const int* in, float* out, size_t num_values, double factor)
+{
+  const float f = factor;
+  size_t k;
+  for (k=0; k < num_values; ++k)
+    out[k] = in[k] * f;
+}
+
+static void scale_double_scalar (const int* in, double* out, size_t num_values, double factor)
+{
+  size_t k;
+  for (k=0; k < num_values; ++k)
+    out[k] = in[k] * factor;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_DECODE_X86 1
+
+// byte i of value k to byte 4*k+1+i of the lane, the lowest byte is zeroed
+#define DECODE_SHUFFLE_MASK -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11
+
+__attribute__((target("ssse3")))
+static inline __m128i decode_4_ssse3 (const unsigned char* in)
+{
+  const __m128i mask = _mm_setr_epi8 (DECODE_SHUFFLE_MASK);
+  return _mm_srai_epi32 (_mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i*) in), mask), 8);
+}
+
+// 16 bytes are loaded for 4 values (12 bytes), so stop 6 values before the end
+__attribute__((target("ssse3")))
+static void decode_int24_ssse3 (const unsigned char* in, int* out, size_t num_values)
+{
+  size_t k = 0;
+  for (; k + 6 <= num_values; k += 4)
+    _mm_storeu_si128 ((__m128i*) (out + k), decode_4_ssse3 (in + 3*k));
+  decode_int24_scalar (in + 3*k, out + k, num_values - k);
+}
+
+__attribute__((target("ssse3")))
+static void decode_int24_float_ssse3 (const unsigned char* in, float* out, size_t num_values)
+{
+  size_t k = 0;
+  for (; k + 6 <= num_values; k += 4)
+    _mm_storeu_ps (out + k, _mm_cvtepi32_ps (decode_4_ssse3 (in + 3*k)));
+  decode_int24_float_scalar (in + 3*k, out + k, num_values - k);
+}
+
+// the shuffle works within 128-bit lanes: load values 0..3 into the lower and 4..7 into the upper lane
+__attribute__((target("avx2")))
+static inline __m256i decode_8_avx2 (const unsigned char* in)
+{
+  const __m256i mask = _mm256_setr_epi8 (DECODE_SHUFFLE_MASK, DECODE_SHUFFLE_MASK);
+  __m256i v = _mm256_inserti128_si256 (_mm256_castsi128_si256 (_mm_loadu_si128 ((const __m128i*) in)),
+                                       _mm_loadu_si128 ((const __m128i*) (in + 12)), 1);
+  return _mm256_srai_epi32 (_mm256_shuffle_epi8 (v, mask), 8);
+}
+
+// bytes 12..27 are loaded for 8 values (24 bytes), so stop 10 values before the end
+__attribute__((target("avx2")))
+static void decode_int24_avx2 (const unsigned char* in, int* out, size_t num_values)
+{
+  size_t k = 0;
+  for (; k + 10 <= num_values; k += 8)
+    _mm256_storeu_si256 ((__m256i*) (out + k), decode_8_avx2 (in + 3*k));
+  decode_int24_ssse3 (in + 3*k, out + k, num_values - k);
+}
+
+__attribute__((target("avx2")))
+static void decode_int24_float_avx2 (const unsigned char* in, float* out, size_t num_values)
+{
+  size_t k = 0;
+  for (; k + 10 <= num_values; k += 8)
+    _mm256_storeu_ps (out + k, _mm256_cvtepi32_ps (decode_8_avx2 (in + 3*k)));
+  decode_int24_float_ssse3 (in + 3*k, out + k, num_values - k);
+}
+
+__attribute__((target("avx2")))
+static void scale_float_avx2 (const int* in, float* out, size_t num_values, double factor)
+{
+  const __m256 f = _mm256_set1_ps ((float) factor);
+  size_t k = 0;
+  for (; k + 8 <= num_values; k += 8)
+    _mm256_storeu_ps (out + k, _mm256_mul_ps (_mm256_cvtepi32_ps (_mm256_loadu_si256 ((const __m256i*) (in + k))), f));
+  scale_float_scalar (in + k, out + k, num_values - k, factor);
+}
+
+__attribute__((target("avx2")))
+static void scale_double_avx2 (const int* in, double* out, size_t num_values, double factor)
+{
+  const __m256d f = _mm256_set1_pd (factor);
+  size_t k = 0;
+  for (; k + 4 <= num_values; k += 4)
+    _mm256_storeu_pd (out + k, _mm256_mul_pd (_mm256_cvtepi32_pd (_mm_loadu_si128 ((const __m128i*) (in + k))), f));
+  scale_double_scalar (in + k, out + k, num_values - k, factor);
+}
+
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_DECODE_NEON 1
+
+// vld3 deinterleaves 8 values into low, middle and high bytes and reads exactly 24 bytes
+static inline void decode_8_neon (const unsigned char* in, int32x4_t* lo, int32x4_t* hi)
+{
+  uint8x8x3_t b = vld3_u8 (in);
+  uint16x8_t low16 = vorrq_u16 (vmovl_u8 (b.val[0]), vshll_n_u8 (b.val[1], 8));
+  int16x8_t high16 = vmovl_s8 (vreinterpret_s8_u8 (b.val[2]));
+  *lo = vorrq_s32 (vshll_n_s16 (vget_low_s16 (high16), 16), vreinterpretq_s32_u32 (vmovl_u16 (vget_low_u16 (low16))));
+  *hi = vorrq_s32 (vshll_n_s16 (vget_high_s16 (high16), 16), vreinterpretq_s32_u32 (vmovl_u16 (vget_high_u16 (low16))));
+}
+
+static void decode_int24_neon (const unsigned char* in, int* out, size_t num_values)
+{
+  size_t k = 0;
+  int32x4_t lo, hi;
+  for (; k + 8 <= num_values; k += 8)
+    {
+      decode_8_neon (in + 3*k, &lo, &hi);
+      vst1q_s32 (out + k, lo);
+      vst1q_s32 (out + k + 4, hi);
+    }
+  decode_int24_scalar (in + 3*k, out + k, num_values - k);
+}
+
+static void decode_int24_float_neon (const unsigned char* in, float* out, size_t num_values)
+{
+  size_t k = 0;
+  int32x4_t lo, hi;
+  for (; k + 8 <= num_values; k += 8)
+    {
+      decode_8_neon (in + 3*k, &lo, &hi);
+      vst1q_f32 (out + k, vcvtq_f32_s32 (lo));
+      vst1q_f32 (out + k + 4, vcvtq_f32_s32 (hi));
+    }
+  decode_int24_float_scalar (in + 3*k, out + k, num_values - k);
+}
+
+static void scale_float_neon (const int* in, float* out, size_t num_values, double factor)
+{
+  const float32x4_t f = vdupq_n_f32 ((float) factor);
+  size_t k = 0;
+  for (; k + 4 <= num_values; k += 4)
+    vst1q_f32 (out + k, vmulq_f32 (vcvtq_f32_s32 (vld1q_s32 (in + k)), f));
+  scale_float_scalar (in + k, out + k, num_values - k, factor);
+}
+#endif
+
+//! Internal: decode and conversion kernels selected by decode_select
+static struct
+{
+  const char* name;
+  void (*to_int) (const unsigned char* in, int* out, size_t num_values);
+  void (*to_float) (const unsigned char* in, float* out, size_t num_values);
+  void (*scale_float) (const int* in, float* out, size_t num_values, double factor);
+  void (*scale_double) (const int* in, double* out, size_t num_values, double factor);
+} decode_impl = {"scalar", decode_int24_scalar, decode_int24_float_scalar, scale_float_scalar, scale_double_scalar};
+
+static pthread_once_t decode_once = PTHREAD_ONCE_INIT;
+
+/*!
+ * \brief Internal: select the fastest decode kernel supported by the CPU
+ *
+ * LIBALLURIS_DECODE=scalar|ssse3|avx2|neon limits the selection, for example for benchmarks.
+ */
+static void decode_select (void)
+{
+  const char* limit = getenv ("LIBALLURIS_DECODE");
+  if (limit && ! strcmp (limit, "scalar"))
+    return;
+#ifdef HAVE_DECODE_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("ssse3"))
+    {
+      decode_impl.name = "ssse3";
+      decode_impl.to_int = decode_int24_ssse3;
+      decode_impl.to_float = decode_int24_float_ssse3;
+    }
+  if (__builtin_cpu_supports ("avx2") && ! (limit && ! strcmp (limit, "ssse3")))
+    {
+      decode_impl.name = "avx2";
+      decode_impl.to_int = decode_int24_avx2;
+      decode_impl.to_float = decode_int24_float_avx2;
+      decode_impl.scale_float = scale_float_avx2;
+      decode_impl.scale_double = scale_double_avx2;
+    }
+#elif defined(HAVE_DECODE_NEON)
+  decode_impl.name = "neon";
+  decode_impl.to_int = decode_int24_neon;
+  decode_impl.to_float = decode_int24_float_neon;
+  decode_impl.scale_float = scale_float_neon;
+#endif
+}
+
+/*!
+ * \brief Decode packed 24-bit little-endian values into int
+ *
+ * Uses SSSE3, AVX2 or NEON if available (selected at runtime on x86), else a portable loop.
+ * in and out must not overlap.
+ * \param[in] in 3*num_values bytes, for example the payload of a cyclic measurement packet
+ * \param[out] out storage for num_values values
+ * \param[in] num_values number of values to decode
+ * \sa liballuris_decode_int24_float, liballuris_decode_packet
+ */
+void liballuris_decode_int24 (const unsigned char* in, int* out, size_t num_values)
+{
+  pthread_once (&decode_once, decode_select);
+  decode_impl.to_int (in, out, num_values);
+}
+
+//! Same as \ref liballuris_decode_int24 but converts to float (exact, 24 bits fit into the mantissa)
+void liballuris_decode_int24_float (const unsigned char* in, float* out, size_t num_values)
+{
+  pthread_once (&decode_once, decode_select);
+  decode_impl.to_float (in, out, num_values);
+}
+
+//! Name of the selected decode kernel: "scalar", "ssse3", "avx2" or "neon"
+const char* liballuris_decode_int24_impl (void)
+{
+  pthread_once (&decode_once, decode_select);
+  return decode_impl.name;
+}
+
+/*!
+ * \brief Decode a raw cyclic measurement packet, for example from a capture file
+ *
+ * The packet consists of the id 0x02, the packet length, 3 header bytes and the packed values.
+ * \param[in] packet received data
+ * \param[in] length number of bytes in packet
+ * \param[out] buf storage for the decoded values
+ * \param[in] buf_length number of elements in buf
+ * \param[out] num_values number of values written to buf
+ * \return 0 if successful, LIBALLURIS_MALFORMED_REPLY if packet isn't a measurement packet,
+ * LIBALLURIS_OUT_OF_RANGE if buf is too small
+ */
+int liballuris_decode_packet (const unsigned char* packet, size_t length, int* buf, size_t buf_length, size_t* num_values)
+{
+  *num_values = 0;
+  if (length < 5 || packet[0] != 0x02 || packet[1] != length || (length - 5) % 3)
+    return LIBALLURIS_MALFORMED_REPLY;
+
+  size_t n = (length - 5) / 3;
+  if (n > buf_length)
+    return LIBALLURIS_OUT_OF_RANGE;
+
+  liballuris_decode_int24 (packet + 5, buf, n);
+  *num_values = n;
+  return LIBALLURIS_SUCCESS;
+}
+
+//! Internal: CLOCK_MONOTONIC in ns
+static int64_t monotonic_ns (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//! Internal: timestamps of length samples, the last one was sampled at t_last
+static void interpolate_timestamps (int64_t* timestamps_ns, size_t length, int64_t t_last, int64_t sample_period_ns)
+{
+  size_t k;
+  for (k=0; k < length; ++k)
+    timestamps_ns[k] = t_last - (int64_t) (length - 1 - k) * sample_period_ns;
+}
+
+//! Internal: sleep for the current backoff and double it up to 100ms
+static void poll_backoff (unsigned int* delay_ms)
+{
+  usleep (*delay_ms * 1000);
+  *delay_ms *= 2;
+  if (*delay_ms > 100)
+    *delay_ms = 100;
+}
+
+//! Internal: poll the measuring bit until it equals target or timeout expires
+static int wait_for_measuring (struct liballuris_device* dev, char target, int64_t t_start, unsigned int timeout, unsigned int* settle_ms)
+{
+  int64_t deadline = t_start + (int64_t) timeout * 1000000;
+  unsigned int delay = 5;
+  struct liballuris_state state;
+  int ret;
+
+  for (;;)
+    {
+      ret = liballuris_device_read_state (dev, &state);
+      if (ret == LIBALLURIS_SUCCESS && state.measuring == target)
+        break;
+      // the device may reject requests while it's busy, keep on polling
+      if (ret != LIBALLURIS_SUCCESS && ret != LIBUSB_ERROR_TIMEOUT && ret != LIBALLURIS_DEVICE_BUSY)
+        return ret;
+      if (monotonic_ns () >= deadline)
+        return LIBALLURIS_TIMEOUT;
+      poll_backoff (&delay);
+    }
+
+  if (settle_ms)
+    *settle_ms = (monotonic_ns () - t_start) / 1000000;
+  return LIBALLURIS_SUCCESS;
+}
+
+/*!
+ * \brief Sample period of the cyclic measurements in the given mode
+ * \param[in] mode measurement mode, see \ref liballuris_get_mode
+ * \return period in ns, 100ms for LIBALLURIS_MODE_STANDARD else 1/900s
+ */
+int64_t liballuris_sample_period_ns (enum liballuris_measurement_mode mode)
+{
+  return (mode == LIBALLURIS_MODE_STANDARD)? LIBALLURIS_PERIOD_STANDARD_NS : LIBALLURIS_PERIOD_PEAK_NS;
+}
+
 /*!
  * Returns a constant NULL-terminated string with the ASCII name of a libusb
  * or liballuris error code. The caller must not free() the returned string.
@@ -158,69 +573,399 @@ static void print_buffer (unsigned char* buf, int len)
 }
 #endif
 
-//! Internal send and receive wrapper around libusb_interrupt_transfer
-static int liballuris_interrupt_transfer (libusb_device_handle* dev_handle,
-    const char* funcname,
-    int send_len,
-    unsigned int send_timeout,
-    int reply_len,
-    unsigned int receive_timeout)
+/****************************************************************************************/
+
+/*!
+ * \brief Internal: transport or recorder attached to a libusb_device_handle
+ *
+ * The handles returned by \ref liballuris_open_transport point to their attachment and
+ * are never passed to libusb. Real handles get an attachment while they are recorded.
+ */
+struct handle_attachment
 {
-  int actual;
-  int r = 0;
+  libusb_device_handle* h;                    // the attachment itself for transports
+  const struct liballuris_transport* transport; // NULL for real devices
+  void* transport_data;
+  FILE* record;                               // see liballuris_record_start, NULL if not recording
+  int64_t record_last_ns;                     // time of the previous frame
+};
+
+static pthread_rwlock_t attachments_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct handle_attachment** attachments;
+static size_t num_attachments;
+static atomic_size_t attachments_used;        // num_attachments without lock for the fast path
+
+//! Internal: find the attachment of a handle. Caller holds attachments_lock.
+static struct handle_attachment* attachment_find (libusb_device_handle* h)
+{
+  size_t k;
+  for (k=0; k < num_attachments; ++k)
+    if (attachments[k]->h == h)
+      return attachments[k];
+  return NULL;
+}
 
-  if (send_len > DEFAULT_SEND_BUF_LEN)
+//! Internal: add an attachment. Caller holds attachments_lock for writing.
+static int attachment_add (struct handle_attachment* a)
+{
+  struct handle_attachment** tmp = realloc (attachments, (num_attachments + 1) * sizeof (struct handle_attachment*));
+  if (! tmp)
+    return LIBUSB_ERROR_NO_MEM;
+  attachments = tmp;
+  attachments[num_attachments++] = a;
+  atomic_store (&attachments_used, num_attachments);
+  return LIBALLURIS_SUCCESS;
+}
+
+//! Internal: remove and free an attachment. Caller holds attachments_lock for writing.
+static void attachment_remove (struct handle_attachment* a)
+{
+  size_t k;
+  for (k=0; k < num_attachments; ++k)
+    if (attachments[k] == a)
+      {
+        attachments[k] = attachments[--num_attachments];
+        break;
+      }
+  atomic_store (&attachments_used, num_attachments);
+  free (a);
+}
+
+//! Internal: check if h was created by liballuris_open_transport
+static int is_transport_handle (libusb_device_handle* h)
+{
+  if (! atomic_load (&attachments_used))
+    return 0;
+  pthread_rwlock_rdlock (&attachments_lock);
+  struct handle_attachment* a = attachment_find (h);
+  int ret = a && a->transport;
+  pthread_rwlock_unlock (&attachments_lock);
+  return ret;
+}
+
+static void put_le32 (unsigned char* out, uint32_t v)
+{
+  out[0] = v & 0xFF;
+  out[1] = (v >> 8) & 0xFF;
+  out[2] = (v >> 16) & 0xFF;
+  out[3] = (v >> 24) & 0xFF;
+}
+
+/*!
+ * \brief Internal: append a frame to the recording of h, if any
+ *
+ * File format (all little endian): the header "ALRF", version (uint16) and a reserved uint16,
+ * then one record per frame: time since the previous frame in us (uint32, saturated),
+ * endpoint (uint8), libusb status (int8), length (uint8), reserved (uint8) and length bytes.
+ */
+static void record_frame (libusb_device_handle* h, unsigned char endpoint, const unsigned char* data, int length, int status)
+{
+  if (! atomic_load (&attachments_used))
+    return;
+  pthread_rwlock_rdlock (&attachments_lock);
+  struct handle_attachment* a = attachment_find (h);
+  if (a && a->record)
     {
-      fprintf (stderr, "Error: Send len %i > receive buffer len %i. This looks like a programming error.\n", send_len, DEFAULT_SEND_BUF_LEN);
-      exit (-1);
+      if (length < 0)
+        length = 0;
+      if (length > 255)
+        length = 255;
+
+      flockfile (a->record);
+      int64_t now = monotonic_ns ();
+      int64_t delta_us = (now - a->record_last_ns) / 1000;
+      a->record_last_ns = now;
+
+      unsigned char hdr[8];
+      put_le32 (hdr, (delta_us > UINT32_MAX)? UINT32_MAX : (uint32_t) delta_us);
+      hdr[4] = endpoint;
+      hdr[5] = (unsigned char) (signed char) status;
+      hdr[6] = length;
+      hdr[7] = 0;
+      fwrite (hdr, 1, sizeof (hdr), a->record);
+      fwrite (data, 1, length, a->record);
+      funlockfile (a->record);
     }
+  pthread_rwlock_unlock (&attachments_lock);
+}
 
-  if (reply_len > DEFAULT_RECV_BUF_LEN)
+//! Internal: record a completed asynchronous transfer
+static void record_transfer (struct libusb_transfer* transfer)
+{
+  int status;
+  switch (transfer->status)
     {
-      fprintf (stderr, "Error: Reply len %i > receive buffer len %i. This looks like a programming error.\n", reply_len, DEFAULT_RECV_BUF_LEN);
-      exit (-1);
+    case LIBUSB_TRANSFER_COMPLETED:
+      status = LIBUSB_SUCCESS;
+      break;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+      status = LIBUSB_ERROR_TIMEOUT;
+      break;
+    case LIBUSB_TRANSFER_CANCELLED:
+      return;
+    default:
+      status = LIBUSB_ERROR_IO;
+      break;
     }
+  record_frame (transfer->dev_handle, transfer->endpoint, transfer->buffer, transfer->actual_length, status);
+}
 
-  if (send_len > 0)
-    {
-      // check length in out_buf
-      assert (out_buf[1] == send_len);
-#ifdef DEBUG_TIMING
-      struct timeval t1, t2;
-      gettimeofday (&t1, NULL);
-#endif
-      r = libusb_interrupt_transfer (dev_handle, (0x1 | LIBUSB_ENDPOINT_OUT), out_buf, send_len, &actual, send_timeout);
-#ifdef DEBUG_TIMING
-      gettimeofday (&t2, NULL);
-      double diff = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec)/1.0e6;
-      fprintf (stderr, "%s send  took %f s\n", funcname, diff);
-#endif
+/*!
+ * \brief Internal: interrupt transfer on endpoint 0x01 or 0x81 of a device context
+ *
+ * Same as libusb_interrupt_transfer but routed to the transport of virtual handles
+ * and recorded if requested.
+ */
+static int device_transfer (struct liballuris_device* dev, unsigned char endpoint, unsigned char* data, int length, int* actual, unsigned int timeout)
+{
+  *actual = 0;
+  if (! atomic_load (&attachments_used))
+    return libusb_interrupt_transfer (dev->dev_handle, endpoint, data, length, actual, timeout);
+
+  pthread_rwlock_rdlock (&attachments_lock);
+  struct handle_attachment* a = attachment_find (dev->dev_handle);
+  const struct liballuris_transport* transport = (a)? a->transport : NULL;
+  void* transport_data = (a)? a->transport_data : NULL;
+  pthread_rwlock_unlock (&attachments_lock);
+
+  int r;
+  if (transport)
+    r = transport->transfer (transport_data, endpoint, data, length, actual, timeout);
+  else
+    r = libusb_interrupt_transfer (dev->dev_handle, endpoint, data, length, actual, timeout);
 
+  record_frame (dev->dev_handle, endpoint, data, (endpoint & LIBUSB_ENDPOINT_IN)? *actual : length, r);
+  return r;
+}
 
-#ifdef PRINT_DEBUG_MSG
-      if ( r == LIBUSB_SUCCESS)
-        {
-          printf ("%s sent %2i/%2i bytes: ", funcname, actual, send_len);
-          print_buffer (out_buf, actual);
-        }
-#endif
+/*!
+ * \brief Use a custom transport instead of a USB device
+ *
+ * The returned handle can be used with all functions of the libusb_device_handle based API
+ * and with \ref liballuris_device_wrap. The transfers of \ref liballuris_stream are done
+ * synchronously in \ref liballuris_stream_handle_events, asynchronous commands and
+ * \ref liballuris_multi aren't available. Don't pass the handle to libusb functions.
+ *
+ * \param[in] transport callbacks, have to stay valid until \ref liballuris_close_transport
+ * \param[in] user_data passed to the callbacks
+ * \param[out] h storage for the new handle
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_open_simulator, liballuris_open_replay
+ */
+int liballuris_open_transport (const struct liballuris_transport* transport, void* user_data, libusb_device_handle** h)
+{
+  struct handle_attachment* a = calloc (1, sizeof (struct handle_attachment));
+  if (! a)
+    return LIBUSB_ERROR_NO_MEM;
+  a->h = (libusb_device_handle*) a;
+  a->transport = transport;
+  a->transport_data = user_data;
+
+  pthread_rwlock_wrlock (&attachments_lock);
+  int ret = attachment_add (a);
+  pthread_rwlock_unlock (&attachments_lock);
+  if (ret)
+    free (a);
+  else
+    *h = a->h;
+  return ret;
+}
 
-      if (r != LIBUSB_SUCCESS || actual != send_len)
-        {
-          fprintf(stderr, "Write error in '%s': '%s', wrote %i of %i bytes.\n", funcname, libusb_error_name(r), actual, send_len);
-          return r;
-        }
+/*!
+ * \brief Close a handle of \ref liballuris_open_transport
+ *
+ * Stops a recording and calls the close callback of the transport.
+ * \param[in] h handle from \ref liballuris_open_transport
+ */
+void liballuris_close_transport (libusb_device_handle* h)
+{
+  pthread_rwlock_wrlock (&attachments_lock);
+  struct handle_attachment* a = attachment_find (h);
+  if (! a || ! a->transport)
+    {
+      pthread_rwlock_unlock (&attachments_lock);
+      return;
     }
+  const struct liballuris_transport* transport = a->transport;
+  void* transport_data = a->transport_data;
+  if (a->record)
+    fclose (a->record);
+  attachment_remove (a);
+  pthread_rwlock_unlock (&attachments_lock);
+
+  if (transport->close)
+    transport->close (transport_data);
+}
 
-  if (reply_len > 0)
-    {
+/*!
+ * \brief Open a device context on a custom transport
+ *
+ * Same as \ref liballuris_open_transport, \ref liballuris_device_close closes the transport.
+ */
+int liballuris_device_open_transport (const struct liballuris_transport* transport, void* user_data, struct liballuris_device** dev)
+{
+  libusb_device_handle* h;
+  int ret = liballuris_open_transport (transport, user_data, &h);
+  if (ret)
+    return ret;
+  ret = liballuris_device_wrap (h, dev);
+  if (ret)
+    liballuris_close_transport (h);
+  else
+    (*dev)->owns_handle = 1;
+  return ret;
+}
 
-#ifdef DEBUG_TIMING
-      struct timeval t1, t2;
-      gettimeofday (&t1, NULL);
+/*!
+ * \brief Record all frames sent to and received from a device
+ *
+ * Every transfer on endpoint 0x01 and 0x81 (commands, replies, cyclic measurements and timeouts)
+ * is appended with its time to a compact binary file which can be served again
+ * with \ref liballuris_open_replay. A running recording of h is replaced.
+ *
+ * \param[in] h a handle for the device (also a handle from \ref liballuris_open_transport)
+ * \param[in] path of the new file
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_record_stop
+ */
+int liballuris_record_start (libusb_device_handle* h, const char* path)
+{
+  FILE* f = fopen (path, "wb");
+  if (! f)
+    {
+      fprintf (stderr, "Couldn't create recording '%s': %s\n", path, strerror (errno));
+      return LIBUSB_ERROR_IO;
+    }
+  unsigned char hdr[8] = {'A', 'L', 'R', 'F', 1, 0, 0, 0};
+  fwrite (hdr, 1, sizeof (hdr), f);
+
+  pthread_rwlock_wrlock (&attachments_lock);
+  int ret = LIBALLURIS_SUCCESS;
+  struct handle_attachment* a = attachment_find (h);
+  if (! a)
+    {
+      a = calloc (1, sizeof (struct handle_attachment));
+      if (a)
+        {
+          a->h = h;
+          ret = attachment_add (a);
+          if (ret)
+            {
+              free (a);
+              a = NULL;
+            }
+        }
+      else
+        ret = LIBUSB_ERROR_NO_MEM;
+    }
+  if (a)
+    {
+      if (a->record)
+        fclose (a->record);
+      a->record = f;
+      a->record_last_ns = monotonic_ns ();
+    }
+  else
+    fclose (f);
+  pthread_rwlock_unlock (&attachments_lock);
+  return ret;
+}
+
+/*!
+ * \brief Stop a recording of \ref liballuris_record_start and close the file
+ * \param[in] h a handle for the device
+ */
+void liballuris_record_stop (libusb_device_handle* h)
+{
+  pthread_rwlock_wrlock (&attachments_lock);
+  struct handle_attachment* a = attachment_find (h);
+  if (a && a->record)
+    {
+      fclose (a->record);
+      a->record = NULL;
+      if (! a->transport)
+        attachment_remove (a);
+    }
+  pthread_rwlock_unlock (&attachments_lock);
+}
+
+//! Variant of \ref liballuris_record_start operating on a device context
+int liballuris_device_record_start (struct liballuris_device* dev, const char* path)
+{
+  return liballuris_record_start (dev->dev_handle, path);
+}
+
+//! Variant of \ref liballuris_record_stop operating on a device context
+void liballuris_device_record_stop (struct liballuris_device* dev)
+{
+  liballuris_record_stop (dev->dev_handle);
+}
+
+/****************************************************************************************/
+
+//! Internal send and receive wrapper around libusb_interrupt_transfer
+static int liballuris_interrupt_transfer (struct liballuris_device* dev,
+    const char* funcname,
+    int send_len,
+    unsigned int send_timeout,
+    int reply_len,
+    unsigned int receive_timeout)
+{
+  int actual;
+  int r = 0;
+
+  if (send_len > DEFAULT_SEND_BUF_LEN)
+    {
+      fprintf (stderr, "Error: Send len %i > receive buffer len %i. This looks like a programming error.\n", send_len, DEFAULT_SEND_BUF_LEN);
+      exit (-1);
+    }
+
+  if (reply_len > DEFAULT_RECV_BUF_LEN)
+    {
+      fprintf (stderr, "Error: Reply len %i > receive buffer len %i. This looks like a programming error.\n", reply_len, DEFAULT_RECV_BUF_LEN);
+      exit (-1);
+    }
+
+  if (send_len > 0)
+    {
+      // check length in dev->out_buf
+      assert (dev->out_buf[1] == send_len);
+#ifdef DEBUG_TIMING
+      struct timeval t1, t2;
+      gettimeofday (&t1, NULL);
 #endif
-      memset (in_buf, 0, sizeof (in_buf));
-      r = libusb_interrupt_transfer (dev_handle, 0x81 | LIBUSB_ENDPOINT_IN, in_buf, reply_len, &actual, receive_timeout);
+      r = device_transfer (dev, (0x1 | LIBUSB_ENDPOINT_OUT), dev->out_buf, send_len, &actual, send_timeout);
+#ifdef DEBUG_TIMING
+      gettimeofday (&t2, NULL);
+      double diff = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec)/1.0e6;
+      fprintf (stderr, "%s send  took %f s\n", funcname, diff);
+#endif
+
+
+#ifdef PRINT_DEBUG_MSG
+      if ( r == LIBUSB_SUCCESS)
+        {
+          printf ("%s sent %2i/%2i bytes: ", funcname, actual, send_len);
+          print_buffer (dev->out_buf, actual);
+        }
+#endif
+
+      if (r != LIBUSB_SUCCESS || actual != send_len)
+        {
+          fprintf(stderr, "Write error in '%s': '%s', wrote %i of %i bytes.\n", funcname, libusb_error_name(r), actual, send_len);
+          return r;
+        }
+    }
+
+  if (reply_len > 0)
+    {
+
+#ifdef DEBUG_TIMING
+      struct timeval t1, t2;
+      gettimeofday (&t1, NULL);
+#endif
+      memset (dev->in_buf, 0, sizeof (dev->in_buf));
+      r = device_transfer (dev, 0x81 | LIBUSB_ENDPOINT_IN, dev->in_buf, reply_len, &actual, receive_timeout);
 #ifdef DEBUG_TIMING
       gettimeofday (&t2, NULL);
       double diff = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec)/1.0e6;
@@ -231,15 +976,15 @@ static int liballuris_interrupt_transfer (libusb_device_handle* dev_handle,
       if (r == LIBUSB_SUCCESS)
         {
           printf ("%s recv %2i/%2i bytes: ", funcname, actual, reply_len);
-          print_buffer (in_buf, actual);
+          print_buffer (dev->in_buf, actual);
         }
 #endif
 
       // if we want to disable streaming (0x01 0x04 0x00....) then reread and discard ID_SAMPLE 0x02
-      if (r == LIBUSB_SUCCESS && out_buf[0] == 0x01 && out_buf[2] == 0x00 && in_buf[0] == 0x02)
+      if (r == LIBUSB_SUCCESS && dev->out_buf[0] == 0x01 && dev->out_buf[2] == 0x00 && dev->in_buf[0] == 0x02)
         {
-          liballuris_clear_RX (dev_handle, 250);
-          liballuris_clear_RX (dev_handle, 250);
+          liballuris_device_clear_RX (dev, 250);
+          liballuris_device_clear_RX (dev, 250);
           return LIBUSB_SUCCESS;
         }
 
@@ -250,7 +995,7 @@ static int liballuris_interrupt_transfer (libusb_device_handle* dev_handle,
 #ifdef PRINT_DEBUG_MSG
               fprintf(stderr, "LIBUSB_ERROR_OVERFLOW in '%s': expected %i bytes but got more.\n", funcname, reply_len);
 #endif
-              // Attention! You can't rely that data was written in in_buf
+              // Attention! You can't rely that data was written in dev->in_buf
               // See: http://libusb.sourceforge.net/api-1.0/packetoverflow.html
               return r;
             }
@@ -261,12 +1006,12 @@ static int liballuris_interrupt_transfer (libusb_device_handle* dev_handle,
       // check reply
       if (!r
           && send_len > 0
-          && in_buf[0] != 0x02
-          && (in_buf[0] != out_buf[0]
-              ||  in_buf[1] != actual))
+          && dev->in_buf[0] != 0x02
+          && (dev->in_buf[0] != dev->out_buf[0]
+              ||  dev->in_buf[1] != actual))
         {
           fprintf(stderr, "Error: Malformed reply. Check physical connection and EMI.\n");
-          fprintf(stderr, "(send_cmd=0x%02X != recv_cmd=0x%02X) || (recv_len=%i != actual_recv=%i),\n", out_buf[0], in_buf[0], in_buf[1], actual);
+          fprintf(stderr, "(send_cmd=0x%02X != recv_cmd=0x%02X) || (recv_len=%i != actual_recv=%i),\n", dev->out_buf[0], dev->in_buf[0], dev->in_buf[1], actual);
 
           return LIBALLURIS_MALFORMED_REPLY;
         }
@@ -274,670 +1019,4890 @@ static int liballuris_interrupt_transfer (libusb_device_handle* dev_handle,
   return r;
 }
 
-/****************************************************************************************/
-
 /*!
- * \brief List accessible alluris devices
+ * \brief Internal: pipelined queries of the same command
  *
- * The product field in alluris_device_description is filled via the USB descriptor.
- * After this the device is opened and the serial_number is read from the device.
- * Thus this function only lists devices where the application has sufficient rights to open
- * and read from the device. Check permissions if a device isn't returned.
+ * liballuris_interrupt_transfer waits for the reply before the next request is sent.
+ * Here up to depth requests are sent ahead and the replies are read in order, which hides
+ * most of the USB and firmware round trip latency for bulk queries.
  *
- * The retrieved list has to be freed with \ref liballuris_free_device_list before the application exits.
- * \param[in] ctx pointer to libusb context
- * \param[out] alluris_devs pointer to storage for the device list
- * \param[in] length number of elements in alluris_devs
- * \param[in] read_serial try to read the serial from devices
- * \return 0 if successful else \ref liballuris_error
- * \sa liballuris_free_device_list
+ * For each index 0..count-1 fill has to populate dev->out_buf (with out_buf[1] == send_len)
+ * and parse is called with the reply (reply_len bytes, command checked) in dev->in_buf.
+ * The caller must hold the device lock.
  */
-int liballuris_get_device_list (libusb_context* ctx, struct alluris_device_description* alluris_devs, size_t length, char read_serial)
+static int liballuris_pipelined_query (struct liballuris_device* dev,
+                                       const char* funcname,
+                                       size_t count,
+                                       size_t depth,
+                                       int send_len,
+                                       int reply_len,
+                                       void (*fill) (struct liballuris_device* dev, size_t index, void* user_data),
+                                       int (*parse) (struct liballuris_device* dev, size_t index, void* user_data),
+                                       void* user_data)
 {
-  size_t k = 0;
-  for (k=0; k<length; ++k)
-    alluris_devs[k].dev = NULL;
+  size_t sent = 0, received = 0;
+  unsigned char cmd = 0;
+  int ret = LIBALLURIS_SUCCESS;
 
-  size_t num_alluris_devices = 0;
-  libusb_device **devs;
-  ssize_t cnt = libusb_get_device_list (ctx, &devs);
-  if (cnt > 0)
+  if (depth < 1)
+    depth = 1;
+
+  while (received < count && ret == LIBALLURIS_SUCCESS)
     {
-      libusb_device *dev;
-      int i = 0;
-      while ((dev = devs[i++]) != NULL)
+      while (sent < count && sent - received < depth && ret == LIBALLURIS_SUCCESS)
         {
-          struct libusb_device_descriptor desc;
-          int r = libusb_get_device_descriptor (dev, &desc);
-          if (r < 0)
-            {
-              fprintf (stderr, "failed to get device descriptor: %s", libusb_error_name(r));
-              continue;
-            }
-
-          //debugging: list all devices
-#ifdef PRINT_DEBUG_MSG
-          printf ("desc.idVendor = 0x%04X, desc.idProduct = 0x%04X\n", desc.idVendor, desc.idProduct);
-#endif
-          //check for compatible devices
-          // FMIS or TTT
-          if (desc.idVendor == 0x04d8 && (desc.idProduct == 0xfc30 || desc.idProduct == 0xf25e) )
-            {
-              alluris_devs[num_alluris_devices].dev = dev;
-
-              //open device
-              libusb_device_handle* h;
-              r = libusb_open (dev, &h);
-              if (r == LIBUSB_SUCCESS)
-                {
-                  r = libusb_claim_interface (h, 0);
-                  if (r == LIBUSB_SUCCESS)
-                    {
-
-                      if(desc.iProduct)
-                        r = libusb_get_string_descriptor_ascii(h, desc.iProduct, (unsigned char*)alluris_devs[num_alluris_devices].product, sizeof (alluris_devs[0].product));
-                      else
-                        strncpy (alluris_devs[num_alluris_devices].product, "No product information available", sizeof (alluris_devs[0].product));
-
-                      if (read_serial)
-                        {
-                          // get serial number from device
-                          r = liballuris_get_serial_number (h, alluris_devs[num_alluris_devices].serial_number, sizeof (alluris_devs[0].serial_number));
-                          if (r == LIBALLURIS_DEVICE_BUSY)
-                            // measurement is running, serial cannot be read
-                            strcpy (alluris_devs[num_alluris_devices].serial_number, "*BUSY*");
-                        }
-
-                      num_alluris_devices++;
-                      libusb_release_interface (h, 0);
-                      libusb_close (h);
-                    }
-                  else if (LIBUSB_ERROR_BUSY) //it's already in use
-                    {
-                      //FIXME: what should we do?
-                    }
-                  else
-                    fprintf (stderr, "liballuris_get_device_list: Couldn't claim interface: %s\n", libusb_error_name(r));
-
-                }
-              else
-                fprintf (stderr, "liballuris_get_device_list: Couldn't open device: %s\n", libusb_error_name(r));
-            }
-          else
-            // unref non Alluris device
-            libusb_unref_device (dev);
+          fill (dev, sent, user_data);
+          cmd = dev->out_buf[0];
+          ret = liballuris_interrupt_transfer (dev, funcname, send_len, dev->send_timeout, 0, 0);
+          if (ret == LIBALLURIS_SUCCESS)
+            sent++;
+        }
+      if (ret != LIBALLURIS_SUCCESS)
+        break;
 
-          if (num_alluris_devices == length)
-            break; // maximum number of devices reached
+      ret = liballuris_interrupt_transfer (dev, funcname, 0, 0, reply_len, dev->receive_timeout);
+      if (ret == LIBALLURIS_SUCCESS && (dev->in_buf[0] != cmd || dev->in_buf[1] != reply_len))
+        {
+          fprintf (stderr, "Error: Malformed reply in '%s' (recv_cmd=0x%02X, recv_len=%i).\n", funcname, dev->in_buf[0], dev->in_buf[1]);
+          ret = LIBALLURIS_MALFORMED_REPLY;
         }
+      if (ret == LIBALLURIS_SUCCESS)
+        ret = parse (dev, received++, user_data);
+      else
+        received++;
     }
-  libusb_free_device_list (devs, 0);
-  return num_alluris_devices;
+
+  // discard the replies of requests which are still in flight
+  for (; received < sent; ++received)
+    liballuris_device_clear_RX (dev, dev->receive_timeout);
+
+  return ret;
 }
 
-/*!
- * \brief Free list filled from get_alluris_device_list
- */
-void liballuris_free_device_list (struct alluris_device_description* alluris_devs, size_t length)
+/****************************************************************************************/
+
+//! Internal: check the USB descriptor for a compatible device (FMIS or TTT)
+static int is_alluris_device (libusb_device* dev, struct libusb_device_descriptor* desc)
 {
-  size_t k = 0;
-  for (k=0; k < length; ++k)
-    if (alluris_devs[k].dev)
-      {
-        libusb_unref_device (alluris_devs[k].dev);
-        alluris_devs[k].dev = NULL;
-      }
+  int r = libusb_get_device_descriptor (dev, desc);
+  if (r < 0)
+    {
+      fprintf (stderr, "failed to get device descriptor: %s", libusb_error_name(r));
+      return 0;
+    }
+
+  //debugging: list all devices
+#ifdef PRINT_DEBUG_MSG
+  printf ("desc.idVendor = 0x%04X, desc.idProduct = 0x%04X\n", desc->idVendor, desc->idProduct);
+#endif
+  return desc->idVendor == 0x04d8 && (desc->idProduct == 0xfc30 || desc->idProduct == 0xf25e);
 }
 
 /*!
- * \brief Open device with specified serial_number or the first available if NULL
- * \param[in] ctx pointer to libusb context
- * \param[in] serial_number of device or NULL
- * \param[out] h storage for handle to communicate with the device
- * \return 0 if successful else \ref liballuris_error
+ * \brief Internal: open an Alluris device and read product string and (optionally) serial number
+ * \return LIBUSB_SUCCESS, LIBUSB_ERROR_BUSY if the interface is claimed by someone else, else error
  */
-int liballuris_open_device (libusb_context* ctx, const char* serial_number, libusb_device_handle** h)
+static int probe_device (libusb_device* dev, const struct libusb_device_descriptor* desc, struct alluris_device_description* alluris_dev, char read_serial)
 {
-  int k;
-  libusb_device *dev = NULL;
-  struct alluris_device_description alluris_devs[MAX_NUM_DEVICES];
-  int cnt = liballuris_get_device_list (ctx, alluris_devs, MAX_NUM_DEVICES, (serial_number != NULL));
-#ifdef PRINT_DEBUG_MSG
-  printf ("liballuris_open_device cnt = %i\n", cnt);
-#endif
-  if (cnt >= 1)
+  alluris_dev->product[0] = 0;
+  alluris_dev->serial_number[0] = 0;
+
+  //open device
+  libusb_device_handle* h;
+  int r = libusb_open (dev, &h);
+  if (r != LIBUSB_SUCCESS)
     {
-      if (serial_number == NULL)
-        dev = alluris_devs[0].dev;
-      else
-        for (k=0; k < cnt; k++)
-          if (! strncmp (serial_number, alluris_devs[k].serial_number, sizeof (alluris_devs[0].serial_number)))
-            dev = alluris_devs[k].dev;
+      fprintf (stderr, "liballuris_get_device_list: Couldn't open device: %s\n", libusb_error_name(r));
+      return r;
     }
 
-  if (! dev)
-    //no device found
-    return LIBUSB_ERROR_NOT_FOUND;
+  r = libusb_claim_interface (h, 0);
+  if (r == LIBUSB_SUCCESS)
+    {
+      if(desc->iProduct)
+        libusb_get_string_descriptor_ascii(h, desc->iProduct, (unsigned char*)alluris_dev->product, sizeof (alluris_dev->product));
+      else
+        strncpy (alluris_dev->product, "No product information available", sizeof (alluris_dev->product));
 
-  int ret = libusb_open (dev, h);
-  liballuris_free_device_list (alluris_devs, MAX_NUM_DEVICES);
-  return ret;
+      if (read_serial)
+        {
+          // get serial number from device
+          int ret = liballuris_get_serial_number (h, alluris_dev->serial_number, sizeof (alluris_dev->serial_number));
+          if (ret == LIBALLURIS_DEVICE_BUSY)
+            // measurement is running, serial cannot be read
+            strcpy (alluris_dev->serial_number, "*BUSY*");
+        }
+      libusb_release_interface (h, 0);
+    }
+  else if (r != LIBUSB_ERROR_BUSY) //BUSY: it's already in use
+    fprintf (stderr, "liballuris_get_device_list: Couldn't claim interface: %s\n", libusb_error_name(r));
+
+  libusb_close (h);
+  return r;
 }
 
+/****************************************************************************************/
+// persistent device cache
 
 /*!
- * \brief Open device with specified bus and device id.
- * \param[in] ctx pointer to libusb context
- * \param[in] bus id of device
- * \param[in] device id of device
- * \param[out] h storage for handle to communicate with the device
- * \return 0 if successful else \ref liballuris_error
+ * \brief Internal: location of the device cache file
+ *
+ * LIBALLURIS_CACHE overrides the path, an empty value disables the cache.
+ * Else $XDG_RUNTIME_DIR/liballuris-devices, /run/user/UID/liballuris-devices or
+ * /tmp/liballuris-devices-UID is used.
+ * \return 1 if the cache is enabled, else 0
  */
-int liballuris_open_device_with_id (libusb_context* ctx, int bus, int device, libusb_device_handle** h)
+static int cache_path (char* buf, size_t length)
 {
-  int k;
-  libusb_device *dev = NULL;
-  struct alluris_device_description alluris_devs[MAX_NUM_DEVICES];
-  int cnt = liballuris_get_device_list (ctx, alluris_devs, MAX_NUM_DEVICES, 0);
+  const char* p = getenv ("LIBALLURIS_CACHE");
+  if (p)
+    {
+      snprintf (buf, length, "%s", p);
+      return (*p != 0);
+    }
 
-  if (cnt >= 1)
+  p = getenv ("XDG_RUNTIME_DIR");
+  if (p && *p)
+    snprintf (buf, length, "%s/liballuris-devices", p);
+  else
     {
-      for (k=0; k < cnt; k++)
-        if (   libusb_get_bus_number (alluris_devs[k].dev) == bus
-               && libusb_get_device_address (alluris_devs[k].dev) == device)
-          dev = alluris_devs[k].dev;
+      snprintf (buf, length, "/run/user/%u", (unsigned int) getuid ());
+      if (access (buf, W_OK) == 0)
+        snprintf (buf, length, "/run/user/%u/liballuris-devices", (unsigned int) getuid ());
+      else
+        snprintf (buf, length, "/tmp/liballuris-devices-%u", (unsigned int) getuid ());
     }
+  return 1;
+}
 
-  if (! dev)
-    //no device found
-    return LIBUSB_ERROR_NOT_FOUND;
+// Internal: fill bus and port path of a cache entry from a libusb device
+static void cache_set_location (struct liballuris_cache_entry* entry, libusb_device* dev)
+{
+  entry->bus = libusb_get_bus_number (dev);
+  int r = libusb_get_port_numbers (dev, entry->port_numbers, sizeof (entry->port_numbers));
+  entry->num_ports = (r > 0)? r : 0;
+}
 
-  int ret = libusb_open (dev, h);
-  liballuris_free_device_list (alluris_devs, MAX_NUM_DEVICES);
-  return ret;
+// Internal: compare bus and port path, the device address changes on every re-plug
+static int cache_same_location (const struct liballuris_cache_entry* a, const struct liballuris_cache_entry* b)
+{
+  return a->bus == b->bus
+         && a->num_ports == b->num_ports
+         && ! memcmp (a->port_numbers, b->port_numbers, a->num_ports);
 }
 
-/*!
- * \brief Clear receive buffer
- *
- * Try to read 64 bytes from receive endpoint to clear the USB receive queue after some error.
- * There is no error if a timeout occurs.
- * \param[in] dev_handle a handle for the device to communicate with
- * \param[in] timeout read timeout
- */
-void liballuris_clear_RX (libusb_device_handle* dev_handle, unsigned int timeout)
+// Internal: write one line of the cache file, see cache_read
+static void cache_write_entry (FILE* f, const struct liballuris_cache_entry* entry)
 {
-  unsigned char data[64];
-  int actual;
-#ifdef PRINT_DEBUG_MSG
-  int r = libusb_interrupt_transfer (dev_handle, 0x81 | LIBUSB_ENDPOINT_IN, data, 64, &actual, timeout);
-  printf ("clear_RX: libusb_interrupt_transfer returned '%s', actual = %i\n", libusb_error_name(r), actual);
-#else
-  libusb_interrupt_transfer (dev_handle, 0x81 | LIBUSB_ENDPOINT_IN, data, 64, &actual, timeout);
-#endif
+  fprintf (f, "%s\t%i\t", entry->serial_number, entry->bus);
+  int k;
+  for (k=0; k < entry->num_ports; ++k)
+    fprintf (f, "%s%u", (k)? "." : "", entry->port_numbers[k]);
+  if (! entry->num_ports)
+    fprintf (f, "-");
+  fprintf (f, "\t%i\t%s\n", entry->fmax, entry->firmware);
 }
 
 /*!
- * \brief Query the serial number
- *
- * Return the serial number of the device which is also laser-engraved on the back.
- * For example "P.25412"
- *
- * Query the serial number is only possible if the measurement is not running,
- * else LIBALLURIS_DEVICE_BUSY is returned.
+ * \brief Internal: open a cache or lock file that belongs to the user
  *
- * \param[in] dev_handle a handle for the device to communicate with
- * \param[out] buf output location for the serial number. Only populated if the return code is 0.
- * \param[in] length length of buffer in bytes
- * \return 0 if successful else \ref liballuris_error. LIBALLURIS_DEVICE_BUSY if measurement is running
+ * The /tmp fallback of cache_path is predictable, another user could plant a symlink
+ * or a file there. Symlinks aren't followed and files not owned by the user are rejected.
+ * \return file descriptor or -1
  */
-int liballuris_get_serial_number (libusb_device_handle *dev_handle, char* buf, size_t length)
+static int cache_open (const char* path, int flags)
 {
-  out_buf[0] = 0x08;
-  out_buf[1] = 3;
-  out_buf[2] = 6;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 6, DEFAULT_RECEIVE_TIMEOUT);
-  if (ret == LIBALLURIS_SUCCESS)
+  int fd = open (path, flags | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  if (fstat (fd, &st) || st.st_uid != getuid () || ! S_ISREG (st.st_mode))
     {
-      unsigned short tmp = char_to_uint16 (in_buf + 3);
-      if (tmp == 65535)
-        return LIBALLURIS_DEVICE_BUSY;
-      else
-        snprintf (buf, length, "%c.%i", in_buf[5] + 'A', tmp);
+      close (fd);
+      return -1;
     }
-  return ret;
+  return fd;
 }
 
 /*!
- * \brief Query firmware version
- *
- * The returned string in buf is for example "V5.03.009"
- * If the measurement is running, the firmware can't be read from the measurement processor
- * and "V255.255.255" is returned instead.
+ * \brief Internal: read all entries of the cache file
  *
- * \param[in] dev_handle a handle for the device to communicate with
- * \param[in] dev 0=USB communication processor, 1=measurement processor
- * \param[out] buf output location for the firmware string. Only populated if the return code is 0.
- * \param[in] length length of buffer in bytes
- * \return 0 if successful else \ref liballuris_error.
+ * Lines are "SERIAL\tBUS\tPORT.PORT...\tFMAX\tFIRMWARE". Symlinks and files not owned by the user are ignored.
+ * \return number of entries in the allocated array *entries
  */
-int liballuris_get_firmware (libusb_device_handle *dev_handle, int dev, char* buf, size_t length)
+static size_t cache_read (const char* path, struct liballuris_cache_entry** entries)
 {
-  if (dev < 0 || dev > 1)
-    return LIBALLURIS_OUT_OF_RANGE;
+  *entries = NULL;
+  int fd = cache_open (path, O_RDONLY);
+  FILE* f = (fd < 0)? NULL : fdopen (fd, "r");
+  if (! f)
+    {
+      if (fd >= 0)
+        close (fd);
+      return 0;
+    }
 
-  out_buf[0] = 0x08;
-  out_buf[1] = 3;
-  out_buf[2] = dev;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 6, DEFAULT_RECEIVE_TIMEOUT);
-  if (ret == LIBALLURIS_SUCCESS)
-    snprintf (buf, length, "V%i.%02i.%03i", in_buf[5], in_buf[4], in_buf[3]);
-  return ret;
-}
+  size_t num = 0, capacity = 0;
+  char line[256];
+  while (fgets (line, sizeof (line), f))
+    {
+      if (line[0] == '#')
+        continue;
+
+      struct liballuris_cache_entry e;
+      memset (&e, 0, sizeof (e));
+      char ports[64];
+      int n = sscanf (line, "%29[^\t]\t%i\t%63[^\t]\t%i\t%41[^\n]", e.serial_number, &e.bus, ports, &e.fmax, e.firmware);
+      if (n < 4)
+        continue;
+
+      // "-" if the device is connected to the root hub
+      char* tok = strtok (ports, ".");
+      while (tok && *tok != '-' && e.num_ports < (int) sizeof (e.port_numbers))
+        {
+          e.port_numbers[e.num_ports++] = atoi (tok);
+          tok = strtok (NULL, ".");
+        }
+
+      if (num == capacity)
+        {
+          capacity = (capacity)? 2 * capacity : 16;
+          struct liballuris_cache_entry* tmp = realloc (*entries, capacity * sizeof (e));
+          if (! tmp)
+            break;
+          *entries = tmp;
+        }
+      (*entries)[num++] = e;
+    }
+  fclose (f);
+  return num;
+}
 
 /*!
- * \brief Query next calibration date
- *
- * The returned int v is YYMM for example "1502" for February 2015
- * If the measurement is running, the next calibration date can't be read from the measurement processor
- * and LIBALLURIS_DEVICE_BUSY is returned instead.
+ * \brief Internal: merge entries into the cache file
  *
- * \param[in] dev_handle a handle for the device to communicate with
- * \param[out] v output location for the next calibration date. Only populated if the return code is 0.
- * \return 0 if successful else \ref liballuris_error.
+ * Existing entries with the same serial number or location are replaced. Known fmax and
+ * firmware of the same device at the same location are kept if the new entry doesn't have them.
+ * Writers are serialized with flock on PATH.lock, the file is replaced with an atomic rename
+ * so that readers don't need a lock.
  */
-int liballuris_get_next_calibration_date (libusb_device_handle *dev_handle, int* v)
+static void cache_store (const struct liballuris_cache_entry* new_entries, size_t num_new)
 {
-  out_buf[0] = 0x08;
-  out_buf[1] = 3;
-  out_buf[2] = 7;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 6, DEFAULT_RECEIVE_TIMEOUT);
-  if (ret == LIBALLURIS_SUCCESS)
+  char path[PATH_MAX];
+  if (! num_new || ! cache_path (path, sizeof (path)))
+    return;
+
+  char lock_path[PATH_MAX + 8];
+  snprintf (lock_path, sizeof (lock_path), "%s.lock", path);
+  int lock_fd = cache_open (lock_path, O_RDWR | O_CREAT);
+  if (lock_fd < 0)
+    return;
+  flock (lock_fd, LOCK_EX);
+
+  struct liballuris_cache_entry* entries;
+  size_t num = cache_read (path, &entries);
+
+  char tmp_path[PATH_MAX + 8];
+  snprintf (tmp_path, sizeof (tmp_path), "%s.XXXXXX", path);
+  int fd = mkstemp (tmp_path);
+  FILE* f = (fd < 0)? NULL : fdopen (fd, "w");
+  if (f)
     {
-      *v = char_to_int24 (in_buf + 3);
-      if (*v == -1)
-        return LIBALLURIS_DEVICE_BUSY;
+      fprintf (f, "# liballuris device cache: serial, bus, port path, fmax, firmware\n");
+      size_t k, j;
+      for (k=0; k < num; ++k)
+        {
+          for (j=0; j < num_new; ++j)
+            if (! strcmp (entries[k].serial_number, new_entries[j].serial_number)
+                || cache_same_location (&entries[k], &new_entries[j]))
+              break;
+          if (j == num_new)
+            cache_write_entry (f, &entries[k]);
+        }
+      for (j=0; j < num_new; ++j)
+        {
+          struct liballuris_cache_entry e = new_entries[j];
+          for (k=0; k < num && ! e.fmax; ++k)
+            if (! strcmp (entries[k].serial_number, e.serial_number) && cache_same_location (&entries[k], &e))
+              {
+                e.fmax = entries[k].fmax;
+                memcpy (e.firmware, entries[k].firmware, sizeof (e.firmware));
+              }
+          cache_write_entry (f, &e);
+        }
+      if (fclose (f) == 0)
+        rename (tmp_path, path);
+      else
+        unlink (tmp_path);
     }
-  return ret;
-}
-
-int liballuris_read_flash (libusb_device_handle *dev_handle, int adr, unsigned short *v)
-{
-  out_buf[0] = 0x72;
-  out_buf[1] = 4;
-  out_buf[2] = adr & 0xFF;
-  out_buf[3] = adr >> 8;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 4, DEFAULT_SEND_TIMEOUT, 6, DEFAULT_RECEIVE_TIMEOUT);
-  if (ret == LIBALLURIS_SUCCESS)
+  else if (fd >= 0)
     {
-      *v  = in_buf[5] << 8;
-      *v += in_buf[4];
+      close (fd);
+      unlink (tmp_path);
     }
-  return ret;
+
+  free (entries);
+  flock (lock_fd, LOCK_UN);
+  close (lock_fd);
 }
 
 /*!
- * \brief Query calibration date
- * Since firmware 5.04.005
- * The returned int v is days since year 2000
+ * \brief Lookup a device in the persistent device cache
  *
- * \param[in] dev_handle a handle for the device to communicate with
- * \param[out] v output location for the calibration date. May be partially populated if the return code is != 0.
- * \return 0 if successful else \ref liballuris_error.
+ * The cache maps serial numbers to the USB location (bus and port path) where the device was
+ * seen last, together with Fmax and firmware if they were queried. It's filled by
+ * \ref liballuris_get_device_list and \ref liballuris_open_device and shared between processes.
+ * The entry may be outdated, \ref liballuris_open_device verifies it before use.
+ * \param[in] serial_number of device
+ * \param[out] entry storage for the cached information
+ * \return 0 if successful, LIBUSB_ERROR_NOT_FOUND if there is no entry
+ * \sa liballuris_cache_clear
  */
-int liballuris_get_calibration_date (libusb_device_handle *dev_handle, unsigned short* v)
+int liballuris_cache_lookup (const char* serial_number, struct liballuris_cache_entry* entry)
 {
-  // see liballuris_get_calibration_number for flash organisation
-  return liballuris_read_flash (dev_handle, 0, v);
+  char path[PATH_MAX];
+  if (! cache_path (path, sizeof (path)))
+    return LIBUSB_ERROR_NOT_FOUND;
+
+  struct liballuris_cache_entry* entries;
+  size_t num = cache_read (path, &entries);
+  int ret = LIBUSB_ERROR_NOT_FOUND;
+  size_t k;
+  for (k=0; k < num && ret; ++k)
+    if (! strcmp (entries[k].serial_number, serial_number))
+      {
+        *entry = entries[k];
+        ret = LIBALLURIS_SUCCESS;
+      }
+  free (entries);
+  return ret;
 }
 
-//! Since firmware 5.04.005
-int liballuris_get_calibration_number (libusb_device_handle *dev_handle, char* buf, size_t length)
+//! Remove the persistent device cache file, see \ref liballuris_cache_lookup
+void liballuris_cache_clear (void)
 {
-  // PIC flash organisation
-  // word adr; word value (16bit)
-  // 0       ; cal_date, days since 1.1.2000, unsigned short
-  // 1..4    ; uncertainty, double
-  // 5..24   ; calibration_number as char[40]
+  char path[PATH_MAX];
+  if (cache_path (path, sizeof (path)))
+    unlink (path);
+}
 
-  if (length > 40)
-    length = 40;
-  // needs to be multiple of 2bytes (words)
-  if (length % 2)
-    return LIBALLURIS_OUT_OF_RANGE;
+/*!
+ * \brief Internal: open the device at the cached location and verify its serial number
+ *
+ * Needs one serial number query instead of probing all devices.
+ * \return 0 if successful, else the caller has to fall back to a full scan
+ */
+static int cache_open_device (libusb_context* ctx, const char* serial_number, libusb_device_handle** h)
+{
+  struct liballuris_cache_entry entry;
+  if (liballuris_cache_lookup (serial_number, &entry))
+    return LIBUSB_ERROR_NOT_FOUND;
+
+  libusb_device **devs;
+  ssize_t cnt = libusb_get_device_list (ctx, &devs);
+  if (cnt < 0)
+    return cnt;
 
-  unsigned int k, ret;
-  unsigned short *p = (unsigned short *) buf;
-  for (k=0; k<length/2; ++k)
+  int ret = LIBUSB_ERROR_NOT_FOUND;
+  ssize_t i;
+  for (i=0; i < cnt; ++i)
     {
-      ret = liballuris_read_flash (dev_handle, k + 5, p++);
-      if (ret != LIBALLURIS_SUCCESS)
+      struct liballuris_cache_entry location;
+      struct libusb_device_descriptor desc;
+      cache_set_location (&location, devs[i]);
+      if (! cache_same_location (&entry, &location) || ! is_alluris_device (devs[i], &desc))
+        continue;
+
+      ret = libusb_open (devs[i], h);
+      if (ret != LIBUSB_SUCCESS)
         break;
+
+      char buf[30];
+      ret = libusb_claim_interface (*h, 0);
+      if (ret == LIBUSB_SUCCESS)
+        {
+          ret = liballuris_get_serial_number (*h, buf, sizeof (buf));
+          libusb_release_interface (*h, 0);
+          if (ret == LIBALLURIS_SUCCESS && strcmp (buf, serial_number))
+            // another device was plugged in at this location
+            ret = LIBUSB_ERROR_NOT_FOUND;
+        }
+      if (ret != LIBUSB_SUCCESS)
+        libusb_close (*h);
+      break;
     }
+  libusb_free_device_list (devs, 1);
   return ret;
 }
 
-//! Since firmware 5.04.005
-int liballuris_get_uncertainty (libusb_device_handle *dev_handle, double* v)
+// Internal: store serial number and location of all listed devices
+static void cache_store_list (const struct alluris_device_description* alluris_devs, size_t length)
 {
-  // see liballuris_get_calibration_number for flash organisation
-  int k, ret;
-  unsigned short *p = (unsigned short *) v;
-  for (k=0; k<4; ++k)
+  struct liballuris_cache_entry* entries = calloc (length + 1, sizeof (struct liballuris_cache_entry));
+  if (! entries)
+    return;
+
+  size_t k, num = 0;
+  for (k=0; k < length; ++k)
+    if (alluris_devs[k].serial_number[0] && strcmp (alluris_devs[k].serial_number, "*BUSY*"))
+      {
+        memcpy (entries[num].serial_number, alluris_devs[k].serial_number, sizeof (entries[num].serial_number));
+        cache_set_location (&entries[num++], alluris_devs[k].dev);
+      }
+  cache_store (entries, num);
+  free (entries);
+}
+
+// Internal: query and store Fmax and firmware of a freshly opened (not claimed) device
+static void cache_store_details (libusb_device_handle* h, const char* serial_number)
+{
+  struct liballuris_cache_entry entry;
+  memset (&entry, 0, sizeof (entry));
+  snprintf (entry.serial_number, sizeof (entry.serial_number), "%s", serial_number);
+  cache_set_location (&entry, libusb_get_device (h));
+
+  if (libusb_claim_interface (h, 0) != LIBUSB_SUCCESS)
+    return;
+  char comm[21], meas[21];
+  if (   liballuris_get_F_max (h, &entry.fmax) == LIBALLURIS_SUCCESS
+      && liballuris_get_firmware (h, 0, comm, sizeof (comm)) == LIBALLURIS_SUCCESS
+      && liballuris_get_firmware (h, 1, meas, sizeof (meas)) == LIBALLURIS_SUCCESS)
     {
-      ret = liballuris_read_flash (dev_handle, k + 1, p++);
-      if (ret != LIBALLURIS_SUCCESS)
-        break;
+      snprintf (entry.firmware, sizeof (entry.firmware), "%s;%s", comm, meas);
+      cache_store (&entry, 1);
     }
-  return ret;
+  libusb_release_interface (h, 0);
+}
+
+//! Internal: arguments and result of one probe_device call in its own thread
+struct probe_job
+{
+  libusb_device* dev;
+  struct libusb_device_descriptor desc;
+  struct alluris_device_description result;
+  char read_serial;
+  int ret;
+  pthread_t thread;
+  char started;                             // thread was created and has to be joined
+  char notify;                              // registry: report the arrival
+};
+
+static void* probe_thread (void* arg)
+{
+  struct probe_job* job = arg;
+  job->ret = probe_device (job->dev, &job->desc, &job->result, job->read_serial);
+  return NULL;
 }
 
 /*!
- * \brief Query the number of digits for the interpretation of the raw fixed-point numbers
- *
- * All liballuris_get_* functions return fixed-point numbers or strings. This function queries the number
- * of digits after the radix point. For example if \ref liballuris_get_value returns 123 and digits returns 1
- * the real value is 12.3. Use \ref liballuris_get_unit to get a meaningful measurement.
- *
- * Query this value is only possible if the measurement is not running,
- * else LIBALLURIS_DEVICE_BUSY is returned.
+ * \brief Internal: run probe_device for all jobs in parallel
  *
- * \param[in] dev_handle a handle for the device to communicate with
- * \param[out] v output location for the returned number of digits. Only populated if the return code is 0.
- * \return 0 if successful else \ref liballuris_error
- * \sa liballuris_get_value
+ * Each device is probed in its own thread so that the time needed is about that of a
+ * single probe (open, claim, read serial) regardless of the number of devices.
  */
-int liballuris_get_digits (libusb_device_handle *dev_handle, int* v)
+static void run_probe_jobs (struct probe_job* jobs, size_t num_jobs)
 {
-  out_buf[0] = 0x08;
-  out_buf[1] = 3;
-  out_buf[2] = 3;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 6, DEFAULT_RECEIVE_TIMEOUT);
-  if (ret == LIBALLURIS_SUCCESS)
-    {
-      *v = char_to_int24 (in_buf + 3);
-      if (*v == -1)
-        return LIBALLURIS_DEVICE_BUSY;
-    }
-  return ret;
+  size_t k;
+  // a single device needs no thread, else probe inline if a thread can't be created
+  for (k=0; k < num_jobs; ++k)
+    if (num_jobs > 1)
+      jobs[k].started = ! pthread_create (&jobs[k].thread, NULL, probe_thread, &jobs[k]);
+
+  for (k=0; k < num_jobs; ++k)
+    if (jobs[k].started)
+      pthread_join (jobs[k].thread, NULL);
+    else
+      probe_thread (&jobs[k]);
 }
 
 /*!
- * \brief Query the resolution
- *
- * Since firmware 5.04.005
- *
- * The resolution as floating point number is 10^(-get_digits) * get_resolution.
- * Possible values for resolution are 1, 2, 5.
- *
- * Example: get_unit returns LIBALLURIS_UNIT_N, get_digit returns 2,
- * get_resolution returns 5 -> real resolution of 0.05N
- *
- * Query this value is only possible if the measurement is not running,
- * else LIBALLURIS_DEVICE_BUSY is returned.
- *
- * \param[in] dev_handle a handle for the device to communicate with
- * \param[out] v output location for the returned resolution. Only populated if the return code is 0.
- * \return 0 if successful else \ref liballuris_error
- * \sa liballuris_get_digits
+ * \brief Internal: enumerate and probe all compatible devices in parallel
+ * \param[in] ctx pointer to libusb context
+ * \param[in] read_serial try to read the serial from devices
+ * \param[out] list allocated array of accessible devices, every dev is referenced
+ * \return number of elements in list or \ref liballuris_error (<0)
  */
-
-int liballuris_get_resolution (libusb_device_handle *dev_handle, int* v)
+static int enumerate_devices (libusb_context* ctx, char read_serial, struct alluris_device_description** list)
 {
-  out_buf[0] = 0x08;
-  out_buf[1] = 3;
-  out_buf[2] = 16;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 6, DEFAULT_RECEIVE_TIMEOUT);
-  if (ret == LIBALLURIS_SUCCESS)
+  *list = NULL;
+  libusb_device **devs;
+  ssize_t cnt = libusb_get_device_list (ctx, &devs);
+  if (cnt < 0)
+    return cnt;
+
+  struct probe_job* jobs = calloc (cnt + 1, sizeof (struct probe_job));
+  if (! jobs)
     {
-      *v = char_to_int24 (in_buf + 3);
-      if (*v == -1)
-        return LIBALLURIS_DEVICE_BUSY;
+      libusb_free_device_list (devs, 1);
+      return LIBUSB_ERROR_NO_MEM;
     }
-  return ret;
+
+  size_t num_jobs = 0;
+  ssize_t i;
+  for (i=0; i < cnt; ++i)
+    if (is_alluris_device (devs[i], &jobs[num_jobs].desc))
+      {
+        struct probe_job* job = &jobs[num_jobs++];
+        job->dev = libusb_ref_device (devs[i]);
+        job->result.dev = job->dev;
+        job->read_serial = read_serial;
+      }
+  libusb_free_device_list (devs, 1);
+
+  run_probe_jobs (jobs, num_jobs);
+
+  size_t k, num_alluris_devices = 0;
+  for (k=0; k < num_jobs; ++k)
+    if (jobs[k].ret == LIBUSB_SUCCESS)
+      jobs[num_alluris_devices++].result = jobs[k].result;
+    else
+      //FIXME: what should we do with devices already in use?
+      libusb_unref_device (jobs[k].dev);
+
+  struct alluris_device_description* l = malloc ((num_alluris_devices + 1) * sizeof (struct alluris_device_description));
+  if (! l)
+    {
+      for (k=0; k < num_alluris_devices; ++k)
+        libusb_unref_device (jobs[k].result.dev);
+      free (jobs);
+      return LIBUSB_ERROR_NO_MEM;
+    }
+  for (k=0; k < num_alluris_devices; ++k)
+    l[k] = jobs[k].result;
+  free (jobs);
+  if (read_serial)
+    cache_store_list (l, num_alluris_devices);
+  *list = l;
+  return num_alluris_devices;
 }
 
 /*!
- * \brief Query the maximum force of the device
+ * \brief List accessible alluris devices
  *
- * Query this value is only possible if the measurement is not running,
- * else LIBALLURIS_DEVICE_BUSY is returned.
+ * The product field in alluris_device_description is filled via the USB descriptor.
+ * After this the device is opened and the serial_number is read from the device.
+ * Thus this function only lists devices where the application has sufficient rights to open
+ * and read from the device. Check permissions if a device isn't returned.
  *
- * \param[in] dev_handle a handle for the device to communicate with
- * \param[out] fmax output location for the returned max force. Only populated if the return code is 0.
- * \return 0 if successful else \ref liballuris_error
- * \sa liballuris_get_unit
- * \sa liballuris_get_digits
+ * At most length devices are returned, use \ref liballuris_get_device_list_alloc to get all devices.
+ * The retrieved list has to be freed with \ref liballuris_free_device_list before the application exits.
+ * Applications which open devices repeatedly should consider a \ref liballuris_registry instead.
+ * \param[in] ctx pointer to libusb context
+ * \param[out] alluris_devs pointer to storage for the device list
+ * \param[in] length number of elements in alluris_devs
+ * \param[in] read_serial try to read the serial from devices
+ * \return number of devices found if successful else \ref liballuris_error
+ * \sa liballuris_free_device_list
  */
-int liballuris_get_F_max (libusb_device_handle *dev_handle, int* fmax)
+int liballuris_get_device_list (libusb_context* ctx, struct alluris_device_description* alluris_devs, size_t length, char read_serial)
 {
-  out_buf[0] = 0x08;
-  out_buf[1] = 3;
-  out_buf[2] = 2;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 6, DEFAULT_RECEIVE_TIMEOUT);
-  if (ret == LIBALLURIS_SUCCESS)
-    {
-      *fmax = char_to_int24 (in_buf + 3);
-      if (*fmax == -1)
-        return LIBALLURIS_DEVICE_BUSY;
-    }
-  return ret;
+  size_t k = 0;
+  for (k=0; k<length; ++k)
+    alluris_devs[k].dev = NULL;
+
+  struct alluris_device_description* list;
+  int cnt = enumerate_devices (ctx, read_serial, &list);
+  if (cnt < 0)
+    return cnt;
+
+  size_t num_alluris_devices = ((size_t) cnt < length)? (size_t) cnt : length;
+  for (k=0; k < num_alluris_devices; ++k)
+    alluris_devs[k] = list[k];
+  // maximum number of devices reached, drop the rest
+  for (; k < (size_t) cnt; ++k)
+    libusb_unref_device (list[k].dev);
+  free (list);
+  return num_alluris_devices;
 }
 
 /*!
- * \brief Query the current measurement value
- *
- * \param[in] dev_handle a handle for the device to communicate with
- * \param[out] value output location for the measurement value. Only populated if the return code is 0.
- * \return 0 if successful else \ref liballuris_error
- * \sa liballuris_get_unit
- * \sa liballuris_get_digits
+ * \brief Free list filled from get_alluris_device_list
  */
-int liballuris_get_value (libusb_device_handle *dev_handle, int* value)
+void liballuris_free_device_list (struct alluris_device_description* alluris_devs, size_t length)
 {
-  out_buf[0] = 0x46;
-  out_buf[1] = 3;
-  out_buf[2] = 3;
-  // worst execution time = 0.466s
-  // when P13=1Hz (effectively 2Hz) and mode=0 (10Hz)
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 6, 700);
-  if (ret == LIBALLURIS_SUCCESS)
-    *value = char_to_int24 (in_buf + 3);
-  return ret;
+  size_t k = 0;
+  for (k=0; k < length; ++k)
+    if (alluris_devs[k].dev)
+      {
+        libusb_unref_device (alluris_devs[k].dev);
+        alluris_devs[k].dev = NULL;
+      }
 }
 
 /*!
- * \brief Query positive peak value
+ * \brief List all accessible alluris devices in an allocated array
  *
- * \param[in] dev_handle a handle for the device to communicate with
- * \param[out] peak output location for the peak value. Only populated if the return code is 0.
- * \return 0 if successful else \ref liballuris_error
- * \sa liballuris_get_unit
- * \sa liballuris_get_digits
+ * Same as \ref liballuris_get_device_list without a limit on the number of devices.
+ * The devices are probed in parallel.
+ * \param[in] ctx pointer to libusb context
+ * \param[out] alluris_devs storage for the allocated list, NULL if none was found
+ * \param[in] read_serial try to read the serial from devices
+ * \return number of devices in alluris_devs if successful else \ref liballuris_error (<0)
+ * \sa liballuris_release_device_list
  */
-int liballuris_get_pos_peak (libusb_device_handle *dev_handle, int* peak)
+int liballuris_get_device_list_alloc (libusb_context* ctx, struct alluris_device_description** alluris_devs, char read_serial)
 {
-  out_buf[0] = 0x46;
-  out_buf[1] = 3;
-  out_buf[2] = 4;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 6, DEFAULT_RECEIVE_TIMEOUT);
-  if (ret == LIBALLURIS_SUCCESS)
-    *peak = char_to_int24 (in_buf + 3);
-  return ret;
+  int cnt = enumerate_devices (ctx, read_serial, alluris_devs);
+  if (cnt == 0)
+    {
+      free (*alluris_devs);
+      *alluris_devs = NULL;
+    }
+  return cnt;
 }
 
 /*!
- * \brief Query negative peak value
- *
- * \param[in] dev_handle a handle for the device to communicate with
- * \param[out] peak output location for the peak value. Only populated if the return code is 0.
- * \return 0 if successful else \ref liballuris_error
- * \sa liballuris_get_unit
- * \sa liballuris_get_digits
+ * \brief Unreference all devices and free a list from \ref liballuris_get_device_list_alloc
+ * \param[in] alluris_devs list, may be NULL
+ * \param[in] length number of devices returned by \ref liballuris_get_device_list_alloc
  */
-int liballuris_get_neg_peak (libusb_device_handle *dev_handle, int* peak)
+void liballuris_release_device_list (struct alluris_device_description* alluris_devs, size_t length)
 {
-  out_buf[0] = 0x46;
-  out_buf[1] = 3;
-  out_buf[2] = 5;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 6, DEFAULT_RECEIVE_TIMEOUT);
-  if (ret == LIBALLURIS_SUCCESS)
-    *peak = char_to_int24 (in_buf + 3);
-  return ret;
+  if (! alluris_devs)
+    return;
+  liballuris_free_device_list (alluris_devs, length);
+  free (alluris_devs);
 }
 
 /*!
- * \brief Query the current state of the device
+ * \brief Open device with specified serial_number or the first available if NULL
  *
- * \param[in] dev_handle a handle for the device to communicate with
- * \param[out] state output location for the state. Only populated if the return code is 0.
+ * If the serial number is in the persistent device cache, only the device at the cached location
+ * is opened and its serial number verified. Else all compatible devices are probed in parallel
+ * and the cache is updated.
+ * \param[in] ctx pointer to libusb context
+ * \param[in] serial_number of device or NULL
+ * \param[out] h storage for handle to communicate with the device
  * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_registry_open_device
  */
-int liballuris_read_state (libusb_device_handle *dev_handle, struct liballuris_state* state)
+int liballuris_open_device (libusb_context* ctx, const char* serial_number, libusb_device_handle** h)
 {
-  out_buf[0] = 0x46;
-  out_buf[1] = 3;
-  out_buf[2] = 2;
+  // try the location from the persistent cache first, see liballuris_cache_lookup
+  if (serial_number && cache_open_device (ctx, serial_number, h) == LIBUSB_SUCCESS)
+    return LIBUSB_SUCCESS;
 
-  // worst execution time = 0.47s
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 6, 705);
-  if (ret == LIBALLURIS_SUCCESS)
+  int k;
+  libusb_device *dev = NULL;
+  struct alluris_device_description* alluris_devs;
+  int cnt = enumerate_devices (ctx, (serial_number != NULL), &alluris_devs);
+#ifdef PRINT_DEBUG_MSG
+  printf ("liballuris_open_device cnt = %i\n", cnt);
+#endif
+  if (cnt < 0)
+    return cnt;
+
+  if (cnt >= 1)
     {
-      union __liballuris_state__ tmp;
-      tmp._int = char_to_int24 (in_buf + 3);
-      *state = tmp.bits;
+      if (serial_number == NULL)
+        dev = alluris_devs[0].dev;
+      else
+        for (k=0; k < cnt; k++)
+          if (! strncmp (serial_number, alluris_devs[k].serial_number, sizeof (alluris_devs[0].serial_number)))
+            dev = alluris_devs[k].dev;
     }
+
+  int ret = (dev)? libusb_open (dev, h) : LIBUSB_ERROR_NOT_FOUND;
+  if (ret == LIBUSB_SUCCESS && serial_number)
+    cache_store_details (*h, serial_number);
+  liballuris_release_device_list (alluris_devs, cnt);
   return ret;
 }
 
-//! Print state to stdout
-void liballuris_print_state (struct liballuris_state state)
-{
-  printf ("[%c] upper limit exceeded\n",               (state.upper_limit_exceeded)? 'X': ' ');
-  printf ("[%c] lower limit underrun\n",               (state.lower_limit_underrun)? 'X': ' ');
-  printf ("[%c] peak  mode active\n",                  (state.some_peak_mode_active)? 'X': ' ');
-  printf ("[%c] peak+ mode active\n",                  (state.peak_plus_active)? 'X': ' ');
-  printf ("[%c] peak- mode active\n",                  (state.peak_minus_active)? 'X': ' ');
-  printf ("[%c] Store to memory in progress\n",        (state.mem_running)? 'X': ' ');
-  printf ("[%c] overload (abs(F) > 150%%)\n",          (state.overload)? 'X': ' ');
-  printf ("[%c] fracture detected (only W20/W40)\n",   (state.fracture)? 'X': ' ');
-  printf ("[%c] mem active (P21=1 or P21=2)\n",        (state.mem_active)? 'X': ' ');
-  printf ("[%c] mem-conti (store with displayrate)\n", (state.mem_conti)? 'X': ' ');
-  printf ("[%c] grenz_option\n",                       (state.grenz_option)? 'X': ' ');
-  printf ("[%c] measurement running\n",                (state.measuring)? 'X': ' ');
-}
 
 /*!
- * \brief Enable or disable cyclic measurements
+ * \brief Open device with specified bus and device id.
  *
- * \param[in] dev_handle a handle for the device to communicate with
- * \param[in] enable
- * \param[in] length 1..19
+ * Other devices are not touched.
+ * \param[in] ctx pointer to libusb context
+ * \param[in] bus id of device
+ * \param[in] device id of device
+ * \param[out] h storage for handle to communicate with the device
  * \return 0 if successful else \ref liballuris_error
  */
-int liballuris_cyclic_measurement (libusb_device_handle *dev_handle, char enable, size_t length)
+int liballuris_open_device_with_id (libusb_context* ctx, int bus, int device, libusb_device_handle** h)
 {
-  if (length < 1 || length > 19)
+  libusb_device **devs;
+  ssize_t cnt = libusb_get_device_list (ctx, &devs);
+  if (cnt < 0)
+    return cnt;
+
+  int ret = LIBUSB_ERROR_NOT_FOUND;
+  ssize_t i;
+  for (i=0; i < cnt; ++i)
+    {
+      struct libusb_device_descriptor desc;
+      if (   libusb_get_bus_number (devs[i]) == bus
+          && libusb_get_device_address (devs[i]) == device
+          && is_alluris_device (devs[i], &desc))
+        {
+          ret = libusb_open (devs[i], h);
+          break;
+        }
+    }
+  libusb_free_device_list (devs, 1);
+  return ret;
+}
+
+/*!
+ * \brief Initialize a device context for an already opened handle
+ *
+ * The caller keeps ownership of dev_handle (and the claimed interface), \ref liballuris_device_close
+ * only frees the context. All liballuris_device_* functions are serialized per context
+ * and can be called from multiple threads.
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[out] dev storage for the new device context
+ * \return 0 if successful else \ref liballuris_error
+ */
+int liballuris_device_wrap (libusb_device_handle* dev_handle, struct liballuris_device** dev)
+{
+  struct liballuris_device* d = malloc (sizeof (struct liballuris_device));
+  if (! d)
+    return LIBUSB_ERROR_NO_MEM;
+
+  device_init_transient (d, dev_handle);
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init (&attr);
+  // composite operations (for example set_upper_limit -> read_state) lock again
+  pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE);
+  int r = pthread_mutex_init (&d->lock, &attr);
+  pthread_mutexattr_destroy (&attr);
+  if (r)
+    {
+      free (d);
+      return LIBUSB_ERROR_OTHER;
+    }
+  d->thread_safe = 1;
+  *dev = d;
+  return LIBALLURIS_SUCCESS;
+}
+
+// Internal: wrap a fresh handle, claim interface 0 and take ownership
+static int device_from_handle (libusb_device_handle* h, struct liballuris_device** dev)
+{
+  int r = libusb_claim_interface (h, 0);
+  if (r == LIBUSB_SUCCESS)
+    {
+      r = liballuris_device_wrap (h, dev);
+      if (r == LIBALLURIS_SUCCESS)
+        {
+          (*dev)->owns_handle = 1;
+          return r;
+        }
+      libusb_release_interface (h, 0);
+    }
+  libusb_close (h);
+  return r;
+}
+
+/*!
+ * \brief Open device with specified serial_number (or the first available if NULL) as device context
+ *
+ * The interface is claimed and the returned context owns the handle.
+ * \param[in] ctx pointer to libusb context
+ * \param[in] serial_number of device or NULL
+ * \param[out] dev storage for the new device context
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_open_device, liballuris_device_close
+ */
+int liballuris_device_open (libusb_context* ctx, const char* serial_number, struct liballuris_device** dev)
+{
+  libusb_device_handle* h;
+  int r = liballuris_open_device (ctx, serial_number, &h);
+  if (r != LIBUSB_SUCCESS)
+    return r;
+
+  r = device_from_handle (h, dev);
+  struct liballuris_cache_entry entry;
+  if (r == LIBALLURIS_SUCCESS && serial_number)
+    {
+      snprintf ((*dev)->serial_number, sizeof ((*dev)->serial_number), "%s", serial_number);
+      // Fmax is fixed for a device, take it from the persistent cache
+      if (! liballuris_cache_lookup (serial_number, &entry) && entry.fmax > 0)
+        {
+          (*dev)->cache.fmax = entry.fmax;
+          (*dev)->cache_valid |= DEVICE_CACHE_FMAX;
+        }
+    }
+  return r;
+}
+
+/*!
+ * \brief Open device with specified bus and device id as device context
+ * \param[in] ctx pointer to libusb context
+ * \param[in] bus id of device
+ * \param[in] device id of device
+ * \param[out] dev storage for the new device context
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_open_device_with_id, liballuris_device_close
+ */
+int liballuris_device_open_with_id (libusb_context* ctx, int bus, int device, struct liballuris_device** dev)
+{
+  libusb_device_handle* h;
+  int r = liballuris_open_device_with_id (ctx, bus, device, &h);
+  if (r != LIBUSB_SUCCESS)
+    return r;
+
+  return device_from_handle (h, dev);
+}
+
+static int async_free (struct liballuris_device* dev);
+
+/*!
+ * \brief Free a device context
+ *
+ * If the context was created with \ref liballuris_device_open or \ref liballuris_device_open_with_id
+ * the interface is released and the handle closed, contexts of \ref liballuris_device_open_transport
+ * close their transport.
+ * Asynchronous commands have to be completed or cancelled before, see \ref liballuris_device_cancel_commands.
+ * \param[in] dev device context, may be NULL
+ */
+void liballuris_device_close (struct liballuris_device* dev)
+{
+  if (! dev)
+    return;
+  if (async_free (dev))
+    return;
+  if (dev->owns_handle && is_transport_handle (dev->dev_handle))
+    liballuris_close_transport (dev->dev_handle);
+  else if (dev->owns_handle)
+    {
+      liballuris_record_stop (dev->dev_handle);
+      libusb_release_interface (dev->dev_handle, 0);
+      libusb_close (dev->dev_handle);
+    }
+  if (dev->thread_safe)
+    pthread_mutex_destroy (&dev->lock);
+  free (dev);
+}
+
+//! Return the libusb handle of a device context, for example for \ref liballuris_stream_open
+libusb_device_handle* liballuris_device_get_handle (struct liballuris_device* dev)
+{
+  return dev->dev_handle;
+}
+
+/*!
+ * \brief Set the timeouts used for command transfers of this context
+ * \param[in] dev device context
+ * \param[in] send_timeout in ms, default DEFAULT_SEND_TIMEOUT
+ * \param[in] receive_timeout in ms, default DEFAULT_RECEIVE_TIMEOUT
+ */
+void liballuris_device_set_timeouts (struct liballuris_device* dev, unsigned int send_timeout, unsigned int receive_timeout)
+{
+  device_lock (dev);
+  dev->send_timeout = send_timeout;
+  dev->receive_timeout = receive_timeout;
+  device_unlock (dev, 0);
+}
+
+/****************************************************************************************/
+// device registry
+
+//! Internal: one Alluris device known to a \ref liballuris_registry
+struct registry_entry
+{
+  struct alluris_device_description desc;   // desc.dev is referenced
+  struct libusb_device_descriptor usb_desc;
+  char probed;                              // product and serial_number are valid
+  char notified;                            // arrival was reported to the callback
+  char gone;                                // device left, remove in liballuris_registry_update
+};
+
+/*!
+ * \brief Device registry kept current by libusb hotplug events
+ *
+ * The hotplug callback runs inside libusb event handling where no synchronous transfers are
+ * allowed. It only records arrivals and departures, the devices are probed for product and
+ * serial number in \ref liballuris_registry_update.
+ */
+struct liballuris_registry
+{
+  libusb_context* ctx;
+  pthread_mutex_t lock;                     // protects entries, never held during I/O
+  char hotplug;                             // hotplug callback is registered, else rescan on update
+  libusb_hotplug_callback_handle cb_handle;
+  liballuris_registry_cb cb;
+  void* user_data;
+  size_t num_entries;
+  size_t capacity;
+  struct registry_entry* entries;
+};
+
+// Internal: append a referenced device, reg->lock has to be held
+static void registry_add (struct liballuris_registry* reg, libusb_device* dev, const struct libusb_device_descriptor* desc)
+{
+  size_t k;
+  for (k=0; k < reg->num_entries; ++k)
+    if (reg->entries[k].desc.dev == dev && ! reg->entries[k].gone)
+      return;
+
+  if (reg->num_entries == reg->capacity)
+    {
+      size_t capacity = (reg->capacity)? 2 * reg->capacity : MAX_NUM_DEVICES;
+      struct registry_entry* tmp = realloc (reg->entries, capacity * sizeof (struct registry_entry));
+      if (! tmp)
+        return;
+      reg->entries = tmp;
+      reg->capacity = capacity;
+    }
+  struct registry_entry* e = &reg->entries[reg->num_entries++];
+  memset (e, 0, sizeof (*e));
+  e->desc.dev = libusb_ref_device (dev);
+  e->usb_desc = *desc;
+}
+
+// Internal: mark a device as gone, reg->lock has to be held
+static void registry_remove (struct liballuris_registry* reg, libusb_device* dev)
+{
+  size_t k;
+  for (k=0; k < reg->num_entries; ++k)
+    if (reg->entries[k].desc.dev == dev)
+      reg->entries[k].gone = 1;
+}
+
+static int LIBUSB_CALL registry_hotplug_cb (libusb_context* ctx, libusb_device* dev, libusb_hotplug_event event, void* user_data)
+{
+  (void) ctx;
+  struct liballuris_registry* reg = user_data;
+  struct libusb_device_descriptor desc;
+
+  pthread_mutex_lock (&reg->lock);
+  if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+    {
+      if (is_alluris_device (dev, &desc))
+        registry_add (reg, dev, &desc);
+    }
+  else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+    registry_remove (reg, dev);
+  pthread_mutex_unlock (&reg->lock);
+  return 0; // keep the callback registered
+}
+
+// Internal: fallback for platforms without hotplug support, diff against the current device list
+static void registry_rescan (struct liballuris_registry* reg)
+{
+  libusb_device **devs;
+  ssize_t cnt = libusb_get_device_list (reg->ctx, &devs);
+  if (cnt < 0)
+    return;
+
+  pthread_mutex_lock (&reg->lock);
+  size_t k;
+  ssize_t i;
+  for (k=0; k < reg->num_entries; ++k)
+    {
+      for (i=0; i < cnt; ++i)
+        if (devs[i] == reg->entries[k].desc.dev)
+          break;
+      if (i == cnt)
+        reg->entries[k].gone = 1;
+    }
+  for (i=0; i < cnt; ++i)
+    {
+      struct libusb_device_descriptor desc;
+      if (is_alluris_device (devs[i], &desc))
+        registry_add (reg, devs[i], &desc);
+    }
+  pthread_mutex_unlock (&reg->lock);
+  libusb_free_device_list (devs, 1);
+}
+
+/*!
+ * \brief Create a device registry
+ *
+ * If libusb supports hotplug, a callback for the Alluris vendor id is registered with
+ * LIBUSB_HOTPLUG_ENUMERATE and the registry follows plug and unplug events as long as libusb
+ * events are handled (by the application or by \ref liballuris_registry_update).
+ * Else the bus is rescanned in every \ref liballuris_registry_update.
+ *
+ * cb (may be NULL) is called from \ref liballuris_registry_update, never from within libusb
+ * event handling, with arrived = 1 after a new device was probed and arrived = 0 after it was unplugged.
+ * \param[in] ctx pointer to libusb context
+ * \param[in] cb notification callback or NULL
+ * \param[in] user_data passed to cb
+ * \param[out] reg storage for the new registry, NULL if the initial update failed
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_registry_close, liballuris_registry_open_device
+ */
+int liballuris_registry_open (libusb_context* ctx, liballuris_registry_cb cb, void* user_data, struct liballuris_registry** reg)
+{
+  struct liballuris_registry* r = calloc (1, sizeof (struct liballuris_registry));
+  if (! r)
+    return LIBUSB_ERROR_NO_MEM;
+
+  if (pthread_mutex_init (&r->lock, NULL))
+    {
+      free (r);
+      return LIBUSB_ERROR_OTHER;
+    }
+  r->ctx = ctx;
+  r->cb = cb;
+  r->user_data = user_data;
+
+  if (libusb_has_capability (LIBUSB_CAP_HAS_HOTPLUG))
+    {
+      int ret = libusb_hotplug_register_callback (ctx,
+                LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                LIBUSB_HOTPLUG_ENUMERATE, 0x04d8, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+                registry_hotplug_cb, r, &r->cb_handle);
+      r->hotplug = (ret == LIBUSB_SUCCESS);
+    }
+
+  int ret = liballuris_registry_update (r);
+  if (ret < 0)
+    {
+      liballuris_registry_close (r);
+      *reg = NULL;
+      return ret;
+    }
+  *reg = r;
+  return LIBALLURIS_SUCCESS;
+}
+
+/*!
+ * \brief Free a registry and release all references to devices
+ * \param[in] reg registry, may be NULL
+ */
+void liballuris_registry_close (struct liballuris_registry* reg)
+{
+  if (! reg)
+    return;
+  if (reg->hotplug)
+    libusb_hotplug_deregister_callback (reg->ctx, reg->cb_handle);
+
+  size_t k;
+  for (k=0; k < reg->num_entries; ++k)
+    libusb_unref_device (reg->entries[k].desc.dev);
+  free (reg->entries);
+  pthread_mutex_destroy (&reg->lock);
+  free (reg);
+}
+
+/*!
+ * \brief Process pending arrivals and departures
+ *
+ * Dispatches pending libusb events without blocking (or rescans the bus if hotplug isn't
+ * supported), removes unplugged devices and probes new devices for product and serial number.
+ * Devices which were busy (measuring or claimed by another process) are probed again on the next call.
+ * The notification callback is called from here.
+ * \param[in] reg registry
+ * \return number of known devices or \ref liballuris_error (<0)
+ */
+int liballuris_registry_update (struct liballuris_registry* reg)
+{
+  if (reg->hotplug)
+    {
+      struct timeval tv = {0, 0};
+      int r = libusb_handle_events_timeout_completed (reg->ctx, &tv, NULL);
+      if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+        return r;
+    }
+  else
+    registry_rescan (reg);
+
+  size_t k;
+  pthread_mutex_lock (&reg->lock);
+  for (k=0; k < reg->num_entries;)
+    {
+      struct registry_entry e = reg->entries[k];
+      if (! e.gone)
+        {
+          k++;
+          continue;
+        }
+      // remove entry and notify without holding the lock
+      memmove (reg->entries + k, reg->entries + k + 1, (--reg->num_entries - k) * sizeof (struct registry_entry));
+      pthread_mutex_unlock (&reg->lock);
+      if (e.notified && reg->cb)
+        reg->cb (&e.desc, 0, reg->user_data);
+      libusb_unref_device (e.desc.dev);
+      pthread_mutex_lock (&reg->lock);
+      k = 0;
+    }
+
+  // probe new devices in parallel, the lock is released during I/O so that hotplug events are not blocked
+  size_t num_jobs = 0;
+  struct probe_job* jobs = calloc (reg->num_entries + 1, sizeof (struct probe_job));
+  if (! jobs)
+    {
+      pthread_mutex_unlock (&reg->lock);
+      return LIBUSB_ERROR_NO_MEM;
+    }
+  for (k=0; k < reg->num_entries; ++k)
+    {
+      struct registry_entry* e = &reg->entries[k];
+      if (e->probed || e->gone)
+        continue;
+      jobs[num_jobs].dev = libusb_ref_device (e->desc.dev);
+      jobs[num_jobs].desc = e->usb_desc;
+      jobs[num_jobs].result.dev = e->desc.dev;
+      jobs[num_jobs].read_serial = 1;
+      num_jobs++;
+    }
+  pthread_mutex_unlock (&reg->lock);
+
+  run_probe_jobs (jobs, num_jobs);
+
+  pthread_mutex_lock (&reg->lock);
+  size_t j;
+  for (j=0; j < num_jobs; ++j)
+    {
+      struct probe_job* job = &jobs[j];
+      char probed = (job->ret == LIBUSB_SUCCESS && strcmp (job->result.serial_number, "*BUSY*"));
+      // the entries may have been reallocated or reordered meanwhile
+      for (k=0; k < reg->num_entries; ++k)
+        if (reg->entries[k].desc.dev == job->dev)
+          break;
+      if (k == reg->num_entries)
+        continue;
+
+      struct registry_entry* e = &reg->entries[k];
+      if (job->ret == LIBUSB_SUCCESS)
+        {
+          memcpy (e->desc.product, job->result.product, sizeof (e->desc.product));
+          memcpy (e->desc.serial_number, job->result.serial_number, sizeof (e->desc.serial_number));
+        }
+      e->probed = probed;
+      if (probed && ! e->notified && ! e->gone)
+        job->notify = e->notified = 1;
+    }
+  pthread_mutex_unlock (&reg->lock);
+
+  for (j=0; j < num_jobs; ++j)
+    {
+      if (jobs[j].notify && reg->cb)
+        reg->cb (&jobs[j].result, 1, reg->user_data);
+      libusb_unref_device (jobs[j].dev);
+    }
+  free (jobs);
+
+  pthread_mutex_lock (&reg->lock);
+  int cnt = reg->num_entries;
+  pthread_mutex_unlock (&reg->lock);
+  return cnt;
+}
+
+/*!
+ * \brief Copy the known devices into alluris_devs
+ *
+ * Same as \ref liballuris_get_device_list but without enumeration and I/O if nothing changed.
+ * serial_number is "*BUSY*" for devices which couldn't be queried yet.
+ * The list has to be freed with \ref liballuris_free_device_list.
+ * \param[in] reg registry
+ * \param[out] alluris_devs pointer to storage for the device list
+ * \param[in] length number of elements in alluris_devs
+ * \return number of devices copied or \ref liballuris_error (<0)
+ */
+int liballuris_registry_get_list (struct liballuris_registry* reg, struct alluris_device_description* alluris_devs, size_t length)
+{
+  int r = liballuris_registry_update (reg);
+  if (r < 0)
+    return r;
+
+  size_t k, cnt = 0;
+  for (k=0; k<length; ++k)
+    alluris_devs[k].dev = NULL;
+
+  pthread_mutex_lock (&reg->lock);
+  for (k=0; k < reg->num_entries && cnt < length; ++k)
+    {
+      struct alluris_device_description* d = &reg->entries[k].desc;
+      if (reg->entries[k].gone || ! d->product[0])
+        continue; // not yet probed or not accessible
+      alluris_devs[cnt] = *d;
+      if (! reg->entries[k].probed)
+        strcpy (alluris_devs[cnt].serial_number, "*BUSY*");
+      libusb_ref_device (d->dev);
+      cnt++;
+    }
+  pthread_mutex_unlock (&reg->lock);
+  return cnt;
+}
+
+// Internal: find a probed device by serial (or the first one if NULL) and reference it
+static libusb_device* registry_lookup (struct liballuris_registry* reg, const char* serial_number)
+{
+  libusb_device* dev = NULL;
+  size_t k;
+  pthread_mutex_lock (&reg->lock);
+  for (k=0; k < reg->num_entries && ! dev; ++k)
+    {
+      struct registry_entry* e = &reg->entries[k];
+      if (e->gone || ! e->desc.product[0] || (serial_number && ! e->probed))
+        continue;
+      if (! serial_number || ! strncmp (serial_number, e->desc.serial_number, sizeof (e->desc.serial_number)))
+        dev = libusb_ref_device (e->desc.dev);
+    }
+  pthread_mutex_unlock (&reg->lock);
+  return dev;
+}
+
+/*!
+ * \brief Open device with specified serial_number (or the first available if NULL) via registry lookup
+ *
+ * The USB bus is only touched if the serial number is unknown, in this case
+ * \ref liballuris_registry_update is called once before giving up.
+ * \param[in] reg registry
+ * \param[in] serial_number of device or NULL
+ * \param[out] h storage for handle to communicate with the device
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_open_device
+ */
+int liballuris_registry_open_device (struct liballuris_registry* reg, const char* serial_number, libusb_device_handle** h)
+{
+  libusb_device* dev = registry_lookup (reg, serial_number);
+  if (! dev)
+    {
+      int r = liballuris_registry_update (reg);
+      if (r < 0)
+        return r;
+      dev = registry_lookup (reg, serial_number);
+    }
+  if (! dev)
+    //no device found
+    return LIBUSB_ERROR_NOT_FOUND;
+
+  int ret = libusb_open (dev, h);
+  if (ret == LIBUSB_ERROR_NO_DEVICE)
+    {
+      // unplugged and the hotplug event wasn't handled yet
+      pthread_mutex_lock (&reg->lock);
+      registry_remove (reg, dev);
+      pthread_mutex_unlock (&reg->lock);
+    }
+  libusb_unref_device (dev);
+  return ret;
+}
+
+/*!
+ * \brief Open device with specified serial_number (or the first available if NULL) as device context via registry lookup
+ * \param[in] reg registry
+ * \param[in] serial_number of device or NULL
+ * \param[out] dev storage for the new device context
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_device_open, liballuris_registry_open_device
+ */
+int liballuris_registry_device_open (struct liballuris_registry* reg, const char* serial_number, struct liballuris_device** dev)
+{
+  libusb_device_handle* h;
+  int r = liballuris_registry_open_device (reg, serial_number, &h);
+  if (r != LIBUSB_SUCCESS)
+    return r;
+
+  r = device_from_handle (h, dev);
+  if (r == LIBALLURIS_SUCCESS && serial_number)
+    snprintf ((*dev)->serial_number, sizeof ((*dev)->serial_number), "%s", serial_number);
+  return r;
+}
+
+/*!
+ * \brief Clear receive buffer
+ *
+ * Try to read 64 bytes from receive endpoint to clear the USB receive queue after some error.
+ * There is no error if a timeout occurs.
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[in] timeout read timeout
+ */
+void liballuris_clear_RX (libusb_device_handle* dev_handle, unsigned int timeout)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  liballuris_device_clear_RX (&dev, timeout);
+}
+
+//! Thread-safe variant of \ref liballuris_clear_RX operating on a device context
+void liballuris_device_clear_RX (struct liballuris_device* dev, unsigned int timeout)
+{
+  unsigned char data[64];
+  int actual;
+  device_lock (dev);
+#ifdef PRINT_DEBUG_MSG
+  int r = device_transfer (dev, 0x81 | LIBUSB_ENDPOINT_IN, data, 64, &actual, timeout);
+  printf ("clear_RX: libusb_interrupt_transfer returned '%s', actual = %i\n", libusb_error_name(r), actual);
+#else
+  device_transfer (dev, 0x81 | LIBUSB_ENDPOINT_IN, data, 64, &actual, timeout);
+#endif
+  device_unlock (dev, 0);
+}
+
+/*!
+ * \brief Query the serial number
+ *
+ * Return the serial number of the device which is also laser-engraved on the back.
+ * For example "P.25412"
+ *
+ * Query the serial number is only possible if the measurement is not running,
+ * else LIBALLURIS_DEVICE_BUSY is returned.
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[out] buf output location for the serial number. Only populated if the return code is 0.
+ * \param[in] length length of buffer in bytes
+ * \return 0 if successful else \ref liballuris_error. LIBALLURIS_DEVICE_BUSY if measurement is running
+ */
+int liballuris_get_serial_number (libusb_device_handle *dev_handle, char* buf, size_t length)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_serial_number (&dev, buf, length);
+}
+
+//! Thread-safe variant of \ref liballuris_get_serial_number operating on a device context
+int liballuris_device_get_serial_number (struct liballuris_device *dev, char* buf, size_t length)
+{
+  int ret = LIBALLURIS_SUCCESS;
+  device_lock (dev);
+  // the serial number never changes, so it's only queried once per context
+  if (! dev->serial_number[0])
+    {
+      dev->out_buf[0] = 0x08;
+      dev->out_buf[1] = 3;
+      dev->out_buf[2] = 6;
+      ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 6, dev->receive_timeout);
+      if (ret == LIBALLURIS_SUCCESS)
+        {
+          unsigned short tmp = char_to_uint16 (dev->in_buf + 3);
+          if (tmp == 65535)
+            return device_unlock (dev, LIBALLURIS_DEVICE_BUSY);
+          else
+            snprintf (dev->serial_number, sizeof (dev->serial_number), "%c.%i", dev->in_buf[5] + 'A', tmp);
+        }
+    }
+  if (ret == LIBALLURIS_SUCCESS)
+    snprintf (buf, length, "%s", dev->serial_number);
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Query firmware version
+ *
+ * The returned string in buf is for example "V5.03.009"
+ * If the measurement is running, the firmware can't be read from the measurement processor
+ * and "V255.255.255" is returned instead.
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[in] processor 0=USB communication processor, 1=measurement processor
+ * \param[out] buf output location for the firmware string. Only populated if the return code is 0.
+ * \param[in] length length of buffer in bytes
+ * \return 0 if successful else \ref liballuris_error.
+ */
+int liballuris_get_firmware (libusb_device_handle *dev_handle, int processor, char* buf, size_t length)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_firmware (&dev, processor, buf, length);
+}
+
+//! Thread-safe variant of \ref liballuris_get_firmware operating on a device context
+int liballuris_device_get_firmware (struct liballuris_device *dev, int processor, char* buf, size_t length)
+{
+  if (processor < 0 || processor > 1)
+    return LIBALLURIS_OUT_OF_RANGE;
+
+  device_lock (dev);
+  dev->out_buf[0] = 0x08;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = processor;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 6, dev->receive_timeout);
+  if (ret == LIBALLURIS_SUCCESS)
+    snprintf (buf, length, "V%i.%02i.%03i", dev->in_buf[5], dev->in_buf[4], dev->in_buf[3]);
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Query next calibration date
+ *
+ * The returned int v is YYMM for example "1502" for February 2015
+ * If the measurement is running, the next calibration date can't be read from the measurement processor
+ * and LIBALLURIS_DEVICE_BUSY is returned instead.
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[out] v output location for the next calibration date. Only populated if the return code is 0.
+ * \return 0 if successful else \ref liballuris_error.
+ */
+int liballuris_get_next_calibration_date (libusb_device_handle *dev_handle, int* v)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_next_calibration_date (&dev, v);
+}
+
+//! Thread-safe variant of \ref liballuris_get_next_calibration_date operating on a device context
+int liballuris_device_get_next_calibration_date (struct liballuris_device *dev, int* v)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x08;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 7;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 6, dev->receive_timeout);
+  if (ret == LIBALLURIS_SUCCESS)
+    {
+      *v = char_to_int24 (dev->in_buf + 3);
+      if (*v == -1)
+        return device_unlock (dev, LIBALLURIS_DEVICE_BUSY);
+    }
+  return device_unlock (dev, ret);
+}
+
+int liballuris_read_flash (libusb_device_handle *dev_handle, int adr, unsigned short *v)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_read_flash (&dev, adr, v);
+}
+
+//! Thread-safe variant of \ref liballuris_read_flash operating on a device context
+int liballuris_device_read_flash (struct liballuris_device *dev, int adr, unsigned short *v)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x72;
+  dev->out_buf[1] = 4;
+  dev->out_buf[2] = adr & 0xFF;
+  dev->out_buf[3] = adr >> 8;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 4, dev->send_timeout, 6, dev->receive_timeout);
+  if (ret == LIBALLURIS_SUCCESS)
+    {
+      *v  = dev->in_buf[5] << 8;
+      *v += dev->in_buf[4];
+    }
+  return device_unlock (dev, ret);
+}
+
+struct flash_query
+{
+  int start_adr;
+  unsigned short* buf;
+};
+
+static void flash_query_fill (struct liballuris_device* dev, size_t index, void* user_data)
+{
+  struct flash_query* q = user_data;
+  int adr = q->start_adr + index;
+  dev->out_buf[0] = 0x72;
+  dev->out_buf[1] = 4;
+  dev->out_buf[2] = adr & 0xFF;
+  dev->out_buf[3] = adr >> 8;
+}
+
+static int flash_query_parse (struct liballuris_device* dev, size_t index, void* user_data)
+{
+  struct flash_query* q = user_data;
+  q->buf[index] = dev->in_buf[5] << 8 | dev->in_buf[4];
+  return LIBALLURIS_SUCCESS;
+}
+
+/*!
+ * \brief Read consecutive words of the PIC flash
+ *
+ * Same as calling \ref liballuris_read_flash for each address but with
+ * DEFAULT_PIPELINE_DEPTH requests in flight.
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[in] adr first word address
+ * \param[out] buf output location for length words
+ * \param[in] length number of words
+ * \return 0 if successful else \ref liballuris_error
+ */
+int liballuris_read_flash_range (libusb_device_handle *dev_handle, int adr, unsigned short *buf, size_t length)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_read_flash_range (&dev, adr, buf, length);
+}
+
+//! Thread-safe variant of \ref liballuris_read_flash_range operating on a device context
+int liballuris_device_read_flash_range (struct liballuris_device *dev, int adr, unsigned short *buf, size_t length)
+{
+  if (adr < 0 || adr + length > 0xFFFF)
+    return LIBALLURIS_OUT_OF_RANGE;
+
+  struct flash_query q = {adr, buf};
+  device_lock (dev);
+  int ret = liballuris_pipelined_query (dev, __FUNCTION__, length, DEFAULT_PIPELINE_DEPTH, 4, 6,
+                                        flash_query_fill, flash_query_parse, &q);
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Query calibration date
+ * Since firmware 5.04.005
+ * The returned int v is days since year 2000
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[out] v output location for the calibration date. May be partially populated if the return code is != 0.
+ * \return 0 if successful else \ref liballuris_error.
+ */
+int liballuris_get_calibration_date (libusb_device_handle *dev_handle, unsigned short* v)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_calibration_date (&dev, v);
+}
+
+//! Thread-safe variant of \ref liballuris_get_calibration_date operating on a device context
+int liballuris_device_get_calibration_date (struct liballuris_device *dev, unsigned short* v)
+{
+  // see liballuris_get_calibration_number for flash organisation
+  return liballuris_device_read_flash (dev, 0, v);
+}
+
+//! Since firmware 5.04.005
+int liballuris_get_calibration_number (libusb_device_handle *dev_handle, char* buf, size_t length)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_calibration_number (&dev, buf, length);
+}
+
+//! Thread-safe variant of \ref liballuris_get_calibration_number operating on a device context
+int liballuris_device_get_calibration_number (struct liballuris_device *dev, char* buf, size_t length)
+{
+  // PIC flash organisation
+  // word adr; word value (16bit)
+  // 0       ; cal_date, days since 1.1.2000, unsigned short
+  // 1..4    ; uncertainty, double
+  // 5..24   ; calibration_number as char[40]
+
+  if (length > 40)
+    length = 40;
+  // needs to be multiple of 2bytes (words)
+  if (length % 2)
+    return LIBALLURIS_OUT_OF_RANGE;
+
+  unsigned short words[20];
+  int ret = liballuris_device_read_flash_range (dev, 5, words, length/2);
+  if (ret == LIBALLURIS_SUCCESS)
+    memcpy (buf, words, length);
+  return ret;
+}
+
+//! Since firmware 5.04.005
+int liballuris_get_uncertainty (libusb_device_handle *dev_handle, double* v)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_uncertainty (&dev, v);
+}
+
+//! Thread-safe variant of \ref liballuris_get_uncertainty operating on a device context
+int liballuris_device_get_uncertainty (struct liballuris_device *dev, double* v)
+{
+  // see liballuris_get_calibration_number for flash organisation
+  unsigned short words[4];
+  int ret = liballuris_device_read_flash_range (dev, 1, words, 4);
+  if (ret == LIBALLURIS_SUCCESS)
+    memcpy (v, words, sizeof (double));
+  return ret;
+}
+
+// Process wide cache of calibration info. The flash content only changes
+// during calibration, see liballuris_clear_calibration_cache
+#define CALIBRATION_CACHE_LEN 32
+static struct
+{
+  char serial_number[30];
+  struct liballuris_calibration_info info;
+} calibration_cache[CALIBRATION_CACHE_LEN];
+static size_t calibration_cache_next;   // round robin replacement
+static pthread_mutex_t calibration_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*!
+ * \brief Query calibration date, uncertainty and calibration number at once
+ *
+ * All 25 flash words are read with pipelined requests. The result is cached per serial number
+ * so following calls for the same device (also with a new handle) don't communicate with the flash.
+ * If the serial number can't be read (measurement is running) the cache isn't used.
+ *
+ * Since firmware 5.04.005
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[out] info output location. Only populated if the return code is 0.
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_get_calibration_date, liballuris_get_uncertainty, liballuris_get_calibration_number
+ */
+int liballuris_get_calibration_info (libusb_device_handle *dev_handle, struct liballuris_calibration_info* info)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_calibration_info (&dev, info);
+}
+
+//! Thread-safe variant of \ref liballuris_get_calibration_info operating on a device context
+int liballuris_device_get_calibration_info (struct liballuris_device *dev, struct liballuris_calibration_info* info)
+{
+  char serial[30];
+  size_t k;
+  device_lock (dev);
+  char have_serial = (liballuris_device_get_serial_number (dev, serial, sizeof (serial)) == LIBALLURIS_SUCCESS);
+  if (have_serial)
+    {
+      pthread_mutex_lock (&calibration_cache_lock);
+      for (k=0; k < CALIBRATION_CACHE_LEN; ++k)
+        if (! strcmp (calibration_cache[k].serial_number, serial))
+          {
+            *info = calibration_cache[k].info;
+            pthread_mutex_unlock (&calibration_cache_lock);
+            return device_unlock (dev, LIBALLURIS_SUCCESS);
+          }
+      pthread_mutex_unlock (&calibration_cache_lock);
+    }
+
+  // see liballuris_get_calibration_number for flash organisation
+  unsigned short words[25];
+  int ret = liballuris_device_read_flash_range (dev, 0, words, 25);
+  if (ret == LIBALLURIS_SUCCESS)
+    {
+      info->date = words[0];
+      memcpy (&info->uncertainty, words + 1, sizeof (double));
+      memcpy (info->number, words + 5, 40);
+      info->number[40] = 0;
+
+      if (have_serial)
+        {
+          pthread_mutex_lock (&calibration_cache_lock);
+          k = calibration_cache_next;
+          calibration_cache_next = (k + 1) % CALIBRATION_CACHE_LEN;
+          snprintf (calibration_cache[k].serial_number, sizeof (calibration_cache[k].serial_number), "%s", serial);
+          calibration_cache[k].info = *info;
+          pthread_mutex_unlock (&calibration_cache_lock);
+        }
+    }
+  return device_unlock (dev, ret);
+}
+
+//! Forget all cached calibration info, for example after a recalibration
+void liballuris_clear_calibration_cache (void)
+{
+  pthread_mutex_lock (&calibration_cache_lock);
+  memset (calibration_cache, 0, sizeof (calibration_cache));
+  calibration_cache_next = 0;
+  pthread_mutex_unlock (&calibration_cache_lock);
+}
+
+/*!
+ * \brief Query the number of digits for the interpretation of the raw fixed-point numbers
+ *
+ * All liballuris_get_* functions return fixed-point numbers or strings. This function queries the number
+ * of digits after the radix point. For example if \ref liballuris_get_value returns 123 and digits returns 1
+ * the real value is 12.3. Use \ref liballuris_get_unit to get a meaningful measurement.
+ *
+ * Query this value is only possible if the measurement is not running,
+ * else LIBALLURIS_DEVICE_BUSY is returned.
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[out] v output location for the returned number of digits. Only populated if the return code is 0.
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_get_value
+ */
+int liballuris_get_digits (libusb_device_handle *dev_handle, int* v)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_digits (&dev, v);
+}
+
+//! Thread-safe variant of \ref liballuris_get_digits operating on a device context
+int liballuris_device_get_digits (struct liballuris_device *dev, int* v)
+{
+  device_lock (dev);
+  if (dev->cache_valid & DEVICE_CACHE_DIGITS)
+    {
+      *v = dev->cache.digits;
+      return device_unlock (dev, LIBALLURIS_SUCCESS);
+    }
+  dev->out_buf[0] = 0x08;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 3;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 6, dev->receive_timeout);
+  if (ret == LIBALLURIS_SUCCESS)
+    {
+      *v = char_to_int24 (dev->in_buf + 3);
+      if (*v == -1)
+        return device_unlock (dev, LIBALLURIS_DEVICE_BUSY);
+      dev->cache.digits = *v;
+      dev->cache_valid |= DEVICE_CACHE_DIGITS;
+    }
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Query the resolution
+ *
+ * Since firmware 5.04.005
+ *
+ * The resolution as floating point number is 10^(-get_digits) * get_resolution.
+ * Possible values for resolution are 1, 2, 5.
+ *
+ * Example: get_unit returns LIBALLURIS_UNIT_N, get_digit returns 2,
+ * get_resolution returns 5 -> real resolution of 0.05N
+ *
+ * Query this value is only possible if the measurement is not running,
+ * else LIBALLURIS_DEVICE_BUSY is returned.
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[out] v output location for the returned resolution. Only populated if the return code is 0.
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_get_digits
+ */
+
+int liballuris_get_resolution (libusb_device_handle *dev_handle, int* v)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_resolution (&dev, v);
+}
+
+//! Thread-safe variant of \ref liballuris_get_resolution operating on a device context
+int liballuris_device_get_resolution (struct liballuris_device *dev, int* v)
+{
+  device_lock (dev);
+  if (dev->cache_valid & DEVICE_CACHE_RESOLUTION)
+    {
+      *v = dev->cache.resolution;
+      return device_unlock (dev, LIBALLURIS_SUCCESS);
+    }
+  dev->out_buf[0] = 0x08;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 16;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 6, dev->receive_timeout);
+  if (ret == LIBALLURIS_SUCCESS)
+    {
+      *v = char_to_int24 (dev->in_buf + 3);
+      if (*v == -1)
+        return device_unlock (dev, LIBALLURIS_DEVICE_BUSY);
+      dev->cache.resolution = *v;
+      dev->cache_valid |= DEVICE_CACHE_RESOLUTION;
+    }
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Query the maximum force of the device
+ *
+ * Query this value is only possible if the measurement is not running,
+ * else LIBALLURIS_DEVICE_BUSY is returned.
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[out] fmax output location for the returned max force. Only populated if the return code is 0.
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_get_unit
+ * \sa liballuris_get_digits
+ */
+int liballuris_get_F_max (libusb_device_handle *dev_handle, int* fmax)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_F_max (&dev, fmax);
+}
+
+//! Thread-safe variant of \ref liballuris_get_F_max operating on a device context
+int liballuris_device_get_F_max (struct liballuris_device *dev, int* fmax)
+{
+  device_lock (dev);
+  if (dev->cache_valid & DEVICE_CACHE_FMAX)
+    {
+      *fmax = dev->cache.fmax;
+      return device_unlock (dev, LIBALLURIS_SUCCESS);
+    }
+  dev->out_buf[0] = 0x08;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 2;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 6, dev->receive_timeout);
+  if (ret == LIBALLURIS_SUCCESS)
+    {
+      *fmax = char_to_int24 (dev->in_buf + 3);
+      if (*fmax == -1)
+        return device_unlock (dev, LIBALLURIS_DEVICE_BUSY);
+      dev->cache.fmax = *fmax;
+      dev->cache_valid |= DEVICE_CACHE_FMAX;
+    }
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Query the current measurement value
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[out] value output location for the measurement value. Only populated if the return code is 0.
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_get_unit
+ * \sa liballuris_get_digits
+ */
+int liballuris_get_value (libusb_device_handle *dev_handle, int* value)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_value (&dev, value);
+}
+
+//! Thread-safe variant of \ref liballuris_get_value operating on a device context
+int liballuris_device_get_value (struct liballuris_device *dev, int* value)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x46;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 3;
+  // worst execution time = 0.466s
+  // when P13=1Hz (effectively 2Hz) and mode=0 (10Hz)
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 6, 700);
+  if (ret == LIBALLURIS_SUCCESS)
+    *value = char_to_int24 (dev->in_buf + 3);
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Query positive peak value
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[out] peak output location for the peak value. Only populated if the return code is 0.
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_get_unit
+ * \sa liballuris_get_digits
+ */
+int liballuris_get_pos_peak (libusb_device_handle *dev_handle, int* peak)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_pos_peak (&dev, peak);
+}
+
+//! Thread-safe variant of \ref liballuris_get_pos_peak operating on a device context
+int liballuris_device_get_pos_peak (struct liballuris_device *dev, int* peak)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x46;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 4;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 6, dev->receive_timeout);
+  if (ret == LIBALLURIS_SUCCESS)
+    *peak = char_to_int24 (dev->in_buf + 3);
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Query negative peak value
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[out] peak output location for the peak value. Only populated if the return code is 0.
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_get_unit
+ * \sa liballuris_get_digits
+ */
+int liballuris_get_neg_peak (libusb_device_handle *dev_handle, int* peak)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_neg_peak (&dev, peak);
+}
+
+//! Thread-safe variant of \ref liballuris_get_neg_peak operating on a device context
+int liballuris_device_get_neg_peak (struct liballuris_device *dev, int* peak)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x46;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 5;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 6, dev->receive_timeout);
+  if (ret == LIBALLURIS_SUCCESS)
+    *peak = char_to_int24 (dev->in_buf + 3);
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Query the current state of the device
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[out] state output location for the state. Only populated if the return code is 0.
+ * \return 0 if successful else \ref liballuris_error
+ */
+int liballuris_read_state (libusb_device_handle *dev_handle, struct liballuris_state* state)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_read_state (&dev, state);
+}
+
+//! Thread-safe variant of \ref liballuris_read_state operating on a device context
+int liballuris_device_read_state (struct liballuris_device *dev, struct liballuris_state* state)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x46;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 2;
+
+  // worst execution time = 0.47s
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 6, 705);
+  if (ret == LIBALLURIS_SUCCESS)
+    {
+      union __liballuris_state__ tmp;
+      tmp._int = char_to_int24 (dev->in_buf + 3);
+      *state = tmp.bits;
+      dev->cache.measuring = state->measuring;
+      dev->cache_valid |= DEVICE_CACHE_MEASURING;
+    }
+  return device_unlock (dev, ret);
+}
+
+//! Internal: measuring flag from the metadata cache or the device
+static int device_is_measuring (struct liballuris_device* dev, char* measuring)
+{
+  if (dev->cache_valid & DEVICE_CACHE_MEASURING)
+    {
+      *measuring = dev->cache.measuring;
+      return LIBALLURIS_SUCCESS;
+    }
+  struct liballuris_state state;
+  int ret = liballuris_device_read_state (dev, &state);
+  if (ret == LIBALLURIS_SUCCESS)
+    *measuring = state.measuring;
+  return ret;
+}
+
+//! Internal: LIBALLURIS_DEVICE_BUSY while measuring. Only a cached "not measuring" is trusted,
+// the measurement may have been ended by auto-stop or the keys since it was cached.
+static int device_check_stopped (struct liballuris_device* dev)
+{
+  if ((dev->cache_valid & DEVICE_CACHE_MEASURING) && !dev->cache.measuring)
+    return LIBALLURIS_SUCCESS;
+  struct liballuris_state state;
+  int ret = liballuris_device_read_state (dev, &state);
+  if (ret == LIBALLURIS_SUCCESS && state.measuring)
+    ret = LIBALLURIS_DEVICE_BUSY;
+  return ret;
+}
+
+/*!
+ * \brief Query Fmax, digits, resolution, unit, mode and measuring state
+ *
+ * Each device context caches these values. They are only read from the device if
+ * they are unknown or were invalidated by one of the setters, start/stop, keypress,
+ * auto-stop, factory defaults or power off. Thus this is cheap enough to be called
+ * before converting samples to engineering units.
+ *
+ * Changes done with the keys of the device or a measurement stopped by auto-stop are
+ * not seen, call \ref liballuris_device_invalidate_cache if this may have happened.
+ *
+ * Fixed attributes can't be queried while measuring, in this case LIBALLURIS_DEVICE_BUSY
+ * is returned if they are not cached.
+ *
+ * \param[in] dev device context
+ * \param[out] md output location. Only completely populated when the return code is 0.
+ * \return 0 if successful else \ref liballuris_error
+ */
+int liballuris_device_get_metadata (struct liballuris_device *dev, struct liballuris_metadata* md)
+{
+  device_lock (dev);
+  int ret = device_is_measuring (dev, &md->measuring);
+  if (!ret)
+    ret = liballuris_device_get_F_max (dev, &md->fmax);
+  if (!ret)
+    ret = liballuris_device_get_digits (dev, &md->digits);
+  if (!ret)
+    ret = liballuris_device_get_resolution (dev, &md->resolution);
+  if (!ret)
+    ret = liballuris_device_get_unit (dev, &md->unit);
+  if (!ret)
+    ret = liballuris_device_get_mode (dev, &md->mode);
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Get the cached metadata without communicating with the device
+ *
+ * Never blocks, thus it can be used while asynchronous commands are pending or a stream runs.
+ * \param[in] dev device context
+ * \param[out] md output location, only the members of the returned bits are populated
+ * \return LIBALLURIS_METADATA_* bits of the cached members, see \ref liballuris_device_get_metadata
+ */
+unsigned int liballuris_device_get_cached_metadata (struct liballuris_device *dev, struct liballuris_metadata* md)
+{
+  device_lock (dev);
+  unsigned int valid = dev->cache_valid;
+  if (valid & DEVICE_CACHE_FMAX)
+    md->fmax = dev->cache.fmax;
+  if (valid & DEVICE_CACHE_DIGITS)
+    md->digits = dev->cache.digits;
+  if (valid & DEVICE_CACHE_RESOLUTION)
+    md->resolution = dev->cache.resolution;
+  if (valid & DEVICE_CACHE_UNIT)
+    md->unit = dev->cache.unit;
+  if (valid & DEVICE_CACHE_MODE)
+    md->mode = dev->cache.mode;
+  if (valid & DEVICE_CACHE_MEASURING)
+    md->measuring = dev->cache.measuring;
+  device_unlock (dev, LIBALLURIS_SUCCESS);
+  return valid;
+}
+
+//! Forget all cached metadata of dev, see \ref liballuris_device_get_metadata
+void liballuris_device_invalidate_cache (struct liballuris_device *dev)
+{
+  device_lock (dev);
+  dev->cache_valid = 0;
+  device_unlock (dev, 0);
+}
+
+/*!
+ * \brief Size of one unit in newton (force units: kg, g, lb and oz are kgf, gf, lbf and ozf)
+ * \return factor or 0 for an invalid unit
+ */
+double liballuris_unit_to_newton (enum liballuris_unit unit)
+{
+  switch (unit)
+    {
+    case LIBALLURIS_UNIT_N:
+      return 1.0;
+    case LIBALLURIS_UNIT_cN:
+      return 0.01;
+    case LIBALLURIS_UNIT_kg:
+      return 9.80665;
+    case LIBALLURIS_UNIT_g:
+      return 0.00980665;
+    case LIBALLURIS_UNIT_lb:
+      return 4.4482216152605;
+    case LIBALLURIS_UNIT_oz:
+      return 0.27801385095378125;
+    }
+  return 0;
+}
+
+/*!
+ * \brief Precompute the factor to convert raw fixed-point values into a physical unit
+ *
+ * The physical value is raw * 10^(-digits) in device_unit. The target unit may differ from
+ * the unit set on the device, thus the display unit can be changed on the host without
+ * \ref liballuris_set_unit (which writes the EEPROM).
+ * \param[out] scale storage for the conversion
+ * \param[in] digits see \ref liballuris_get_digits
+ * \param[in] device_unit see \ref liballuris_get_unit
+ * \param[in] target_unit unit of the converted values
+ * \return 0 if successful, LIBALLURIS_OUT_OF_RANGE for invalid units or digits
+ * \sa liballuris_device_get_scale, liballuris_convert_float, liballuris_convert_double
+ */
+int liballuris_scale_init (struct liballuris_scale* scale, int digits, enum liballuris_unit device_unit, enum liballuris_unit target_unit)
+{
+  double from = liballuris_unit_to_newton (device_unit);
+  double to = liballuris_unit_to_newton (target_unit);
+  if (from == 0 || to == 0 || digits < 0 || digits > 9)
+    return LIBALLURIS_OUT_OF_RANGE;
+
+  scale->digits = digits;
+  scale->device_unit = device_unit;
+  scale->unit = target_unit;
+  scale->factor = from / to;
+  while (digits--)
+    scale->factor /= 10;
+  return LIBALLURIS_SUCCESS;
+}
+
+/*!
+ * \brief Query digits and unit and precompute the conversion into target_unit
+ *
+ * Digits and unit can't be queried while the measurement is running. Call this before
+ * starting the measurement, the device context caches the values afterwards.
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[in] target_unit unit of the converted values
+ * \param[out] scale storage for the conversion
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_scale_init
+ */
+int liballuris_get_scale (libusb_device_handle *dev_handle, enum liballuris_unit target_unit, struct liballuris_scale* scale)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_scale (&dev, target_unit, scale);
+}
+
+//! Thread-safe variant of \ref liballuris_get_scale operating on a device context
+int liballuris_device_get_scale (struct liballuris_device *dev, enum liballuris_unit target_unit, struct liballuris_scale* scale)
+{
+  int digits;
+  enum liballuris_unit unit;
+  device_lock (dev);
+  int ret = liballuris_device_get_digits (dev, &digits);
+  if (! ret)
+    ret = liballuris_device_get_unit (dev, &unit);
+  if (! ret)
+    ret = liballuris_scale_init (scale, digits, unit, target_unit);
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Convert raw fixed-point values into float in the unit of scale
+ *
+ * Vectorized with AVX2 or NEON if available. in and out must not overlap.
+ * \param[in] scale from \ref liballuris_scale_init or \ref liballuris_get_scale
+ * \param[in] in raw values, for example from \ref liballuris_poll_measurement
+ * \param[out] out storage for num_values converted values
+ * \param[in] num_values number of values
+ */
+void liballuris_convert_float (const struct liballuris_scale* scale, const int* in, float* out, size_t num_values)
+{
+  pthread_once (&decode_once, decode_select);
+  decode_impl.scale_float (in, out, num_values, scale->factor);
+}
+
+//! Same as \ref liballuris_convert_float with double precision output
+void liballuris_convert_double (const struct liballuris_scale* scale, const int* in, double* out, size_t num_values)
+{
+  pthread_once (&decode_once, decode_select);
+  decode_impl.scale_double (in, out, num_values, scale->factor);
+}
+
+//! Print state to stdout, see \ref liballuris_fprint_state
+void liballuris_print_state (struct liballuris_state state)
+{
+  liballuris_fprint_state (stdout, state);
+}
+
+//! Print state to the stream f, one flag per line
+void liballuris_fprint_state (FILE* f, struct liballuris_state state)
+{
+  fprintf (f, "[%c] upper limit exceeded\n",               (state.upper_limit_exceeded)? 'X': ' ');
+  fprintf (f, "[%c] lower limit underrun\n",               (state.lower_limit_underrun)? 'X': ' ');
+  fprintf (f, "[%c] peak  mode active\n",                  (state.some_peak_mode_active)? 'X': ' ');
+  fprintf (f, "[%c] peak+ mode active\n",                  (state.peak_plus_active)? 'X': ' ');
+  fprintf (f, "[%c] peak- mode active\n",                  (state.peak_minus_active)? 'X': ' ');
+  fprintf (f, "[%c] Store to memory in progress\n",        (state.mem_running)? 'X': ' ');
+  fprintf (f, "[%c] overload (abs(F) > 150%%)\n",          (state.overload)? 'X': ' ');
+  fprintf (f, "[%c] fracture detected (only W20/W40)\n",   (state.fracture)? 'X': ' ');
+  fprintf (f, "[%c] mem active (P21=1 or P21=2)\n",        (state.mem_active)? 'X': ' ');
+  fprintf (f, "[%c] mem-conti (store with displayrate)\n", (state.mem_conti)? 'X': ' ');
+  fprintf (f, "[%c] grenz_option\n",                       (state.grenz_option)? 'X': ' ');
+  fprintf (f, "[%c] measurement running\n",                (state.measuring)? 'X': ' ');
+}
+
+/*!
+ * \brief Enable or disable cyclic measurements
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[in] enable
+ * \param[in] length 1..19
+ * \return 0 if successful else \ref liballuris_error
+ */
+int liballuris_cyclic_measurement (libusb_device_handle *dev_handle, char enable, size_t length)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_cyclic_measurement (&dev, enable, length);
+}
+
+//! Thread-safe variant of \ref liballuris_cyclic_measurement operating on a device context
+int liballuris_device_cyclic_measurement (struct liballuris_device *dev, char enable, size_t length)
+{
+  if (length < 1 || length > MAX_BLOCK_SIZE)
+    {
+      fprintf (stderr, "Error: packetlen %li out of range 1..%i.\n", length, MAX_BLOCK_SIZE);
+      return LIBALLURIS_OUT_OF_RANGE;
+    }
+
+  device_lock (dev);
+  dev->out_buf[0] = 0x01;
+  dev->out_buf[1] = 4;
+  dev->out_buf[2] = (enable)? 2:0;
+  dev->out_buf[3] = length;
+
+  //printf ("liballuris_cyclic_measurement enable=%i\n", enable);
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 4, dev->send_timeout, 4, dev->receive_timeout);
+
+  // we expect LIBUSB_ERROR_OVERFLOW if we try to disable streaming
+  if (ret == LIBUSB_ERROR_OVERFLOW)
+    {
+      liballuris_device_clear_RX (dev, 10);
+      // one more try
+      ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 4, dev->send_timeout, 4, dev->receive_timeout);
+      liballuris_device_clear_RX (dev, 10);
+    }
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Poll cyclic measurements
+ *
+ * Cyclic measurements have to be enabled before with liballuris_cyclic_measurement.
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[in] buf output location for the measurements. Only populated if the return code is 0.
+ * \param[in] length of block 1..19, typically the same used with liballuris_cyclic_measurement
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_cyclic_measurement
+ * \sa liballuris_get_unit
+ * \sa liballuris_get_digits
+ */
+int liballuris_poll_measurement (libusb_device_handle *dev_handle, int* buf, size_t length)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_poll_measurement (&dev, buf, length);
+}
+
+//! Thread-safe variant of \ref liballuris_poll_measurement operating on a device context
+int liballuris_device_poll_measurement (struct liballuris_device *dev, int* buf, size_t length)
+{
+  device_lock (dev);
+  size_t len = 5 + length * 3;
+
+  /* Increased receive timeout:
+   * The sampling frequency can be selected between 10Hz and 990Hz
+   * Therefore the maximum delay until one measurement completes is 1/10Hz = 100ms.
+   * Since the block size can be up to 19 (see liballuris_cyclic_measurement) the typically delay
+   * in 10Hz mode and blocksize 19 is >1.9s
+   *
+   * Test case: "gadc --stop --set-mode 0 --start -s 19"
+  */
+
+  // worst execution time = 2.4s
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 0, 0, len, 3600);
+  liballuris_decode_int24 (dev->in_buf + 5, buf, length);
+
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Poll cyclic measurements and timestamp each sample
+ *
+ * Same as \ref liballuris_poll_measurement but the packet is timestamped (CLOCK_MONOTONIC)
+ * when the transfer completes. This is taken as time of the last sample, the timestamps of the
+ * previous samples are interpolated backwards using sample_period_ns.
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[out] buf output location for the measurements. Only populated if the return code is 0.
+ * \param[out] timestamps_ns output location for length timestamps in ns
+ * \param[in] length of block 1..19, typically the same used with liballuris_cyclic_measurement
+ * \param[in] sample_period_ns see \ref liballuris_sample_period_ns
+ * \return 0 if successful else \ref liballuris_error
+ */
+int liballuris_poll_measurement_timestamps (libusb_device_handle *dev_handle, int* buf, int64_t* timestamps_ns, size_t length, int64_t sample_period_ns)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_poll_measurement_timestamps (&dev, buf, timestamps_ns, length, sample_period_ns);
+}
+
+//! Thread-safe variant of \ref liballuris_poll_measurement_timestamps operating on a device context
+int liballuris_device_poll_measurement_timestamps (struct liballuris_device *dev, int* buf, int64_t* timestamps_ns, size_t length, int64_t sample_period_ns)
+{
+  device_lock (dev);
+  int ret = liballuris_device_poll_measurement (dev, buf, length);
+  if (ret == LIBALLURIS_SUCCESS)
+    interpolate_timestamps (timestamps_ns, length, monotonic_ns (), sample_period_ns);
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Poll cyclic measurements without waiting
+ *
+ * Cyclic measurements have to be enabled before with liballuris_cyclic_measurement.
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[in] buf output location for the measurements. Only populated if the return code is 0.
+ * \param[in] length of block 1..19, typically the same used with liballuris_cyclic_measurement
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_cyclic_measurement
+ * \sa liballuris_get_unit
+ * \sa liballuris_get_digits
+ */
+int liballuris_poll_measurement_no_wait (libusb_device_handle *dev_handle, int* buf, size_t length, size_t *actual_num_values)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_poll_measurement_no_wait (&dev, buf, length, actual_num_values);
+}
+
+//! Thread-safe variant of \ref liballuris_poll_measurement_no_wait operating on a device context
+int liballuris_device_poll_measurement_no_wait (struct liballuris_device *dev, int* buf, size_t length, size_t *actual_num_values)
+{
+  device_lock (dev);
+  int actual=0;
+  int r = 0;
+
+  size_t len = 5 + length * 3;
+  *actual_num_values = 0;
+  r = device_transfer (dev, 0x81 | LIBUSB_ENDPOINT_IN, dev->in_buf, len, &actual, 5);
+  //printf ("actual = %i, %s\n", actual, libusb_error_name(r));
+
+  if ((r == LIBUSB_SUCCESS || r == LIBUSB_ERROR_TIMEOUT ) && actual == (int) len)
+    {
+      *actual_num_values = (actual - 5) / 3;
+      liballuris_decode_int24 (dev->in_buf + 5, buf, *actual_num_values);
+    }
+  else if (r == LIBUSB_ERROR_TIMEOUT && actual > 0)
+    {
+      // this isn't expected
+      fprintf (stderr, "Error in liballuris_poll_measurement_no_wait: LIBUSB_ERROR_TIMEOUT and actual = %i, len = %li\n", actual, len);
+      fprintf (stderr, "please file a bug report\n");
+      return device_unlock (dev, r);
+    }
+
+  return device_unlock (dev, r);
+}
+
+/****************************************************************************************/
+
+//! Internal state of an asynchronous cyclic measurement, see \ref liballuris_stream_open
+struct liballuris_stream
+{
+  libusb_context* ctx;
+  struct liballuris_device* dev;
+  char owns_dev;               // dev was created by liballuris_stream_open
+  unsigned int device_index;   // copied to liballuris_block.device_index
+  size_t block_size;           // requested number of values per packet
+  size_t num_transfers;
+  struct libusb_transfer** transfers;
+  size_t in_flight;            // number of submitted transfers including resize_transfer
+  unsigned int latency_ms;     // latency target or 0 for a fixed block_size
+  struct libusb_transfer* resize_transfer; // asynchronous command to change the block size
+  unsigned char resize_buf[4];
+  char resize_in_flight;
+  char running;
+  char stopping;
+  char polled;                 // on a transport, packets are received in liballuris_stream_handle_events
+  int error;                   // first error reported by a transfer callback
+  liballuris_stream_cb cb;
+  void* user_data;
+  struct liballuris_ring* ring; // optional, filled with all decoded values
+  int values[MAX_BLOCK_SIZE];  // decoded values of the current packet
+  int64_t timestamps[MAX_BLOCK_SIZE]; // interpolated sample times of the current packet
+  int64_t sample_period_ns;    // of the active measurement mode
+  int64_t last_packet_ns;      // completion time of the previous packet or 0
+  int64_t period_change_ns;    // arrival of the first packet of a run suggesting the other mode or 0
+
+  // queue of decoded blocks with a stride of MAX_BLOCK_SIZE, only used if cb == NULL
+  int* queue;
+  int64_t* queue_timestamps;
+  size_t* queue_sizes;         // number of values of each block
+  size_t queue_len;
+  size_t queue_head;
+  size_t queue_count;
+  size_t queue_offset;         // values of the head block already read
+
+  // health accounting, see liballuris_stream_get_stats and stream_check_gap
+  struct liballuris_stream_stats stats;
+  int64_t seq_samples;         // samples (received and lost) since the timing reference, 0 = no reference
+  int64_t gap_base_ns;         // expected arrival time of the packets minus seq_samples periods
+  int64_t gap_window_start_ns;
+  int64_t gap_window_min_ns;   // minimum lateness in the current window
+  unsigned int gap_window_packets;
+};
+
+//! Minimum number of packets and duration of a gap detection window
+#define GAP_WINDOW_PACKETS 16
+#define GAP_WINDOW_NS 1000000000LL
+
+//! Minimum duration of packet intervals suggesting the other mode before the period is switched
+#define PERIOD_CHANGE_NS 1000000000LL
+
+//! Internal: map libusb_transfer_status to libusb_error
+static int transfer_status_to_error (enum libusb_transfer_status status)
+{
+  switch (status)
+    {
+    case LIBUSB_TRANSFER_COMPLETED:
+      return LIBUSB_SUCCESS;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+      return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_STALL:
+      return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      return LIBUSB_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW:
+      return LIBUSB_ERROR_OVERFLOW;
+    case LIBUSB_TRANSFER_CANCELLED:
+      return LIBUSB_ERROR_INTERRUPTED;
+    default:
+      return LIBUSB_ERROR_IO;
+    }
+}
+
+//! Internal: block size which keeps the delay of the first sample below latency_ms
+static size_t latency_block_size (unsigned int latency_ms, int64_t sample_period_ns)
+{
+  int64_t n = (int64_t) latency_ms * 1000000 / sample_period_ns;
+  if (n < 1)
+    return 1;
+  return (n > MAX_BLOCK_SIZE)? MAX_BLOCK_SIZE : n;
+}
+
+static void stream_resize (struct liballuris_stream* stream, size_t block_size);
+static int async_stream_packet (struct liballuris_device* dev, unsigned char* buf, int actual);
+static void async_stream_detach (struct liballuris_device* dev);
+
+//! Internal: completion callback of the asynchronous resize command
+static void LIBUSB_CALL stream_resize_cb (struct libusb_transfer* transfer)
+{
+  struct liballuris_stream* stream = transfer->user_data;
+  record_transfer (transfer);
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_CANCELLED && !stream->error)
+    stream->error = transfer_status_to_error (transfer->status);
+  stream->resize_in_flight = 0;
+  stream->in_flight--;
+  // the mode may have changed again meanwhile
+  if (stream->latency_ms && transfer->status == LIBUSB_TRANSFER_COMPLETED)
+    stream_resize (stream, latency_block_size (stream->latency_ms, stream->sample_period_ns));
+}
+
+/*!
+ * \brief Internal: change the number of values per packet while streaming
+ *
+ * Synchronous transfers aren't allowed in transfer callbacks and the reply would be received
+ * by one of the IN transfers anyway. Thus the command is sent asynchronously.
+ */
+static void stream_resize (struct liballuris_stream* stream, size_t block_size)
+{
+  if (block_size == stream->block_size || stream->resize_in_flight || stream->stopping)
+    return;
+
+  stream->resize_buf[0] = 0x01;
+  stream->resize_buf[1] = 4;
+  stream->resize_buf[2] = 2;
+  stream->resize_buf[3] = block_size;
+  if (stream->polled)
+    {
+      // called from liballuris_stream_handle_events, not from a libusb callback
+      int actual;
+      if (device_transfer (stream->dev, 0x01 | LIBUSB_ENDPOINT_OUT, stream->resize_buf, sizeof (stream->resize_buf), &actual, DEFAULT_SEND_TIMEOUT) == LIBUSB_SUCCESS)
+        stream->block_size = block_size;
+    }
+  else if (libusb_submit_transfer (stream->resize_transfer) == LIBUSB_SUCCESS)
+    {
+      stream->resize_in_flight = 1;
+      stream->in_flight++;
+      stream->block_size = block_size;
+    }
+}
+
+//! Internal: compare the minimum lateness of the window with the sample period, see stream_check_gap
+static void stream_end_gap_window (struct liballuris_stream* stream, int64_t now)
+{
+  int64_t period = stream->sample_period_ns;
+  int64_t min = stream->gap_window_min_ns;
+  if (min >= STREAM_GAP_JITTER_NS && min >= period / 2)
+    {
+      int64_t lost = (min + period / 2) / period;
+      stream->stats.gaps++;
+      stream->stats.lost_samples += lost;
+      stream->seq_samples += lost;
+      stream->gap_base_ns += min - lost * period;
+    }
+  else
+    stream->gap_base_ns += min;
+
+  stream->gap_window_start_ns = now;
+  stream->gap_window_min_ns = INT64_MAX;
+  stream->gap_window_packets = 0;
+}
+
+/*!
+ * \brief Internal: infer lost samples from the arrival time of a packet with n samples
+ *
+ * The lateness of a packet is its arrival time minus the expected one (reference plus
+ * received and lost samples times the period). Delayed event handling only makes single
+ * packets late, a gap makes all following packets late. Thus the minimum lateness over a window
+ * of packets is compared with the period, and otherwise the reference follows the clock drift.
+ */
+static void stream_check_gap (struct liballuris_stream* stream, int64_t now, size_t n)
+{
+  int64_t period = stream->sample_period_ns;
+  int64_t offset = now - (stream->seq_samples + (int64_t) n) * period;
+  if (!stream->seq_samples)
+    {
+      stream->gap_base_ns = offset;
+      stream->gap_window_start_ns = now;
+      stream->gap_window_min_ns = INT64_MAX;
+      stream->gap_window_packets = 0;
+    }
+  stream->seq_samples += n;
+
+  int64_t late = offset - stream->gap_base_ns;
+  if (late < 0)
+    {
+      // earlier than ever, the previous packets were delayed or the device clock is faster
+      stream->gap_base_ns = offset;
+      late = 0;
+    }
+  if (late < stream->gap_window_min_ns)
+    stream->gap_window_min_ns = late;
+
+  if (++stream->gap_window_packets >= GAP_WINDOW_PACKETS && now - stream->gap_window_start_ns >= GAP_WINDOW_NS)
+    stream_end_gap_window (stream, now);
+}
+
+//! Internal: decode a received cyclic measurement packet and pass it to the callback or queue
+static void stream_deliver (struct liballuris_stream* stream, unsigned char* buf, int actual)
+{
+  // only complete ID_SAMPLE packets are valid, discard everything else.
+  // The size isn't compared with block_size, after a resize packets of the old size may follow.
+  size_t n = (actual > 5)? (actual - 5) / 3 : 0;
+  if (!n || n > MAX_BLOCK_SIZE || actual != (int) (5 + n * 3) || buf[0] != 0x02)
+    {
+      // the reply to the cyclic command of stream_resize is expected,
+      // replies to asynchronous commands of the device context are passed on
+      if (actual > 0 && buf[0] != 0x01 && !async_stream_packet (stream->dev, buf, actual))
+        stream->stats.malformed++;
+#ifdef PRINT_DEBUG_MSG
+      fprintf (stderr, "stream_deliver: discarded packet with id 0x%02x and %i bytes\n", buf[0], actual);
+#endif
+      return;
+    }
+
+  int64_t now = monotonic_ns ();
+  // timeouts of asynchronous commands waiting for a reply in the stream
+  async_stream_packet (stream->dev, NULL, 0);
+
+  // The period is read from the mode in liballuris_stream_start. A later change between
+  // 10Hz and 900Hz mode (for example with the keys) is detected from the packet interval,
+  // the threshold is the geometric mean of both periods. Delayed event handling causes a
+  // burst of up to num_transfers short intervals or a single long one, thus the other mode
+  // is only assumed if all intervals suggest it for PERIOD_CHANGE_NS.
+  if (stream->last_packet_ns)
+    {
+      int64_t per_sample = (now - stream->last_packet_ns) / (int64_t) n;
+      int64_t other = (stream->sample_period_ns == LIBALLURIS_PERIOD_PEAK_NS)? LIBALLURIS_PERIOD_STANDARD_NS : LIBALLURIS_PERIOD_PEAK_NS;
+      char suggests_other = (other > stream->sample_period_ns)? per_sample > 10500000 : per_sample < 10500000;
+      if (!suggests_other)
+        stream->period_change_ns = 0;
+      else if (!stream->period_change_ns)
+        stream->period_change_ns = now;
+      else if (now - stream->period_change_ns >= PERIOD_CHANGE_NS)
+        {
+          stream->sample_period_ns = other;
+          stream->period_change_ns = 0;
+          stream->seq_samples = 0;
+          stream->stats.resyncs++;
+          if (stream->latency_ms)
+            stream_resize (stream, latency_block_size (stream->latency_ms, other));
+        }
+    }
+  stream->last_packet_ns = now;
+
+  stream->stats.packets++;
+  stream->stats.samples += n;
+  stream_check_gap (stream, now, n);
+
+  liballuris_decode_int24 (buf + 5, stream->values, n);
+  interpolate_timestamps (stream->timestamps, n, now, stream->sample_period_ns);
+
+  if (stream->cb)
+    {
+      struct liballuris_block block;
+      block.values = stream->values;
+      block.num_values = n;
+      block.device_index = stream->device_index;
+      block.timestamp_ns = now;
+      block.timestamps_ns = stream->timestamps;
+      block.sample_period_ns = stream->sample_period_ns;
+      stream->cb (&block, stream->user_data);
+    }
+
+  if (stream->ring)
+    stream->stats.dropped_samples += n - liballuris_ring_write (stream->ring, stream->values, n);
+  else if (!stream->cb)
+    {
+      if (stream->queue_count == stream->queue_len)
+        {
+          // queue full, drop the oldest block
+          stream->stats.dropped_samples += stream->queue_sizes[stream->queue_head] - stream->queue_offset;
+          stream->queue_head = (stream->queue_head + 1) % stream->queue_len;
+          stream->queue_count--;
+          stream->queue_offset = 0;
+        }
+      size_t tail = (stream->queue_head + stream->queue_count) % stream->queue_len;
+      memcpy (stream->queue + tail * MAX_BLOCK_SIZE, stream->values, n * sizeof (int));
+      memcpy (stream->queue_timestamps + tail * MAX_BLOCK_SIZE, stream->timestamps, n * sizeof (int64_t));
+      stream->queue_sizes[tail] = n;
+      stream->queue_count++;
+    }
+}
+
+//! Internal: completion callback for the IN transfers of a stream
+static void LIBUSB_CALL stream_transfer_cb (struct libusb_transfer* transfer)
+{
+  struct liballuris_stream* stream = transfer->user_data;
+  record_transfer (transfer);
+
+  if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+    stream_deliver (stream, transfer->buffer, transfer->actual_length);
+  else if (transfer->status != LIBUSB_TRANSFER_TIMED_OUT)
+    {
+      // cancelled or fatal error, don't resubmit
+      if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+        stream->stats.transfer_errors++;
+      if (transfer->status != LIBUSB_TRANSFER_CANCELLED && !stream->error)
+        stream->error = transfer_status_to_error (transfer->status);
+      stream->in_flight--;
+      return;
+    }
+
+  if (stream->stopping)
+    {
+      stream->in_flight--;
+      return;
+    }
+
+  // resubmit immediately so that the ring of pending transfers is never exhausted
+  int r = libusb_submit_transfer (transfer);
+  if (r != LIBUSB_SUCCESS)
+    {
+      stream->stats.transfer_errors++;
+      if (!stream->error)
+        stream->error = r;
+      stream->in_flight--;
+    }
+}
+
+/*!
+ * \brief Create an asynchronous cyclic measurement stream
+ *
+ * In contrast to \ref liballuris_poll_measurement, which issues one blocking transfer per packet,
+ * the stream keeps num_transfers IN transfers queued on endpoint 0x81. Thus packets are still
+ * received if the application is busy and doesn't handle events for a while.
+ *
+ * Decoded blocks are either passed to cb or, if cb is NULL, buffered in an internal queue
+ * of \ref DEFAULT_STREAM_QUEUE_LEN blocks which can be read with \ref liballuris_stream_read.
+ * The oldest block is dropped if the queue is full.
+ *
+ * The stream is not thread safe: libusb events for ctx have to be handled from the same thread
+ * which calls the other liballuris_stream_* functions, for example with \ref liballuris_stream_handle_events.
+ * Don't use other functions on dev_handle while the stream is running.
+ *
+ * On a transport (see \ref liballuris_open_transport) no transfers are queued, the packets are
+ * received synchronously in \ref liballuris_stream_handle_events. ctx isn't used then.
+ *
+ * \param[in] ctx pointer to libusb context used to open dev_handle
+ * \param[in] dev_handle a handle for the device to communicate with. The interface has to be claimed.
+ * \param[in] block_size number of values per packet 1..19
+ * \param[in] num_transfers number of IN transfers kept in flight or 0 for \ref DEFAULT_STREAM_TRANSFERS
+ * \param[in] cb callback for decoded blocks or NULL to use the internal queue
+ * \param[in] user_data passed to cb
+ * \param[out] stream storage for the created stream. Free it with \ref liballuris_stream_close
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_stream_start, liballuris_device_stream_open
+ */
+int liballuris_stream_open (libusb_context* ctx, libusb_device_handle *dev_handle, size_t block_size, size_t num_transfers, liballuris_stream_cb cb, void* user_data, struct liballuris_stream** stream)
+{
+  struct liballuris_device* dev;
+  int ret = liballuris_device_wrap (dev_handle, &dev);
+  if (ret)
+    return ret;
+
+  ret = liballuris_device_stream_open (ctx, dev, block_size, num_transfers, cb, user_data, stream);
+  if (ret)
+    liballuris_device_close (dev);
+  else
+    (*stream)->owns_dev = 1;
+  return ret;
+}
+
+/*!
+ * \brief Create an asynchronous cyclic measurement stream on a device context
+ *
+ * Same as \ref liballuris_stream_open but the commands to enable and disable cyclic
+ * measurements are serialized with other users of dev. The context has to outlive the stream.
+ */
+int liballuris_device_stream_open (libusb_context* ctx, struct liballuris_device *dev, size_t block_size, size_t num_transfers, liballuris_stream_cb cb, void* user_data, struct liballuris_stream** stream)
+{
+  if (block_size < 1 || block_size > MAX_BLOCK_SIZE)
+    {
+      fprintf (stderr, "Error: packetlen %li out of range 1..%i.\n", block_size, MAX_BLOCK_SIZE);
+      return LIBALLURIS_OUT_OF_RANGE;
+    }
+
+  if (!num_transfers)
+    num_transfers = DEFAULT_STREAM_TRANSFERS;
+
+  struct liballuris_stream* s = calloc (1, sizeof (struct liballuris_stream));
+  if (!s)
+    return LIBUSB_ERROR_NO_MEM;
+
+  s->ctx = ctx;
+  s->dev = dev;
+  s->polled = is_transport_handle (dev->dev_handle);
+  s->block_size = block_size;
+  s->num_transfers = num_transfers;
+  s->cb = cb;
+  s->user_data = user_data;
+
+  if (!cb)
+    {
+      s->queue_len = DEFAULT_STREAM_QUEUE_LEN;
+      s->queue = malloc (s->queue_len * MAX_BLOCK_SIZE * sizeof (int));
+      s->queue_timestamps = malloc (s->queue_len * MAX_BLOCK_SIZE * sizeof (int64_t));
+      s->queue_sizes = malloc (s->queue_len * sizeof (size_t));
+    }
+
+  s->transfers = calloc (num_transfers, sizeof (struct libusb_transfer*));
+  s->resize_transfer = libusb_alloc_transfer (0);
+  if (!s->transfers || !s->resize_transfer || (!cb && (!s->queue || !s->queue_timestamps || !s->queue_sizes)))
+    {
+      liballuris_stream_close (s);
+      return LIBUSB_ERROR_NO_MEM;
+    }
+
+  size_t k;
+  for (k=0; k < num_transfers; ++k)
+    {
+      s->transfers[k] = libusb_alloc_transfer (0);
+      unsigned char* buf = malloc (DEFAULT_SEND_BUF_LEN);
+      if (!s->transfers[k] || !buf)
+        {
+          free (buf);
+          liballuris_stream_close (s);
+          return LIBUSB_ERROR_NO_MEM;
+        }
+      // Use a full packet as buffer so that unexpected replies don't cause an overflow
+      libusb_fill_interrupt_transfer (s->transfers[k], dev->dev_handle, 0x81 | LIBUSB_ENDPOINT_IN,
+                                      buf, DEFAULT_SEND_BUF_LEN, stream_transfer_cb, s, 0);
+      s->transfers[k]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    }
+
+  // [0x01, 4, 2, length], see liballuris_cyclic_measurement. The reply is discarded by stream_deliver.
+  libusb_fill_interrupt_transfer (s->resize_transfer, dev->dev_handle, 0x01 | LIBUSB_ENDPOINT_OUT,
+                                  s->resize_buf, sizeof (s->resize_buf), stream_resize_cb, s, DEFAULT_SEND_TIMEOUT);
+
+  *stream = s;
+  return LIBALLURIS_SUCCESS;
+}
+
+/*!
+ * \brief Let the stream write all decoded values into a ring buffer
+ *
+ * Use this to decouple the thread which handles the libusb events from slow consumers.
+ * The internal queue and \ref liballuris_stream_read are not used if a ring is set.
+ * Only call this while the stream is stopped.
+ *
+ * \param[in] stream created with \ref liballuris_stream_open
+ * \param[in] ring created with \ref liballuris_ring_new or NULL to disable
+ */
+void liballuris_stream_set_ring (struct liballuris_stream* stream, struct liballuris_ring* ring)
+{
+  stream->ring = ring;
+}
+
+/*!
+ * \brief Choose the block size from a latency target instead of a fixed value
+ *
+ * The first value of a packet is delayed by (block_size - 1) sample periods. With a latency
+ * target the block size is max (1, min (19, latency / sample period)), for example 2 in 10Hz mode
+ * and 19 in 900Hz mode for 200ms. It's chosen in \ref liballuris_stream_start from the active
+ * measurement mode and adjusted while streaming if the stream detects a mode change.
+ * Only call this while the stream is stopped.
+ *
+ * \param[in] stream created with \ref liballuris_stream_open
+ * \param[in] latency_ms latency target in milliseconds or 0 for the fixed block_size passed to \ref liballuris_stream_open
+ * \return 0 if successful else LIBALLURIS_DEVICE_BUSY if the stream is running
+ */
+int liballuris_stream_set_latency (struct liballuris_stream* stream, unsigned int latency_ms)
+{
+  if (stream->running)
+    return LIBALLURIS_DEVICE_BUSY;
+  stream->latency_ms = latency_ms;
+  return LIBALLURIS_SUCCESS;
+}
+
+/*!
+ * \brief Get the health counters of a stream
+ *
+ * The counters are reset by \ref liballuris_stream_start and kept after \ref liballuris_stream_stop.
+ * Call this from the thread which handles the events.
+ *
+ * \param[in] stream created with \ref liballuris_stream_open
+ * \param[out] stats output location for the counters
+ */
+void liballuris_stream_get_stats (struct liballuris_stream* stream, struct liballuris_stream_stats* stats)
+{
+  *stats = stream->stats;
+}
+
+/*!
+ * \brief Enable cyclic measurements and submit the IN transfers
+ *
+ * The measurement has to be running, see \ref liballuris_start_measurement.
+ *
+ * \param[in] stream created with \ref liballuris_stream_open
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_stream_stop
+ */
+int liballuris_stream_start (struct liballuris_stream* stream)
+{
+  if (stream->running)
+    return LIBALLURIS_SUCCESS;
+
+  // the sample period is needed for the timestamps and the latency target
+  struct liballuris_state state;
+  stream->sample_period_ns = LIBALLURIS_PERIOD_STANDARD_NS;
+  if (liballuris_device_read_state (stream->dev, &state) == LIBALLURIS_SUCCESS && state.some_peak_mode_active)
+    stream->sample_period_ns = LIBALLURIS_PERIOD_PEAK_NS;
+  if (stream->latency_ms)
+    stream->block_size = latency_block_size (stream->latency_ms, stream->sample_period_ns);
+
+  int ret = liballuris_device_cyclic_measurement (stream->dev, 1, stream->block_size);
+  if (ret)
+    return ret;
+
+  stream->error = 0;
+  stream->stopping = 0;
+  stream->queue_head = 0;
+  stream->queue_count = 0;
+  stream->queue_offset = 0;
+  stream->last_packet_ns = 0;
+  stream->period_change_ns = 0;
+  stream->seq_samples = 0;
+  memset (&stream->stats, 0, sizeof (stream->stats));
+
+  size_t k;
+  // the synchronous receiver of a polled stream counts as one transfer in flight
+  if (stream->polled)
+    stream->in_flight = 1;
+  for (k=0; k < stream->num_transfers && !stream->polled; ++k)
+    {
+      ret = libusb_submit_transfer (stream->transfers[k]);
+      if (ret != LIBUSB_SUCCESS)
+        break;
+      stream->in_flight++;
+    }
+
+  stream->running = 1;
+  if (ret != LIBUSB_SUCCESS)
+    liballuris_stream_stop (stream);
+  else if (!stream->polled)
+    {
+      device_lock (stream->dev);
+      stream->dev->stream = stream;
+      device_unlock (stream->dev, LIBALLURIS_SUCCESS);
+    }
+  return ret;
+}
+
+//! Internal: receive one packet of a stream on a transport, see liballuris_stream_handle_events
+static int stream_poll (struct liballuris_stream* stream, unsigned int timeout)
+{
+  if (!stream->in_flight)
+    {
+      int ret = stream->error;
+      stream->error = 0;
+      return ret;
+    }
+
+  unsigned char buf[DEFAULT_SEND_BUF_LEN];
+  int actual;
+  // a timeout of 0 means unlimited for interrupt transfers
+  int r = device_transfer (stream->dev, 0x81 | LIBUSB_ENDPOINT_IN, buf, sizeof (buf), &actual, (timeout)? timeout : 1);
+  if (r == LIBUSB_SUCCESS)
+    stream_deliver (stream, buf, actual);
+  else if (r != LIBUSB_ERROR_TIMEOUT)
+    {
+      stream->stats.transfer_errors++;
+      stream->in_flight = 0;
+      return r;
+    }
+  return LIBALLURIS_SUCCESS;
+}
+
+/*!
+ * \brief Handle pending libusb events and dispatch completed blocks
+ *
+ * Blocks at most timeout milliseconds. The callback passed to \ref liballuris_stream_open
+ * is called from within this function.
+ *
+ * \param[in] stream created with \ref liballuris_stream_open
+ * \param[in] timeout in milliseconds
+ * \return 0 if successful else \ref liballuris_error. An error of the stream (for example
+ * LIBUSB_ERROR_NO_DEVICE if the device was disconnected) is reported once.
+ */
+int liballuris_stream_handle_events (struct liballuris_stream* stream, unsigned int timeout)
+{
+  if (stream->polled)
+    return stream_poll (stream, timeout);
+
+  struct timeval tv;
+  tv.tv_sec = timeout / 1000;
+  tv.tv_usec = (timeout % 1000) * 1000;
+
+  int ret = libusb_handle_events_timeout_completed (stream->ctx, &tv, NULL);
+  if (ret == LIBUSB_SUCCESS && stream->error)
+    {
+      ret = stream->error;
+      stream->error = 0;
+    }
+  return ret;
+}
+
+/*!
+ * \brief Handle pending libusb events without blocking
+ *
+ * Meant for applications with their own event loop: wait with poll, select or epoll on the
+ * descriptors from \ref liballuris_get_pollfds (and the timeout from \ref liballuris_get_next_timeout)
+ * next to sockets and timers and call this function if one of them is ready.
+ * Completed blocks are passed to the callback, the ring or the internal queue before it returns,
+ * thus \ref liballuris_stream_read with timeout 0 returns them immediately.
+ *
+ * The events of all streams on the same libusb context are handled, but errors are only
+ * reported for the given stream.
+ *
+ * \param[in] stream created with \ref liballuris_stream_open
+ * \return 0 if successful else \ref liballuris_error, see \ref liballuris_stream_handle_events
+ */
+int liballuris_stream_dispatch (struct liballuris_stream* stream)
+{
+  return liballuris_stream_handle_events (stream, 0);
+}
+
+/*!
+ * \brief Get the file descriptors to watch for libusb events
+ *
+ * Add them to the poll set of the application and call \ref liballuris_stream_dispatch
+ * if one is ready. The set may change when devices are opened or closed, use
+ * \ref liballuris_set_pollfd_notifiers to get informed.
+ *
+ * \param[in] ctx pointer to libusb context
+ * \param[out] fds output location for the descriptors, fd and events are set, revents is cleared
+ * \param[in] length of fds
+ * \param[out] num_fds total number of descriptors, may be > length
+ * \return 0 if successful, LIBUSB_ERROR_NOT_SUPPORTED if the platform has no pollable descriptors
+ * or LIBALLURIS_OUT_OF_RANGE if fds is too small
+ */
+int liballuris_get_pollfds (libusb_context* ctx, struct pollfd* fds, size_t length, size_t* num_fds)
+{
+  *num_fds = 0;
+  const struct libusb_pollfd** list = libusb_get_pollfds (ctx);
+  if (!list)
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+
+  size_t k;
+  for (k=0; list[k]; ++k)
+    if (k < length)
+      {
+        fds[k].fd = list[k]->fd;
+        fds[k].events = list[k]->events;
+        fds[k].revents = 0;
+      }
+  libusb_free_pollfds (list);
+
+  *num_fds = k;
+  return (k > length)? LIBALLURIS_OUT_OF_RANGE : LIBALLURIS_SUCCESS;
+}
+
+/*!
+ * \brief Get the timeout for the next poll call
+ *
+ * Some platforms can't signal libusb timeouts via the descriptors of \ref liballuris_get_pollfds.
+ * Then the application has to wait at most timeout_ms before calling \ref liballuris_stream_dispatch.
+ *
+ * \param[in] ctx pointer to libusb context
+ * \param[out] timeout_ms maximum time to wait in milliseconds (rounded up) or -1 if there is no pending timeout,
+ * thus it can be passed to poll directly
+ * \return 0 if successful else \ref liballuris_error
+ */
+int liballuris_get_next_timeout (libusb_context* ctx, int* timeout_ms)
+{
+  *timeout_ms = -1;
+  if (libusb_pollfds_handle_timeouts (ctx))
+    return LIBALLURIS_SUCCESS;
+
+  struct timeval tv;
+  int r = libusb_get_next_timeout (ctx, &tv);
+  if (r < 0)
+    return r;
+  if (r == 1)
+    *timeout_ms = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+  return LIBALLURIS_SUCCESS;
+}
+
+/*!
+ * \brief Get informed if a descriptor of \ref liballuris_get_pollfds is added or removed
+ *
+ * Thin wrapper around libusb_set_pollfd_notifiers.
+ *
+ * \param[in] ctx pointer to libusb context
+ * \param[in] added_cb called with the new descriptor and its events or NULL
+ * \param[in] removed_cb called with the removed descriptor or NULL
+ * \param[in] user_data passed to the callbacks
+ */
+void liballuris_set_pollfd_notifiers (libusb_context* ctx, libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb, void* user_data)
+{
+  libusb_set_pollfd_notifiers (ctx, added_cb, removed_cb, user_data);
+}
+
+//! Internal: copy up to length queued values, a partially read block stays at the head of the queue
+static size_t stream_dequeue (struct liballuris_stream* stream, int* buf, int64_t* timestamps_ns, size_t length)
+{
+  size_t cnt = 0;
+  while (stream->queue_count && cnt < length)
+    {
+      size_t block_size = stream->queue_sizes[stream->queue_head];
+      size_t offset = stream->queue_head * MAX_BLOCK_SIZE + stream->queue_offset;
+      size_t n = block_size - stream->queue_offset;
+      if (n > length - cnt)
+        n = length - cnt;
+      memcpy (buf + cnt, stream->queue + offset, n * sizeof (int));
+      if (timestamps_ns)
+        memcpy (timestamps_ns + cnt, stream->queue_timestamps + offset, n * sizeof (int64_t));
+      cnt += n;
+      stream->queue_offset += n;
+      if (stream->queue_offset == block_size)
+        {
+          stream->queue_head = (stream->queue_head + 1) % stream->queue_len;
+          stream->queue_count--;
+          stream->queue_offset = 0;
+        }
+    }
+  return cnt;
+}
+
+/*!
+ * \brief Read the oldest queued block
+ *
+ * Only available if the stream was opened without callback. Events are handled
+ * until a block is available or timeout expires.
+ * If length is smaller than the block_size the remaining values are returned by the next read.
+ *
+ * \param[in] stream created with \ref liballuris_stream_open
+ * \param[out] buf output location for the measurements. Only populated if the return code is 0.
+ * \param[in] length of buf, should be >= block_size of the stream
+ * \param[out] actual_num_values number of values copied to buf, 0 if the timeout expired
+ * \param[in] timeout in milliseconds
+ * \return 0 if successful else \ref liballuris_error. LIBALLURIS_TIMEOUT if no block is available.
+ */
+int liballuris_stream_read (struct liballuris_stream* stream, int* buf, size_t length, size_t *actual_num_values, unsigned int timeout)
+{
+  return liballuris_stream_read_timestamps (stream, buf, NULL, length, actual_num_values, timeout);
+}
+
+/*!
+ * \brief Read the oldest queued block with the interpolated timestamp of each sample
+ *
+ * Same as \ref liballuris_stream_read. If timestamps_ns isn't NULL it's populated with
+ * the CLOCK_MONOTONIC time in ns of each value, see \ref liballuris_block.timestamps_ns.
+ */
+int liballuris_stream_read_timestamps (struct liballuris_stream* stream, int* buf, int64_t* timestamps_ns, size_t length, size_t *actual_num_values, unsigned int timeout)
+{
+  *actual_num_values = 0;
+  if (stream->cb || stream->ring)
+    return LIBALLURIS_DEVICE_BUSY;
+
+  struct timeval end, now;
+  gettimeofday (&end, NULL);
+  end.tv_sec += timeout / 1000;
+  end.tv_usec += (timeout % 1000) * 1000;
+  if (end.tv_usec >= 1000000)
+    {
+      end.tv_sec++;
+      end.tv_usec -= 1000000;
+    }
+
+  while (!stream->queue_count)
+    {
+      if (!stream->in_flight)
+        return (stream->error)? stream->error : LIBALLURIS_DEVICE_BUSY;
+
+      gettimeofday (&now, NULL);
+      long remaining = (end.tv_sec - now.tv_sec) * 1000 + (end.tv_usec - now.tv_usec) / 1000;
+      if (remaining <= 0)
+        return LIBALLURIS_TIMEOUT;
+
+      int ret = liballuris_stream_handle_events (stream, remaining);
+      if (ret)
+        return ret;
+    }
+
+  size_t n = stream->queue_sizes[stream->queue_head] - stream->queue_offset;
+  if (n > length)
+    n = length;
+  *actual_num_values = stream_dequeue (stream, buf, timestamps_ns, n);
+  return LIBALLURIS_SUCCESS;
+}
+
+/*!
+ * \brief Fill a large buffer with consecutive values of many packets
+ *
+ * Only available if the stream was opened without callback. Events are handled and the
+ * queued blocks are copied into buf until length values are read or the timeout expires.
+ * Thus the number of values per call isn't limited by the block size of 19 values.
+ *
+ * \param[in] stream created with \ref liballuris_stream_open
+ * \param[out] buf output location for the measurements
+ * \param[out] timestamps_ns output location for the sample times (see \ref liballuris_block.timestamps_ns) or NULL
+ * \param[in] length of buf (and timestamps_ns), any size
+ * \param[out] actual_num_values number of values copied to buf, < length if the timeout expired
+ * \param[in] timeout in milliseconds, deadline for the whole call
+ * \return 0 if at least one value was read else \ref liballuris_error. LIBALLURIS_TIMEOUT if no value is available.
+ * \sa liballuris_stream_read
+ */
+int liballuris_stream_read_bulk (struct liballuris_stream* stream, int* buf, int64_t* timestamps_ns, size_t length, size_t *actual_num_values, unsigned int timeout)
+{
+  *actual_num_values = 0;
+  if (stream->cb || stream->ring)
+    return LIBALLURIS_DEVICE_BUSY;
+
+  int64_t end = monotonic_ns () + (int64_t) timeout * 1000000;
+  size_t cnt = 0;
+  int ret = LIBALLURIS_SUCCESS;
+  while (1)
+    {
+      cnt += stream_dequeue (stream, buf + cnt, (timestamps_ns)? timestamps_ns + cnt : NULL, length - cnt);
+      if (cnt == length)
+        break;
+
+      if (!stream->in_flight)
+        {
+          ret = (stream->error)? stream->error : LIBALLURIS_DEVICE_BUSY;
+          break;
+        }
+
+      int64_t remaining = (end - monotonic_ns ()) / 1000000;
+      if (remaining <= 0)
+        {
+          ret = LIBALLURIS_TIMEOUT;
+          break;
+        }
+
+      ret = liballuris_stream_handle_events (stream, remaining);
+      if (ret)
+        break;
+    }
+
+  *actual_num_values = cnt;
+  // values already read are returned, the error is reported by the next call
+  if (cnt && ret)
+    {
+      if (ret != LIBALLURIS_TIMEOUT && !stream->error)
+        stream->error = ret;
+      ret = LIBALLURIS_SUCCESS;
+    }
+  return ret;
+}
+
+/*!
+ * \brief Cancel the pending transfers and disable cyclic measurements
+ *
+ * \param[in] stream created with \ref liballuris_stream_open
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_stream_start
+ */
+int liballuris_stream_stop (struct liballuris_stream* stream)
+{
+  if (!stream->running)
+    return LIBALLURIS_SUCCESS;
+
+  stream->stopping = 1;
+  if (stream->dev->stream == stream)
+    async_stream_detach (stream->dev);
+  if (stream->polled)
+    stream->in_flight = 0;
+  size_t k;
+  for (k=0; k < stream->num_transfers && !stream->polled; ++k)
+    libusb_cancel_transfer (stream->transfers[k]);
+  if (stream->resize_in_flight)
+    libusb_cancel_transfer (stream->resize_transfer);
+
+  // wait until all cancelled transfers are returned from libusb, they are freed in liballuris_stream_close
+  while (stream->in_flight)
+    {
+      struct timeval tv = {0, 20000};
+      libusb_handle_events_timeout_completed (stream->ctx, &tv, NULL);
+    }
+
+  stream->running = 0;
+  // a gap shortly before the stop, a few packets are enough since no more are delayed
+  if (stream->seq_samples && stream->gap_window_packets >= 4)
+    stream_end_gap_window (stream, monotonic_ns ());
+  int ret = liballuris_device_cyclic_measurement (stream->dev, 0, stream->block_size);
+
+  // discard remaining packets
+  liballuris_device_clear_RX (stream->dev, 10);
+  return ret;
+}
+
+/*!
+ * \brief Stop the stream if it's running and free all resources
+ *
+ * \param[in] stream created with \ref liballuris_stream_open
+ */
+void liballuris_stream_close (struct liballuris_stream* stream)
+{
+  if (!stream)
+    return;
+
+  liballuris_stream_stop (stream);
+
+  if (stream->transfers)
+    {
+      size_t k;
+      for (k=0; k < stream->num_transfers; ++k)
+        libusb_free_transfer (stream->transfers[k]);
+      free (stream->transfers);
+    }
+  libusb_free_transfer (stream->resize_transfer);
+  free (stream->queue);
+  free (stream->queue_timestamps);
+  free (stream->queue_sizes);
+  if (stream->owns_dev)
+    liballuris_device_close (stream->dev);
+  free (stream);
+}
+
+/****************************************************************************************/
+
+/*!
+ * \brief Lock-free single-producer/single-consumer ring of measurement values
+ *
+ * head and tail are free running counters, the index into values is counter & mask.
+ * Only the producer writes tail and the producer statistics, only the consumer writes head.
+ * mutex and cond are only used to put a waiting consumer to sleep.
+ */
+struct liballuris_ring
+{
+  int* values;
+  size_t capacity;             // power of 2
+  size_t mask;
+  atomic_size_t head;          // next value to read
+  atomic_size_t tail;          // next value to write
+  atomic_int waiting;          // consumer sleeps in liballuris_ring_wait
+
+  // producer statistics
+  atomic_ullong written;
+  atomic_ullong overflow_values;
+  atomic_ullong overflow_events;
+  atomic_size_t high_water;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+/*!
+ * \brief Create a ring buffer for measurement values
+ *
+ * The ring decouples the thread which handles the USB events (producer) from one
+ * consumer thread. If the ring is full, new values are dropped and counted, see
+ * \ref liballuris_ring_get_stats.
+ *
+ * \param[in] capacity minimum number of values, rounded up to the next power of 2
+ * \param[out] ring storage for the created ring. Free it with \ref liballuris_ring_free
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_stream_set_ring, liballuris_multi_set_ring
+ */
+int liballuris_ring_new (size_t capacity, struct liballuris_ring** ring)
+{
+  if (capacity < 1)
+    return LIBALLURIS_OUT_OF_RANGE;
+
+  size_t c = 1;
+  while (c < capacity)
+    c <<= 1;
+
+  struct liballuris_ring* r = calloc (1, sizeof (struct liballuris_ring));
+  if (!r)
+    return LIBUSB_ERROR_NO_MEM;
+  r->values = malloc (c * sizeof (int));
+  if (!r->values)
+    {
+      free (r);
+      return LIBUSB_ERROR_NO_MEM;
+    }
+  r->capacity = c;
+  r->mask = c - 1;
+  atomic_init (&r->head, 0);
+  atomic_init (&r->tail, 0);
+  atomic_init (&r->waiting, 0);
+  atomic_init (&r->written, 0);
+  atomic_init (&r->overflow_values, 0);
+  atomic_init (&r->overflow_events, 0);
+  atomic_init (&r->high_water, 0);
+
+  pthread_condattr_t attr;
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&r->cond, &attr);
+  pthread_condattr_destroy (&attr);
+  pthread_mutex_init (&r->mutex, NULL);
+
+  *ring = r;
+  return LIBALLURIS_SUCCESS;
+}
+
+//! Free a ring created with \ref liballuris_ring_new. Producer and consumer must not use it anymore.
+void liballuris_ring_free (struct liballuris_ring* ring)
+{
+  if (!ring)
+    return;
+  pthread_cond_destroy (&ring->cond);
+  pthread_mutex_destroy (&ring->mutex);
+  free (ring->values);
+  free (ring);
+}
+
+/*!
+ * \brief Append values to the ring (producer side)
+ *
+ * Never blocks. Values which don't fit are dropped and counted as overflow.
+ * \param[in] ring created with \ref liballuris_ring_new
+ * \param[in] values to append
+ * \param[in] length number of values
+ * \return number of values actually written
+ */
+size_t liballuris_ring_write (struct liballuris_ring* ring, const int* values, size_t length)
+{
+  size_t tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit (&ring->head, memory_order_acquire);
+  size_t space = ring->capacity - (tail - head);
+  size_t n = (length < space)? length : space;
+
+  if (n < length)
+    {
+      atomic_fetch_add_explicit (&ring->overflow_values, length - n, memory_order_relaxed);
+      atomic_fetch_add_explicit (&ring->overflow_events, 1, memory_order_relaxed);
+    }
+
+  // copy in max. two chunks because of the wrap around
+  size_t idx = tail & ring->mask;
+  size_t first = (n < ring->capacity - idx)? n : ring->capacity - idx;
+  memcpy (ring->values + idx, values, first * sizeof (int));
+  memcpy (ring->values, values + first, (n - first) * sizeof (int));
+
+  atomic_store (&ring->tail, tail + n);
+  atomic_fetch_add_explicit (&ring->written, n, memory_order_relaxed);
+
+  size_t used = tail + n - head;
+  if (used > atomic_load_explicit (&ring->high_water, memory_order_relaxed))
+    atomic_store_explicit (&ring->high_water, used, memory_order_relaxed);
+
+  // sequentially consistent with the store to tail, see liballuris_ring_wait
+  if (n && atomic_load (&ring->waiting))
+    {
+      pthread_mutex_lock (&ring->mutex);
+      pthread_cond_signal (&ring->cond);
+      pthread_mutex_unlock (&ring->mutex);
+    }
+  return n;
+}
+
+/*!
+ * \brief Remove up to length values from the ring (consumer side)
+ *
+ * Never blocks, see \ref liballuris_ring_wait.
+ * \param[in] ring created with \ref liballuris_ring_new
+ * \param[out] buf output location for the values
+ * \param[in] length of buf
+ * \return number of values copied to buf
+ */
+size_t liballuris_ring_read (struct liballuris_ring* ring, int* buf, size_t length)
+{
+  size_t head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit (&ring->tail, memory_order_acquire);
+  size_t avail = tail - head;
+  size_t n = (length < avail)? length : avail;
+
+  size_t idx = head & ring->mask;
+  size_t first = (n < ring->capacity - idx)? n : ring->capacity - idx;
+  memcpy (buf, ring->values + idx, first * sizeof (int));
+  memcpy (buf + first, ring->values, (n - first) * sizeof (int));
+
+  atomic_store_explicit (&ring->head, head + n, memory_order_release);
+  return n;
+}
+
+//! Number of values which can be read without waiting
+size_t liballuris_ring_available (struct liballuris_ring* ring)
+{
+  return atomic_load_explicit (&ring->tail, memory_order_acquire)
+         - atomic_load_explicit (&ring->head, memory_order_relaxed);
+}
+
+/*!
+ * \brief Wait until at least min_values can be read (consumer side)
+ * \param[in] ring created with \ref liballuris_ring_new
+ * \param[in] min_values number of values to wait for, limited to the capacity
+ * \param[in] timeout in milliseconds
+ * \return 0 if successful else LIBALLURIS_TIMEOUT
+ */
+int liballuris_ring_wait (struct liballuris_ring* ring, size_t min_values, unsigned int timeout)
+{
+  if (min_values > ring->capacity)
+    min_values = ring->capacity;
+  if (liballuris_ring_available (ring) >= min_values)
+    return LIBALLURIS_SUCCESS;
+
+  struct timespec deadline;
+  clock_gettime (CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout / 1000;
+  deadline.tv_nsec += (timeout % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+
+  int ret = LIBALLURIS_SUCCESS;
+  pthread_mutex_lock (&ring->mutex);
+  atomic_store (&ring->waiting, 1);
+  // the producer either sees waiting == 1 and signals or we see the new tail here
+  while (atomic_load (&ring->tail) - atomic_load_explicit (&ring->head, memory_order_relaxed) < min_values)
+    if (pthread_cond_timedwait (&ring->cond, &ring->mutex, &deadline))
+      {
+        if (liballuris_ring_available (ring) < min_values)
+          ret = LIBALLURIS_TIMEOUT;
+        break;
+      }
+  atomic_store (&ring->waiting, 0);
+  pthread_mutex_unlock (&ring->mutex);
+  return ret;
+}
+
+/*!
+ * \brief Get the counters of a ring
+ *
+ * Use the overflow counters and high_water to size the ring.
+ */
+void liballuris_ring_get_stats (struct liballuris_ring* ring, struct liballuris_ring_stats* stats)
+{
+  stats->capacity = ring->capacity;
+  stats->written = atomic_load_explicit (&ring->written, memory_order_relaxed);
+  stats->read = atomic_load_explicit (&ring->head, memory_order_relaxed);
+  stats->overflow_values = atomic_load_explicit (&ring->overflow_values, memory_order_relaxed);
+  stats->overflow_events = atomic_load_explicit (&ring->overflow_events, memory_order_relaxed);
+  stats->high_water = atomic_load_explicit (&ring->high_water, memory_order_relaxed);
+}
+
+/****************************************************************************************/
+// stream publication in POSIX shared memory
+
+#define SHM_MAGIC 0x48534c41u   // "ALSH" in little endian
+#define SHM_VERSION 2
+#define SHM_MAX_CAPACITY (1u << 28)
+#define SHM_POLL_NS 1000000     // sleep between checks of liballuris_shm_wait
+
+// Internal: struct liballuris_shm_info with fixed-width fields, naturally aligned
+struct shm_info
+{
+  char serial_number[32];
+  int32_t fmax;
+  int32_t digits;
+  int32_t resolution;
+  int32_t unit;
+  int32_t mode;
+  int32_t measuring;
+  int64_t sample_period_ns;
+  uint32_t capacity;
+  uint32_t reserved;
+};
+
+/*!
+ * \brief Header of the shared memory segment, followed by the values and timestamps
+ *
+ * Only fixed-width fields are used and the counters are 32 bit so that the layout and the
+ * lock-free atomics are the same on all platforms. The counters are free running, the index
+ * into the arrays is counter & (capacity - 1).
+ * The writer raises begin before it overwrites slots and end after it, thus a reader
+ * knows which of the values it copied were valid the whole time. info is protected by the
+ * sequence counter info_seq which is odd while the writer updates it.
+ */
+struct shm_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;           // power of 2
+  int32_t writer_pid;          // checked before a segment with the same name is replaced
+  atomic_uint closed;          // set by the writer in liballuris_shm_close
+  atomic_uint info_seq;
+  atomic_uint begin;
+  atomic_uint end;
+  struct shm_info info;
+};
+
+// the arrays start at the next cache line after the header
+#define SHM_HEADER_SIZE ((sizeof (struct shm_header) + 63) & ~(size_t) 63)
+
+//! Process local view of a shared memory ring, either the writer or a reader
+struct liballuris_shm
+{
+  struct shm_header* hdr;
+  int* values;
+  int64_t* timestamps;
+  size_t size;                 // of the mapping
+  char* name;                  // only set for the writer, unlinked in liballuris_shm_close
+  uint32_t cursor;             // next value to read
+  unsigned long long lost;     // values overwritten before the reader got them
+};
+
+static size_t shm_size (uint32_t capacity)
+{
+  return SHM_HEADER_SIZE + capacity * (sizeof (int64_t) + sizeof (int));
+}
+
+static void shm_map (struct liballuris_shm* s, void* p, size_t size)
+{
+  s->hdr = p;
+  s->size = size;
+  s->timestamps = (int64_t*) ((char*) p + SHM_HEADER_SIZE);
+  s->values = (int*) (s->timestamps + s->hdr->capacity);
+}
+
+static void shm_info_store (struct shm_info* dst, const struct liballuris_shm_info* src, uint32_t capacity)
+{
+  memset (dst, 0, sizeof (struct shm_info));
+  memcpy (dst->serial_number, src->serial_number, sizeof (src->serial_number));
+  dst->fmax = src->metadata.fmax;
+  dst->digits = src->metadata.digits;
+  dst->resolution = src->metadata.resolution;
+  dst->unit = src->metadata.unit;
+  dst->mode = src->metadata.mode;
+  dst->measuring = src->metadata.measuring;
+  dst->sample_period_ns = src->sample_period_ns;
+  dst->capacity = capacity;
+}
+
+static void shm_info_load (struct liballuris_shm_info* dst, const struct shm_info* src)
+{
+  memset (dst, 0, sizeof (struct liballuris_shm_info));
+  memcpy (dst->serial_number, src->serial_number, sizeof (dst->serial_number) - 1);
+  dst->metadata.fmax = src->fmax;
+  dst->metadata.digits = src->digits;
+  dst->metadata.resolution = src->resolution;
+  dst->metadata.unit = src->unit;
+  dst->metadata.mode = src->mode;
+  dst->metadata.measuring = src->measuring;
+  dst->sample_period_ns = src->sample_period_ns;
+  dst->capacity = src->capacity;
+}
+
+/*!
+ * \brief Internal: check if an existing segment may be replaced
+ *
+ * That's the case if its writer closed it or died without closing it.
+ * Segments of a running writer or of an unknown format are kept.
+ */
+static int shm_is_stale (const char* name)
+{
+  int fd = shm_open (name, O_RDONLY, 0);
+  if (fd < 0)
+    return (errno == ENOENT);
+
+  struct stat st;
+  int stale = 0;
+  if (! fstat (fd, &st) && (size_t) st.st_size >= sizeof (struct shm_header))
+    {
+      void* p = mmap (NULL, sizeof (struct shm_header), PROT_READ, MAP_SHARED, fd, 0);
+      if (p != MAP_FAILED)
+        {
+          struct shm_header* h = p;
+          if (h->magic == SHM_MAGIC && h->version == SHM_VERSION)
+            stale = atomic_load (&h->closed)
+                    || (kill ((pid_t) h->writer_pid, 0) && errno == ESRCH);
+          munmap (p, sizeof (struct shm_header));
+        }
+    }
+  close (fd);
+  return stale;
+}
+
+static int shm_errno_to_error (int e)
+{
+  switch (e)
+    {
+    case ENOENT:
+      return LIBUSB_ERROR_NOT_FOUND;
+    case EACCES:
+    case EPERM:
+      return LIBUSB_ERROR_ACCESS;
+    case EEXIST:
+      return LIBUSB_ERROR_BUSY;
+    case ENOMEM:
+    case ENOSPC:
+      return LIBUSB_ERROR_NO_MEM;
+    default:
+      return LIBUSB_ERROR_OTHER;
+    }
+}
+
+/*!
+ * \brief Create a shared memory ring and become its writer
+ *
+ * The ring lets any number of local processes read a stream without copying it through
+ * pipes, see \ref liballuris_shm_open. The writer never waits for the readers: if the ring
+ * is full the oldest values are overwritten and slow readers count them as lost.
+ * A segment with the same name is only replaced if its writer closed it or doesn't run
+ * anymore (for example after a crash), else LIBUSB_ERROR_BUSY is returned.
+ *
+ * Publish the blocks of a stream by passing \ref liballuris_shm_publish_cb and the ring as
+ * callback to \ref liballuris_stream_open, or write values with \ref liballuris_shm_write.
+ * Only one thread may write.
+ *
+ * \param[in] name of the POSIX shared memory object, for example "/alluris-P.25412"
+ * \param[in] capacity minimum number of values, rounded up to the next power of 2
+ * \param[in] info description of the stream for the readers, may be NULL
+ * \param[out] shm storage for the created ring. Free it with \ref liballuris_shm_close
+ * \return 0 if successful else \ref liballuris_error
+ */
+int liballuris_shm_create (const char* name, size_t capacity, const struct liballuris_shm_info* info, struct liballuris_shm** shm)
+{
+  if (capacity < 1 || capacity > SHM_MAX_CAPACITY)
+    return LIBALLURIS_OUT_OF_RANGE;
+
+  uint32_t c = 1;
+  while (c < capacity)
+    c <<= 1;
+
+  struct liballuris_shm* s = calloc (1, sizeof (struct liballuris_shm));
+  if (!s)
+    return LIBUSB_ERROR_NO_MEM;
+  s->name = strdup (name);
+  if (!s->name)
+    {
+      free (s);
+      return LIBUSB_ERROR_NO_MEM;
+    }
+
+  int fd = shm_open (name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  // shm_is_stale overwrites errno
+  int open_errno = errno;
+  if (fd < 0 && open_errno == EEXIST && shm_is_stale (name))
+    {
+      shm_unlink (name);
+      fd = shm_open (name, O_CREAT | O_EXCL | O_RDWR, 0644);
+      open_errno = errno;
+    }
+  size_t size = shm_size (c);
+  void* p = MAP_FAILED;
+  int ret = LIBALLURIS_SUCCESS;
+  if (fd < 0)
+    ret = shm_errno_to_error (open_errno);
+  else if (ftruncate (fd, size))
+    ret = shm_errno_to_error (errno);
+  else
+    {
+      p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED)
+        ret = shm_errno_to_error (errno);
+    }
+  if (fd >= 0)
+    close (fd);
+  if (ret)
+    {
+      if (fd >= 0)
+        shm_unlink (name);
+      free (s->name);
+      free (s);
+      return ret;
+    }
+
+  // ftruncate zeroed the segment
+  struct shm_header* h = p;
+  h->version = SHM_VERSION;
+  h->capacity = c;
+  h->writer_pid = (int32_t) getpid ();
+  if (info)
+    shm_info_store (&h->info, info, c);
+  h->info.capacity = c;
+  atomic_init (&h->closed, 0);
+  atomic_init (&h->info_seq, 0);
+  atomic_init (&h->begin, 0);
+  atomic_init (&h->end, 0);
+  // readers check the magic last
+  atomic_thread_fence (memory_order_release);
+  h->magic = SHM_MAGIC;
+
+  shm_map (s, p, size);
+  *shm = s;
+  return LIBALLURIS_SUCCESS;
+}
+
+/*!
+ * \brief Append values to a shared memory ring (writer side)
+ *
+ * Never blocks, the oldest values are overwritten if the ring is full.
+ * \param[in] shm created with \ref liballuris_shm_create
+ * \param[in] values to append
+ * \param[in] timestamps_ns CLOCK_MONOTONIC time of each value or NULL
+ * \param[in] length number of values
+ * \return 0 if successful, LIBUSB_ERROR_ACCESS if shm was opened by a reader
+ */
+int liballuris_shm_write (struct liballuris_shm* shm, const int* values, const int64_t* timestamps_ns, size_t length)
+{
+  if (!shm->name)
+    return LIBUSB_ERROR_ACCESS;
+
+  struct shm_header* h = shm->hdr;
+  uint32_t mask = h->capacity - 1;
+  uint32_t end = atomic_load_explicit (&h->end, memory_order_relaxed);
+  atomic_store_explicit (&h->begin, end + (uint32_t) length, memory_order_relaxed);
+  // the new begin is visible before any slot is overwritten
+  atomic_thread_fence (memory_order_seq_cst);
+
+  size_t k;
+  for (k=0; k < length; ++k)
+    {
+      uint32_t idx = (end + k) & mask;
+      shm->values[idx] = values[k];
+      shm->timestamps[idx] = (timestamps_ns)? timestamps_ns[k] : 0;
+    }
+  atomic_store_explicit (&h->end, end + (uint32_t) length, memory_order_release);
+  return LIBALLURIS_SUCCESS;
+}
+
+/*!
+ * \brief Update the description of the stream (writer side)
+ *
+ * Readers never see a partially written info, see \ref liballuris_shm_get_info.
+ * The capacity is kept.
+ * \param[in] shm created with \ref liballuris_shm_create
+ * \param[in] info new description
+ */
+void liballuris_shm_set_info (struct liballuris_shm* shm, const struct liballuris_shm_info* info)
+{
+  if (!shm->name)
+    return;
+
+  struct shm_header* h = shm->hdr;
+  unsigned int seq = atomic_load_explicit (&h->info_seq, memory_order_relaxed);
+  atomic_store_explicit (&h->info_seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence (memory_order_release);
+  shm_info_store (&h->info, info, h->capacity);
+  atomic_store_explicit (&h->info_seq, seq + 2, memory_order_release);
+}
+
+/*!
+ * \brief Stream callback which publishes each block in a shared memory ring
+ *
+ * Pass it together with the ring as user_data to \ref liballuris_stream_open.
+ * A change of the sample period (for example after a mode change) is published with
+ * \ref liballuris_shm_set_info.
+ * \param[in] block decoded values
+ * \param[in] user_data ring created with \ref liballuris_shm_create
+ */
+void liballuris_shm_publish_cb (const struct liballuris_block* block, void* user_data)
+{
+  struct liballuris_shm* shm = user_data;
+  if (block->sample_period_ns && block->sample_period_ns != shm->hdr->info.sample_period_ns)
+    {
+      struct liballuris_shm_info info;
+      shm_info_load (&info, &shm->hdr->info);
+      info.sample_period_ns = block->sample_period_ns;
+      liballuris_shm_set_info (shm, &info);
+    }
+  liballuris_shm_write (shm, block->values, block->timestamps_ns, block->num_values);
+}
+
+/*!
+ * \brief Map a shared memory ring read-only (reader side)
+ *
+ * Any number of readers may open the same ring, each one has its own read position
+ * which starts at the newest value, thus only values published after this call are read.
+ * \param[in] name of the POSIX shared memory object, see \ref liballuris_shm_create
+ * \param[out] shm storage for the reader. Free it with \ref liballuris_shm_close
+ * \return 0 if successful else \ref liballuris_error, LIBUSB_ERROR_NOT_FOUND if there is no such ring
+ * and LIBALLURIS_MALFORMED_REPLY if the object isn't a ring of this version
+ */
+int liballuris_shm_open (const char* name, struct liballuris_shm** shm)
+{
+  int fd = shm_open (name, O_RDONLY, 0);
+  if (fd < 0)
+    return shm_errno_to_error (errno);
+
+  struct stat st;
+  void* p = MAP_FAILED;
+  int ret = LIBALLURIS_SUCCESS;
+  if (fstat (fd, &st))
+    ret = shm_errno_to_error (errno);
+  else if ((size_t) st.st_size < SHM_HEADER_SIZE)
+    ret = LIBALLURIS_MALFORMED_REPLY;
+  else
+    {
+      p = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED)
+        ret = shm_errno_to_error (errno);
+    }
+  close (fd);
+  if (ret)
+    return ret;
+
+  struct shm_header* h = p;
+  uint32_t magic = h->magic;
+  atomic_thread_fence (memory_order_acquire);
+  if (magic != SHM_MAGIC || h->version != SHM_VERSION || !h->capacity
+      || (h->capacity & (h->capacity - 1)) || shm_size (h->capacity) > (size_t) st.st_size)
+    {
+      munmap (p, st.st_size);
+      return LIBALLURIS_MALFORMED_REPLY;
+    }
+
+  struct liballuris_shm* s = calloc (1, sizeof (struct liballuris_shm));
+  if (!s)
+    {
+      munmap (p, st.st_size);
+      return LIBUSB_ERROR_NO_MEM;
+    }
+  shm_map (s, p, st.st_size);
+  s->cursor = atomic_load_explicit (&h->end, memory_order_acquire);
+  *shm = s;
+  return LIBALLURIS_SUCCESS;
+}
+
+/*!
+ * \brief Get a consistent copy of the stream description
+ * \param[in] shm writer or reader
+ * \param[out] info output location for the description
+ */
+void liballuris_shm_get_info (struct liballuris_shm* shm, struct liballuris_shm_info* info)
+{
+  struct shm_header* h = shm->hdr;
+  unsigned int seq;
+  struct shm_info tmp;
+  do
+    {
+      seq = atomic_load_explicit (&h->info_seq, memory_order_acquire);
+      memcpy (&tmp, &h->info, sizeof (struct shm_info));
+      atomic_thread_fence (memory_order_acquire);
+    }
+  while ((seq & 1) || seq != atomic_load_explicit (&h->info_seq, memory_order_relaxed));
+  shm_info_load (info, &tmp);
+}
+
+/*!
+ * \brief Read up to length values from a shared memory ring (reader side)
+ *
+ * Never blocks, see \ref liballuris_shm_wait. Values which were overwritten by the writer
+ * before (or while) they were copied are skipped and counted, see \ref liballuris_shm_get_lost.
+ * \param[in] shm opened with \ref liballuris_shm_open
+ * \param[out] buf output location for the values
+ * \param[out] timestamps_ns output location for the timestamps or NULL
+ * \param[in] length of buf and timestamps_ns
+ * \param[out] actual_num_values number of values copied to buf
+ * \return 0 if successful, LIBUSB_ERROR_NO_DEVICE if the writer closed the ring and all values were read
+ */
+int liballuris_shm_read (struct liballuris_shm* shm, int* buf, int64_t* timestamps_ns, size_t length, size_t* actual_num_values)
+{
+  struct shm_header* h = shm->hdr;
+  uint32_t capacity = h->capacity;
+  uint32_t mask = capacity - 1;
+  char closed = atomic_load_explicit (&h->closed, memory_order_acquire);
+  uint32_t end = atomic_load_explicit (&h->end, memory_order_acquire);
+  uint32_t avail = end - shm->cursor;
+  if (avail > capacity)
+    {
+      shm->lost += avail - capacity;
+      shm->cursor = end - capacity;
+      avail = capacity;
+    }
+  size_t n = (length < avail)? length : avail;
+
+  size_t k;
+  for (k=0; k < n; ++k)
+    {
+      uint32_t idx = (shm->cursor + k) & mask;
+      buf[k] = shm->values[idx];
+      if (timestamps_ns)
+        timestamps_ns[k] = shm->timestamps[idx];
+    }
+
+  // slots before begin - capacity may have been overwritten during the copy
+  atomic_thread_fence (memory_order_acquire);
+  uint32_t valid = atomic_load_explicit (&h->begin, memory_order_relaxed) - capacity;
+  uint32_t bad = valid - shm->cursor;
+  if ((int32_t) bad > 0)
+    {
+      if (bad >= n)
+        {
+          shm->lost += bad;
+          shm->cursor = valid;
+          n = 0;
+        }
+      else
+        {
+          shm->lost += bad;
+          shm->cursor += bad;
+          n -= bad;
+          memmove (buf, buf + bad, n * sizeof (int));
+          if (timestamps_ns)
+            memmove (timestamps_ns, timestamps_ns + bad, n * sizeof (int64_t));
+        }
+    }
+  shm->cursor += n;
+  *actual_num_values = n;
+
+  if (!n && closed && shm->cursor == end)
+    return LIBUSB_ERROR_NO_DEVICE;
+  return LIBALLURIS_SUCCESS;
+}
+
+/*!
+ * \brief Wait until at least min_values can be read (reader side)
+ *
+ * The writer doesn't signal the readers, so the ring is checked every \ref SHM_POLL_NS.
+ * \param[in] shm opened with \ref liballuris_shm_open
+ * \param[in] min_values number of values to wait for, limited to the capacity
+ * \param[in] timeout in milliseconds
+ * \return 0 if successful or the writer closed the ring, else LIBALLURIS_TIMEOUT
+ */
+int liballuris_shm_wait (struct liballuris_shm* shm, size_t min_values, unsigned int timeout)
+{
+  struct shm_header* h = shm->hdr;
+  if (min_values > h->capacity)
+    min_values = h->capacity;
+
+  int64_t deadline = monotonic_ns () + (int64_t) timeout * 1000000;
+  while (1)
+    {
+      uint32_t end = atomic_load_explicit (&h->end, memory_order_acquire);
+      if ((uint32_t) (end - shm->cursor) >= min_values || atomic_load_explicit (&h->closed, memory_order_acquire))
+        return LIBALLURIS_SUCCESS;
+      if (monotonic_ns () >= deadline)
+        return LIBALLURIS_TIMEOUT;
+      struct timespec ts = {0, SHM_POLL_NS};
+      nanosleep (&ts, NULL);
+    }
+}
+
+//! Number of values a reader missed because the writer overwrote them, see \ref liballuris_shm_read
+unsigned long long liballuris_shm_get_lost (struct liballuris_shm* shm)
+{
+  return shm->lost;
+}
+
+/*!
+ * \brief Unmap a shared memory ring
+ *
+ * If shm is the writer, the readers are told that the stream ended and the name is
+ * removed. Readers which still have it mapped can read the remaining values.
+ * \param[in] shm writer or reader, may be NULL
+ */
+void liballuris_shm_close (struct liballuris_shm* shm)
+{
+  if (!shm)
+    return;
+  if (shm->name)
+    {
+      atomic_store_explicit (&shm->hdr->closed, 1, memory_order_release);
+      shm_unlink (shm->name);
+      free (shm->name);
+    }
+  munmap (shm->hdr, shm->size);
+  free (shm);
+}
+
+/****************************************************************************************/
+
+/*!
+ * \brief Several devices streaming through one libusb event thread
+ */
+struct liballuris_multi
+{
+  libusb_context* ctx;
+  size_t num_devices;
+  struct liballuris_device** devs;
+  struct liballuris_stream** streams;
+  struct liballuris_ring** rings;
+  unsigned int latency_ms;     // passed to liballuris_stream_set_latency
+  pthread_t thread;
+  char thread_running;
+  volatile char quit;          // set by liballuris_multi_stop
+  int error;                   // first error reported by the event thread
+};
+
+//! Internal: handle libusb events for all streams until liballuris_multi_stop
+static void* multi_event_thread (void* arg)
+{
+  struct liballuris_multi* m = arg;
+  size_t k;
+
+  while (!m->quit)
+    {
+      struct timeval tv = {0, 100000};
+      int r = libusb_handle_events_timeout_completed (m->ctx, &tv, NULL);
+      if (r != LIBUSB_SUCCESS && r != LIBUSB_ERROR_INTERRUPTED && !m->error)
+        m->error = r;
+      for (k=0; k < m->num_devices; ++k)
+        if (m->streams[k]->error && !m->error)
+          m->error = m->streams[k]->error;
+    }
+
+  // liballuris_multi_stop has cancelled all transfers, wait until they are returned
+  size_t in_flight;
+  do
+    {
+      in_flight = 0;
+      for (k=0; k < m->num_devices; ++k)
+        in_flight += m->streams[k]->in_flight;
+      if (in_flight)
+        {
+          struct timeval tv = {0, 20000};
+          libusb_handle_events_timeout_completed (m->ctx, &tv, NULL);
+        }
+    }
+  while (in_flight);
+
+  return NULL;
+}
+
+/*!
+ * \brief Open several devices for synchronized acquisition
+ *
+ * Each entry of ids is either a serial number like "P.25412", bus and device id
+ * separated by a comma like "1,12" or NULL for the first available device.
+ * The interfaces are claimed.
+ *
+ * \param[in] ctx pointer to libusb context
+ * \param[in] ids array of num_devices device identifiers
+ * \param[in] num_devices number of entries in ids
+ * \param[out] multi storage for the created object. Free it with \ref liballuris_multi_close
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_multi_start
+ */
+int liballuris_multi_open (libusb_context* ctx, const char* const* ids, size_t num_devices, struct liballuris_multi** multi)
+{
+  if (!num_devices)
+    return LIBALLURIS_OUT_OF_RANGE;
+
+  struct liballuris_multi* m = calloc (1, sizeof (struct liballuris_multi));
+  if (!m)
+    return LIBUSB_ERROR_NO_MEM;
+
+  m->ctx = ctx;
+  m->num_devices = num_devices;
+  m->devs = calloc (num_devices, sizeof (struct liballuris_device*));
+  m->streams = calloc (num_devices, sizeof (struct liballuris_stream*));
+  m->rings = calloc (num_devices, sizeof (struct liballuris_ring*));
+  if (!m->devs || !m->streams || !m->rings)
     {
-      fprintf (stderr, "Error: packetlen %li out of range 1..19.\n", length);
-      return LIBALLURIS_OUT_OF_RANGE;
+      liballuris_multi_close (m);
+      return LIBUSB_ERROR_NO_MEM;
+    }
+
+  // enumerate and probe all devices once (in parallel) instead of once per id
+  struct liballuris_registry* reg = NULL;
+  int r = LIBALLURIS_SUCCESS;
+  size_t k;
+  for (k=0; k < num_devices && !r; ++k)
+    {
+      int bus, device;
+      if (ids[k] && sscanf (ids[k], "%i,%i", &bus, &device) == 2)
+        r = liballuris_device_open_with_id (ctx, bus, device, &m->devs[k]);
+      else
+        {
+          if (! reg)
+            r = liballuris_registry_open (ctx, NULL, NULL, &reg);
+          if (! r)
+            r = liballuris_registry_device_open (reg, ids[k], &m->devs[k]);
+        }
+      if (r)
+        fprintf (stderr, "Couldn't open device '%s': %s\n", (ids[k])? ids[k] : "any", liballuris_error_name (r));
+    }
+  liballuris_registry_close (reg);
+  if (r)
+    {
+      liballuris_multi_close (m);
+      return r;
     }
 
-  out_buf[0] = 0x01;
-  out_buf[1] = 4;
-  out_buf[2] = (enable)? 2:0;
-  out_buf[3] = length;
+  *multi = m;
+  return LIBALLURIS_SUCCESS;
+}
 
-  //printf ("liballuris_cyclic_measurement enable=%i\n", enable);
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 4, DEFAULT_SEND_TIMEOUT, 4, DEFAULT_RECEIVE_TIMEOUT);
+/*!
+ * \brief Enable cyclic measurements on all devices and start the event thread
+ *
+ * The measurement has to be running on all devices, see \ref liballuris_device_start_measurement.
+ * cb is called from the event thread with \ref liballuris_block.device_index set to the
+ * position of the device in the ids array passed to \ref liballuris_multi_open and
+ * \ref liballuris_block.timestamp_ns set to the host receive time (CLOCK_MONOTONIC).
+ *
+ * \param[in] multi created with \ref liballuris_multi_open
+ * \param[in] block_size number of values per packet 1..19
+ * \param[in] num_transfers number of IN transfers per device or 0 for \ref DEFAULT_STREAM_TRANSFERS
+ * \param[in] cb callback for decoded blocks, may be NULL if all devices use a ring
+ * \param[in] user_data passed to cb
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_multi_set_ring
+ */
+int liballuris_multi_start (struct liballuris_multi* multi, size_t block_size, size_t num_transfers, liballuris_stream_cb cb, void* user_data)
+{
+  if (multi->thread_running)
+    return LIBALLURIS_DEVICE_BUSY;
 
-  // we expect LIBUSB_ERROR_OVERFLOW if we try to disable streaming
-  if (ret == LIBUSB_ERROR_OVERFLOW)
+  int ret = LIBALLURIS_SUCCESS;
+  size_t k;
+  for (k=0; k < multi->num_devices && !ret; ++k)
     {
-      liballuris_clear_RX (dev_handle, 10);
-      // one more try
-      ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 4, DEFAULT_SEND_TIMEOUT, 4, DEFAULT_RECEIVE_TIMEOUT);
-      liballuris_clear_RX (dev_handle, 10);
+      ret = liballuris_device_stream_open (multi->ctx, multi->devs[k], block_size, num_transfers, cb, user_data, &multi->streams[k]);
+      if (!ret)
+        {
+          multi->streams[k]->device_index = k;
+          liballuris_stream_set_ring (multi->streams[k], multi->rings[k]);
+          liballuris_stream_set_latency (multi->streams[k], multi->latency_ms);
+          ret = liballuris_stream_start (multi->streams[k]);
+        }
+    }
+
+  multi->quit = 0;
+  multi->error = 0;
+  if (!ret)
+    {
+      ret = pthread_create (&multi->thread, NULL, multi_event_thread, multi);
+      if (ret)
+        ret = LIBUSB_ERROR_OTHER;
+      else
+        multi->thread_running = 1;
     }
+
+  if (ret)
+    liballuris_multi_stop (multi);
   return ret;
 }
 
 /*!
- * \brief Poll cyclic measurements
+ * \brief Stop the event thread and disable cyclic measurements on all devices
+ * \param[in] multi created with \ref liballuris_multi_open
+ * \return 0 if successful else the first error which occurred while streaming
+ */
+int liballuris_multi_stop (struct liballuris_multi* multi)
+{
+  size_t k;
+  if (multi->thread_running)
+    {
+      for (k=0; k < multi->num_devices; ++k)
+        {
+          struct liballuris_stream* s = multi->streams[k];
+          s->stopping = 1;
+          size_t j;
+          for (j=0; j < s->num_transfers; ++j)
+            libusb_cancel_transfer (s->transfers[j]);
+        }
+      multi->quit = 1;
+      pthread_join (multi->thread, NULL);
+      multi->thread_running = 0;
+    }
+
+  int ret = multi->error;
+  for (k=0; k < multi->num_devices; ++k)
+    {
+      if (!multi->streams[k])
+        continue;
+      int r = liballuris_stream_stop (multi->streams[k]);
+      if (r && !ret)
+        ret = r;
+      liballuris_stream_close (multi->streams[k]);
+      multi->streams[k] = NULL;
+    }
+  return ret;
+}
+
+/*!
+ * \brief Stop streaming if necessary, close all devices and free multi
+ * \param[in] multi created with \ref liballuris_multi_open
+ */
+void liballuris_multi_close (struct liballuris_multi* multi)
+{
+  if (!multi)
+    return;
+
+  size_t k;
+  if (multi->streams)
+    liballuris_multi_stop (multi);
+  if (multi->devs)
+    for (k=0; k < multi->num_devices; ++k)
+      liballuris_device_close (multi->devs[k]);
+  free (multi->devs);
+  free (multi->streams);
+  free (multi->rings);
+  free (multi);
+}
+
+/*!
+ * \brief Let the event thread write all values of a device into a ring buffer
  *
- * Cyclic measurements have to be enabled before with liballuris_cyclic_measurement.
+ * Must be called before \ref liballuris_multi_start. The ring is not owned by multi.
+ * \param[in] multi created with \ref liballuris_multi_open
+ * \param[in] index of the device
+ * \param[in] ring created with \ref liballuris_ring_new or NULL
+ * \return 0 if successful else \ref liballuris_error
+ */
+int liballuris_multi_set_ring (struct liballuris_multi* multi, size_t index, struct liballuris_ring* ring)
+{
+  if (index >= multi->num_devices)
+    return LIBALLURIS_OUT_OF_RANGE;
+  if (multi->thread_running)
+    return LIBALLURIS_DEVICE_BUSY;
+  multi->rings[index] = ring;
+  return LIBALLURIS_SUCCESS;
+}
+
+/*!
+ * \brief Use a latency target instead of the fixed block size for all devices
  *
- * \param[in] dev_handle a handle for the device to communicate with
- * \param[in] buf output location for the measurements. Only populated if the return code is 0.
- * \param[in] length of block 1..19, typically the same used with liballuris_cyclic_measurement
+ * Must be called before \ref liballuris_multi_start, see \ref liballuris_stream_set_latency.
+ * \param[in] multi created with \ref liballuris_multi_open
+ * \param[in] latency_ms latency target in milliseconds or 0 for a fixed block size
  * \return 0 if successful else \ref liballuris_error
- * \sa liballuris_cyclic_measurement
- * \sa liballuris_get_unit
- * \sa liballuris_get_digits
  */
-int liballuris_poll_measurement (libusb_device_handle *dev_handle, int* buf, size_t length)
+int liballuris_multi_set_latency (struct liballuris_multi* multi, unsigned int latency_ms)
 {
-  size_t len = 5 + length * 3;
+  if (multi->thread_running)
+    return LIBALLURIS_DEVICE_BUSY;
+  multi->latency_ms = latency_ms;
+  return LIBALLURIS_SUCCESS;
+}
 
-  /* Increased receive timeout:
-   * The sampling frequency can be selected between 10Hz and 990Hz
-   * Therefore the maximum delay until one measurement completes is 1/10Hz = 100ms.
-   * Since the block size can be up to 19 (see liballuris_cyclic_measurement) the typically delay
-   * in 10Hz mode and blocksize 19 is >1.9s
-   *
-   * Test case: "gadc --stop --set-mode 0 --start -s 19"
-  */
+//! Return the number of devices of multi
+size_t liballuris_multi_get_num_devices (struct liballuris_multi* multi)
+{
+  return multi->num_devices;
+}
 
-  // worst execution time = 2.4s
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 0, 0, len, 3600);
-  size_t k;
-  for (k=0; k<length; k++)
-    buf[k] = char_to_int24 (in_buf + 5 + k*3);
+/*!
+ * \brief Return the device context at index, for example to start the measurements
+ *
+ * The context is owned by multi and can be used concurrently to the event thread.
+ * Don't change the cyclic measurement settings while streaming.
+ */
+struct liballuris_device* liballuris_multi_get_device (struct liballuris_multi* multi, size_t index)
+{
+  return (index < multi->num_devices)? multi->devs[index] : NULL;
+}
+
+/****************************************************************************************/
+
+//! Internal: encoding of a command for the asynchronous engine, indexed by \ref liballuris_command
+static const struct
+{
+  unsigned char id;            // out_buf[0]
+  unsigned char send_len;      // out_buf[1]
+  short sub;                   // out_buf[2] or -1 if the argument is sent there
+  unsigned char reply_len;
+  unsigned short reply_timeout; // ms, 0 for the receive_timeout of the device
+  unsigned short settle_ms;     // time the device needs before the next command
+  char result;                 // 0: none, 2: byte at in_buf[2], 3: int24 at in_buf[3]
+  char needs_stopped;          // rejected by the device while measuring
+} async_commands[] =
+{
+  {0x46, 3,  3, 6, 700,    0, 3, 0}, // LIBALLURIS_CMD_GET_VALUE
+  {0x46, 3,  4, 6,   0,    0, 3, 0}, // LIBALLURIS_CMD_GET_POS_PEAK
+  {0x46, 3,  5, 6,   0,    0, 3, 0}, // LIBALLURIS_CMD_GET_NEG_PEAK
+  {0x15, 3,  0, 3,   0,  200, 0, 0}, // LIBALLURIS_CMD_TARE
+  {0x15, 3,  1, 3,   0,    0, 0, 0}, // LIBALLURIS_CMD_CLEAR_POS_PEAK
+  {0x15, 3,  2, 3,   0,    0, 0, 0}, // LIBALLURIS_CMD_CLEAR_NEG_PEAK
+  {0x1C, 3,  1, 3,   0,  150, 0, 0}, // LIBALLURIS_CMD_START_MEASUREMENT
+  {0x1C, 3,  0, 3,   0, 1100, 0, 0}, // LIBALLURIS_CMD_STOP_MEASUREMENT
+  {0x19, 3,  0, 6,   0,    0, 3, 1}, // LIBALLURIS_CMD_GET_UPPER_LIMIT
+  {0x19, 3,  1, 6,   0,    0, 3, 1}, // LIBALLURIS_CMD_GET_LOWER_LIMIT
+  {0x18, 6,  0, 6, 702,    0, 0, 1}, // LIBALLURIS_CMD_SET_UPPER_LIMIT
+  {0x18, 6,  1, 6, 702,    0, 0, 1}, // LIBALLURIS_CMD_SET_LOWER_LIMIT
+  {0x05, 2,  0, 3,   0,    0, 2, 0}, // LIBALLURIS_CMD_GET_MODE
+  {0x04, 3, -1, 3,   0,    0, 2, 0}, // LIBALLURIS_CMD_SET_MODE
+  {0x22, 2,  0, 3,   0,    0, 2, 0}, // LIBALLURIS_CMD_GET_DIGOUT
+  {0x21, 3, -1, 3,   0,    0, 2, 0}, // LIBALLURIS_CMD_SET_DIGOUT
+  {0x27, 2,  0, 3,   0,    0, 2, 0}, // LIBALLURIS_CMD_GET_DIGIN
+  {0x08, 3,  5, 6,   0,    0, 3, 0}, // LIBALLURIS_CMD_GET_MEM_COUNT
+  {0x46, 3,  2, 6, 705,    0, 3, 0}, // LIBALLURIS_CMD_READ_STATE
+  {0x1D, 3, -1, 3, 712,    0, 2, 0}, // LIBALLURIS_CMD_SET_MEM_MODE
+  {0x34, 2,  0, 3,   0,    0, 2, 0}, // LIBALLURIS_CMD_GET_AUTOSTOP
+  {0x33, 3, -1, 3, 1000,   0, 2, 0}  // LIBALLURIS_CMD_SET_AUTOSTOP
+};
+
+#define NUM_ASYNC_COMMANDS (sizeof (async_commands) / sizeof (async_commands[0]))
+
+//! Internal: queued asynchronous command, see \ref liballuris_device_submit
+struct async_command
+{
+  struct async_command* next;
+  enum liballuris_command cmd;
+  int arg;
+  liballuris_command_cb cb;
+  void* user_data;
+};
+
+//! Internal: asynchronous command engine of a device context. One command is in flight at a time.
+struct device_async
+{
+  struct libusb_transfer* out;
+  struct libusb_transfer* in;
+  unsigned char out_buf[DEFAULT_SEND_BUF_LEN];
+  unsigned char in_buf[DEFAULT_RECV_BUF_LEN];
+  struct async_command* head;  // command in flight (if busy) followed by the queued ones
+  struct async_command* tail;
+  size_t num_pending;
+  char busy;                   // a transfer for head is submitted
+  char settling;               // the IN transfer only waits until not_before_ns
+  char cancelled;              // head was cancelled by liballuris_device_cancel_commands
+  char via_stream;             // no IN transfer, the reply is taken from the packets of dev->stream
+  int64_t deadline_ns;         // reply timeout or end of the settle time if via_stream
+  int64_t not_before_ns;       // the device needs time after tare, start or stop
+};
+
+static void async_start_next (struct liballuris_device* dev);
+
+//! Internal: remove head and call its callback without holding the device lock
+static void async_finish (struct liballuris_device* dev, int status, int value)
+{
+  struct device_async* a = dev->async;
+  struct async_command* c = a->head;
+  a->head = c->next;
+  if (! a->head)
+    a->tail = NULL;
+  a->num_pending--;
+  a->busy = 0;
+  if (a->cancelled)
+    {
+      status = LIBUSB_ERROR_INTERRUPTED;
+      a->cancelled = 0;
+    }
+
+  device_unlock (dev, status);
+  if (c->cb)
+    c->cb (dev, c->cmd, status, value, c->user_data);
+  free (c);
+  device_lock (dev);
+}
+
+//! Internal: submit the IN transfer for a reply or to wait for the device. Caller holds the lock.
+static int async_submit_in (struct liballuris_device* dev, unsigned int timeout)
+{
+  struct device_async* a = dev->async;
+  a->in->timeout = timeout;
+  memset (a->in_buf, 0, sizeof (a->in_buf));
+  int r = libusb_submit_transfer (a->in);
+  if (r == LIBUSB_SUCCESS)
+    a->busy = 1;
+  return r;
+}
+
+//! Internal: send queued commands until one is in flight. Caller holds the lock.
+static void async_start_next (struct liballuris_device* dev)
+{
+  struct device_async* a = dev->async;
+  while (a->head && ! a->busy)
+    {
+      struct async_command* c = a->head;
+
+      // wait with an IN transfer, this also drains stale replies
+      int64_t remaining = a->not_before_ns - monotonic_ns ();
+      if (remaining > 0 && ! a->cancelled)
+        {
+          a->settling = 1;
+          if (dev->stream)
+            {
+              // an IN transfer would take packets from the stream, see async_stream_packet
+              a->via_stream = 1;
+              a->deadline_ns = a->not_before_ns;
+              a->busy = 1;
+              continue;
+            }
+          int r = async_submit_in (dev, (remaining + 999999) / 1000000);
+          if (r != LIBUSB_SUCCESS)
+            async_finish (dev, r, 0);
+          continue;
+        }
+
+      if (a->cancelled)
+        {
+          async_finish (dev, LIBUSB_ERROR_INTERRUPTED, 0);
+          continue;
+        }
+
+      if (async_commands[c->cmd].needs_stopped
+          && (dev->cache_valid & DEVICE_CACHE_MEASURING) && dev->cache.measuring)
+        {
+          async_finish (dev, LIBALLURIS_DEVICE_BUSY, 0);
+          continue;
+        }
+
+      a->out_buf[0] = async_commands[c->cmd].id;
+      a->out_buf[1] = async_commands[c->cmd].send_len;
+      if (async_commands[c->cmd].sub < 0)
+        a->out_buf[2] = c->arg;
+      else
+        a->out_buf[2] = async_commands[c->cmd].sub;
+      if (a->out_buf[1] == 6)
+        memcpy (a->out_buf + 3, (unsigned char *) &c->arg, 3);
+
+      if (async_commands[c->cmd].id == 0x1C || c->cmd == LIBALLURIS_CMD_SET_AUTOSTOP)
+        dev->cache_valid &= ~DEVICE_CACHE_MEASURING;
+      else if (async_commands[c->cmd].id == 0x04)
+        dev->cache_valid &= ~DEVICE_CACHE_MODE;
+
+      a->out->length = a->out_buf[1];
+      a->out->timeout = dev->send_timeout;
+      int r = libusb_submit_transfer (a->out);
+      if (r == LIBUSB_SUCCESS)
+        a->busy = 1;
+      else
+        async_finish (dev, r, 0);
+    }
+}
+
+//! Internal: the command was sent, wait for the reply
+static void LIBUSB_CALL async_out_cb (struct libusb_transfer* transfer)
+{
+  struct liballuris_device* dev = transfer->user_data;
+  struct device_async* a = dev->async;
+  device_lock (dev);
+  record_transfer (transfer);
+  a->busy = 0;
+
+  int r;
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+    r = transfer_status_to_error (transfer->status);
+  else if (a->cancelled)
+    r = LIBUSB_ERROR_INTERRUPTED;
+  else
+    {
+      unsigned int timeout = async_commands[a->head->cmd].reply_timeout;
+      if (! timeout)
+        timeout = dev->receive_timeout;
+      if (dev->stream)
+        {
+          a->via_stream = 1;
+          a->deadline_ns = monotonic_ns () + (int64_t) timeout * 1000000;
+          a->busy = 1;
+          r = LIBUSB_SUCCESS;
+        }
+      else
+        r = async_submit_in (dev, timeout);
+    }
+
+  if (r != LIBUSB_SUCCESS)
+    async_finish (dev, r, 0);
+  async_start_next (dev);
+  device_unlock (dev, LIBALLURIS_SUCCESS);
+}
+
+/*!
+ * \brief Internal: decode the reply of head and complete it. Caller holds the lock.
+ * \param[in] r status of the reception, buf is only used if it is 0
+ */
+static void async_complete (struct liballuris_device* dev, int r, unsigned char* buf, int actual)
+{
+  struct device_async* a = dev->async;
+  enum liballuris_command cmd = a->head->cmd;
+  int value = 0;
+  if (r != LIBALLURIS_SUCCESS)
+    ;
+  else if (buf[0] != a->out_buf[0] || buf[1] != actual || actual != async_commands[cmd].reply_len)
+    {
+      fprintf (stderr, "Error: Malformed reply to asynchronous command 0x%02X (recv_cmd=0x%02X, recv_len=%i, actual=%i).\n",
+               a->out_buf[0], buf[0], buf[1], actual);
+      r = LIBALLURIS_MALFORMED_REPLY;
+    }
+  else
+    {
+      if (async_commands[cmd].result == 2)
+        value = buf[2];
+      else if (async_commands[cmd].result == 3)
+        value = char_to_int24 (buf + 3);
+
+      // setters echo the new value, see liballuris_set_mode
+      if (async_commands[cmd].sub < 0 && value != a->head->arg)
+        r = LIBALLURIS_DEVICE_BUSY;
+      else if (cmd == LIBALLURIS_CMD_GET_MEM_COUNT && value == -1)
+        r = LIBALLURIS_DEVICE_BUSY;
+    }
+
+  if (r == LIBALLURIS_SUCCESS)
+    {
+      int64_t settle = (int64_t) async_commands[cmd].settle_ms * 1000000;
+      if (settle)
+        a->not_before_ns = monotonic_ns () + settle;
+      if (async_commands[cmd].id == 0x1C)
+        {
+          dev->cache.measuring = (cmd == LIBALLURIS_CMD_START_MEASUREMENT);
+          dev->cache_valid |= DEVICE_CACHE_MEASURING;
+        }
+      else if (cmd == LIBALLURIS_CMD_READ_STATE)
+        {
+          union __liballuris_state__ tmp;
+          tmp._int = value;
+          dev->cache.measuring = tmp.bits.measuring;
+          dev->cache_valid |= DEVICE_CACHE_MEASURING;
+        }
+      else if (cmd == LIBALLURIS_CMD_GET_MODE || cmd == LIBALLURIS_CMD_SET_MODE)
+        {
+          dev->cache.mode = (enum liballuris_measurement_mode) value;
+          dev->cache_valid |= DEVICE_CACHE_MODE;
+        }
+    }
+  else if (r == LIBALLURIS_DEVICE_BUSY)
+    dev->cache_valid &= ~DEVICE_CACHE_MEASURING;
+
+  async_finish (dev, r, value);
+}
+
+//! Internal: reply received (or settle time expired), decode it and complete the command
+static void LIBUSB_CALL async_in_cb (struct libusb_transfer* transfer)
+{
+  struct liballuris_device* dev = transfer->user_data;
+  struct device_async* a = dev->async;
+  device_lock (dev);
+  record_transfer (transfer);
+  a->busy = 0;
+
+  int fatal = transfer->status != LIBUSB_TRANSFER_COMPLETED
+              && transfer->status != LIBUSB_TRANSFER_TIMED_OUT
+              && transfer->status != LIBUSB_TRANSFER_CANCELLED;
+
+  if (a->settling)
+    {
+      a->settling = 0;
+      if (fatal)
+        async_finish (dev, transfer_status_to_error (transfer->status), 0);
+      async_start_next (dev);
+      device_unlock (dev, LIBALLURIS_SUCCESS);
+      return;
+    }
+
+  int r = LIBALLURIS_SUCCESS;
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+    r = transfer_status_to_error (transfer->status);
+  else if (a->in_buf[0] == 0x02 && ! a->cancelled)
+    {
+      // late packet of a cyclic measurement, discard it and wait for the reply
+      r = async_submit_in (dev, transfer->timeout);
+      if (r == LIBUSB_SUCCESS)
+        {
+          device_unlock (dev, r);
+          return;
+        }
+    }
+
+  async_complete (dev, r, a->in_buf, transfer->actual_length);
+  async_start_next (dev);
+  device_unlock (dev, LIBALLURIS_SUCCESS);
+}
+
+/*!
+ * \brief Internal: let the asynchronous commands use the packets of a running stream
+ *
+ * While the stream has its IN transfers queued, the replies of commands arrive there.
+ * Every packet is passed here, the reply of head completes it. The reply timeout and the
+ * settle time are checked on each packet, thus with the granularity of the packet interval.
+ * \return 1 if the packet was the reply, else 0
+ */
+static int async_stream_packet (struct liballuris_device* dev, unsigned char* buf, int actual)
+{
+  device_lock (dev);
+  struct device_async* a = dev->async;
+  int taken = 0;
+  if (a && a->via_stream)
+    {
+      int64_t now = monotonic_ns ();
+      if (a->settling)
+        {
+          if (now >= a->deadline_ns)
+            {
+              a->via_stream = 0;
+              a->settling = 0;
+              a->busy = 0;
+              async_start_next (dev);
+            }
+        }
+      else if (actual > 0 && buf[0] == a->out_buf[0])
+        {
+          a->via_stream = 0;
+          taken = 1;
+          async_complete (dev, LIBALLURIS_SUCCESS, buf, actual);
+          async_start_next (dev);
+        }
+      else if (now >= a->deadline_ns)
+        {
+          a->via_stream = 0;
+          async_complete (dev, LIBUSB_ERROR_TIMEOUT, NULL, 0);
+          async_start_next (dev);
+        }
+    }
+  device_unlock (dev, LIBALLURIS_SUCCESS);
+  return taken;
+}
+
+//! Internal: the stream of dev stops, a command waiting for its reply in the packets is aborted
+static void async_stream_detach (struct liballuris_device* dev)
+{
+  device_lock (dev);
+  dev->stream = NULL;
+  struct device_async* a = dev->async;
+  if (a && a->via_stream)
+    {
+      a->via_stream = 0;
+      if (a->settling)
+        {
+          a->settling = 0;
+          a->busy = 0;
+        }
+      else
+        async_complete (dev, LIBUSB_ERROR_INTERRUPTED, NULL, 0);
+      async_start_next (dev);
+    }
+  device_unlock (dev, LIBALLURIS_SUCCESS);
+}
+
+//! Internal: allocate the asynchronous engine on first use. Caller holds the lock.
+static int async_init (struct liballuris_device* dev)
+{
+  if (dev->async)
+    return LIBALLURIS_SUCCESS;
+
+  struct device_async* a = calloc (1, sizeof (struct device_async));
+  if (! a)
+    return LIBUSB_ERROR_NO_MEM;
+  a->out = libusb_alloc_transfer (0);
+  a->in = libusb_alloc_transfer (0);
+  if (! a->out || ! a->in)
+    {
+      libusb_free_transfer (a->out);
+      libusb_free_transfer (a->in);
+      free (a);
+      return LIBUSB_ERROR_NO_MEM;
+    }
+  libusb_fill_interrupt_transfer (a->out, dev->dev_handle, 0x01 | LIBUSB_ENDPOINT_OUT,
+                                  a->out_buf, 0, async_out_cb, dev, 0);
+  libusb_fill_interrupt_transfer (a->in, dev->dev_handle, 0x81 | LIBUSB_ENDPOINT_IN,
+                                  a->in_buf, sizeof (a->in_buf), async_in_cb, dev, 0);
+  dev->async = a;
+  return LIBALLURIS_SUCCESS;
+}
+
+//! Internal: free the asynchronous engine, returns -1 and keeps it if commands are pending
+static int async_free (struct liballuris_device* dev)
+{
+  struct device_async* a = dev->async;
+  if (! a)
+    return 0;
+  if (a->num_pending)
+    {
+      // the transfer callbacks still refer to dev
+      fprintf (stderr, "Error: %li asynchronous commands pending in liballuris_device_close. This looks like a programming error.\n", a->num_pending);
+      return -1;
+    }
+  libusb_free_transfer (a->out);
+  libusb_free_transfer (a->in);
+  free (a);
+  dev->async = NULL;
+  return 0;
+}
+
+/*!
+ * \brief Queue a command without waiting for the reply
+ *
+ * The command is sent as soon as the previous commands of this device are completed,
+ * cb is called with the result from within libusb event handling (for example
+ * \ref liballuris_handle_events, \ref liballuris_future_wait or \ref liballuris_stream_dispatch),
+ * or before this function returns if the command is rejected without a transfer.
+ * Thus one thread can keep commands in flight on many devices at the same time.
+ *
+ * The delays of the blocking variants (after tare, start and stop measurement) are kept
+ * without blocking: the next command of the device is sent after the settle time.
+ * Unlike the blocking variants the state isn't queried before commands which are rejected
+ * while measuring, they fail with LIBALLURIS_DEVICE_BUSY if the cached state says measuring.
+ *
+ * Commands may be submitted while a stream opened on the same device context
+ * (\ref liballuris_device_stream_open) runs, their replies are then taken from the packets of
+ * the stream. Replies which arrive between cyclic packets don't interrupt the stream,
+ * but the timeouts are only checked when a packet arrives.
+ * Don't call blocking functions on the same device context, start or stop a stream
+ * while commands are pending, see \ref liballuris_device_get_num_pending.
+ *
+ * \param[in] dev device context
+ * \param[in] cmd command to send
+ * \param[in] arg limit, mode or digital output for the setters, ignored otherwise
+ * \param[in] cb called once with the status (0 or \ref liballuris_error) and the result, may be NULL
+ * \param[in] user_data passed to cb
+ * \return 0 if the command was queued, LIBALLURIS_OUT_OF_RANGE for an invalid cmd or arg,
+ * LIBUSB_ERROR_NOT_SUPPORTED on a transport (see \ref liballuris_open_transport),
+ * else \ref liballuris_error and cb isn't called
+ */
+int liballuris_device_submit (struct liballuris_device *dev, enum liballuris_command cmd, int arg, liballuris_command_cb cb, void* user_data)
+{
+  if ((unsigned int) cmd >= NUM_ASYNC_COMMANDS
+      || (cmd == LIBALLURIS_CMD_SET_MODE && (arg < 0 || arg > 3))
+      || (cmd == LIBALLURIS_CMD_SET_DIGOUT && (arg < 0 || arg > 7))
+      || (cmd == LIBALLURIS_CMD_SET_MEM_MODE && (arg < 0 || arg > 2))
+      || (cmd == LIBALLURIS_CMD_SET_AUTOSTOP && (arg < 0 || arg > 30)))
+    return LIBALLURIS_OUT_OF_RANGE;
+
+  // transports only offer synchronous transfers
+  if (is_transport_handle (dev->dev_handle))
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+
+  struct async_command* c = malloc (sizeof (struct async_command));
+  if (! c)
+    return LIBUSB_ERROR_NO_MEM;
+  c->next = NULL;
+  c->cmd = cmd;
+  c->arg = arg;
+  c->cb = cb;
+  c->user_data = user_data;
+
+  device_lock (dev);
+  int ret = async_init (dev);
+  if (ret)
+    {
+      free (c);
+      return device_unlock (dev, ret);
+    }
+
+  struct device_async* a = dev->async;
+  if (a->tail)
+    a->tail->next = c;
+  else
+    a->head = c;
+  a->tail = c;
+  a->num_pending++;
+
+  async_start_next (dev);
+  return device_unlock (dev, LIBALLURIS_SUCCESS);
+}
+
+//! Callback for \ref liballuris_device_submit which stores the result in the \ref liballuris_future passed as user_data
+void liballuris_future_cb (struct liballuris_device *dev, enum liballuris_command cmd, int status, int value, void* user_data)
+{
+  (void) dev;
+  (void) cmd;
+  struct liballuris_future* future = user_data;
+  future->status = status;
+  future->value = value;
+  future->done = 1;
+}
+
+/*!
+ * \brief Queue a command and track its result with a future
+ *
+ * Same as \ref liballuris_device_submit with \ref liballuris_future_cb.
+ * The future has to stay valid until it's done.
+ *
+ * \param[in] dev device context
+ * \param[in] cmd command to send
+ * \param[in] arg limit, mode or digital output for the setters, ignored otherwise
+ * \param[out] future initialized here, done is set when the reply is decoded
+ * \return 0 if the command was queued else \ref liballuris_error
+ * \sa liballuris_future_wait
+ */
+int liballuris_device_submit_future (struct liballuris_device *dev, enum liballuris_command cmd, int arg, struct liballuris_future* future)
+{
+  future->done = 0;
+  future->status = LIBALLURIS_SUCCESS;
+  future->value = 0;
+  return liballuris_device_submit (dev, cmd, arg, liballuris_future_cb, future);
+}
+
+/*!
+ * \brief Handle libusb events until the future is done
+ *
+ * Other commands and streams on ctx progress while waiting.
+ *
+ * \param[in] ctx pointer to libusb context used to open the device
+ * \param[in] future passed to \ref liballuris_device_submit_future
+ * \param[in] timeout in milliseconds
+ * \return status of the command, LIBALLURIS_TIMEOUT if it's not done yet
+ * or a libusb error of the event handling
+ */
+int liballuris_future_wait (libusb_context* ctx, struct liballuris_future* future, unsigned int timeout)
+{
+  int64_t end = monotonic_ns () + (int64_t) timeout * 1000000;
+  while (! future->done)
+    {
+      int64_t remaining = end - monotonic_ns ();
+      if (remaining <= 0)
+        return LIBALLURIS_TIMEOUT;
+
+      struct timeval tv;
+      tv.tv_sec = remaining / 1000000000;
+      tv.tv_usec = (remaining % 1000000000) / 1000;
+      int r = libusb_handle_events_timeout_completed (ctx, &tv, &future->done);
+      if (r)
+        return r;
+    }
+  return future->status;
+}
+
+/*!
+ * \brief Handle pending libusb events
+ *
+ * Dispatches the callbacks of asynchronous commands and streams. Blocks at most timeout milliseconds,
+ * use 0 from an event loop built on \ref liballuris_get_pollfds.
+ *
+ * \param[in] ctx pointer to libusb context
+ * \param[in] timeout in milliseconds
+ * \return 0 if successful else \ref liballuris_error
+ */
+int liballuris_handle_events (libusb_context* ctx, unsigned int timeout)
+{
+  struct timeval tv;
+  tv.tv_sec = timeout / 1000;
+  tv.tv_usec = (timeout % 1000) * 1000;
+  return libusb_handle_events_timeout_completed (ctx, &tv, NULL);
+}
 
-  return ret;
+/*!
+ * \brief Number of submitted commands which are not completed yet
+ *
+ * \param[in] dev device context
+ * \return number of commands whose callback wasn't called yet
+ */
+size_t liballuris_device_get_num_pending (struct liballuris_device *dev)
+{
+  device_lock (dev);
+  size_t n = (dev->async)? dev->async->num_pending : 0;
+  device_unlock (dev, LIBALLURIS_SUCCESS);
+  return n;
 }
 
 /*!
- * \brief Poll cyclic measurements without waiting
+ * \brief Abort all pending commands of a device
  *
- * Cyclic measurements have to be enabled before with liballuris_cyclic_measurement.
+ * The callbacks of queued commands are called with LIBUSB_ERROR_INTERRUPTED from within this function,
+ * the one of the command in flight when its transfer is cancelled during event handling.
+ * Handle events until \ref liballuris_device_get_num_pending returns 0 before closing the device.
  *
- * \param[in] dev_handle a handle for the device to communicate with
- * \param[in] buf output location for the measurements. Only populated if the return code is 0.
- * \param[in] length of block 1..19, typically the same used with liballuris_cyclic_measurement
- * \return 0 if successful else \ref liballuris_error
- * \sa liballuris_cyclic_measurement
- * \sa liballuris_get_unit
- * \sa liballuris_get_digits
+ * \param[in] dev device context
  */
-int liballuris_poll_measurement_no_wait (libusb_device_handle *dev_handle, int* buf, size_t length, size_t *actual_num_values)
+void liballuris_device_cancel_commands (struct liballuris_device *dev)
 {
-  int actual=0;
-  int r = 0;
-
-  size_t len = 5 + length * 3;
-  *actual_num_values = 0;
-  r = libusb_interrupt_transfer (dev_handle, 0x81 | LIBUSB_ENDPOINT_IN, in_buf, len, &actual, 5);
-  //printf ("actual = %i, %s\n", actual, libusb_error_name(r));
+  device_lock (dev);
+  struct device_async* a = dev->async;
+  while (a && a->head && (! a->busy || a->head->next))
+    {
+      // don't touch the command in flight, its transfer callback needs it
+      struct async_command* c = (a->busy)? a->head->next : a->head;
+      if (a->busy)
+        a->head->next = c->next;
+      else
+        a->head = c->next;
+      if (a->tail == c)
+        a->tail = (a->busy)? a->head : NULL;
+      a->num_pending--;
+
+      device_unlock (dev, LIBALLURIS_SUCCESS);
+      if (c->cb)
+        c->cb (dev, c->cmd, LIBUSB_ERROR_INTERRUPTED, 0, c->user_data);
+      free (c);
+      device_lock (dev);
+    }
 
-  if ((r == LIBUSB_SUCCESS || r == LIBUSB_ERROR_TIMEOUT ) && actual == (int) len)
+  if (a && a->busy && a->via_stream)
     {
-      size_t k;
-      *actual_num_values = (actual - 5) / 3;
-      for (k=0; k < (*actual_num_values); k++)
-        buf[k] = char_to_int24 (in_buf + 5 + k*3);
+      // no transfer to cancel, the reply would arrive in a packet of the stream
+      a->cancelled = 1;
+      a->via_stream = 0;
+      if (a->settling)
+        {
+          a->settling = 0;
+          a->busy = 0;
+        }
+      else
+        async_finish (dev, LIBUSB_ERROR_INTERRUPTED, 0);
+      async_start_next (dev);
     }
-  else if (r == LIBUSB_ERROR_TIMEOUT && actual > 0)
+  else if (a && a->busy)
     {
-      // this isn't expected
-      fprintf (stderr, "Error in liballuris_poll_measurement_no_wait: LIBUSB_ERROR_TIMEOUT and actual = %i, len = %li\n", actual, len);
-      fprintf (stderr, "please file a bug report\n");
-      return r;
+      a->cancelled = 1;
+      // only one of them is submitted
+      libusb_cancel_transfer (a->out);
+      libusb_cancel_transfer (a->in);
     }
-
-  return r;
+  device_unlock (dev, LIBALLURIS_SUCCESS);
 }
 
+/****************************************************************************************/
+
 /*!
  * \brief Tare measurement
  *
@@ -947,14 +5912,92 @@ int liballuris_poll_measurement_no_wait (libusb_device_handle *dev_handle, int*
  */
 int liballuris_tare (libusb_device_handle *dev_handle)
 {
-  out_buf[0] = 0x15;
-  out_buf[1] = 3;
-  out_buf[2] = 0;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 3, DEFAULT_RECEIVE_TIMEOUT);
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_tare (&dev);
+}
+
+//! Thread-safe variant of \ref liballuris_tare operating on a device context
+int liballuris_device_tare (struct liballuris_device *dev)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x15;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 0;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 3, dev->receive_timeout);
 
   // tare needs some time to calculate the mean
   usleep (200000);
-  return ret;
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Tare measurement and wait until the new offset is applied
+ *
+ * \ref liballuris_tare always sleeps 200ms. This variant waits one display period (100ms),
+ * then polls the value with increasing intervals and returns as soon as two consecutive
+ * values are within +-threshold, but at the latest after 200ms like \ref liballuris_tare.
+ *
+ * The state (\ref liballuris_read_state) has no flag for a running tare, so the value is
+ * the completion signal: the device answers \ref liballuris_get_value with the next display
+ * update, which shows the new offset once the mean is calculated. On an unloaded gauge the
+ * old value is already near zero, hence values before the first display period after the
+ * command aren't trusted.
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[in] threshold maximum absolute raw value which is considered as zero, for example 2
+ * \param[out] settle_ms time from sending the command until the value settled, may be NULL
+ * \return 0 if successful else \ref liballuris_error
+ */
+int liballuris_tare_wait (libusb_device_handle *dev_handle, int threshold, unsigned int* settle_ms)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_tare_wait (&dev, threshold, settle_ms);
+}
+
+//! Thread-safe variant of \ref liballuris_tare_wait operating on a device context
+int liballuris_device_tare_wait (struct liballuris_device *dev, int threshold, unsigned int* settle_ms)
+{
+  device_lock (dev);
+  int64_t t_start = monotonic_ns ();
+  int64_t deadline = t_start + 200000000;
+  dev->out_buf[0] = 0x15;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 0;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 3, dev->receive_timeout);
+
+  // the mean is calculated over at least one display period
+  int64_t min_settle = t_start + LIBALLURIS_PERIOD_STANDARD_NS - monotonic_ns ();
+  if (ret == LIBALLURIS_SUCCESS && min_settle > 0)
+    usleep (min_settle / 1000);
+
+  unsigned int delay = 5;
+  int value, settled = 0;
+  while (ret == LIBALLURIS_SUCCESS && settled < 2)
+    {
+      int64_t now = monotonic_ns ();
+      if (now >= deadline)
+        break;
+      poll_backoff (&delay);
+      // the old value may still be reported until the mean is calculated
+      if (liballuris_device_get_value (dev, &value) == LIBALLURIS_SUCCESS && abs (value) <= threshold)
+        settled++;
+      else
+        settled = 0;
+    }
+
+  if (ret == LIBALLURIS_SUCCESS && settled < 2)
+    {
+      // same as liballuris_tare
+      int64_t remaining = deadline - monotonic_ns ();
+      if (remaining > 0)
+        usleep (remaining / 1000);
+    }
+
+  if (settle_ms)
+    *settle_ms = (monotonic_ns () - t_start) / 1000000;
+  return device_unlock (dev, ret);
 }
 
 /*!
@@ -965,10 +6008,19 @@ int liballuris_tare (libusb_device_handle *dev_handle)
  */
 int liballuris_clear_pos_peak (libusb_device_handle *dev_handle)
 {
-  out_buf[0] = 0x15;
-  out_buf[1] = 3;
-  out_buf[2] = 1;
-  return liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 3, DEFAULT_RECEIVE_TIMEOUT);
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_clear_pos_peak (&dev);
+}
+
+//! Thread-safe variant of \ref liballuris_clear_pos_peak operating on a device context
+int liballuris_device_clear_pos_peak (struct liballuris_device *dev)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x15;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 1;
+  return device_unlock (dev, liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 3, dev->receive_timeout));
 }
 
 /*!
@@ -980,10 +6032,19 @@ int liballuris_clear_pos_peak (libusb_device_handle *dev_handle)
 
 int liballuris_clear_neg_peak (libusb_device_handle *dev_handle)
 {
-  out_buf[0] = 0x15;
-  out_buf[1] = 3;
-  out_buf[2] = 2;
-  return liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 3, DEFAULT_RECEIVE_TIMEOUT);
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_clear_neg_peak (&dev);
+}
+
+//! Thread-safe variant of \ref liballuris_clear_neg_peak operating on a device context
+int liballuris_device_clear_neg_peak (struct liballuris_device *dev)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x15;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 2;
+  return device_unlock (dev, liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 3, dev->receive_timeout));
 }
 
 /*!
@@ -998,18 +6059,64 @@ int liballuris_clear_neg_peak (libusb_device_handle *dev_handle)
  */
 int liballuris_start_measurement (libusb_device_handle *dev_handle)
 {
-  out_buf[0] = 0x1C;
-  out_buf[1] = 3;
-  out_buf[2] = 1; //start
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 3, DEFAULT_RECEIVE_TIMEOUT);
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_start_measurement (&dev);
+}
+
+//! Thread-safe variant of \ref liballuris_start_measurement operating on a device context
+int liballuris_device_start_measurement (struct liballuris_device *dev)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x1C;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 1; //start
+  dev->cache_valid &= ~DEVICE_CACHE_MEASURING;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 3, dev->receive_timeout);
 
   if (ret == LIBALLURIS_SUCCESS)
     {
+      dev->cache.measuring = 1;
+      dev->cache_valid |= DEVICE_CACHE_MEASURING;
       // wait until measurement processor is configured and running
       // this may take up to 100ms if P13=1
       usleep (150000);
     }
-  return ret;
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Start measurement and wait until it's running
+ *
+ * In contrast to \ref liballuris_start_measurement, which always sleeps 150ms, the
+ * measuring bit of the state is polled with increasing intervals (5ms..100ms).
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[in] timeout maximum time to wait in milliseconds
+ * \param[out] settle_ms time from sending the command until the measurement was running, may be NULL
+ * \return 0 if successful else \ref liballuris_error. LIBALLURIS_TIMEOUT if the measurement wasn't running in time.
+ * \sa liballuris_stop_measurement_wait
+ */
+int liballuris_start_measurement_wait (libusb_device_handle *dev_handle, unsigned int timeout, unsigned int* settle_ms)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_start_measurement_wait (&dev, timeout, settle_ms);
+}
+
+//! Thread-safe variant of \ref liballuris_start_measurement_wait operating on a device context
+int liballuris_device_start_measurement_wait (struct liballuris_device *dev, unsigned int timeout, unsigned int* settle_ms)
+{
+  device_lock (dev);
+  int64_t t_start = monotonic_ns ();
+  dev->out_buf[0] = 0x1C;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 1; //start
+  dev->cache_valid &= ~DEVICE_CACHE_MEASURING;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 3, dev->receive_timeout);
+  if (ret == LIBALLURIS_SUCCESS)
+    ret = wait_for_measuring (dev, 1, t_start, timeout, settle_ms);
+  return device_unlock (dev, ret);
 }
 
 /*!
@@ -1021,19 +6128,65 @@ int liballuris_start_measurement (libusb_device_handle *dev_handle)
  */
 int liballuris_stop_measurement (libusb_device_handle *dev_handle)
 {
-  out_buf[0] = 0x1C;
-  out_buf[1] = 3;
-  out_buf[2] = 0; //stop
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 3, DEFAULT_RECEIVE_TIMEOUT);
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_stop_measurement (&dev);
+}
+
+//! Thread-safe variant of \ref liballuris_stop_measurement operating on a device context
+int liballuris_device_stop_measurement (struct liballuris_device *dev)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x1C;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 0; //stop
+  dev->cache_valid &= ~DEVICE_CACHE_MEASURING;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 3, dev->receive_timeout);
 
   if (ret == LIBUSB_SUCCESS)
     {
+      dev->cache.measuring = 0;
+      dev->cache_valid |= DEVICE_CACHE_MEASURING;
       // wait until measurement processor is stopped
       // this may take up to 1100ms if P13=1
       usleep (1100000);
     }
 
-  return ret;
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Stop measurement and wait until it's stopped
+ *
+ * In contrast to \ref liballuris_stop_measurement, which always sleeps 1.1s, the
+ * measuring bit of the state is polled with increasing intervals (5ms..100ms).
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[in] timeout maximum time to wait in milliseconds
+ * \param[out] settle_ms time from sending the command until the measurement was stopped, may be NULL
+ * \return 0 if successful else \ref liballuris_error. LIBALLURIS_TIMEOUT if the measurement didn't stop in time.
+ * \sa liballuris_start_measurement_wait
+ */
+int liballuris_stop_measurement_wait (libusb_device_handle *dev_handle, unsigned int timeout, unsigned int* settle_ms)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_stop_measurement_wait (&dev, timeout, settle_ms);
+}
+
+//! Thread-safe variant of \ref liballuris_stop_measurement_wait operating on a device context
+int liballuris_device_stop_measurement_wait (struct liballuris_device *dev, unsigned int timeout, unsigned int* settle_ms)
+{
+  device_lock (dev);
+  int64_t t_start = monotonic_ns ();
+  dev->out_buf[0] = 0x1C;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 0; //stop
+  dev->cache_valid &= ~DEVICE_CACHE_MEASURING;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 3, dev->receive_timeout);
+  if (ret == LIBALLURIS_SUCCESS)
+    ret = wait_for_measuring (dev, 0, t_start, timeout, settle_ms);
+  return device_unlock (dev, ret);
 }
 
 /*!
@@ -1056,22 +6209,27 @@ int liballuris_stop_measurement (libusb_device_handle *dev_handle)
  */
 int liballuris_set_upper_limit (libusb_device_handle *dev_handle, int limit)
 {
-  struct liballuris_state state;
-  int ret = liballuris_read_state (dev_handle, &state);
-  if (ret)
-    return ret;
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_set_upper_limit (&dev, limit);
+}
 
-  if (state.measuring)
-    return LIBALLURIS_DEVICE_BUSY;
+//! Thread-safe variant of \ref liballuris_set_upper_limit operating on a device context
+int liballuris_device_set_upper_limit (struct liballuris_device *dev, int limit)
+{
+  device_lock (dev);
+  int ret = device_check_stopped (dev);
+  if (ret)
+    return device_unlock (dev, ret);
 
-  out_buf[0] = 0x18;
-  out_buf[1] = 6;
-  out_buf[2] = 0; //maximum
-  memcpy (out_buf+3, (unsigned char *) &limit, 3);
+  dev->out_buf[0] = 0x18;
+  dev->out_buf[1] = 6;
+  dev->out_buf[2] = 0; //maximum
+  memcpy (dev->out_buf+3, (unsigned char *) &limit, 3);
 
   // worst execution time = 0.468s
   // Increased receive timeout due to EEPROM write operation
-  return liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 6, DEFAULT_SEND_TIMEOUT, 6, 702);
+  return device_unlock (dev, liballuris_interrupt_transfer (dev, __FUNCTION__, 6, dev->send_timeout, 6, 702));
 }
 
 /*!
@@ -1094,22 +6252,27 @@ int liballuris_set_upper_limit (libusb_device_handle *dev_handle, int limit)
  */
 int liballuris_set_lower_limit (libusb_device_handle *dev_handle, int limit)
 {
-  struct liballuris_state state;
-  int ret = liballuris_read_state (dev_handle, &state);
-  if (ret)
-    return ret;
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_set_lower_limit (&dev, limit);
+}
 
-  if (state.measuring)
-    return LIBALLURIS_DEVICE_BUSY;
+//! Thread-safe variant of \ref liballuris_set_lower_limit operating on a device context
+int liballuris_device_set_lower_limit (struct liballuris_device *dev, int limit)
+{
+  device_lock (dev);
+  int ret = device_check_stopped (dev);
+  if (ret)
+    return device_unlock (dev, ret);
 
-  out_buf[0] = 0x18;
-  out_buf[1] = 6;
-  out_buf[2] = 1; //minimum
-  memcpy (out_buf+3, (unsigned char *) &limit, 3);
+  dev->out_buf[0] = 0x18;
+  dev->out_buf[1] = 6;
+  dev->out_buf[2] = 1; //minimum
+  memcpy (dev->out_buf+3, (unsigned char *) &limit, 3);
 
   // worst execution time = 0.468s
   // Increased receive timeout due to EEPROM write operation
-  return liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 6, DEFAULT_SEND_TIMEOUT, 6, 702);
+  return device_unlock (dev, liballuris_interrupt_transfer (dev, __FUNCTION__, 6, dev->send_timeout, 6, 702));
 }
 
 /*!
@@ -1127,21 +6290,26 @@ int liballuris_set_lower_limit (libusb_device_handle *dev_handle, int limit)
  */
 int liballuris_get_upper_limit (libusb_device_handle *dev_handle, int* limit)
 {
-  struct liballuris_state state;
-  int ret = liballuris_read_state (dev_handle, &state);
-  if (ret)
-    return ret;
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_upper_limit (&dev, limit);
+}
 
-  if (state.measuring)
-    return LIBALLURIS_DEVICE_BUSY;
+//! Thread-safe variant of \ref liballuris_get_upper_limit operating on a device context
+int liballuris_device_get_upper_limit (struct liballuris_device *dev, int* limit)
+{
+  device_lock (dev);
+  int ret = device_check_stopped (dev);
+  if (ret)
+    return device_unlock (dev, ret);
 
-  out_buf[0] = 0x19;
-  out_buf[1] = 3;
-  out_buf[2] = 0; //maximum
-  ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 6, DEFAULT_RECEIVE_TIMEOUT);
+  dev->out_buf[0] = 0x19;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 0; //maximum
+  ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 6, dev->receive_timeout);
   if (ret == LIBALLURIS_SUCCESS)
-    *limit = char_to_int24 (in_buf + 3);
-  return ret;
+    *limit = char_to_int24 (dev->in_buf + 3);
+  return device_unlock (dev, ret);
 }
 
 /*!
@@ -1159,21 +6327,26 @@ int liballuris_get_upper_limit (libusb_device_handle *dev_handle, int* limit)
  */
 int liballuris_get_lower_limit (libusb_device_handle *dev_handle, int* limit)
 {
-  struct liballuris_state state;
-  int ret = liballuris_read_state (dev_handle, &state);
-  if (ret)
-    return ret;
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_lower_limit (&dev, limit);
+}
 
-  if (state.measuring)
-    return LIBALLURIS_DEVICE_BUSY;
+//! Thread-safe variant of \ref liballuris_get_lower_limit operating on a device context
+int liballuris_device_get_lower_limit (struct liballuris_device *dev, int* limit)
+{
+  device_lock (dev);
+  int ret = device_check_stopped (dev);
+  if (ret)
+    return device_unlock (dev, ret);
 
-  out_buf[0] = 0x19;
-  out_buf[1] = 3;
-  out_buf[2] = 1; //minimum
-  ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 6, DEFAULT_RECEIVE_TIMEOUT);
+  dev->out_buf[0] = 0x19;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 1; //minimum
+  ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 6, dev->receive_timeout);
   if (ret == LIBALLURIS_SUCCESS)
-    *limit = char_to_int24 (in_buf + 3);
-  return ret;
+    *limit = char_to_int24 (dev->in_buf + 3);
+  return device_unlock (dev, ret);
 }
 
 /*!
@@ -1188,21 +6361,37 @@ int liballuris_get_lower_limit (libusb_device_handle *dev_handle, int* limit)
  * \sa liballuris_get_mode
  */
 int liballuris_set_mode (libusb_device_handle *dev_handle, enum liballuris_measurement_mode mode)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_set_mode (&dev, mode);
+}
+
+//! Thread-safe variant of \ref liballuris_set_mode operating on a device context
+int liballuris_device_set_mode (struct liballuris_device *dev, enum liballuris_measurement_mode mode)
 {
   if (mode < 0 || mode > 3)
     {
       fprintf (stderr, "Error: mode %i out of range 0..3\n", mode);
       return LIBALLURIS_OUT_OF_RANGE;
     }
-  out_buf[0] = 0x04;
-  out_buf[1] = 3;
-  out_buf[2] = mode;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 3, DEFAULT_RECEIVE_TIMEOUT);
 
-  if (in_buf[2] != mode)
-    return LIBALLURIS_DEVICE_BUSY;
+  device_lock (dev);
+  dev->out_buf[0] = 0x04;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = mode;
+  dev->cache_valid &= ~DEVICE_CACHE_MODE;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 3, dev->receive_timeout);
 
-  return ret;
+  if (dev->in_buf[2] != mode)
+    return device_unlock (dev, LIBALLURIS_DEVICE_BUSY);
+
+  if (ret == LIBALLURIS_SUCCESS)
+    {
+      dev->cache.mode = mode;
+      dev->cache_valid |= DEVICE_CACHE_MODE;
+    }
+  return device_unlock (dev, ret);
 }
 
 /*!
@@ -1215,12 +6404,30 @@ int liballuris_set_mode (libusb_device_handle *dev_handle, enum liballuris_measu
  */
 int liballuris_get_mode (libusb_device_handle *dev_handle, enum liballuris_measurement_mode *mode)
 {
-  out_buf[0] = 0x05;
-  out_buf[1] = 2;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 2, DEFAULT_SEND_TIMEOUT, 3, DEFAULT_RECEIVE_TIMEOUT);
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_mode (&dev, mode);
+}
+
+//! Thread-safe variant of \ref liballuris_get_mode operating on a device context
+int liballuris_device_get_mode (struct liballuris_device *dev, enum liballuris_measurement_mode *mode)
+{
+  device_lock (dev);
+  if (dev->cache_valid & DEVICE_CACHE_MODE)
+    {
+      *mode = dev->cache.mode;
+      return device_unlock (dev, LIBALLURIS_SUCCESS);
+    }
+  dev->out_buf[0] = 0x05;
+  dev->out_buf[1] = 2;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 2, dev->send_timeout, 3, dev->receive_timeout);
   if (ret == LIBALLURIS_SUCCESS)
-    *mode = (enum liballuris_measurement_mode) in_buf[2];
-  return ret;
+    {
+      *mode = (enum liballuris_measurement_mode) dev->in_buf[2];
+      dev->cache.mode = *mode;
+      dev->cache_valid |= DEVICE_CACHE_MODE;
+    }
+  return device_unlock (dev, ret);
 }
 
 /*!
@@ -1235,22 +6442,32 @@ int liballuris_get_mode (libusb_device_handle *dev_handle, enum liballuris_measu
  * \sa liballuris_get_mem_mode
  */
 int liballuris_set_mem_mode (libusb_device_handle *dev_handle, enum liballuris_memory_mode mode)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_set_mem_mode (&dev, mode);
+}
+
+//! Thread-safe variant of \ref liballuris_set_mem_mode operating on a device context
+int liballuris_device_set_mem_mode (struct liballuris_device *dev, enum liballuris_memory_mode mode)
 {
   if (mode < 0 || mode > 2)
     {
       fprintf (stderr, "Error: memory mode %i out of range 0..2\n", mode);
       return LIBALLURIS_OUT_OF_RANGE;
     }
-  out_buf[0] = 0x1D;
-  out_buf[1] = 3;
-  out_buf[2] = mode;
+
+  device_lock (dev);
+  dev->out_buf[0] = 0x1D;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = mode;
   // worst execution time = 0.475s
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 3, 712);
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 3, 712);
 
-  if (in_buf[2] != mode)
-    return LIBALLURIS_DEVICE_BUSY;
+  if (dev->in_buf[2] != mode)
+    return device_unlock (dev, LIBALLURIS_DEVICE_BUSY);
 
-  return ret;
+  return device_unlock (dev, ret);
 }
 
 /*!
@@ -1263,27 +6480,36 @@ int liballuris_set_mem_mode (libusb_device_handle *dev_handle, enum liballuris_m
  */
 int liballuris_get_mem_mode (libusb_device_handle *dev_handle, enum liballuris_memory_mode *mode)
 {
-  out_buf[0] = 0x1E;
-  out_buf[1] = 2;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 2, DEFAULT_SEND_TIMEOUT, 3, DEFAULT_RECEIVE_TIMEOUT);
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_mem_mode (&dev, mode);
+}
+
+//! Thread-safe variant of \ref liballuris_get_mem_mode operating on a device context
+int liballuris_device_get_mem_mode (struct liballuris_device *dev, enum liballuris_memory_mode *mode)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x1E;
+  dev->out_buf[1] = 2;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 2, dev->send_timeout, 3, dev->receive_timeout);
   if (ret == LIBALLURIS_SUCCESS)
-    *mode = (enum liballuris_memory_mode) in_buf[2];
+    *mode = (enum liballuris_memory_mode) dev->in_buf[2];
 
   // workaround for a firmware bug in versions < FIXME: add version number!
   // check if we get a second reply
   int actual;
-  int temp_ret = libusb_interrupt_transfer (dev_handle, 0x81 | LIBUSB_ENDPOINT_IN, in_buf, 3, &actual, 100);
+  int temp_ret = device_transfer (dev, 0x81 | LIBUSB_ENDPOINT_IN, dev->in_buf, 3, &actual, 100);
   if (temp_ret == LIBALLURIS_SUCCESS)
     {
       // discard first reply
-      *mode = (enum liballuris_memory_mode) in_buf[2];
+      *mode = (enum liballuris_memory_mode) dev->in_buf[2];
       //fprintf (stderr, "Warning: double answer for get_mem_mode (0x1E)\n");
     }
   else
     // bug is fixed and we got a timeout (no superfluous reply)
     { }
 
-  return ret;
+  return device_unlock (dev, ret);
 }
 
 /*!
@@ -1302,6 +6528,14 @@ int liballuris_get_mem_mode (libusb_device_handle *dev_handle, enum liballuris_m
  * \sa liballuris_get_unit
  */
 int liballuris_set_unit (libusb_device_handle *dev_handle, enum liballuris_unit unit)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_set_unit (&dev, unit);
+}
+
+//! Thread-safe variant of \ref liballuris_set_unit operating on a device context
+int liballuris_device_set_unit (struct liballuris_device *dev, enum liballuris_unit unit)
 {
   if (unit < 0 || unit > 5)
     {
@@ -1309,33 +6543,42 @@ int liballuris_set_unit (libusb_device_handle *dev_handle, enum liballuris_unit
       return LIBALLURIS_OUT_OF_RANGE;
     }
 
+  device_lock (dev);
+  enum liballuris_unit requested_unit = unit;
   // F_max dependent mapping
   int fmax;
-  int ret = liballuris_get_F_max (dev_handle, &fmax);
+  int ret = liballuris_device_get_F_max (dev, &fmax);
   if (ret)
-    return ret;
+    return device_unlock (dev, ret);
 
-  out_buf[0] = 0x1A;
-  out_buf[1] = 3;
+  dev->out_buf[0] = 0x1A;
+  dev->out_buf[1] = 3;
 
   if (fmax <= 10) //mapping from chapter 3.14.3
     {
       if (unit == 2 || unit == 4) //kg and lb not available on 5N and 10N devices
-        return LIBALLURIS_OUT_OF_RANGE;
+        return device_unlock (dev, LIBALLURIS_OUT_OF_RANGE);
       if (unit == 3 || unit == 5)
         unit = (enum liballuris_unit)((int)(unit) - 1);
     }
   else if (unit == 1 || unit == 3 || unit == 5) //g and oz not available on devices with fmax > 10N
-    return LIBALLURIS_OUT_OF_RANGE;
+    return device_unlock (dev, LIBALLURIS_OUT_OF_RANGE);
 
-  out_buf[2] = unit;
+  dev->out_buf[2] = unit;
+  // the fixed-point representation depends on the unit
+  dev->cache_valid &= ~(DEVICE_CACHE_UNIT | DEVICE_CACHE_DIGITS | DEVICE_CACHE_RESOLUTION);
   // worst execution time = 0.482s
-  ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 3, 723);
+  ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 3, 723);
 
-  if (in_buf[2] != unit)
-    return LIBALLURIS_DEVICE_BUSY;
+  if (dev->in_buf[2] != unit)
+    return device_unlock (dev, LIBALLURIS_DEVICE_BUSY);
 
-  return ret;
+  if (ret == LIBALLURIS_SUCCESS)
+    {
+      dev->cache.unit = requested_unit;
+      dev->cache_valid |= DEVICE_CACHE_UNIT;
+    }
+  return device_unlock (dev, ret);
 }
 
 /*!
@@ -1351,23 +6594,41 @@ int liballuris_set_unit (libusb_device_handle *dev_handle, enum liballuris_unit
  */
 int liballuris_get_unit (libusb_device_handle *dev_handle, enum liballuris_unit *unit)
 {
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_unit (&dev, unit);
+}
+
+//! Thread-safe variant of \ref liballuris_get_unit operating on a device context
+int liballuris_device_get_unit (struct liballuris_device *dev, enum liballuris_unit *unit)
+{
+  device_lock (dev);
+  if (dev->cache_valid & DEVICE_CACHE_UNIT)
+    {
+      *unit = dev->cache.unit;
+      return device_unlock (dev, LIBALLURIS_SUCCESS);
+    }
   // F_max dependent mapping
   int fmax;
-  int ret = liballuris_get_F_max (dev_handle, &fmax);
+  int ret = liballuris_device_get_F_max (dev, &fmax);
   if (ret)
-    return ret;
+    return device_unlock (dev, ret);
 
-  out_buf[0] = 0x1B;
-  out_buf[1] = 2;
-  ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 2, DEFAULT_SEND_TIMEOUT, 3, DEFAULT_RECEIVE_TIMEOUT);
+  dev->out_buf[0] = 0x1B;
+  dev->out_buf[1] = 2;
+  ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 2, dev->send_timeout, 3, dev->receive_timeout);
   if (ret == LIBALLURIS_SUCCESS)
-    *unit = (enum liballuris_unit) in_buf[2];
+    {
+      *unit = (enum liballuris_unit) dev->in_buf[2];
 
-  // mapping from chapter 3.15.3
-  if (fmax <= 10 && (*unit == 2 || *unit == 4))
-    *unit = (enum liballuris_unit)((int)(*unit) + 1);
+      // mapping from chapter 3.15.3
+      if (fmax <= 10 && (*unit == 2 || *unit == 4))
+        *unit = (enum liballuris_unit)((int)(*unit) + 1);
 
-  return ret;
+      dev->cache.unit = *unit;
+      dev->cache_valid |= DEVICE_CACHE_UNIT;
+    }
+  return device_unlock (dev, ret);
 }
 
 /*!
@@ -1379,19 +6640,28 @@ int liballuris_get_unit (libusb_device_handle *dev_handle, enum liballuris_unit
  * \sa liballuris_get_digout
  */
 int liballuris_set_digout (libusb_device_handle *dev_handle, int v)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_set_digout (&dev, v);
+}
+
+//! Thread-safe variant of \ref liballuris_set_digout operating on a device context
+int liballuris_device_set_digout (struct liballuris_device *dev, int v)
 {
   if (v < 0 || v > 7) //only 3 bits
     return LIBALLURIS_OUT_OF_RANGE;
 
-  out_buf[0] = 0x21;
-  out_buf[1] = 3;
-  out_buf[2] = v;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 3, DEFAULT_RECEIVE_TIMEOUT);
+  device_lock (dev);
+  dev->out_buf[0] = 0x21;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = v;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 3, dev->receive_timeout);
 
-  if (in_buf[2] != v)
-    return LIBALLURIS_DEVICE_BUSY;
+  if (dev->in_buf[2] != v)
+    return device_unlock (dev, LIBALLURIS_DEVICE_BUSY);
 
-  return ret;
+  return device_unlock (dev, ret);
 }
 
 /*!
@@ -1404,12 +6674,21 @@ int liballuris_set_digout (libusb_device_handle *dev_handle, int v)
  */
 int liballuris_get_digout (libusb_device_handle *dev_handle, int *v)
 {
-  out_buf[0] = 0x22;
-  out_buf[1] = 2;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 2, DEFAULT_SEND_TIMEOUT, 3, DEFAULT_RECEIVE_TIMEOUT);
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_digout (&dev, v);
+}
+
+//! Thread-safe variant of \ref liballuris_get_digout operating on a device context
+int liballuris_device_get_digout (struct liballuris_device *dev, int *v)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x22;
+  dev->out_buf[1] = 2;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 2, dev->send_timeout, 3, dev->receive_timeout);
   if (ret == LIBALLURIS_SUCCESS)
-    *v = in_buf[2];
-  return ret;
+    *v = dev->in_buf[2];
+  return device_unlock (dev, ret);
 }
 
 /*!
@@ -1422,73 +6701,206 @@ int liballuris_get_digout (libusb_device_handle *dev_handle, int *v)
  */
 int liballuris_get_digin (libusb_device_handle *dev_handle, int *v)
 {
-  out_buf[0] = 0x27;
-  out_buf[1] = 2;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 2, DEFAULT_SEND_TIMEOUT, 3, DEFAULT_RECEIVE_TIMEOUT);
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_digin (&dev, v);
+}
+
+//! Thread-safe variant of \ref liballuris_get_digin operating on a device context
+int liballuris_device_get_digin (struct liballuris_device *dev, int *v)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x27;
+  dev->out_buf[1] = 2;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 2, dev->send_timeout, 3, dev->receive_timeout);
   if (ret == LIBALLURIS_SUCCESS)
-    *v = in_buf[2];
-  return ret;
+    *v = dev->in_buf[2];
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Restore factory defaults
+ *
+ * Restore factory defaults and set idle mode.
+ *
+ * Only possible if the measurement is not running,
+ * else LIBALLURIS_DEVICE_BUSY is returned.
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \return 0 if successful else \ref liballuris_error
+ */
+int liballuris_restore_factory_defaults (libusb_device_handle *dev_handle)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_restore_factory_defaults (&dev);
+}
+
+//! Thread-safe variant of \ref liballuris_restore_factory_defaults operating on a device context
+int liballuris_device_restore_factory_defaults (struct liballuris_device *dev)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x16;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 1;
+  dev->cache_valid = 0;
+  // worst execution time = 2.34s (on TTT)
+  // Long receive timeout because device performs many slow EEPROM write operations
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 3, 3510);
+  if (ret == LIBALLURIS_SUCCESS && dev->in_buf[2] == 0xFF)
+    ret = LIBALLURIS_DEVICE_BUSY;
+  return device_unlock (dev, ret);
+}
+
+/*!
+ * \brief Power off the device
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \return 0 if successful else \ref liballuris_error
+ */
+int liballuris_power_off (libusb_device_handle *dev_handle)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_power_off (&dev);
+}
+
+//! Thread-safe variant of \ref liballuris_power_off operating on a device context
+int liballuris_device_power_off (struct liballuris_device *dev)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x13;
+  dev->out_buf[1] = 2;
+  dev->cache_valid = 0;
+  return device_unlock (dev, liballuris_interrupt_transfer (dev, __FUNCTION__, 2, dev->send_timeout, 0, dev->receive_timeout));
+}
+
+/*!
+ * \brief Read the measurement memory
+ *
+ * \param[in] dev_handle a handle for the device to communicate with
+ * \param[in] adr 0..999
+ * \param[out] mem_value output location for the stored value. Only populated when the return code is 0.
+ * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_get_mem_count
+ */
+int liballuris_read_memory (libusb_device_handle *dev_handle, int adr, int* mem_value)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_read_memory (&dev, adr, mem_value);
+}
+
+//! Thread-safe variant of \ref liballuris_read_memory operating on a device context
+int liballuris_device_read_memory (struct liballuris_device *dev, int adr, int* mem_value)
+{
+  if (adr < 0 || adr > 999)
+    return LIBALLURIS_OUT_OF_RANGE;
+
+  device_lock (dev);
+  dev->out_buf[0] = 0x06;
+  dev->out_buf[1] = 4;
+  dev->out_buf[2] = adr & 0xFF;
+  dev->out_buf[3] = (adr >> 8) & 0xFF;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 4, dev->send_timeout, 5, dev->receive_timeout);
+  if (ret == LIBALLURIS_SUCCESS)
+    *mem_value = char_to_int24 (dev->in_buf + 2);
+  return device_unlock (dev, ret);
+}
+
+struct memory_query
+{
+  int start_adr;
+  int* buf;
+};
+
+static void memory_query_fill (struct liballuris_device* dev, size_t index, void* user_data)
+{
+  struct memory_query* q = user_data;
+  int adr = q->start_adr + index;
+  dev->out_buf[0] = 0x06;
+  dev->out_buf[1] = 4;
+  dev->out_buf[2] = adr & 0xFF;
+  dev->out_buf[3] = (adr >> 8) & 0xFF;
+}
+
+static int memory_query_parse (struct liballuris_device* dev, size_t index, void* user_data)
+{
+  struct memory_query* q = user_data;
+  q->buf[index] = char_to_int24 (dev->in_buf + 2);
+  return LIBALLURIS_SUCCESS;
 }
 
 /*!
- * \brief Restore factory defaults
- *
- * Restore factory defaults and set idle mode.
+ * \brief Read consecutive addresses of the measurement memory
  *
- * Only possible if the measurement is not running,
- * else LIBALLURIS_DEVICE_BUSY is returned.
+ * Same as calling \ref liballuris_read_memory for each address but with
+ * DEFAULT_PIPELINE_DEPTH requests in flight, thus much faster.
  *
  * \param[in] dev_handle a handle for the device to communicate with
+ * \param[in] adr first address 0..999
+ * \param[out] buf output location for length values. Only completely populated when the return code is 0.
+ * \param[in] length number of values to read, adr + length <= 1000
  * \return 0 if successful else \ref liballuris_error
+ * \sa liballuris_read_memory_all
  */
-int liballuris_restore_factory_defaults (libusb_device_handle *dev_handle)
+int liballuris_read_memory_range (libusb_device_handle *dev_handle, int adr, int* buf, size_t length)
 {
-  out_buf[0] = 0x16;
-  out_buf[1] = 3;
-  out_buf[2] = 1;
-  // worst execution time = 2.34s (on TTT)
-  // Long receive timeout because device performs many slow EEPROM write operations
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 3, 3510);
-  if (ret == LIBALLURIS_SUCCESS && in_buf[2] == 0xFF)
-    ret = LIBALLURIS_DEVICE_BUSY;
-  return ret;
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_read_memory_range (&dev, adr, buf, length);
 }
 
-/*!
- * \brief Power off the device
- *
- * \param[in] dev_handle a handle for the device to communicate with
- * \return 0 if successful else \ref liballuris_error
- */
-int liballuris_power_off (libusb_device_handle *dev_handle)
+//! Thread-safe variant of \ref liballuris_read_memory_range operating on a device context
+int liballuris_device_read_memory_range (struct liballuris_device *dev, int adr, int* buf, size_t length)
 {
-  out_buf[0] = 0x13;
-  out_buf[1] = 2;
-  return liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 2, DEFAULT_SEND_TIMEOUT, 0, DEFAULT_RECEIVE_TIMEOUT);
+  if (adr < 0 || adr + length > 1000)
+    return LIBALLURIS_OUT_OF_RANGE;
+
+  struct memory_query q = {adr, buf};
+  device_lock (dev);
+  int ret = liballuris_pipelined_query (dev, __FUNCTION__, length, DEFAULT_PIPELINE_DEPTH, 4, 5,
+                                        memory_query_fill, memory_query_parse, &q);
+  return device_unlock (dev, ret);
 }
 
 /*!
- * \brief Read the measurement memory
+ * \brief Read all stored values of the measurement memory
+ *
+ * Queries \ref liballuris_get_mem_count and reads that many values with
+ * \ref liballuris_read_memory_range.
  *
  * \param[in] dev_handle a handle for the device to communicate with
- * \param[in] adr 0..999
- * \param[out] mem_value output location for the stored value. Only populated when the return code is 0.
+ * \param[out] buf output location for the values
+ * \param[in] length of buf, 1000 values are sufficient for all devices
+ * \param[out] actual_num_values number of values copied to buf
  * \return 0 if successful else \ref liballuris_error
- * \sa liballuris_get_mem_count
  */
-int liballuris_read_memory (libusb_device_handle *dev_handle, int adr, int* mem_value)
+int liballuris_read_memory_all (libusb_device_handle *dev_handle, int* buf, size_t length, size_t* actual_num_values)
 {
-  if (adr < 0 || adr > 999)
-    return LIBALLURIS_OUT_OF_RANGE;
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_read_memory_all (&dev, buf, length, actual_num_values);
+}
 
-  out_buf[0] = 0x06;
-  out_buf[1] = 4;
-  out_buf[2] = adr & 0xFF;
-  out_buf[3] = (adr >> 8) & 0xFF;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 4, DEFAULT_SEND_TIMEOUT, 5, DEFAULT_RECEIVE_TIMEOUT);
+//! Thread-safe variant of \ref liballuris_read_memory_all operating on a device context
+int liballuris_device_read_memory_all (struct liballuris_device *dev, int* buf, size_t length, size_t* actual_num_values)
+{
+  int cnt;
+  *actual_num_values = 0;
+  device_lock (dev);
+  int ret = liballuris_device_get_mem_count (dev, &cnt);
   if (ret == LIBALLURIS_SUCCESS)
-    *mem_value = char_to_int24 (in_buf + 2);
-  return ret;
+    {
+      if (cnt < 0)
+        cnt = 0;
+      if ((size_t) cnt > length)
+        cnt = length;
+      ret = liballuris_device_read_memory_range (dev, 0, buf, cnt);
+      if (ret == LIBALLURIS_SUCCESS)
+        *actual_num_values = cnt;
+    }
+  return device_unlock (dev, ret);
 }
 
 /*!
@@ -1499,10 +6911,19 @@ int liballuris_read_memory (libusb_device_handle *dev_handle, int adr, int* mem_
  */
 int liballuris_delete_memory (libusb_device_handle *dev_handle)
 {
-  out_buf[0] = 0x07;
-  out_buf[1] = 3;
-  out_buf[2] = 1;
-  return liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 3, DEFAULT_RECEIVE_TIMEOUT);
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_delete_memory (&dev);
+}
+
+//! Thread-safe variant of \ref liballuris_delete_memory operating on a device context
+int liballuris_device_delete_memory (struct liballuris_device *dev)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x07;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 1;
+  return device_unlock (dev, liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 3, dev->receive_timeout));
 }
 
 /*!
@@ -1515,17 +6936,26 @@ int liballuris_delete_memory (libusb_device_handle *dev_handle)
  */
 int liballuris_get_mem_count (libusb_device_handle *dev_handle, int* v)
 {
-  out_buf[0] = 0x08;
-  out_buf[1] = 3;
-  out_buf[2] = 5;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 6, DEFAULT_RECEIVE_TIMEOUT);
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_mem_count (&dev, v);
+}
+
+//! Thread-safe variant of \ref liballuris_get_mem_count operating on a device context
+int liballuris_device_get_mem_count (struct liballuris_device *dev, int* v)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x08;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = 5;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 6, dev->receive_timeout);
   if (ret == LIBALLURIS_SUCCESS)
     {
-      *v = char_to_int24 (in_buf + 3);
+      *v = char_to_int24 (dev->in_buf + 3);
       if (*v == -1)
-        return LIBALLURIS_DEVICE_BUSY;
+        return device_unlock (dev, LIBALLURIS_DEVICE_BUSY);
     }
-  return ret;
+  return device_unlock (dev, ret);
 }
 
 /*!
@@ -1544,16 +6974,25 @@ int liballuris_get_mem_count (libusb_device_handle *dev_handle, int* v)
  */
 int liballuris_get_mem_statistics (libusb_device_handle *dev_handle, int* stats, size_t length)
 {
-  out_buf[0] = 0x09;
-  out_buf[1] = 2;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 2, DEFAULT_SEND_TIMEOUT, 20, DEFAULT_RECEIVE_TIMEOUT);
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_mem_statistics (&dev, stats, length);
+}
+
+//! Thread-safe variant of \ref liballuris_get_mem_statistics operating on a device context
+int liballuris_device_get_mem_statistics (struct liballuris_device *dev, int* stats, size_t length)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x09;
+  dev->out_buf[1] = 2;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 2, dev->send_timeout, 20, dev->receive_timeout);
   if (ret == LIBALLURIS_SUCCESS)
     {
       unsigned int k;
       for (k=0; k<length; ++k)
-        stats[k] = char_to_int24 (in_buf + 2 + k * 3);
+        stats[k] = char_to_int24 (dev->in_buf + 2 + k * 3);
     }
-  return ret;
+  return device_unlock (dev, ret);
 }
 
 /*!
@@ -1568,77 +7007,880 @@ int liballuris_get_mem_statistics (libusb_device_handle *dev_handle, int* stats,
  * \return 0 if successful else \ref liballuris_error
  */
 int liballuris_sim_keypress (libusb_device_handle *dev_handle, unsigned char mask)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_sim_keypress (&dev, mask);
+}
+
+//! Thread-safe variant of \ref liballuris_sim_keypress operating on a device context
+int liballuris_device_sim_keypress (struct liballuris_device *dev, unsigned char mask)
 {
   if (mask > 0x0F)
     return LIBALLURIS_OUT_OF_RANGE;
-  out_buf[0] = 0x14;
-  out_buf[1] = 3;
-  out_buf[2] = mask & 0x0F ;
-  return liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 3, DEFAULT_RECEIVE_TIMEOUT);
+
+  device_lock (dev);
+  dev->out_buf[0] = 0x14;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = mask & 0x0F ;
+  // a keypress may start/stop the measurement or change the settings
+  dev->cache_valid = 0;
+  return device_unlock (dev, liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 3, dev->receive_timeout));
 }
 
 int liballuris_set_peak_level (libusb_device_handle *dev_handle, int v)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_set_peak_level (&dev, v);
+}
+
+//! Thread-safe variant of \ref liballuris_set_peak_level operating on a device context
+int liballuris_device_set_peak_level (struct liballuris_device *dev, int v)
 {
   if (v < 1 || v > 9)
     return LIBALLURIS_OUT_OF_RANGE;
 
-  out_buf[0] = 0x31;
-  out_buf[1] = 3;
-  out_buf[2] = v;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 3, DEFAULT_RECEIVE_TIMEOUT);
+  device_lock (dev);
+  dev->out_buf[0] = 0x31;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = v;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 3, dev->receive_timeout);
 
-  if (in_buf[2] != v)
-    return LIBALLURIS_DEVICE_BUSY;
+  if (dev->in_buf[2] != v)
+    return device_unlock (dev, LIBALLURIS_DEVICE_BUSY);
 
-  return ret;
+  return device_unlock (dev, ret);
 }
 
 int liballuris_get_peak_level (libusb_device_handle *dev_handle, int *v)
 {
-  out_buf[0] = 0x32;
-  out_buf[1] = 2;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 2, DEFAULT_SEND_TIMEOUT, 3, DEFAULT_RECEIVE_TIMEOUT);
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_peak_level (&dev, v);
+}
+
+//! Thread-safe variant of \ref liballuris_get_peak_level operating on a device context
+int liballuris_device_get_peak_level (struct liballuris_device *dev, int *v)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x32;
+  dev->out_buf[1] = 2;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 2, dev->send_timeout, 3, dev->receive_timeout);
   if (ret == LIBALLURIS_SUCCESS)
-    *v = in_buf[2];
-  return ret;
+    *v = dev->in_buf[2];
+  return device_unlock (dev, ret);
 }
 
 int liballuris_set_autostop (libusb_device_handle *dev_handle, int v)
+{
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_set_autostop (&dev, v);
+}
+
+//! Thread-safe variant of \ref liballuris_set_autostop operating on a device context
+int liballuris_device_set_autostop (struct liballuris_device *dev, int v)
 {
   if (v < 0 || v > 30)
     return LIBALLURIS_OUT_OF_RANGE;
 
-  out_buf[0] = 0x33;
-  out_buf[1] = 3;
-  out_buf[2] = v;
+  device_lock (dev);
+  dev->out_buf[0] = 0x33;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = v;
+  dev->cache_valid &= ~DEVICE_CACHE_MEASURING;
   // reply for set_autostop may take up to 500ms, use 1s as timeout
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 3, 1000);
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 3, 1000);
 
-  if (in_buf[2] != v)
-    return LIBALLURIS_DEVICE_BUSY;
+  if (dev->in_buf[2] != v)
+    return device_unlock (dev, LIBALLURIS_DEVICE_BUSY);
 
-  return ret;
+  return device_unlock (dev, ret);
 }
 
 int liballuris_get_autostop (libusb_device_handle *dev_handle, int *v)
 {
-  out_buf[0] = 0x34;
-  out_buf[1] = 2;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 2, DEFAULT_SEND_TIMEOUT, 3, DEFAULT_RECEIVE_TIMEOUT);
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_get_autostop (&dev, v);
+}
+
+//! Thread-safe variant of \ref liballuris_get_autostop operating on a device context
+int liballuris_device_get_autostop (struct liballuris_device *dev, int *v)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x34;
+  dev->out_buf[1] = 2;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 2, dev->send_timeout, 3, dev->receive_timeout);
   if (ret == LIBALLURIS_SUCCESS)
-    *v = in_buf[2];
-  return ret;
+    *v = dev->in_buf[2];
+  return device_unlock (dev, ret);
 }
 
 int liballuris_set_key_lock (libusb_device_handle *dev_handle, char active)
 {
-  out_buf[0] = 0x68;
-  out_buf[1] = 3;
-  out_buf[2] = active;
-  int ret = liballuris_interrupt_transfer (dev_handle, __FUNCTION__, 3, DEFAULT_SEND_TIMEOUT, 3, DEFAULT_RECEIVE_TIMEOUT);
+  struct liballuris_device dev;
+  device_init_transient (&dev, dev_handle);
+  return liballuris_device_set_key_lock (&dev, active);
+}
 
-  if (in_buf[2] != active)
-    return LIBALLURIS_DEVICE_BUSY;
+//! Thread-safe variant of \ref liballuris_set_key_lock operating on a device context
+int liballuris_device_set_key_lock (struct liballuris_device *dev, char active)
+{
+  device_lock (dev);
+  dev->out_buf[0] = 0x68;
+  dev->out_buf[1] = 3;
+  dev->out_buf[2] = active;
+  int ret = liballuris_interrupt_transfer (dev, __FUNCTION__, 3, dev->send_timeout, 3, dev->receive_timeout);
+
+  if (dev->in_buf[2] != active)
+    return device_unlock (dev, LIBALLURIS_DEVICE_BUSY);
+
+  return device_unlock (dev, ret);
+}
+
+/****************************************************************************************/
+// replay of recordings and simulated device, see liballuris_open_transport
+
+//! Internal: one frame of a recording, see record_frame
+struct replay_frame
+{
+  int64_t t_ns;                // since the start of the recording
+  unsigned char endpoint;
+  int status;
+  int length;
+  unsigned char data[255];
+};
+
+//! Internal: state of liballuris_open_replay
+struct replay
+{
+  pthread_mutex_t lock;
+  struct replay_frame* frames;
+  size_t num_frames;
+  size_t next_out;             // next frame on endpoint 0x01
+  size_t next_in;              // next frame on endpoint 0x81
+  double speed;                // 0 = as fast as possible
+  int64_t start_ns;            // monotonic time of frames[0], 0 = not started
+};
+
+//! Internal: index of the next frame in direction dir (0 or LIBUSB_ENDPOINT_IN) at or after k
+static size_t replay_next (struct replay* r, size_t k, unsigned char dir)
+{
+  while (k < r->num_frames && (r->frames[k].endpoint & LIBUSB_ENDPOINT_IN) != dir)
+    k++;
+  return k;
+}
+
+//! Internal: monotonic time at which a frame is due
+static int64_t replay_due (struct replay* r, const struct replay_frame* f)
+{
+  return r->start_ns + (int64_t) ((f->t_ns - r->frames[0].t_ns) / r->speed);
+}
+
+static void sleep_ns (int64_t ns)
+{
+  if (ns <= 0)
+    return;
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  nanosleep (&ts, NULL);
+}
+
+/*!
+ * \brief Internal: transfer callback of liballuris_open_replay
+ *
+ * OUT and IN frames are served with independent cursors. An IN frame is only available after
+ * all OUT frames recorded before it were sent and when its time has come, else the transfer
+ * times out without consuming it. A late OUT frame shifts the time base of the following frames,
+ * thus replies keep their delay relative to the commands.
+ */
+static int replay_transfer (void* user_data, unsigned char endpoint, unsigned char* data, int length, int* actual, unsigned int timeout)
+{
+  struct replay* r = user_data;
+  int ret;
+  *actual = 0;
+
+  pthread_mutex_lock (&r->lock);
+  int64_t now = monotonic_ns ();
+  if (! r->start_ns)
+    r->start_ns = now;
+
+  if (! (endpoint & LIBUSB_ENDPOINT_IN))
+    {
+      r->next_out = replay_next (r, r->next_out, 0);
+      if (r->next_out == r->num_frames)
+        {
+          pthread_mutex_unlock (&r->lock);
+          return LIBUSB_ERROR_NO_DEVICE;
+        }
+      struct replay_frame* f = &r->frames[r->next_out++];
+      if (f->length != length || memcmp (f->data, data, length))
+        fprintf (stderr, "Warning: replay frame %zu: command 0x%02x differs from the recorded 0x%02x.\n", (size_t) (f - r->frames), data[0], f->data[0]);
+      if (r->speed > 0 && now > replay_due (r, f))
+        r->start_ns += now - replay_due (r, f);
+      *actual = (f->status == LIBUSB_SUCCESS)? length : 0;
+      ret = f->status;
+      pthread_mutex_unlock (&r->lock);
+      return ret;
+    }
+
+  int64_t deadline = (timeout)? now + (int64_t) timeout * 1000000 : INT64_MAX;
+  while (1)
+    {
+      r->next_in = replay_next (r, r->next_in, LIBUSB_ENDPOINT_IN);
+      if (r->next_in == r->num_frames)
+        {
+          pthread_mutex_unlock (&r->lock);
+          return LIBUSB_ERROR_NO_DEVICE;
+        }
+      struct replay_frame* f = &r->frames[r->next_in];
+      char ready = replay_next (r, r->next_out, 0) > r->next_in;
+      int64_t due = (r->speed > 0)? replay_due (r, f) : now;
+      if (ready && due <= now)
+        {
+          r->next_in++;
+          int n = (f->length < length)? f->length : length;
+          memcpy (data, f->data, n);
+          *actual = n;
+          ret = (f->length > length && f->status == LIBUSB_SUCCESS)? LIBUSB_ERROR_OVERFLOW : f->status;
+          break;
+        }
+      if (now >= deadline || (! ready && r->speed <= 0 && ! timeout))
+        {
+          ret = LIBUSB_ERROR_TIMEOUT;
+          break;
+        }
+      // without speed nothing changes unless the application sends the next command
+      if (! ready && r->speed <= 0)
+        due = deadline;
+      else if (! ready)
+        due = now + 10000000;
+      pthread_mutex_unlock (&r->lock);
+      sleep_ns (((due < deadline)? due : deadline) - now);
+      pthread_mutex_lock (&r->lock);
+      now = monotonic_ns ();
+    }
+  pthread_mutex_unlock (&r->lock);
+  return ret;
+}
+
+static void replay_close (void* user_data)
+{
+  struct replay* r = user_data;
+  pthread_mutex_destroy (&r->lock);
+  free (r->frames);
+  free (r);
+}
+
+static const struct liballuris_transport replay_transport = {replay_transfer, replay_close};
+
+/*!
+ * \brief Serve a recording of \ref liballuris_record_start as device
+ *
+ * The frames are replayed with their recorded timing scaled by speed. Commands which differ
+ * from the recording are reported on stderr but answered with the recorded reply.
+ * Transfers fail with LIBUSB_ERROR_NO_DEVICE at the end of the recording.
+ *
+ * \param[in] path of the recording
+ * \param[in] speed time scale, for example 2 for twice as fast, 0 to replay without delays
+ * \param[out] h storage for the new handle, close it with \ref liballuris_close_transport
+ * \return 0 if successful else \ref liballuris_error
+ */
+int liballuris_open_replay (const char* path, double speed, libusb_device_handle** h)
+{
+  FILE* f = fopen (path, "rb");
+  if (! f)
+    {
+      fprintf (stderr, "Couldn't open recording '%s': %s\n", path, strerror (errno));
+      return LIBUSB_ERROR_NOT_FOUND;
+    }
+
+  unsigned char hdr[8];
+  if (fread (hdr, 1, sizeof (hdr), f) != sizeof (hdr) || memcmp (hdr, "ALRF", 4) || hdr[4] != 1 || hdr[5] != 0)
+    {
+      fprintf (stderr, "Error: '%s' isn't a liballuris recording.\n", path);
+      fclose (f);
+      return LIBALLURIS_MALFORMED_REPLY;
+    }
+
+  struct replay* r = calloc (1, sizeof (struct replay));
+  if (! r)
+    {
+      fclose (f);
+      return LIBUSB_ERROR_NO_MEM;
+    }
+  r->speed = (speed > 0)? speed : 0;
+  pthread_mutex_init (&r->lock, NULL);
+
+  size_t capacity = 0;
+  int64_t t = 0;
+  int ret = LIBALLURIS_SUCCESS;
+  while (fread (hdr, 1, sizeof (hdr), f) == sizeof (hdr))
+    {
+      if (r->num_frames == capacity)
+        {
+          capacity = (capacity)? capacity * 2 : 1024;
+          struct replay_frame* tmp = realloc (r->frames, capacity * sizeof (struct replay_frame));
+          if (! tmp)
+            {
+              ret = LIBUSB_ERROR_NO_MEM;
+              break;
+            }
+          r->frames = tmp;
+        }
+      struct replay_frame* fr = &r->frames[r->num_frames];
+      t += (int64_t) ((uint32_t) hdr[0] | (uint32_t) hdr[1] << 8 | (uint32_t) hdr[2] << 16 | (uint32_t) hdr[3] << 24) * 1000;
+      fr->t_ns = t;
+      fr->endpoint = hdr[4];
+      fr->status = (signed char) hdr[5];
+      fr->length = hdr[6];
+      if (fread (fr->data, 1, fr->length, f) != (size_t) fr->length)
+        {
+          fprintf (stderr, "Warning: recording '%s' is truncated.\n", path);
+          break;
+        }
+      r->num_frames++;
+    }
+  fclose (f);
+
+  if (! ret)
+    ret = liballuris_open_transport (&replay_transport, r, h);
+  if (ret)
+    replay_close (r);
+  return ret;
+}
+
+/*!
+ * \brief Internal: state of the simulated gauge, see liballuris_open_simulator
+ *
+ * All times are simulated nanoseconds, the real time multiplied by speed.
+ */
+struct simulator
+{
+  pthread_mutex_t lock;
+  double speed;
+  int64_t t0_ns;               // monotonic time of the simulated time 0
+
+  int unit, mode, mem_mode, upper, lower, digout, peak_level, autostop, key_lock;
+  char measuring;
+  int64_t measuring_at;        // pending start or stop, 0 = none
+  char measuring_target;
+  int tare;
+  int64_t tare_at;             // pending tare, 0 = none
+  int pos_peak, neg_peak;
+  int64_t peak_tick;           // last display tick evaluated for the peaks
+  int mem[1000];
+  int mem_count;
+
+  char stream_on;
+  int stream_len;
+  int64_t stream_t0;           // start of the cyclic measurements
+  int64_t stream_samples;      // samples since stream_t0
+
+  unsigned char replies[16][DEFAULT_SEND_BUF_LEN];
+  int reply_len[16];
+  int64_t reply_at[16];
+  unsigned int reply_head, reply_count;
+};
+
+#define SIM_LATENCY_NS        1000000LL   // USB round trip
+#define SIM_EEPROM_NS       470000000LL   // one EEPROM write, see liballuris_set_upper_limit
+#define SIM_FACTORY_NS     1500000000LL   // many EEPROM writes, see liballuris_restore_factory_defaults
+#define SIM_START_NS        100000000LL   // measurement processor setup, see liballuris_start_measurement
+#define SIM_STOP_NS        1000000000LL   // see liballuris_stop_measurement
+#define SIM_TARE_NS         150000000LL   // averaging for the new offset
+#define SIM_DISPLAY_NS      100000000LL   // display and get_value rate 10Hz
+#define SIM_OVERRUN_NS     1000000000LL   // unread cyclic packets are dropped after this
+
+//! Internal: simulated time
+static int64_t sim_now (struct simulator* s)
+{
+  return (int64_t) ((monotonic_ns () - s->t0_ns) * s->speed);
+}
+
+//! Internal: the applied load, a triangle of +-1000 digits with 2s period, minus tare
+static int sim_value (struct simulator* s, int64_t t)
+{
+  int64_t phase = (t / 1000000) % 2000;   // ms
+  int raw = (phase < 1000)? (int) phase * 2 - 1000 : 3000 - (int) phase * 2;
+  return raw - s->tare;
+}
+
+//! Internal: apply pending state changes and track the peaks on the display ticks
+static void sim_update (struct simulator* s, int64_t t)
+{
+  if (s->tare_at && t >= s->tare_at)
+    {
+      s->tare = 0;
+      s->tare = sim_value (s, s->tare_at);
+      s->tare_at = 0;
+    }
+  if (s->measuring_at && t >= s->measuring_at)
+    {
+      s->measuring = s->measuring_target;
+      s->measuring_at = 0;
+      s->stream_t0 = t;
+      s->stream_samples = 0;
+      s->peak_tick = t / SIM_DISPLAY_NS;
+    }
+  if (s->measuring)
+    {
+      int64_t tick = t / SIM_DISPLAY_NS;
+      // one period of the load is enough
+      if (tick - s->peak_tick > 20)
+        s->peak_tick = tick - 20;
+      for (; s->peak_tick <= tick; ++s->peak_tick)
+        {
+          int v = sim_value (s, s->peak_tick * SIM_DISPLAY_NS);
+          if (v > s->pos_peak)
+            s->pos_peak = v;
+          if (v < s->neg_peak)
+            s->neg_peak = v;
+        }
+    }
+}
+
+static int64_t sim_sample_period (struct simulator* s)
+{
+  return (s->mode)? LIBALLURIS_PERIOD_PEAK_NS : LIBALLURIS_PERIOD_STANDARD_NS;
+}
+
+static void sim_put24 (unsigned char* out, int v)
+{
+  out[0] = v & 0xFF;
+  out[1] = (v >> 8) & 0xFF;
+  out[2] = (v >> 16) & 0xFF;
+}
+
+static unsigned int sim_state (struct simulator* s, int64_t t)
+{
+  union __liballuris_state__ state;
+  state._int = 0;
+  if (s->measuring)
+    {
+      int v = sim_value (s, t);
+      state.bits.upper_limit_exceeded = v >= s->upper;
+      state.bits.lower_limit_underrun = v <= s->lower;
+    }
+  state.bits.some_peak_mode_active = s->mode != LIBALLURIS_MODE_STANDARD;
+  state.bits.peak_plus_active = s->mode == LIBALLURIS_MODE_PEAK_MAX;
+  state.bits.peak_minus_active = s->mode == LIBALLURIS_MODE_PEAK_MIN;
+  state.bits.mem_active = s->mem_mode != LIBALLURIS_MEM_MODE_DISABLED;
+  state.bits.mem_conti = s->mem_mode == LIBALLURIS_MEM_MODE_CONTINUOUS;
+  state.bits.measuring = s->measuring;
+  return state._int & 0xFFFFFF;
+}
+
+//! Internal: execute a command and queue the reply, the caller holds s->lock
+static void sim_command (struct simulator* s, const unsigned char* in, int len)
+{
+  int64_t t = sim_now (s);
+  sim_update (s, t);
+
+  unsigned char r[DEFAULT_SEND_BUF_LEN];
+  memset (r, 0, sizeof (r));
+  r[0] = in[0];
+  int reply_len = 3;
+  int64_t delay = SIM_LATENCY_NS;
+  int arg = (len > 2)? in[2] : 0;
+
+  switch (in[0])
+    {
+    case 0x01: // cyclic measurements
+      s->stream_on = (arg == 2);
+      s->stream_len = (len > 3 && in[3] >= 1 && in[3] <= MAX_BLOCK_SIZE)? in[3] : 1;
+      s->stream_t0 = t;
+      s->stream_samples = 0;
+      reply_len = 4;
+      r[2] = arg;
+      r[3] = s->stream_len;
+      break;
+    case 0x04: // set mode, rejected while measuring
+      if (! s->measuring && arg <= LIBALLURIS_MODE_PEAK_MIN)
+        s->mode = arg;
+      r[2] = s->mode;
+      break;
+    case 0x05:
+      r[2] = s->mode;
+      break;
+    case 0x06: // read memory
+      reply_len = 5;
+      sim_put24 (r + 2, s->mem[(arg | in[3] << 8) % 1000]);
+      break;
+    case 0x07:
+      s->mem_count = 0;
+      break;
+    case 0x08: // fixed attributes, not available while measuring
+      reply_len = 6;
+      switch (arg)
+        {
+        case 0:
+          r[3] = 9;
+          r[4] = 3;
+          r[5] = 5;
+          break;
+        case 1:
+          if (s->measuring)
+            r[3] = r[4] = r[5] = 0xFF;
+          else
+            {
+              r[3] = 9;
+              r[4] = 4;
+              r[5] = 5;
+            }
+          break;
+        case 2:
+          sim_put24 (r + 3, (s->measuring)? -1 : 500);
+          break;
+        case 3:
+        case 16:
+          sim_put24 (r + 3, (s->measuring)? -1 : 1);
+          break;
+        case 5:
+          sim_put24 (r + 3, (s->measuring)? -1 : s->mem_count);
+          break;
+        case 6:
+          if (s->measuring)
+            r[3] = r[4] = r[5] = 0xFF;
+          else
+            {
+              r[3] = 10000 & 0xFF;
+              r[4] = 10000 >> 8;
+              r[5] = 'S' - 'A';
+            }
+          break;
+        case 7:
+          sim_put24 (r + 3, (s->measuring)? -1 : 2612);
+          break;
+        }
+      break;
+    case 0x09: // memory statistics
+      {
+        reply_len = 20;
+        int k, stats[6] = {0, 0, 0, 0, 0, 0};
+        int64_t sum = 0;
+        for (k=0; k < s->mem_count; ++k)
+          {
+            int v = s->mem[k];
+            if (v > stats[0])
+              stats[0] = v;
+            if (v < stats[3])
+              stats[3] = v;
+            sum += v;
+          }
+        if (s->mem_count)
+          stats[4] = sum / s->mem_count;
+        for (k=0; k < 6; ++k)
+          sim_put24 (r + 2 + k * 3, stats[k]);
+        break;
+      }
+    case 0x13: // power off, no reply
+      s->measuring = 0;
+      s->stream_on = 0;
+      return;
+    case 0x14: // key press
+      r[2] = arg;
+      break;
+    case 0x15: // tare or clear peaks
+      if (arg == 0)
+        s->tare_at = t + SIM_TARE_NS;
+      else if (arg == 1)
+        s->pos_peak = sim_value (s, t);
+      else if (arg == 2)
+        s->neg_peak = sim_value (s, t);
+      break;
+    case 0x16: // factory defaults
+      r[2] = (s->measuring)? 0xFF : 1;
+      if (! s->measuring)
+        {
+          s->mode = LIBALLURIS_MODE_STANDARD;
+          s->mem_mode = LIBALLURIS_MEM_MODE_DISABLED;
+          s->upper = 450;
+          s->lower = -450;
+          s->unit = LIBALLURIS_UNIT_N;
+          delay += SIM_FACTORY_NS;
+        }
+      break;
+    case 0x18: // set limit
+      {
+        reply_len = 6;
+        int v = (len > 5)? (int) (in[3] | in[4] << 8 | in[5] << 16) : 0;
+        if (v > 8388607)
+          v -= 16777216;
+        if (arg == 0)
+          s->upper = v;
+        else
+          s->lower = v;
+        memcpy (r + 2, in + 2, 4);
+        delay += SIM_EEPROM_NS;
+        break;
+      }
+    case 0x19:
+      reply_len = 6;
+      sim_put24 (r + 3, (arg == 0)? s->upper : s->lower);
+      break;
+    case 0x1A: // set unit
+      if (! s->measuring)
+        {
+          s->unit = arg;
+          delay += SIM_EEPROM_NS;
+        }
+      r[2] = s->unit;
+      break;
+    case 0x1B:
+      r[2] = s->unit;
+      break;
+    case 0x1C: // start or stop
+      if (arg != s->measuring || s->measuring_at)
+        {
+          s->measuring_target = (arg != 0);
+          s->measuring_at = t + ((arg)? SIM_START_NS : SIM_STOP_NS);
+        }
+      break;
+    case 0x1D: // set memory mode
+      if (! s->measuring && arg <= LIBALLURIS_MEM_MODE_CONTINUOUS)
+        {
+          s->mem_mode = arg;
+          delay += SIM_EEPROM_NS;
+        }
+      r[2] = s->mem_mode;
+      break;
+    case 0x1E:
+      r[2] = s->mem_mode;
+      break;
+    case 0x21:
+      s->digout = arg & 0x07;
+      r[2] = s->digout;
+      break;
+    case 0x22:
+      r[2] = s->digout;
+      break;
+    case 0x27: // digital inputs, all high
+      r[2] = 0x07;
+      break;
+    case 0x31:
+      s->peak_level = arg;
+      r[2] = arg;
+      delay += SIM_EEPROM_NS;
+      break;
+    case 0x32:
+      r[2] = s->peak_level;
+      break;
+    case 0x33:
+      s->autostop = arg;
+      r[2] = arg;
+      delay += SIM_EEPROM_NS;
+      break;
+    case 0x34:
+      r[2] = s->autostop;
+      break;
+    case 0x46:
+      reply_len = 6;
+      if (arg == 2)
+        sim_put24 (r + 3, sim_state (s, t));
+      else if (arg == 4)
+        sim_put24 (r + 3, s->pos_peak);
+      else if (arg == 5)
+        sim_put24 (r + 3, s->neg_peak);
+      else
+        {
+          // the value is updated with the display rate
+          int64_t tick = (t / SIM_DISPLAY_NS + 1) * SIM_DISPLAY_NS;
+          sim_put24 (r + 3, sim_value (s, tick));
+          delay += tick - t;
+        }
+      break;
+    case 0x68:
+      s->key_lock = arg;
+      r[2] = arg;
+      break;
+    case 0x72: // read flash
+      {
+        static const unsigned char flash[] = {0xA8, 0x16,                   // fw version 5800
+                                              0, 0, 0, 0, 0, 0, 0xC0, 0x3F, // uncertainty 0.125
+                                              'K', 'A', 'L', '-', '2', '0', '2', '4', '-', '0', '8', '1', '5', 0
+                                             };
+        reply_len = 6;
+        unsigned int adr = arg | in[3] << 8;
+        if (adr * 2 + 1 < sizeof (flash))
+          {
+            r[4] = flash[adr * 2];
+            r[5] = flash[adr * 2 + 1];
+          }
+        else
+          r[4] = r[5] = 0xFF;
+        break;
+      }
+    default:
+      break;
+    }
+
+  r[1] = reply_len;
+  if (s->reply_count < 16)
+    {
+      unsigned int k = (s->reply_head + s->reply_count++) % 16;
+      memcpy (s->replies[k], r, reply_len);
+      s->reply_len[k] = reply_len;
+      s->reply_at[k] = t + delay;
+    }
+}
+
+/*!
+ * \brief Internal: next packet on endpoint 0x81
+ *
+ * Returns the simulated time when the next packet is ready. If it's ready at t
+ * it's copied to out and consumed.
+ */
+static int64_t sim_receive (struct simulator* s, int64_t t, unsigned char* out, int* len)
+{
+  sim_update (s, t);
+  int64_t next = INT64_MAX;
+
+  if (s->reply_count)
+    {
+      unsigned int k = s->reply_head;
+      if (s->reply_at[k] <= t)
+        {
+          memcpy (out, s->replies[k], s->reply_len[k]);
+          *len = s->reply_len[k];
+          s->reply_head = (k + 1) % 16;
+          s->reply_count--;
+          return t;
+        }
+      next = s->reply_at[k];
+    }
+
+  if (s->stream_on && s->measuring)
+    {
+      int64_t period = sim_sample_period (s);
+      int64_t due = s->stream_t0 + (s->stream_samples + s->stream_len) * period;
+      // the device drops packets which aren't read in time
+      while (t - due > SIM_OVERRUN_NS)
+        {
+          s->stream_samples += s->stream_len;
+          due += s->stream_len * period;
+        }
+      if (due <= t)
+        {
+          int k;
+          out[0] = 0x02;
+          out[1] = 5 + s->stream_len * 3;
+          out[2] = out[3] = out[4] = 0;
+          for (k=0; k < s->stream_len; ++k)
+            sim_put24 (out + 5 + k * 3, sim_value (s, s->stream_t0 + (s->stream_samples + k + 1) * period));
+          *len = out[1];
+          s->stream_samples += s->stream_len;
+          return t;
+        }
+      if (due < next)
+        next = due;
+    }
+
+  if (s->measuring_at && s->measuring_at < next)
+    next = s->measuring_at;
+  return next;
+}
+
+//! Internal: transfer callback of liballuris_open_simulator
+static int sim_transfer (void* user_data, unsigned char endpoint, unsigned char* data, int length, int* actual, unsigned int timeout)
+{
+  struct simulator* s = user_data;
+  *actual = 0;
+  pthread_mutex_lock (&s->lock);
+  if (! (endpoint & LIBUSB_ENDPOINT_IN))
+    {
+      if (length >= 2)
+        sim_command (s, data, length);
+      pthread_mutex_unlock (&s->lock);
+      *actual = length;
+      return LIBUSB_SUCCESS;
+    }
+
+  int64_t start = monotonic_ns ();
+  int ret;
+  while (1)
+    {
+      unsigned char buf[DEFAULT_SEND_BUF_LEN];
+      int len = 0;
+      int64_t t = sim_now (s);
+      int64_t next = sim_receive (s, t, buf, &len);
+      if (next <= t)
+        {
+          int n = (len < length)? len : length;
+          memcpy (data, buf, n);
+          *actual = n;
+          ret = (len > length)? LIBUSB_ERROR_OVERFLOW : LIBUSB_SUCCESS;
+          break;
+        }
+      int64_t now = monotonic_ns ();
+      int64_t remaining = (timeout)? start + (int64_t) timeout * 1000000 - now : INT64_MAX;
+      if (remaining <= 0)
+        {
+          ret = LIBUSB_ERROR_TIMEOUT;
+          break;
+        }
+      int64_t wait = (next == INT64_MAX)? remaining : (int64_t) ((next - t) / s->speed) + 1;
+      if (wait > remaining)
+        wait = remaining;
+      // wake up regularly, another thread may send a command meanwhile
+      if (wait > 50000000)
+        wait = 50000000;
+      pthread_mutex_unlock (&s->lock);
+      sleep_ns (wait);
+      pthread_mutex_lock (&s->lock);
+    }
+  pthread_mutex_unlock (&s->lock);
+  return ret;
+}
+
+static void sim_close (void* user_data)
+{
+  struct simulator* s = user_data;
+  pthread_mutex_destroy (&s->lock);
+  free (s);
+}
+
+static const struct liballuris_transport sim_transport = {sim_transfer, sim_close};
+
+/*!
+ * \brief Open a simulated gauge
+ *
+ * The simulator answers all commands of this library like an idle FMI-S with 500N,
+ * serial number "S.10000" and a triangular load of +-1000 digits (2s period).
+ * The timing follows the real device: replies take 1ms, EEPROM writes 470ms,
+ * \ref liballuris_get_value waits for the next 10Hz display update, start and stop of the
+ * measurement take effect after 100ms and 1s and tare after 150ms.
+ * Cyclic measurements are sent with 10Hz or 900Hz and dropped if not read within 1s.
+ *
+ * \param[in] speed time scale, for example 10 for a ten times faster device, has to be > 0
+ * \param[out] h storage for the new handle, close it with \ref liballuris_close_transport
+ * \return 0 if successful else \ref liballuris_error
+ */
+int liballuris_open_simulator (double speed, libusb_device_handle** h)
+{
+  if (! (speed > 0))
+    return LIBALLURIS_OUT_OF_RANGE;
+
+  struct simulator* s = calloc (1, sizeof (struct simulator));
+  if (! s)
+    return LIBUSB_ERROR_NO_MEM;
+  pthread_mutex_init (&s->lock, NULL);
+  s->speed = speed;
+  s->t0_ns = monotonic_ns ();
+  s->unit = LIBALLURIS_UNIT_N;
+  s->upper = 450;
+  s->lower = -450;
+  s->peak_level = 5;
+  s->mem_count = 37;
+  int k;
+  for (k=0; k < s->mem_count; ++k)
+    s->mem[k] = k * 7 - 100;
 
+  int ret = liballuris_open_transport (&sim_transport, s, h);
+  if (ret)
+    sim_close (s);
   return ret;
 }
@@ -38,6 +38,8 @@ If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <poll.h>
 #include <libusb-1.0/libusb.h>
 
 #ifndef liballuris_h
@@ -46,7 +48,7 @@ If not, see <http://www.gnu.org/licenses/>.
 //#define PRINT_DEBUG_MSG
 //#define DEBUG_TIMING
 
-//! Number of device which can be enumerated and simultaneously opened
+//! Default length of device lists, see \ref liballuris_get_device_list_alloc for an unlimited list
 #define MAX_NUM_DEVICES 4
 
 //! Default timeout in milliseconds while writing to the device
@@ -60,6 +62,27 @@ If not, see <http://www.gnu.org/licenses/>.
 //! Default receive buffer size.
 #define DEFAULT_RECV_BUF_LEN 256
 
+//! Number of requests sent ahead for bulk queries like \ref liballuris_read_memory_range
+#define DEFAULT_PIPELINE_DEPTH 8
+
+//! Maximum number of values in one cyclic measurement packet
+#define MAX_BLOCK_SIZE 19
+
+//! Sample period in ns of the cyclic measurements in LIBALLURIS_MODE_STANDARD (10Hz)
+#define LIBALLURIS_PERIOD_STANDARD_NS 100000000LL
+
+//! Sample period in ns of the cyclic measurements in the peak modes (900Hz)
+#define LIBALLURIS_PERIOD_PEAK_NS 1111111LL
+
+//! Default number of IN transfers a \ref liballuris_stream keeps in flight
+#define DEFAULT_STREAM_TRANSFERS 8
+
+//! Default number of blocks a \ref liballuris_stream buffers if no callback is used
+#define DEFAULT_STREAM_QUEUE_LEN 64
+
+//! Arrival jitter in ns tolerated by the gap detection of a \ref liballuris_stream
+#define STREAM_GAP_JITTER_NS 2000000LL
+
 //! liballuris specific errors
 enum liballuris_error
 {
@@ -169,6 +192,195 @@ struct alluris_device_description
   char serial_number[30]; //!< serial number of device, for example "P.25412"
 };
 
+//! Entry of the persistent device cache, see \ref liballuris_cache_lookup
+struct liballuris_cache_entry
+{
+  char serial_number[30];   //!< serial number of device, for example "P.25412"
+  int bus;                  //!< USB bus number
+  uint8_t port_numbers[7];  //!< port path from the root hub, see libusb_get_port_numbers
+  int num_ports;            //!< number of valid elements in port_numbers
+  int fmax;                 //!< see \ref liballuris_get_F_max, 0 if unknown
+  char firmware[42];        //!< "COMMUNICATION;MEASUREMENT" firmware, empty if unknown
+};
+
+//! Cached device metadata, see \ref liballuris_device_get_metadata
+struct liballuris_metadata
+{
+  int fmax;                             //!< see \ref liballuris_get_F_max
+  int digits;                           //!< see \ref liballuris_get_digits
+  int resolution;                       //!< see \ref liballuris_get_resolution
+  enum liballuris_unit unit;            //!< see \ref liballuris_get_unit
+  enum liballuris_measurement_mode mode; //!< see \ref liballuris_get_mode
+  char measuring;                       //!< measurement is running
+};
+
+//! Bits of the members of \ref liballuris_metadata, see \ref liballuris_device_get_cached_metadata
+#define LIBALLURIS_METADATA_FMAX       0x01
+#define LIBALLURIS_METADATA_DIGITS     0x02
+#define LIBALLURIS_METADATA_RESOLUTION 0x04
+#define LIBALLURIS_METADATA_UNIT       0x08
+#define LIBALLURIS_METADATA_MODE       0x10
+#define LIBALLURIS_METADATA_MEASURING  0x20
+
+//! Conversion of raw fixed-point values into a physical unit, see \ref liballuris_scale_init
+struct liballuris_scale
+{
+  double factor;                    //!< physical value = raw value * factor
+  enum liballuris_unit unit;        //!< unit of the converted values
+  int digits;                       //!< digits of the raw values, see \ref liballuris_get_digits
+  enum liballuris_unit device_unit; //!< unit of the raw values, see \ref liballuris_get_unit
+};
+
+//! Calibration data stored in the PIC flash, see \ref liballuris_get_calibration_info
+struct liballuris_calibration_info
+{
+  unsigned short date;    //!< calibration date, days since 1.1.2000
+  double uncertainty;     //!< uncertainty of the calibration
+  char number[41];        //!< calibration number, NULL terminated
+};
+
+/*!
+ * \brief Block of decoded values delivered by a \ref liballuris_stream
+ *
+ * The block and the values it points to are only valid during the callback.
+ */
+struct liballuris_block
+{
+  const int* values;      //!< decoded measurement values
+  size_t num_values;      //!< number of values in this block
+  unsigned int device_index; //!< index of the device in a \ref liballuris_multi, else 0
+  int64_t timestamp_ns;   //!< host receive time of the packet, CLOCK_MONOTONIC in ns
+  //! \brief Sample time of each value, CLOCK_MONOTONIC in ns.
+  //! The last value is assigned timestamp_ns, the previous ones are interpolated with sample_period_ns
+  const int64_t* timestamps_ns;
+  int64_t sample_period_ns; //!< sample period of the active measurement mode
+};
+
+/*!
+ * \brief Callback for completed blocks of a \ref liballuris_stream
+ * \sa liballuris_stream_open
+ */
+typedef void (*liballuris_stream_cb) (const struct liballuris_block* block, void* user_data);
+
+//! Opaque handle for asynchronous cyclic measurements, see \ref liballuris_stream_open
+struct liballuris_stream;
+
+//! Opaque lock-free single-producer/single-consumer ring of values, see \ref liballuris_ring_new
+struct liballuris_ring;
+
+//! Counters of a \ref liballuris_ring
+struct liballuris_ring_stats
+{
+  size_t capacity;                   //!< number of values the ring can hold
+  unsigned long long written;        //!< values written by the producer
+  unsigned long long read;           //!< values read by the consumer
+  unsigned long long overflow_values; //!< values dropped because the ring was full
+  unsigned long long overflow_events; //!< number of writes which dropped values
+  size_t high_water;                 //!< maximum fill level seen by the producer
+};
+
+//! Opaque ring in POSIX shared memory with one writer and many readers, see \ref liballuris_shm_create
+struct liballuris_shm;
+
+//! Description of the stream published in a \ref liballuris_shm
+struct liballuris_shm_info
+{
+  char serial_number[30];                //!< serial number of the device, for example "P.25412"
+  struct liballuris_metadata metadata;   //!< see \ref liballuris_get_metadata
+  int64_t sample_period_ns;              //!< sample period of the published values, updated by \ref liballuris_shm_publish_cb
+  size_t capacity;                       //!< number of values the ring can hold, set by \ref liballuris_shm_create
+};
+
+/*!
+ * \brief Health counters of a stream, see \ref liballuris_stream_get_stats
+ *
+ * The sample packets carry no sequence number, thus gaps are inferred from the arrival
+ * times against the nominal sample rate. The device clock drift is tracked, delayed event
+ * handling isn't counted. Gaps shorter than \ref STREAM_GAP_JITTER_NS can't be detected.
+ */
+struct liballuris_stream_stats
+{
+  unsigned long long packets;         //!< valid sample packets received
+  unsigned long long samples;         //!< values decoded from these packets
+  unsigned long long malformed;       //!< discarded packets with unexpected id or length
+  unsigned long long gaps;            //!< detection windows (at least 16 packets and 1s) with lost samples
+  unsigned long long lost_samples;    //!< estimated number of samples missing in these gaps
+  unsigned long long dropped_samples; //!< values dropped by a full queue or ring (slow consumer)
+  unsigned long long resyncs;         //!< restarts of the timing reference, for example after a mode change
+  unsigned long long transfer_errors; //!< IN transfers which failed or couldn't be resubmitted
+};
+
+//! Opaque handle for synchronized acquisition from several devices, see \ref liballuris_multi_open
+struct liballuris_multi;
+
+//! Opaque per-device context with its own buffers and lock, see \ref liballuris_device_open
+struct liballuris_device;
+
+//! Opaque registry of connected devices kept current by hotplug events, see \ref liballuris_registry_open
+struct liballuris_registry;
+
+/*!
+ * \brief Notification about plugged (arrived = 1) or unplugged (arrived = 0) devices
+ * \sa liballuris_registry_open
+ */
+typedef void (*liballuris_registry_cb) (const struct alluris_device_description* desc, int arrived, void* user_data);
+
+//! Commands which can be sent asynchronously, see \ref liballuris_device_submit
+enum liballuris_command
+{
+  LIBALLURIS_CMD_GET_VALUE = 0,      //!< result: measurement value, see \ref liballuris_get_value
+  LIBALLURIS_CMD_GET_POS_PEAK,       //!< result: positive peak
+  LIBALLURIS_CMD_GET_NEG_PEAK,       //!< result: negative peak
+  LIBALLURIS_CMD_TARE,               //!< see \ref liballuris_tare
+  LIBALLURIS_CMD_CLEAR_POS_PEAK,
+  LIBALLURIS_CMD_CLEAR_NEG_PEAK,
+  LIBALLURIS_CMD_START_MEASUREMENT,
+  LIBALLURIS_CMD_STOP_MEASUREMENT,
+  LIBALLURIS_CMD_GET_UPPER_LIMIT,    //!< result: upper limit, device has to be stopped
+  LIBALLURIS_CMD_GET_LOWER_LIMIT,    //!< result: lower limit, device has to be stopped
+  LIBALLURIS_CMD_SET_UPPER_LIMIT,    //!< arg: new limit, device has to be stopped
+  LIBALLURIS_CMD_SET_LOWER_LIMIT,    //!< arg: new limit, device has to be stopped
+  LIBALLURIS_CMD_GET_MODE,           //!< result: \ref liballuris_measurement_mode
+  LIBALLURIS_CMD_SET_MODE,           //!< arg: \ref liballuris_measurement_mode
+  LIBALLURIS_CMD_GET_DIGOUT,         //!< result: digital outputs (3 bits)
+  LIBALLURIS_CMD_SET_DIGOUT,         //!< arg: digital outputs (3 bits)
+  LIBALLURIS_CMD_GET_DIGIN,          //!< result: digital input
+  LIBALLURIS_CMD_GET_MEM_COUNT,      //!< result: number of values in memory
+  LIBALLURIS_CMD_READ_STATE,         //!< result: \ref liballuris_state as __liballuris_state__._int
+  LIBALLURIS_CMD_SET_MEM_MODE,       //!< arg: \ref liballuris_memory_mode
+  LIBALLURIS_CMD_GET_AUTOSTOP,       //!< result: auto-stop time in seconds
+  LIBALLURIS_CMD_SET_AUTOSTOP        //!< arg: auto-stop time in seconds, 0..30
+};
+
+/*!
+ * \brief Completion of an asynchronous command
+ *
+ * status is 0 or \ref liballuris_error, value is the result of getters (0 for other commands).
+ * \sa liballuris_device_submit
+ */
+typedef void (*liballuris_command_cb) (struct liballuris_device* dev, enum liballuris_command cmd, int status, int value, void* user_data);
+
+//! Result of an asynchronous command, see \ref liballuris_device_submit_future
+struct liballuris_future
+{
+  int done;     //!< set to 1 when status and value are valid
+  int status;   //!< 0 if successful else \ref liballuris_error
+  int value;    //!< result of getters
+};
+
+/*!
+ * \brief Replacement for the USB transfers of a device, see \ref liballuris_open_transport
+ *
+ * transfer has the semantics of libusb_interrupt_transfer on endpoint 0x01 (commands)
+ * and 0x81 (replies and cyclic measurements), a timeout of 0 means unlimited.
+ * It may be called from different threads.
+ */
+struct liballuris_transport
+{
+  int (*transfer) (void* user_data, unsigned char endpoint, unsigned char* data, int length, int* actual, unsigned int timeout);
+  void (*close) (void* user_data); //!< called by \ref liballuris_close_transport, may be NULL
+};
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -177,25 +389,43 @@ extern "C"
 const char * liballuris_error_name (int error_code);
 const char * liballuris_unit_enum2str (enum liballuris_unit unit);
 enum liballuris_unit liballuris_unit_str2enum (const char *str);
+double liballuris_unit_to_newton (enum liballuris_unit unit);
+int liballuris_scale_init (struct liballuris_scale* scale, int digits, enum liballuris_unit device_unit, enum liballuris_unit target_unit);
+void liballuris_convert_float (const struct liballuris_scale* scale, const int* in, float* out, size_t num_values);
+void liballuris_convert_double (const struct liballuris_scale* scale, const int* in, double* out, size_t num_values);
 
 int liballuris_get_device_list (libusb_context* ctx, struct alluris_device_description* alluris_devs, size_t length, char read_serial);
 int liballuris_open_device (libusb_context* ctx, const char* serial_number, libusb_device_handle** h);
 int liballuris_open_device_with_id (libusb_context* ctx, int bus, int device, libusb_device_handle** h);
 void liballuris_free_device_list (struct alluris_device_description* alluris_devs, size_t length);
+int liballuris_get_device_list_alloc (libusb_context* ctx, struct alluris_device_description** alluris_devs, char read_serial);
+void liballuris_release_device_list (struct alluris_device_description* alluris_devs, size_t length);
+int liballuris_cache_lookup (const char* serial_number, struct liballuris_cache_entry* entry);
+void liballuris_cache_clear (void);
+
+int liballuris_registry_open (libusb_context* ctx, liballuris_registry_cb cb, void* user_data, struct liballuris_registry** reg);
+void liballuris_registry_close (struct liballuris_registry* reg);
+int liballuris_registry_update (struct liballuris_registry* reg);
+int liballuris_registry_get_list (struct liballuris_registry* reg, struct alluris_device_description* alluris_devs, size_t length);
+int liballuris_registry_open_device (struct liballuris_registry* reg, const char* serial_number, libusb_device_handle** h);
 
 void liballuris_clear_RX (libusb_device_handle* dev_handle, unsigned int timeout);
 
 int liballuris_get_serial_number (libusb_device_handle *dev_handle, char* buf, size_t length);
-int liballuris_get_firmware (libusb_device_handle *dev_handle, int dev, char* buf, size_t length);
+int liballuris_get_firmware (libusb_device_handle *dev_handle, int processor, char* buf, size_t length);
 int liballuris_get_next_calibration_date (libusb_device_handle *dev_handle, int* v);
 int liballuris_read_flash (libusb_device_handle *dev_handle, int adr, unsigned short *v);
 int liballuris_get_calibration_date (libusb_device_handle *dev_handle, unsigned short* v);
 int liballuris_get_calibration_number (libusb_device_handle *dev_handle, char* buf, size_t length);
 int liballuris_get_uncertainty (libusb_device_handle *dev_handle, double* v);
+int liballuris_read_flash_range (libusb_device_handle *dev_handle, int adr, unsigned short *buf, size_t length);
+int liballuris_get_calibration_info (libusb_device_handle *dev_handle, struct liballuris_calibration_info* info);
+void liballuris_clear_calibration_cache (void);
 
 int liballuris_get_digits (libusb_device_handle *dev_handle, int* v);
 int liballuris_get_resolution (libusb_device_handle *dev_handle, int* v);
 int liballuris_get_F_max (libusb_device_handle *dev_handle, int* fmax);
+int liballuris_get_scale (libusb_device_handle *dev_handle, enum liballuris_unit target_unit, struct liballuris_scale* scale);
 
 int liballuris_get_value (libusb_device_handle *dev_handle, int* value);
 int liballuris_get_pos_peak (libusb_device_handle *dev_handle, int* peak);
@@ -204,17 +434,73 @@ int liballuris_get_neg_peak (libusb_device_handle *dev_handle, int* peak);
 /* read and print state */
 int liballuris_read_state (libusb_device_handle *dev_handle, struct liballuris_state* state);
 void liballuris_print_state (struct liballuris_state state);
+void liballuris_fprint_state (FILE* f, struct liballuris_state state);
 
 int liballuris_cyclic_measurement (libusb_device_handle *dev_handle, char enable, size_t length);
 int liballuris_poll_measurement (libusb_device_handle *dev_handle, int* buf, size_t length);
 int liballuris_poll_measurement_no_wait (libusb_device_handle *dev_handle, int* buf, size_t length, size_t *actual_num_values);
+int liballuris_poll_measurement_timestamps (libusb_device_handle *dev_handle, int* buf, int64_t* timestamps_ns, size_t length, int64_t sample_period_ns);
+int64_t liballuris_sample_period_ns (enum liballuris_measurement_mode mode);
+
+void liballuris_decode_int24 (const unsigned char* in, int* out, size_t num_values);
+void liballuris_decode_int24_float (const unsigned char* in, float* out, size_t num_values);
+const char* liballuris_decode_int24_impl (void);
+int liballuris_decode_packet (const unsigned char* packet, size_t length, int* buf, size_t buf_length, size_t* num_values);
+
+int liballuris_stream_open (libusb_context* ctx, libusb_device_handle *dev_handle, size_t block_size, size_t num_transfers, liballuris_stream_cb cb, void* user_data, struct liballuris_stream** stream);
+int liballuris_stream_start (struct liballuris_stream* stream);
+int liballuris_stream_handle_events (struct liballuris_stream* stream, unsigned int timeout);
+int liballuris_stream_dispatch (struct liballuris_stream* stream);
+int liballuris_stream_read (struct liballuris_stream* stream, int* buf, size_t length, size_t *actual_num_values, unsigned int timeout);
+int liballuris_stream_read_timestamps (struct liballuris_stream* stream, int* buf, int64_t* timestamps_ns, size_t length, size_t *actual_num_values, unsigned int timeout);
+int liballuris_stream_read_bulk (struct liballuris_stream* stream, int* buf, int64_t* timestamps_ns, size_t length, size_t *actual_num_values, unsigned int timeout);
+int liballuris_stream_stop (struct liballuris_stream* stream);
+void liballuris_stream_close (struct liballuris_stream* stream);
+void liballuris_stream_set_ring (struct liballuris_stream* stream, struct liballuris_ring* ring);
+int liballuris_stream_set_latency (struct liballuris_stream* stream, unsigned int latency_ms);
+void liballuris_stream_get_stats (struct liballuris_stream* stream, struct liballuris_stream_stats* stats);
+
+int liballuris_get_pollfds (libusb_context* ctx, struct pollfd* fds, size_t length, size_t* num_fds);
+int liballuris_get_next_timeout (libusb_context* ctx, int* timeout_ms);
+void liballuris_set_pollfd_notifiers (libusb_context* ctx, libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb, void* user_data);
+
+int liballuris_ring_new (size_t capacity, struct liballuris_ring** ring);
+void liballuris_ring_free (struct liballuris_ring* ring);
+size_t liballuris_ring_write (struct liballuris_ring* ring, const int* values, size_t length);
+size_t liballuris_ring_read (struct liballuris_ring* ring, int* buf, size_t length);
+size_t liballuris_ring_available (struct liballuris_ring* ring);
+int liballuris_ring_wait (struct liballuris_ring* ring, size_t min_values, unsigned int timeout);
+void liballuris_ring_get_stats (struct liballuris_ring* ring, struct liballuris_ring_stats* stats);
+
+int liballuris_shm_create (const char* name, size_t capacity, const struct liballuris_shm_info* info, struct liballuris_shm** shm);
+int liballuris_shm_write (struct liballuris_shm* shm, const int* values, const int64_t* timestamps_ns, size_t length);
+void liballuris_shm_publish_cb (const struct liballuris_block* block, void* user_data);
+void liballuris_shm_set_info (struct liballuris_shm* shm, const struct liballuris_shm_info* info);
+int liballuris_shm_open (const char* name, struct liballuris_shm** shm);
+void liballuris_shm_get_info (struct liballuris_shm* shm, struct liballuris_shm_info* info);
+int liballuris_shm_read (struct liballuris_shm* shm, int* buf, int64_t* timestamps_ns, size_t length, size_t* actual_num_values);
+int liballuris_shm_wait (struct liballuris_shm* shm, size_t min_values, unsigned int timeout);
+unsigned long long liballuris_shm_get_lost (struct liballuris_shm* shm);
+void liballuris_shm_close (struct liballuris_shm* shm);
+
+int liballuris_multi_open (libusb_context* ctx, const char* const* ids, size_t num_devices, struct liballuris_multi** multi);
+int liballuris_multi_start (struct liballuris_multi* multi, size_t block_size, size_t num_transfers, liballuris_stream_cb cb, void* user_data);
+int liballuris_multi_stop (struct liballuris_multi* multi);
+void liballuris_multi_close (struct liballuris_multi* multi);
+int liballuris_multi_set_ring (struct liballuris_multi* multi, size_t index, struct liballuris_ring* ring);
+int liballuris_multi_set_latency (struct liballuris_multi* multi, unsigned int latency_ms);
+size_t liballuris_multi_get_num_devices (struct liballuris_multi* multi);
+struct liballuris_device* liballuris_multi_get_device (struct liballuris_multi* multi, size_t index);
 
 int liballuris_tare (libusb_device_handle *dev_handle);
+int liballuris_tare_wait (libusb_device_handle *dev_handle, int threshold, unsigned int* settle_ms);
 int liballuris_clear_pos_peak (libusb_device_handle *dev_handle);
 int liballuris_clear_neg_peak (libusb_device_handle *dev_handle);
 
 int liballuris_start_measurement (libusb_device_handle *dev_handle);
 int liballuris_stop_measurement (libusb_device_handle *dev_handle);
+int liballuris_start_measurement_wait (libusb_device_handle *dev_handle, unsigned int timeout, unsigned int* settle_ms);
+int liballuris_stop_measurement_wait (libusb_device_handle *dev_handle, unsigned int timeout, unsigned int* settle_ms);
 
 int liballuris_set_upper_limit (libusb_device_handle *dev_handle, int limit);
 int liballuris_set_lower_limit (libusb_device_handle *dev_handle, int limit);
@@ -240,6 +526,8 @@ int liballuris_restore_factory_defaults (libusb_device_handle *dev_handle);
 int liballuris_power_off (libusb_device_handle *dev_handle);
 
 int liballuris_read_memory (libusb_device_handle *dev_handle, int adr, int* mem_value);
+int liballuris_read_memory_range (libusb_device_handle *dev_handle, int adr, int* buf, size_t length);
+int liballuris_read_memory_all (libusb_device_handle *dev_handle, int* buf, size_t length, size_t* actual_num_values);
 int liballuris_delete_memory (libusb_device_handle *dev_handle);
 int liballuris_get_mem_count (libusb_device_handle *dev_handle, int* v);
 
@@ -255,6 +543,117 @@ int liballuris_get_autostop (libusb_device_handle *dev_handle, int *v);
 
 int liballuris_set_key_lock (libusb_device_handle *dev_handle, char active);
 
+/* thread-safe API on per-device contexts */
+int liballuris_device_wrap (libusb_device_handle* dev_handle, struct liballuris_device** dev);
+int liballuris_device_open (libusb_context* ctx, const char* serial_number, struct liballuris_device** dev);
+int liballuris_device_open_with_id (libusb_context* ctx, int bus, int device, struct liballuris_device** dev);
+int liballuris_registry_device_open (struct liballuris_registry* reg, const char* serial_number, struct liballuris_device** dev);
+void liballuris_device_close (struct liballuris_device* dev);
+libusb_device_handle* liballuris_device_get_handle (struct liballuris_device* dev);
+void liballuris_device_set_timeouts (struct liballuris_device* dev, unsigned int send_timeout, unsigned int receive_timeout);
+void liballuris_device_clear_RX (struct liballuris_device* dev, unsigned int timeout);
+
+int liballuris_device_get_serial_number (struct liballuris_device *dev, char* buf, size_t length);
+int liballuris_device_get_firmware (struct liballuris_device *dev, int processor, char* buf, size_t length);
+int liballuris_device_get_next_calibration_date (struct liballuris_device *dev, int* v);
+int liballuris_device_read_flash (struct liballuris_device *dev, int adr, unsigned short *v);
+int liballuris_device_get_calibration_date (struct liballuris_device *dev, unsigned short* v);
+int liballuris_device_get_calibration_number (struct liballuris_device *dev, char* buf, size_t length);
+int liballuris_device_get_uncertainty (struct liballuris_device *dev, double* v);
+int liballuris_device_read_flash_range (struct liballuris_device *dev, int adr, unsigned short *buf, size_t length);
+int liballuris_device_get_calibration_info (struct liballuris_device *dev, struct liballuris_calibration_info* info);
+
+int liballuris_device_get_digits (struct liballuris_device *dev, int* v);
+int liballuris_device_get_resolution (struct liballuris_device *dev, int* v);
+int liballuris_device_get_F_max (struct liballuris_device *dev, int* fmax);
+int liballuris_device_get_scale (struct liballuris_device *dev, enum liballuris_unit target_unit, struct liballuris_scale* scale);
+
+int liballuris_device_get_value (struct liballuris_device *dev, int* value);
+int liballuris_device_get_pos_peak (struct liballuris_device *dev, int* peak);
+int liballuris_device_get_neg_peak (struct liballuris_device *dev, int* peak);
+
+int liballuris_device_read_state (struct liballuris_device *dev, struct liballuris_state* state);
+int liballuris_device_get_metadata (struct liballuris_device *dev, struct liballuris_metadata* md);
+unsigned int liballuris_device_get_cached_metadata (struct liballuris_device *dev, struct liballuris_metadata* md);
+void liballuris_device_invalidate_cache (struct liballuris_device *dev);
+
+int liballuris_device_cyclic_measurement (struct liballuris_device *dev, char enable, size_t length);
+int liballuris_device_poll_measurement (struct liballuris_device *dev, int* buf, size_t length);
+int liballuris_device_poll_measurement_no_wait (struct liballuris_device *dev, int* buf, size_t length, size_t *actual_num_values);
+int liballuris_device_poll_measurement_timestamps (struct liballuris_device *dev, int* buf, int64_t* timestamps_ns, size_t length, int64_t sample_period_ns);
+int liballuris_device_stream_open (libusb_context* ctx, struct liballuris_device *dev, size_t block_size, size_t num_transfers, liballuris_stream_cb cb, void* user_data, struct liballuris_stream** stream);
+
+int liballuris_device_tare (struct liballuris_device *dev);
+int liballuris_device_tare_wait (struct liballuris_device *dev, int threshold, unsigned int* settle_ms);
+int liballuris_device_clear_pos_peak (struct liballuris_device *dev);
+int liballuris_device_clear_neg_peak (struct liballuris_device *dev);
+
+int liballuris_device_start_measurement (struct liballuris_device *dev);
+int liballuris_device_stop_measurement (struct liballuris_device *dev);
+int liballuris_device_start_measurement_wait (struct liballuris_device *dev, unsigned int timeout, unsigned int* settle_ms);
+int liballuris_device_stop_measurement_wait (struct liballuris_device *dev, unsigned int timeout, unsigned int* settle_ms);
+
+int liballuris_device_set_upper_limit (struct liballuris_device *dev, int limit);
+int liballuris_device_set_lower_limit (struct liballuris_device *dev, int limit);
+
+int liballuris_device_get_upper_limit (struct liballuris_device *dev, int* limit);
+int liballuris_device_get_lower_limit (struct liballuris_device *dev, int* limit);
+
+int liballuris_device_set_mode (struct liballuris_device *dev, enum liballuris_measurement_mode mode);
+int liballuris_device_get_mode (struct liballuris_device *dev, enum liballuris_measurement_mode *mode);
+
+int liballuris_device_set_mem_mode (struct liballuris_device *dev, enum liballuris_memory_mode mode);
+int liballuris_device_get_mem_mode (struct liballuris_device *dev, enum liballuris_memory_mode *mode);
+
+int liballuris_device_set_unit (struct liballuris_device *dev, enum liballuris_unit unit);
+int liballuris_device_get_unit (struct liballuris_device *dev, enum liballuris_unit *unit);
+
+int liballuris_device_set_digout (struct liballuris_device *dev, int v);
+int liballuris_device_get_digout (struct liballuris_device *dev, int *v);
+
+int liballuris_device_get_digin (struct liballuris_device *dev, int *v);
+
+int liballuris_device_restore_factory_defaults (struct liballuris_device *dev);
+int liballuris_device_power_off (struct liballuris_device *dev);
+
+int liballuris_device_read_memory (struct liballuris_device *dev, int adr, int* mem_value);
+int liballuris_device_read_memory_range (struct liballuris_device *dev, int adr, int* buf, size_t length);
+int liballuris_device_read_memory_all (struct liballuris_device *dev, int* buf, size_t length, size_t* actual_num_values);
+int liballuris_device_delete_memory (struct liballuris_device *dev);
+int liballuris_device_get_mem_count (struct liballuris_device *dev, int* v);
+
+int liballuris_device_get_mem_statistics (struct liballuris_device *dev, int* stats, size_t length);
+
+int liballuris_device_sim_keypress (struct liballuris_device *dev, unsigned char mask);
+
+int liballuris_device_set_peak_level (struct liballuris_device *dev, int v);
+int liballuris_device_get_peak_level (struct liballuris_device *dev, int *v);
+
+int liballuris_device_set_autostop (struct liballuris_device *dev, int v);
+int liballuris_device_get_autostop (struct liballuris_device *dev, int *v);
+
+int liballuris_device_set_key_lock (struct liballuris_device *dev, char active);
+
+/* asynchronous commands on device contexts */
+int liballuris_device_submit (struct liballuris_device *dev, enum liballuris_command cmd, int arg, liballuris_command_cb cb, void* user_data);
+int liballuris_device_submit_future (struct liballuris_device *dev, enum liballuris_command cmd, int arg, struct liballuris_future* future);
+void liballuris_future_cb (struct liballuris_device *dev, enum liballuris_command cmd, int status, int value, void* user_data);
+int liballuris_future_wait (libusb_context* ctx, struct liballuris_future* future, unsigned int timeout);
+int liballuris_handle_events (libusb_context* ctx, unsigned int timeout);
+size_t liballuris_device_get_num_pending (struct liballuris_device *dev);
+void liballuris_device_cancel_commands (struct liballuris_device *dev);
+
+/* transports, recorder, replay and simulator */
+int liballuris_open_transport (const struct liballuris_transport* transport, void* user_data, libusb_device_handle** h);
+void liballuris_close_transport (libusb_device_handle* h);
+int liballuris_device_open_transport (const struct liballuris_transport* transport, void* user_data, struct liballuris_device** dev);
+int liballuris_open_replay (const char* path, double speed, libusb_device_handle** h);
+int liballuris_open_simulator (double speed, libusb_device_handle** h);
+int liballuris_record_start (libusb_device_handle* h, const char* path);
+void liballuris_record_stop (libusb_device_handle* h);
+int liballuris_device_record_start (struct liballuris_device* dev, const char* path);
+void liballuris_device_record_stop (struct liballuris_device* dev);
+
 #ifdef __cplusplus
 }
 #endif
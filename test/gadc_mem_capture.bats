@@ -30,3 +30,15 @@ GADC=../cli/gadc
 }
 
 
+
+@test "Fast memory dump matches single reads" {
+  run $GADC --get-mem-count
+  [ "$status" -eq 0 ]
+  count=$output
+  run $GADC --dump-memory
+  [ "$status" -eq 0 ]
+  [ "${#lines[@]}" -eq "$count" ]
+  dump=$output
+  run bash -c "$GADC --read-memory -1 | head -n $count"
+  [ "$output" == "$dump" ]
+}
@@ -66,6 +66,12 @@ GADC=../cli/gadc
   [ "$status" -eq 0 ]
 }
 
+@test "Read 900 samples, check stream health for gaps" {
+  run $GADC -s 900
+  [ "$status" -eq 0 ]
+  [[ "$output" == *" 0 gaps (0 samples lost), 0 malformed,"* ]]
+}
+
 @test "Set mode = 0, check for LIBALLURIS_DEVICE_BUSY" {
   run $GADC --set-mode 0
   [ "$status" -eq 2 ]
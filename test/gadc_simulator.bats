@@ -0,0 +1,36 @@
+#!/usr/bin/env bats
+
+## Tests the simulated device and the replay of recordings, no hardware needed
+
+GADC=../cli/gadc
+
+@test "Simulator: set mode = 1 (900Hz), start, read 900 samples, stop" {
+  run $GADC --speed 10 --simulate --set-mode 1 --start -s 900 --stop
+  [ "$status" -eq 0 ]
+  [ "${#lines[@]}" -ge 900 ]
+}
+
+@test "Simulator: set mode while measuring, check for LIBALLURIS_DEVICE_BUSY" {
+  run $GADC --speed 10 --simulate --start --set-mode 1
+  [ "$status" -eq 2 ]
+}
+
+@test "Record simulator session, replay it without delays and compare" {
+  rec=$BATS_TMPDIR/gadc_simulator.alrf
+  run $GADC --speed 10 --simulate --record $rec --start -v -s 20 --stop
+  [ "$status" -eq 0 ]
+  recorded="$output"
+  run $GADC --speed 0 --replay $rec --start -v -s 20 --stop
+  [ "$status" -eq 0 ]
+  [ "$output" == "$recorded" ]
+}
+
+@test "Batch: several command lines on one open simulator, one reply line each" {
+  run bash -c "printf -- '--fmax\n--set-mode 7\n--bogus\n\n--set-mode 1 --get-mode\n' | $GADC --speed 10 --simulate --batch 2>/dev/null"
+  [ "$status" -eq 0 ]
+  [ "${#lines[@]}" -eq 4 ]
+  [ "${lines[0]}" == "OK 500" ]
+  [ "${lines[1]}" == "ERR LIBALLURIS_OUT_OF_RANGE" ]
+  [ "${lines[2]}" == "ERR LIBUSB_ERROR_INVALID_PARAM" ]
+  [ "${lines[3]}" == "OK 1" ]
+}
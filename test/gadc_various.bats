@@ -14,6 +14,17 @@ GADC=../cli/gadc
   [ "$status" -eq 0 ]
 }
 
+@test "Open by serial twice, second time from device cache" {
+  export LIBALLURIS_CACHE=$BATS_TMPDIR/liballuris-devices
+  rm -f $LIBALLURIS_CACHE
+  serial=$($GADC --list | awk 'NR==3 {print $NF}')
+  run $GADC --serial $serial --stop
+  [ "$status" -eq 0 ]
+  grep -q "^$serial" $LIBALLURIS_CACHE
+  run $GADC --serial $serial --stop
+  [ "$status" -eq 0 ]
+}
+
 @test "Stop, set mode = 1 (900Hz), start measurement, capture one value" {
   run $GADC --stop --set-mode 1 --start -v
   [ "$output" -ge -10 ] && [ "$output" -le 10 ]